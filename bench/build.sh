@@ -0,0 +1,22 @@
+#!/bin/sh
+# Builds the benchmark bench/<name>.c, linked against the server code in src.
+# Pass another source directory to measure a different version of the
+# server, for example one checked out with git worktree. The server's main
+# function is renamed, so the benchmark can have its own. A benchmark can
+# include a source file of the server to reach its static functions. That
+# file is then left out of the link. Extra libraries can be given in
+# LDLIBS, for example -ldeflate for a server built with LIBDEFLATE_ENABLED.
+#
+# usage: bench/build.sh <name> [source directory]
+set -e
+name=$1
+src=${2:-src}
+objs=$(mktemp -d)
+trap 'rm -rf "$objs"' EXIT
+for f in "$src"/*.c; do
+    if grep -q "^#include \"$(basename "$f")\"" "bench/$name.c"; then
+        continue
+    fi
+    cc -O2 -Dmain=blaze_main -c "$f" -o "$objs/$(basename "$f" .c).o"
+done
+cc -O2 -I"$src" -o "bench/$name" "bench/$name.c" "$objs"/*.o -lz -lm -pthread $LDLIBS
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include "shared.h"
+
+// Measures loading chunks on a single thread. Every chunk position of every
+// region file in world/region is loaded through try_read_chunk_from_storage,
+// like the chunk loader threads do. Converted region files in world/blaze
+// are used where they are current, as in the server, unless "anvil" is
+// passed. Only loading is timed.
+// A checksum over the block states, non-air counts and height maps of the
+// loaded chunks is printed as well, so different versions of the loading
+// code can be checked to give the same chunks.
+//
+// usage: bench/chunkdecode [runs] [anvil]
+
+#define MAX_REGIONS (256)
+
+static long long
+nano_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+alloc_block_resource_table(void) {
+    // same sizes as the server uses
+    resource_loc_table * table = &serv->block_resource_table;
+    *table = (resource_loc_table) {
+        .size_mask = (1 << 10) - 1,
+        .string_buf_size = 1 << 16,
+        .entries = calloc(1 << 10, sizeof *table->entries),
+        .string_buf = calloc(1 << 16, 1),
+        .by_id = calloc(ACTUAL_BLOCK_TYPE_COUNT, sizeof *table->by_id),
+        .max_ids = ACTUAL_BLOCK_TYPE_COUNT
+    };
+}
+
+static mc_ulong
+checksum_chunk(mc_ulong sum, chunk * ch) {
+    // Goes through chunk_get_block_state, so the checksum doesn't depend on
+    // how sections are stored.
+    for (int section_y = 0; section_y < 16; section_y++) {
+        sum = sum * 31 + section_y + ch->non_air_count[section_y];
+        for (int i = 0; i < 4096; i++) {
+            int x = i & 0xf;
+            int y = (section_y << 4) | (i >> 8);
+            int z = (i >> 4) & 0xf;
+            sum = sum * 1000003 + chunk_get_block_state(ch, x, y, z);
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        sum = sum * 7 + ch->motion_blocking_height_map[i];
+    }
+    return sum;
+}
+
+int
+main(int argc, char ** argv) {
+    int runs = argc > 1 ? atoi(argv[1]) : 3;
+
+    serv = calloc(1, sizeof *serv);
+    alloc_block_resource_table();
+    init_block_data();
+
+    DIR * dir = opendir("world/region");
+    if (dir == NULL) {
+        perror("Failed to open world/region");
+        return 1;
+    }
+    chunk_pos regions[MAX_REGIONS];
+    int region_count = 0;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL && region_count < MAX_REGIONS) {
+        int name_end = 0;
+        int region_x;
+        int region_z;
+        if (sscanf(entry->d_name, "r.%d.%d.mca%n", &region_x, &region_z,
+                &name_end) != 2 || entry->d_name[name_end] != '\0') {
+            continue;
+        }
+        // chunk coordinates of the region must fit in a chunk_pos
+        if (region_x < -1024 || region_x > 1023
+                || region_z < -1024 || region_z > 1023) {
+            continue;
+        }
+        regions[region_count] = (chunk_pos) {.x = region_x, .z = region_z};
+        region_count++;
+    }
+    closedir(dir);
+
+    memory_arena scratch_arena = {
+        .ptr = malloc(CHUNK_LOADER_SCRATCH_SIZE),
+        .size = CHUNK_LOADER_SCRATCH_SIZE
+    };
+    region_file_cache * region_cache = calloc(1, sizeof *region_cache);
+    chunk * ch = calloc(1, sizeof *ch);
+#if defined(NATIVE_REGION_MAGIC)
+    // versions without native region files can still be measured
+    region_cache->anvil_only = argc > 2 && strcmp(argv[2], "anvil") == 0;
+#endif
+
+    for (int run = 0; run < runs; run++) {
+        mc_ulong sum = 0;
+        int loaded = 0;
+        int total = 0;
+        long long load_time = 0;
+
+        for (int regioni = 0; regioni < region_count; regioni++) {
+            for (int index = 0; index < 1024; index++) {
+                chunk_pos pos = {
+                    .x = regions[regioni].x * 32 + (index & 0x1f),
+                    .z = regions[regioni].z * 32 + (index >> 5)
+                };
+
+                *ch = (chunk) {0};
+                scratch_arena.index = 0;
+                long long start = nano_time();
+                try_read_chunk_from_storage(pos, ch, &scratch_arena,
+                        region_cache);
+                load_time += nano_time() - start;
+                total++;
+
+                if (ch->flags & CHUNK_LOADED) {
+                    loaded++;
+                    sum = checksum_chunk(sum, ch);
+                }
+                for (int section_y = 0; section_y < 16; section_y++) {
+                    if (ch->sections[section_y] != NULL) {
+                        free_chunk_section(ch->sections[section_y]);
+                    }
+                }
+            }
+        }
+
+        printf("%d of %d chunks loaded in %.1f ms: %.0f chunks/s, %.1f us per chunk, checksum %016llx\n",
+                loaded, total, load_time / 1e6, loaded / (load_time / 1e9),
+                load_time / 1e3 / loaded, (unsigned long long) sum);
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+import socket
+import select
+import struct
+import zlib
+
+# Minimal client for the protocol version the server implements, used by the
+# benchmarks to put load on a running server. It logs in, answers keep alives
+# and teleports, and otherwise only counts the packets it receives and their
+# sizes.
+
+PROTOCOL_VERSION = 754
+
+# serverbound play packets
+TELEPORT_CONFIRM = 0x00
+CLIENT_SETTINGS = 0x05
+KEEP_ALIVE_RESPONSE = 0x10
+PLAYER_DIGGING = 0x1b
+
+# clientbound play packets
+KEEP_ALIVE = 0x1f
+CHUNK_DATA = 0x20
+UPDATE_LIGHT = 0x23
+PLAYER_POSITION_AND_LOOK = 0x34
+
+def write_varint(value):
+    value &= 0xffffffff
+    out = b""
+    while True:
+        b = value & 0x7f
+        value >>= 7
+        if value == 0:
+            return out + bytes([b])
+        out += bytes([b | 0x80])
+
+def read_varint(buf, index):
+    # Returns the value and the index after it, or None as value if the
+    # buffer ends before the varint does.
+    value = 0
+    for i in range(5):
+        if index >= len(buf):
+            return None, index
+        b = buf[index]
+        index += 1
+        value |= (b & 0x7f) << (7 * i)
+        if not b & 0x80:
+            if value >= 1 << 31:
+                value -= 1 << 32
+            return value, index
+    raise ValueError("VarInt too long")
+
+def write_string(s):
+    data = s.encode()
+    return write_varint(len(data)) + data
+
+def write_block_pos(x, y, z):
+    return struct.pack(">Q", ((x & 0x3ffffff) << 38) | ((z & 0x3ffffff) << 12) | (y & 0xfff))
+
+class Client:
+    def __init__(self, name, host="127.0.0.1", port=25565):
+        self.sock = socket.create_connection((host, port))
+        self.name = name
+        self.buf = b""
+        self.compression_threshold = -1
+        self.packet_counts = {}
+        # bytes received per packet ID, as sent and after decompression
+        self.wire_bytes = {}
+        self.packet_bytes = {}
+        self.closed = False
+        self.logged_in = False
+        # position the server last teleported us to
+        self.pos = None
+
+        self.send_packet(0x00, write_varint(PROTOCOL_VERSION) + write_string(host)
+                + struct.pack(">H", port) + write_varint(2))
+        self.send_packet(0x00, write_string(name))
+
+    def send_packet(self, packet_id, data=b""):
+        body = write_varint(packet_id) + data
+        if self.compression_threshold >= 0:
+            if len(body) >= self.compression_threshold:
+                body = write_varint(len(body)) + zlib.compress(body)
+            else:
+                body = write_varint(0) + body
+        try:
+            self.sock.sendall(write_varint(len(body)) + body)
+        except ConnectionError:
+            self.closed = True
+
+    def send_settings(self, view_distance):
+        # language, view distance, chat mode, chat colours, skin parts, main hand
+        self.send_packet(CLIENT_SETTINGS, write_string("en_gb")
+                + bytes([view_distance]) + write_varint(0) + b"\x01\x7f"
+                + write_varint(1))
+
+    def receive(self, timeout=0.0, handler=None):
+        # Handles all packets that have arrived. The handler is called with
+        # the client, the packet ID, the packet and the index of the data
+        # after the packet ID.
+        try:
+            readable, _, _ = select.select([self.sock], [], [], timeout)
+            if readable:
+                data = self.sock.recv(1 << 20)
+                if not data:
+                    self.closed = True
+                    return
+                self.buf += data
+        except ConnectionError:
+            self.closed = True
+            return
+
+        while True:
+            size, index = read_varint(self.buf, 0)
+            if size is None or len(self.buf) - index < size:
+                break
+            packet = self.buf[index:index + size]
+            self.buf = self.buf[index + size:]
+            wire_size = index + size
+
+            if self.compression_threshold >= 0:
+                uncompressed_size, index = read_varint(packet, 0)
+                if uncompressed_size == 0:
+                    packet = packet[index:]
+                else:
+                    packet = zlib.decompress(packet[index:])
+
+            packet_id, index = read_varint(packet, 0)
+            if not self.logged_in:
+                if packet_id == 0x02:
+                    self.logged_in = True
+                elif packet_id == 0x03:
+                    self.compression_threshold, _ = read_varint(packet, index)
+                continue
+            self.packet_counts[packet_id] = self.packet_counts.get(packet_id, 0) + 1
+            self.wire_bytes[packet_id] = self.wire_bytes.get(packet_id, 0) + wire_size
+            self.packet_bytes[packet_id] = self.packet_bytes.get(packet_id, 0) + len(packet)
+            if packet_id == KEEP_ALIVE:
+                self.send_packet(KEEP_ALIVE_RESPONSE, packet[index:index + 8])
+            elif packet_id == PLAYER_POSITION_AND_LOOK:
+                self.pos = struct.unpack(">ddd", packet[index:index + 24])
+                teleport_id, _ = read_varint(packet, index + 24 + 8 + 1)
+                self.send_packet(TELEPORT_CONFIRM, write_varint(teleport_id))
+            if handler is not None:
+                handler(self, packet_id, packet, index)
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+// for encoding packets the way the server does
+#include "player.c"
+
+// Measures compressing and decompressing a single packet: a small entity
+// teleport packet and the chunk packet of the spawn chunk, encoded from
+// world/region like the server sends it. Each packet goes through the
+// server's compress_data and decompress_data, and through a zlib stream
+// that is set up and torn down for every packet, which is how the server
+// compressed packets before it kept its streams around. Both must give
+// back the packet.
+//
+// usage: bench/compressbench [iterations]
+
+static long long
+nano_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+alloc_block_resource_table(void) {
+    // same sizes as the server uses
+    resource_loc_table * table = &serv->block_resource_table;
+    *table = (resource_loc_table) {
+        .size_mask = (1 << 10) - 1,
+        .string_buf_size = 1 << 16,
+        .entries = calloc(1 << 10, sizeof *table->entries),
+        .string_buf = calloc(1 << 16, 1),
+        .by_id = calloc(ACTUAL_BLOCK_TYPE_COUNT, sizeof *table->by_id),
+        .max_ids = ACTUAL_BLOCK_TYPE_COUNT
+    };
+}
+
+static int
+compress_with_new_stream(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    z_stream zstream = {0};
+    if (deflateInit(&zstream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return -1;
+    }
+    zstream.next_in = in;
+    zstream.avail_in = in_size;
+    zstream.next_out = out;
+    zstream.avail_out = out_size;
+    int res = -1;
+    if (deflate(&zstream, Z_FINISH) == Z_STREAM_END) {
+        res = zstream.total_out;
+    }
+    deflateEnd(&zstream);
+    return res;
+}
+
+static int
+decompress_with_new_stream(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    z_stream zstream = {0};
+    if (inflateInit2(&zstream, 0) != Z_OK) {
+        return -1;
+    }
+    zstream.next_in = in;
+    zstream.avail_in = in_size;
+    zstream.next_out = out;
+    zstream.avail_out = out_size;
+    int res = -1;
+    if (inflate(&zstream, Z_FINISH) == Z_STREAM_END) {
+        res = zstream.total_out;
+    }
+    inflateEnd(&zstream);
+    return res;
+}
+
+static void
+measure_packet(char * name, unsigned char * packet, int packet_size,
+        int iterations) {
+    int max_compressed_size = compress_bound(packet_size);
+    unsigned char * compressed = malloc(max_compressed_size);
+    unsigned char * decompressed = malloc(packet_size);
+
+    long long start = nano_time();
+    int new_stream_size;
+    for (int i = 0; i < iterations; i++) {
+        new_stream_size = compress_with_new_stream(packet, packet_size,
+                compressed, max_compressed_size);
+    }
+    long long new_deflate_time = nano_time() - start;
+
+    start = nano_time();
+    int new_stream_ok;
+    for (int i = 0; i < iterations; i++) {
+        new_stream_ok = decompress_with_new_stream(compressed, new_stream_size,
+                decompressed, packet_size) == packet_size;
+    }
+    long long new_inflate_time = nano_time() - start;
+    new_stream_ok &= memcmp(decompressed, packet, packet_size) == 0;
+
+    start = nano_time();
+    int size;
+    for (int i = 0; i < iterations; i++) {
+        size = compress_data(packet, packet_size, compressed,
+                max_compressed_size);
+    }
+    long long deflate_time = nano_time() - start;
+
+    memset(decompressed, 0, packet_size);
+    start = nano_time();
+    int ok;
+    for (int i = 0; i < iterations; i++) {
+        ok = decompress_data(compressed, size, decompressed, packet_size,
+                COMPRESSION_FORMAT_ZLIB) == packet_size;
+    }
+    long long inflate_time = nano_time() - start;
+    ok &= memcmp(decompressed, packet, packet_size) == 0;
+
+    printf("%s, %d bytes:\n", name, packet_size);
+    printf("  new stream per packet: deflate %8.2f us, inflate %7.2f us, %6d bytes compressed\n",
+            new_deflate_time / 1e3 / iterations,
+            new_inflate_time / 1e3 / iterations, new_stream_size);
+    printf("  compress_data:         deflate %8.2f us, inflate %7.2f us, %6d bytes compressed\n",
+            deflate_time / 1e3 / iterations, inflate_time / 1e3 / iterations,
+            size);
+    if (!new_stream_ok || !ok) {
+        printf("  PACKET DIFFERS AFTER DECOMPRESSING\n");
+    }
+    free(compressed);
+    free(decompressed);
+}
+
+static int
+get_packet_data(buffer_cursor * send_cursor, unsigned char ** packet) {
+    // Finds the packet that was just written, starting at its packet ID, and
+    // returns its size. That leaves out the internal header and the packet
+    // size in front of it.
+    int size_offset = send_cursor->buf[0] & 0x7;
+    buffer_cursor cursor = {
+        .buf = send_cursor->buf,
+        .limit = send_cursor->index,
+        .index = 1 + size_offset
+    };
+    int packet_size = net_read_varint(&cursor);
+    *packet = cursor.buf + cursor.index;
+    return packet_size;
+}
+
+int
+main(int argc, char ** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+
+    serv = calloc(1, sizeof *serv);
+    alloc_block_resource_table();
+    init_block_data();
+
+    memory_arena scratch_arena = {
+        .ptr = malloc(CHUNK_LOADER_SCRATCH_SIZE),
+        .size = CHUNK_LOADER_SCRATCH_SIZE
+    };
+    region_file_cache * region_cache = calloc(1, sizeof *region_cache);
+    chunk * ch = calloc(1, sizeof *ch);
+    // the chunk players spawn in
+    chunk_pos pos = {.x = 88 >> 4, .z = 73 >> 4};
+    try_read_chunk_from_storage(pos, ch, &scratch_arena, region_cache);
+    if (!(ch->flags & CHUNK_LOADED)) {
+        fprintf(stderr, "Failed to load chunk %d, %d from world/region\n",
+                pos.x, pos.z);
+        return 1;
+    }
+
+    // players without packet compression get packets as they are encoded
+    entity_base * player = calloc(1, sizeof *player);
+    player->type = ENTITY_PLAYER;
+    int max_packet_size = 1 << 20;
+    buffer_cursor send_cursor = {
+        .buf = malloc(max_packet_size),
+        .limit = max_packet_size
+    };
+    unsigned char * packet;
+
+    begin_packet(&send_cursor, CBP_TELEPORT_ENTITY);
+    net_write_varint(&send_cursor, 1);
+    net_write_double(&send_cursor, 88.5);
+    net_write_double(&send_cursor, 70);
+    net_write_double(&send_cursor, 73.5);
+    net_write_ubyte(&send_cursor, 64);
+    net_write_ubyte(&send_cursor, 0);
+    net_write_ubyte(&send_cursor, 1);
+    finish_packet(&send_cursor, player);
+    int packet_size = get_packet_data(&send_cursor, &packet);
+    measure_packet("entity teleport packet", packet, packet_size, iterations);
+
+    send_cursor.index = 0;
+    scratch_arena.index = 0;
+    send_chunk_fully(&send_cursor, pos, ch, player, &scratch_arena);
+    if (send_cursor.error) {
+        fprintf(stderr, "Failed to encode chunk packet\n");
+        return 1;
+    }
+    packet_size = get_packet_data(&send_cursor, &packet);
+    measure_packet("chunk packet", packet, packet_size, iterations / 10);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs the server with idle players at spawn (see idlers.py) and prints what
+# the server's profiler reports over 20 seconds once all players have
+# joined, such as the socket syscalls the server makes per tick. The
+# server's output goes to idlebench.log in the temporary directory.
+# Arguments for profiler.py can be given in PROFILER_ARGS, like for
+# minebench.sh.
+#
+# usage: bench/idlebench.sh [players] [server binary]
+cd "$(dirname "$0")/.." || exit 1
+players=${1:-100}
+server=${2:-./blaze}
+idlers_out=$(mktemp)
+trap 'rm -f "$idlers_out"' EXIT
+# every player takes a socket on both ends
+ulimit -n $((2 * players + 256)) 2>/dev/null
+
+"$server" > "${TMPDIR:-/tmp}/idlebench.log" 2>&1 &
+server_pid=$!
+sleep 1
+python3 bench/idlers.py "$players" 22 > "$idlers_out" &
+idlers_pid=$!
+until grep -q joined "$idlers_out" || ! kill -0 $idlers_pid 2>/dev/null; do
+    sleep 1
+done
+python3 bench/profiler.py 20 10 $PROFILER_ARGS
+sleep 2
+kill $server_pid
+wait $server_pid
+wait $idlers_pid
+cat "$idlers_out"
@@ -0,0 +1,50 @@
+import sys
+import time
+from client import Client
+
+# Players that log in 32 at a time, since the server can't take more than
+# 64 new players in a tick, and then stay idle at spawn. They only answer
+# keep alives and teleports. Each player asks for the given view distance,
+# 2 by default, so many players can join without the chunks they are sent
+# dominating the measurement. Once all players have joined, that is
+# printed, and the given number of seconds later, the number of connected
+# players is printed. The players stay connected until the server stops.
+#
+# usage: python3 bench/idlers.py players seconds [view distance]
+
+player_count = int(sys.argv[1])
+duration = float(sys.argv[2])
+view_distance = int(sys.argv[3]) if len(sys.argv) > 3 else 2
+
+def receive_all(players):
+    for player in players:
+        if player.closed:
+            continue
+        player.receive()
+        if player.logged_in and not player.sent_settings:
+            player.send_settings(view_distance)
+            player.sent_settings = True
+
+start = time.time()
+players = []
+for i in range(player_count):
+    player = Client("idler%d" % i)
+    player.sent_settings = False
+    players.append(player)
+    if len(players) % 32 != 0 and len(players) != player_count:
+        continue
+    # also keeps the players that already joined connected
+    while not all(p.sent_settings or p.closed for p in players):
+        receive_all(players)
+        time.sleep(0.01)
+print("players joined in %.1f s" % (time.time() - start), flush=True)
+
+start = time.time()
+while time.time() - start < duration:
+    receive_all(players)
+    time.sleep(0.02)
+print("players connected %d" % sum(1 for p in players if not p.closed), flush=True)
+
+while not all(p.closed for p in players):
+    receive_all(players)
+    time.sleep(0.02)
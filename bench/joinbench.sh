@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs the server, lets players join at spawn at the same time (see
+# joiners.py) and prints what the server's profiler reports over the first
+# 13 seconds, while the server loads, lights and sends the chunks around
+# spawn. The server's output goes to joinbench.log in the temporary
+# directory. Arguments for profiler.py can be given in PROFILER_ARGS, like
+# for minebench.sh.
+#
+# usage: bench/joinbench.sh [players] [server binary]
+cd "$(dirname "$0")/.." || exit 1
+players=${1:-4}
+server=${2:-./blaze}
+
+"$server" > "${TMPDIR:-/tmp}/joinbench.log" 2>&1 &
+server_pid=$!
+sleep 1
+(sleep 1; python3 bench/joiners.py "$players" 14) &
+joiners_pid=$!
+python3 bench/profiler.py 13 40 $PROFILER_ARGS
+wait $joiners_pid
+kill $server_pid
+wait $server_pid
@@ -0,0 +1,28 @@
+import sys
+import time
+from client import Client, CHUNK_DATA, UPDATE_LIGHT
+
+# Players that join at the same time and stay at spawn, so the server loads,
+# lights and sends all chunks around spawn. Prints how many chunk and light
+# packets the players received and how large they were on average, as sent
+# and after decompression.
+#
+# usage: python3 bench/joiners.py players seconds
+
+player_count = int(sys.argv[1])
+duration = float(sys.argv[2])
+
+players = [Client("joiner%d" % i) for i in range(player_count)]
+
+start = time.time()
+while time.time() - start < duration:
+    for player in players:
+        player.receive(0.01 / player_count)
+
+for packet_id, name in ((CHUNK_DATA, "chunk"), (UPDATE_LIGHT, "light")):
+    count = sum(p.packet_counts.get(packet_id, 0) for p in players)
+    wire_bytes = sum(p.wire_bytes.get(packet_id, 0) for p in players)
+    packet_bytes = sum(p.packet_bytes.get(packet_id, 0) for p in players)
+    print("%s packets %d, avg bytes sent %d, avg bytes decompressed %d"
+            % (name, count, wire_bytes // max(count, 1), packet_bytes // max(count, 1)))
+print("players connected %d" % sum(1 for p in players if not p.closed))
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "shared.h"
+
+// Measures the chunk map. Every player makes the chunks in a 21x21 area
+// available, as the server does for a view distance of 10. Then all chunks
+// in those areas plus a ring of chunks around them are looked up, so some
+// lookups miss. At last the chunks are made unavailable again and cleaned
+// up. Players stand close together around spawn or are scattered over the
+// world.
+//
+// usage: bench/mapbench [player count]
+
+#define VIEW_RADIUS (10)
+#define LOOKUP_ROUNDS (20)
+
+static long long
+nano_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static unsigned random_state = 12345;
+
+static int
+random_int(int bound) {
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 8) % bound;
+}
+
+static void
+run_benchmark(char * name, int player_count, int spread) {
+    chunk_pos * players = malloc(player_count * sizeof *players);
+    for (int i = 0; i < player_count; i++) {
+        players[i].x = random_int(2 * spread + 1) - spread;
+        players[i].z = random_int(2 * spread + 1) - spread;
+    }
+
+    long long start = nano_time();
+    long inserts = 0;
+    long created = 0;
+    for (int i = 0; i < player_count; i++) {
+        for (int x = players[i].x - VIEW_RADIUS; x <= players[i].x + VIEW_RADIUS; x++) {
+            for (int z = players[i].z - VIEW_RADIUS; z <= players[i].z + VIEW_RADIUS; z++) {
+                chunk * ch = get_or_create_chunk((chunk_pos) {.x = x, .z = z});
+                if (ch->available_interest == 0) {
+                    created++;
+                }
+                ch->available_interest++;
+                ch->flags |= CHUNK_LOADED;
+                inserts++;
+            }
+        }
+    }
+
+    long long lookup_start = nano_time();
+    long lookups = 0;
+    long found = 0;
+    int radius = VIEW_RADIUS + 1;
+    for (int round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (int i = 0; i < player_count; i++) {
+            for (int x = players[i].x - radius; x <= players[i].x + radius; x++) {
+                for (int z = players[i].z - radius; z <= players[i].z + radius; z++) {
+                    chunk_pos pos = {.x = x, .z = z};
+                    found += (get_chunk_if_loaded(pos) != NULL);
+                    lookups++;
+                }
+            }
+        }
+    }
+    long long lookup_end = nano_time();
+
+    for (int i = 0; i < player_count; i++) {
+        for (int x = players[i].x - VIEW_RADIUS; x <= players[i].x + VIEW_RADIUS; x++) {
+            for (int z = players[i].z - VIEW_RADIUS; z <= players[i].z + VIEW_RADIUS; z++) {
+                chunk * ch = get_chunk_if_available((chunk_pos) {.x = x, .z = z});
+                ch->available_interest--;
+                // unloaded chunks are removed right away instead of being
+                // retained
+                ch->flags &= ~CHUNK_LOADED;
+            }
+        }
+    }
+
+    long long clean_up_start = nano_time();
+    clean_up_unused_chunks(get_scratch_arena());
+    long long clean_up_end = nano_time();
+
+    printf("%-9s players %5d chunks %7ld: insert %6.1f ns, lookup %6.1f ns (%.0f%% hits), clean up %7.2f ms\n",
+            name, player_count, created,
+            (double) (lookup_start - start) / inserts,
+            (double) (lookup_end - lookup_start) / lookups,
+            100.0 * found / lookups,
+            (clean_up_end - clean_up_start) / 1e6);
+    free(players);
+}
+
+int
+main(int argc, char ** argv) {
+    int player_count = argc > 1 ? atoi(argv[1]) : 32;
+
+    serv = calloc(1, sizeof *serv);
+    init_job_system();
+
+    // the first rounds warm up the chunk map and the allocator
+    for (int round = 0; round < 2; round++) {
+        run_benchmark("clustered", player_count, 16);
+        run_benchmark("scattered", player_count, 20000);
+    }
+    return 0;
+}
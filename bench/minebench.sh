@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs the server with creative players breaking blocks in every chunk
+# around spawn (see miners.py) and prints what the server's profiler reports
+# over 20 seconds, starting once the players have loaded their chunks and
+# are breaking blocks. The server's output goes to minebench.log in the
+# temporary directory. Changed chunks are saved to the world, so run this on
+# a copy of a world. Arguments for profiler.py can be given in PROFILER_ARGS,
+# for example to measure older versions of the server.
+#
+# usage: bench/minebench.sh [players] [radius] [blocks per chunk] [server binary]
+cd "$(dirname "$0")/.." || exit 1
+players=${1:-2}
+radius=${2:-4}
+blocks=${3:-16}
+server=${4:-./blaze}
+
+"$server" > "${TMPDIR:-/tmp}/minebench.log" 2>&1 &
+server_pid=$!
+sleep 1
+python3 bench/miners.py "$players" 35 "$radius" "$blocks" &
+miners_pid=$!
+sleep 12
+python3 bench/profiler.py 20 40 $PROFILER_ARGS
+wait $miners_pid
+kill $server_pid
+wait $server_pid
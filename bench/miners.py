@@ -0,0 +1,66 @@
+import sys
+import time
+from client import Client, PLAYER_DIGGING, write_block_pos, write_varint
+
+# Creative players that break blocks in every chunk around spawn, to put
+# load on block changes, light updates and chunk saving. Every round, 20 per
+# second, each player breaks the given number of blocks in every chunk of
+# the square with the given radius. The blocks are broken layer by layer,
+# from the given height down. Each player works in a different layer. The
+# players start breaking blocks 3 seconds after they have spawned.
+#
+# usage: python3 bench/miners.py players seconds [radius] [blocks per chunk] [top y]
+
+player_count = int(sys.argv[1])
+duration = float(sys.argv[2])
+radius = int(sys.argv[3]) if len(sys.argv) > 3 else 4
+blocks_per_chunk = int(sys.argv[4]) if len(sys.argv) > 4 else 16
+top_y = int(sys.argv[5]) if len(sys.argv) > 5 else 70
+
+players = []
+for i in range(player_count):
+    player = Client("miner%d" % i)
+    player.index = i
+    player.spawn_time = None
+    player.broken_count = 0
+    players.append(player)
+
+start = time.time()
+last_round = 0
+sent = 0
+
+while time.time() - start < duration:
+    for player in players:
+        player.receive()
+
+    now = time.time()
+    if now - last_round < 0.05:
+        time.sleep(0.005)
+        continue
+    last_round = now
+
+    for player in players:
+        if player.pos is None:
+            continue
+        if player.spawn_time is None:
+            player.spawn_time = now
+        if now - player.spawn_time < 3:
+            continue
+
+        spawn_chunk_x = int(player.pos[0]) >> 4
+        spawn_chunk_z = int(player.pos[2]) >> 4
+        for dx in range(-radius, radius + 1):
+            for dz in range(-radius, radius + 1):
+                for i in range(player.broken_count, player.broken_count + blocks_per_chunk):
+                    y = top_y - (i >> 8) - 8 * player.index
+                    if y < 1:
+                        continue
+                    x = ((spawn_chunk_x + dx) << 4) | (i & 0xf)
+                    z = ((spawn_chunk_z + dz) << 4) | ((i >> 4) & 0xf)
+                    # start digging, which breaks the block in creative mode
+                    player.send_packet(PLAYER_DIGGING, write_varint(0)
+                            + write_block_pos(x, y, z) + b"\x01")
+                    sent += 1
+        player.broken_count += blocks_per_chunk
+
+print("blocks broken %d, players connected %d" % (sent, sum(1 for p in players if not p.closed)))
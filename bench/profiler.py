@@ -0,0 +1,87 @@
+import socket
+import struct
+import sys
+import time
+
+# Stands in for the profiler the server connects to on port 16186. Collects
+# the timed blocks and counters the server sends every tick for the given
+# number of seconds, then prints the average and maximum per tick of every
+# counter and of the most expensive timed blocks. The time of a timed block
+# is summed over all job threads.
+#
+# Versions of the server from before timed blocks were tagged with the job
+# thread that ran them need --no-thread-index.
+#
+# usage: python3 bench/profiler.py [seconds] [block count] [--no-thread-index]
+
+args = [a for a in sys.argv[1:] if not a.startswith("--")]
+duration = float(args[0]) if len(args) > 0 else 20
+block_limit = int(args[1]) if len(args) > 1 else 40
+has_thread_index = "--no-thread-index" not in sys.argv
+
+listen_sock = socket.socket()
+listen_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listen_sock.bind(("127.0.0.1", 16186))
+listen_sock.listen(1)
+sock, _ = listen_sock.accept()
+
+buf = b""
+
+def receive(size):
+    global buf
+    while len(buf) < size:
+        data = sock.recv(1 << 20)
+        if not data:
+            raise EOFError("Server closed the connection")
+        buf += data
+    res = buf[:size]
+    buf = buf[size:]
+    return res
+
+def read_name(body, index):
+    size = body[index]
+    return body[index + 1:index + 1 + size].decode(), index + 1 + size
+
+ticks = 0
+counter_sums = {}
+counter_maxes = {}
+block_sums = {}
+block_maxes = {}
+start = time.time()
+
+while time.time() - start < duration:
+    size, = struct.unpack(">I", receive(4))
+    body = receive(size)
+
+    block_count, = struct.unpack_from(">i", body, 0)
+    index = 4
+    tick_blocks = {}
+    for i in range(block_count):
+        if has_thread_index:
+            index += 1
+        name, index = read_name(body, index)
+        _, nanos = struct.unpack_from(">QI", body, index)
+        index += 12
+        tick_blocks[name] = tick_blocks.get(name, 0) + nanos
+
+    counter_count, = struct.unpack_from(">i", body, index)
+    index += 4
+    for i in range(counter_count):
+        name, index = read_name(body, index)
+        value, = struct.unpack_from(">q", body, index)
+        index += 8
+        counter_sums[name] = counter_sums.get(name, 0) + value
+        counter_maxes[name] = max(counter_maxes.get(name, value), value)
+
+    for name, nanos in tick_blocks.items():
+        block_sums[name] = block_sums.get(name, 0) + nanos
+        block_maxes[name] = max(block_maxes.get(name, 0), nanos)
+    ticks += 1
+
+sock.close()
+
+print("ticks %d" % ticks)
+for name in sorted(counter_sums):
+    print("  counter %-36s avg %12.2f max %d" % (name, counter_sums[name] / ticks, counter_maxes[name]))
+for name in sorted(block_sums, key=lambda name: -block_sums[name])[:block_limit]:
+    print("  block %-38s avg %9.1f us max %9.1f us" % (name, block_sums[name] / ticks / 1000, block_maxes[name] / 1000))
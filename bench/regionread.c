@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "shared.h"
+
+// Measures reading every chunk of an Anvil region file, either with pread
+// into a buffer or straight from a mapping of the file. Runs start with the
+// file dropped from the page cache (cold) or with the file cached (warm).
+// Cold runs are repeated with readahead hints for the next 16 chunks, like
+// the chunk loader threads give. Dropping the file from the page cache needs
+// posix_fadvise. By default a byte of every cache line of the chunk data is
+// read. Pass "inflate" to inflate the chunks instead.
+//
+// usage: bench/regionread [region file] [inflate]
+
+#define RUNS (3)
+
+static unsigned char read_buf[256 << 12];
+static unsigned char inflate_buf[2 << 20];
+static z_stream inflater;
+static int inflate_chunks;
+// keeps the compiler from dropping the reads
+static volatile long read_sum;
+
+static long long
+nano_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static mc_uint
+read_location(unsigned char * header, int index) {
+    unsigned char * entry = header + 4 * index;
+    return ((mc_uint) entry[0] << 24) | (entry[1] << 16) | (entry[2] << 8)
+            | entry[3];
+}
+
+static long
+consume_chunk(unsigned char * data, int size) {
+    // returns the size of the data, or -1 if the chunk is invalid
+    if (!inflate_chunks) {
+        for (int i = 0; i < size; i += 64) {
+            read_sum += data[i];
+        }
+        return size;
+    }
+
+    inflateReset(&inflater);
+    inflater.next_in = data;
+    inflater.avail_in = size;
+    inflater.next_out = inflate_buf;
+    inflater.avail_out = sizeof inflate_buf;
+    if (inflate(&inflater, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return inflater.total_out;
+}
+
+static double
+read_region(char * file_name, int use_map, int cold, int readahead,
+        long * total_size) {
+    // returns the time taken in milliseconds
+    int fd = open(file_name, O_RDONLY);
+    struct stat region_stat;
+    if (fd == -1 || fstat(fd, &region_stat) == -1) {
+        perror("Failed to open region file");
+        exit(1);
+    }
+    if (cold) {
+#if defined(POSIX_FADV_DONTNEED)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+        fprintf(stderr, "Can't drop the region file from the page cache\n");
+        exit(1);
+#endif
+    }
+
+    long long start = nano_time();
+    unsigned char header[4096];
+    unsigned char * map = NULL;
+    if (use_map) {
+        map = mmap(NULL, region_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Failed to map region file");
+            exit(1);
+        }
+        memcpy(header, map, sizeof header);
+    } else if (pread(fd, header, sizeof header, 0) != sizeof header) {
+        perror("Failed to read region file header");
+        exit(1);
+    }
+
+    *total_size = 0;
+    for (int i = 0; i < 1024; i++) {
+        if (readahead) {
+            // hint each chunk once, 16 chunks ahead
+            int first = (i == 0 ? 1 : i + 16);
+            for (int j = first; j <= i + 16 && j < 1024; j++) {
+                mc_uint loc = read_location(header, j);
+                off_t offset = (off_t) (loc >> 8) << 12;
+                size_t size = (size_t) (loc & 0xff) << 12;
+                if (loc == 0) {
+                    continue;
+                }
+                if (use_map) {
+                    madvise(map + offset, size, MADV_WILLNEED);
+                } else {
+#if defined(POSIX_FADV_WILLNEED)
+                    posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+                }
+            }
+        }
+
+        mc_uint loc = read_location(header, i);
+        if (loc == 0) {
+            continue;
+        }
+        off_t offset = (off_t) (loc >> 8) << 12;
+        size_t size = (size_t) (loc & 0xff) << 12;
+        unsigned char * data;
+        if (use_map) {
+            data = map + offset;
+        } else {
+            if (pread(fd, read_buf, size, offset) != (ssize_t) size) {
+                perror("Failed to read chunk");
+                exit(1);
+            }
+            data = read_buf;
+        }
+
+        // skip the size and compression method
+        int data_size = (data[0] << 24) | (data[1] << 16) | (data[2] << 8)
+                | data[3];
+        long consumed = consume_chunk(data + 5, data_size - 1);
+        if (consumed == -1) {
+            fprintf(stderr, "Failed to inflate chunk %d\n", i);
+            exit(1);
+        }
+        *total_size += consumed;
+    }
+    long long end = nano_time();
+
+    if (map != NULL) {
+        munmap(map, region_stat.st_size);
+    }
+    close(fd);
+    return (end - start) / 1e6;
+}
+
+int
+main(int argc, char ** argv) {
+    char * file_name = argc > 1 ? argv[1] : "world/region/r.0.0.mca";
+    inflate_chunks = argc > 2 && strcmp(argv[2], "inflate") == 0;
+    inflateInit2(&inflater, 32 + 15);
+
+    for (int run = 0; run < RUNS; run++) {
+        for (int cold = 1; cold >= 0; cold--) {
+            for (int use_map = 0; use_map < 2; use_map++) {
+                for (int readahead = 0; readahead <= cold; readahead++) {
+                    long total_size;
+                    double millis = read_region(file_name, use_map, cold,
+                            readahead, &total_size);
+                    printf("%-4s %-4s %-9s %8.2f ms (%ld KB)\n",
+                            cold ? "cold" : "warm",
+                            use_map ? "mmap" : "read",
+                            readahead ? "readahead" : "", millis,
+                            total_size >> 10);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+// for the static section decoding functions
+#include "chunk.c"
+
+// Measures unpacking the block states of an Anvil chunk section into a
+// chunk_section, for 4 to 12 bits per block. The block states have been
+// read from NBT and the palette has been resolved already, so this is the
+// part of decode_section that depends on the number of bits per block. The
+// section is decoded the way decode_section does it now, and with the
+// scalar loop decode_section used before, which is kept below. Both must
+// give the same section. Most IDs in the section are one of a few common
+// IDs, like in real terrain.
+//
+// usage: bench/sectiondecode [iterations]
+
+static unsigned char longs[820 * 8];
+static mc_ushort palette_map[4096];
+static mc_ulong reference_data[1024];
+// keeps the compiler from dropping the decoding
+static volatile int result_sum;
+
+static long long
+nano_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int
+decode_with_scalar_loop(int bits_per_id, mc_uint palette_size,
+        int section_bits, int has_section_palette, mc_ulong * data) {
+    // Returns the non-air count plus 1 if the section is uniform, or -1 if
+    // an ID is outside the palette.
+    int ids_per_long = 64 / bits_per_id;
+    mc_uint needed_longs = (4096 + ids_per_long - 1) / ids_per_long;
+    mc_uint id_mask = (1 << bits_per_id) - 1;
+    mc_ushort * direct_states = (mc_ushort *) data;
+    mc_ulong out_entry = 0;
+    int out_shift = 0;
+    int out_index = 0;
+    mc_ushort first_block_state = palette_map[0];
+    int uniform = 1;
+    int non_air_count = 0;
+    int j = 0;
+
+    for (mc_uint longi = 0; longi < needed_longs; longi++) {
+        unsigned char * bytes = longs + 8 * longi;
+        mc_ulong entry = ((mc_ulong) bytes[0] << 56)
+                | ((mc_ulong) bytes[1] << 48)
+                | ((mc_ulong) bytes[2] << 40)
+                | ((mc_ulong) bytes[3] << 32)
+                | ((mc_ulong) bytes[4] << 24)
+                | ((mc_ulong) bytes[5] << 16)
+                | ((mc_ulong) bytes[6] << 8)
+                | (mc_ulong) bytes[7];
+
+        int end = MIN(4096, j + ids_per_long);
+        for (; j < end; j++) {
+            mc_uint id = entry & id_mask;
+            entry >>= bits_per_id;
+            if (id >= palette_size) {
+                return -1;
+            }
+
+            mc_ushort block_state = palette_map[id];
+            non_air_count += (block_state != 0);
+            if (j == 0) {
+                first_block_state = block_state;
+            }
+            uniform &= (block_state == first_block_state);
+
+            if (has_section_palette) {
+                out_entry |= (mc_ulong) id << out_shift;
+                out_shift += section_bits;
+                if (out_shift + section_bits > 64) {
+                    data[out_index] = out_entry;
+                    out_index++;
+                    out_entry = 0;
+                    out_shift = 0;
+                }
+            } else {
+                direct_states[j] = block_state;
+            }
+        }
+    }
+
+    if (has_section_palette && out_shift != 0) {
+        data[out_index] = out_entry;
+    }
+    return non_air_count + uniform;
+}
+
+static int
+decode_like_decode_section(int bits_per_id, mc_uint palette_size,
+        chunk_section * section) {
+    // Same return value as the scalar loop. Calls the same functions as
+    // decode_section.
+    int ids_per_long = 64 / bits_per_id;
+    mc_uint needed_longs = (4096 + ids_per_long - 1) / ids_per_long;
+    buffer_cursor longs_cursor = {.buf = longs, .limit = needed_longs * 8};
+
+    if (section->palette != NULL) {
+        if (bits_per_id == 7) {
+            mc_ulong packed[586];
+            net_read_ulongs(&longs_cursor, packed, needed_longs);
+            widen_7_bit_ids(packed, section->data);
+        } else {
+            net_read_ulongs(&longs_cursor, section->data, needed_longs);
+        }
+
+        packed_id_stats stats = scan_section_ids(section->data,
+                section->bits_per_block, palette_size, palette_map);
+        if (stats.max_id >= palette_size) {
+            return -1;
+        }
+        return 4096 - stats.air_count + (stats.min_id == stats.max_id);
+    }
+
+    mc_ulong packed[820];
+    net_read_ulongs(&longs_cursor, packed, needed_longs);
+    mc_ushort * block_states = (mc_ushort *) section->data;
+    int non_air_count;
+    int uniform;
+    int valid;
+    switch (bits_per_id) {
+    case 9:
+        valid = unpack_direct_block_states(packed, 9, palette_size,
+                palette_map, block_states, &non_air_count, &uniform);
+        break;
+    case 10:
+        valid = unpack_direct_block_states(packed, 10, palette_size,
+                palette_map, block_states, &non_air_count, &uniform);
+        break;
+    case 11:
+        valid = unpack_direct_block_states(packed, 11, palette_size,
+                palette_map, block_states, &non_air_count, &uniform);
+        break;
+    default:
+        valid = unpack_direct_block_states(packed, 12, palette_size,
+                palette_map, block_states, &non_air_count, &uniform);
+        break;
+    }
+    if (!valid) {
+        return -1;
+    }
+    return non_air_count + uniform;
+}
+
+static void
+generate_section(int bits_per_id, mc_uint palette_size) {
+    // Stores the IDs in big-endian longs, like Anvil chunks do. Palette
+    // entry 1 is air.
+    int ids_per_long = 64 / bits_per_id;
+    memset(longs, 0, sizeof longs);
+    for (int j = 0; j < 4096; j++) {
+        mc_ulong id = (rand() % 4 != 0) ? rand() % 3 : rand() % palette_size;
+        unsigned char * bytes = longs + 8 * (j / ids_per_long);
+        int shift = (j % ids_per_long) * bits_per_id;
+        for (int k = 0; k < 8; k++) {
+            bytes[7 - k] |= (id << shift) >> (8 * k);
+        }
+    }
+
+    for (mc_uint i = 0; i < palette_size; i++) {
+        palette_map[i] = (i == 1 ? 0 : 100 + i);
+    }
+}
+
+int
+main(int argc, char ** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    srand(1);
+
+    for (int bits_per_id = 4; bits_per_id <= 12; bits_per_id++) {
+        // the smallest palette that needs this many bits per block
+        mc_uint palette_size = (1 << (bits_per_id - 1)) + 1;
+        generate_section(bits_per_id, palette_size);
+
+        chunk_section * section = alloc_chunk_section(bits_per_id);
+        int has_section_palette = (section->palette != NULL);
+        int section_bits = section->bits_per_block;
+        size_t data_size = has_section_palette
+                ? get_section_data_longs(section_bits) * sizeof (mc_ulong)
+                : 4096 * sizeof (mc_ushort);
+
+        int reference_result = decode_with_scalar_loop(bits_per_id,
+                palette_size, section_bits, has_section_palette,
+                reference_data);
+        int result = decode_like_decode_section(bits_per_id, palette_size,
+                section);
+        int same = (result == reference_result && result != -1
+                && memcmp(section->data, reference_data, data_size) == 0);
+
+        long long start = nano_time();
+        for (int i = 0; i < iterations; i++) {
+            result_sum += decode_with_scalar_loop(bits_per_id, palette_size,
+                    section_bits, has_section_palette, reference_data);
+        }
+        long long middle = nano_time();
+        for (int i = 0; i < iterations; i++) {
+            result_sum += decode_like_decode_section(bits_per_id,
+                    palette_size, section);
+        }
+        long long end = nano_time();
+
+        double scalar_micros = (middle - start) / 1e3 / iterations;
+        double micros = (end - middle) / 1e3 / iterations;
+        printf("bits %2d: scalar loop %6.2f us, now %6.2f us, %4.1fx%s\n",
+                bits_per_id, scalar_micros, micros, scalar_micros / micros,
+                same ? "" : ", DIFFERENT RESULTS");
+        free_chunk_section(section);
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+import sys
+import time
+from client import Client, CHUNK_DATA
+
+# A single player that joins with the given view distance, 10 by default,
+# and stays at spawn while the server sends it the chunks around it.
+# Prints how many chunks had arrived after every second, how long it took
+# until all of them had arrived, and whether the server disconnected the
+# player.
+#
+# usage: python3 bench/streamer.py port seconds [view distance]
+
+port = int(sys.argv[1])
+duration = float(sys.argv[2])
+view_distance = int(sys.argv[3]) if len(sys.argv) > 3 else 10
+# the view distance doesn't include the border of chunks clients get
+view_chunks = (2 * view_distance + 1) ** 2
+
+player = Client("streamer", port=port)
+sent_settings = False
+start = time.time()
+chunk_counts = []
+done_time = None
+
+while time.time() - start < duration and not player.closed:
+    player.receive(0.01)
+    if player.logged_in and not sent_settings:
+        player.send_settings(view_distance)
+        sent_settings = True
+    now = time.time()
+    chunks = player.packet_counts.get(CHUNK_DATA, 0)
+    if done_time is None and chunks >= view_chunks:
+        done_time = now - start
+    if now - start >= len(chunk_counts) + 1:
+        chunk_counts.append(chunks)
+
+print("chunks after every second: %s" % " ".join(str(c) for c in chunk_counts))
+if done_time is None:
+    print("not all %d chunks arrived" % view_chunks)
+else:
+    print("all %d chunks arrived after %.1f s" % (view_chunks, done_time))
+print("disconnected" if player.closed else "still connected")
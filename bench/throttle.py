@@ -0,0 +1,88 @@
+import asyncio
+import socket
+import sys
+import time
+
+# Proxy for slow connections. Clients connect to it on port 25566 and it
+# connects them to the server on port 25565. Data from the server is passed
+# on at the given number of bytes per second, and data from the client is
+# held back for the given delay, so the round trip time grows by that
+# delay. The proxy only reads from the server as fast as it passes data on,
+# and reads into a small receive buffer, so the data piles up in the
+# server's send queue like it would on a slow link.
+#
+# usage: python3 bench/throttle.py bytes_per_second delay_ms
+
+rate = float(sys.argv[1])
+delay = float(sys.argv[2]) / 1000
+
+async def pass_server_data(server_sock, writer):
+    loop = asyncio.get_running_loop()
+    # bytes we may pass on, which accumulate at the rate up to a tenth of a
+    # second's worth
+    allowance = 0
+    last_time = time.monotonic()
+    while True:
+        now = time.monotonic()
+        allowance = min(max(rate / 10, 4096), allowance + (now - last_time) * rate)
+        last_time = now
+        if allowance < 256:
+            await asyncio.sleep(0.005)
+            continue
+        try:
+            data = await loop.sock_recv(server_sock, int(allowance))
+        except OSError:
+            break
+        if not data:
+            break
+        allowance -= len(data)
+        writer.write(data)
+        try:
+            await writer.drain()
+        except ConnectionError:
+            break
+    writer.close()
+
+async def pass_client_data(reader, server_sock):
+    loop = asyncio.get_running_loop()
+    queue = asyncio.Queue()
+
+    async def send_queued():
+        while True:
+            send_time, data = await queue.get()
+            wait = send_time - time.monotonic()
+            if wait > 0:
+                await asyncio.sleep(wait)
+            if not data:
+                server_sock.close()
+                return
+            try:
+                await loop.sock_sendall(server_sock, data)
+            except OSError:
+                return
+
+    sender = asyncio.create_task(send_queued())
+    while True:
+        try:
+            data = await reader.read(1 << 16)
+        except ConnectionError:
+            data = b""
+        await queue.put((time.monotonic() + delay, data))
+        if not data:
+            break
+    await sender
+
+async def handle_client(reader, writer):
+    server_sock = socket.socket()
+    server_sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 16384)
+    server_sock.setblocking(False)
+    await asyncio.get_running_loop().sock_connect(server_sock, ("127.0.0.1", 25565))
+    await asyncio.gather(pass_server_data(server_sock, writer),
+            pass_client_data(reader, server_sock))
+
+async def main():
+    server = await asyncio.start_server(handle_client, "127.0.0.1", 25566)
+    async with server:
+        await server.serve_forever()
+
+asyncio.run(main())
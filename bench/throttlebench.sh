@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs the server with a single player that gets its chunks through a
+# proxy that limits the bandwidth and adds latency (see throttle.py and
+# streamer.py), to check that the chunk send rate follows the connection
+# without the player getting disconnected. Prints what the server's
+# profiler reports while the chunks are sent, such as "chunks sent" and
+# "send backlog bytes", and what the player received. Without arguments,
+# the player connects to the server directly. The server's output goes to
+# throttlebench.log in the temporary directory. Arguments for profiler.py
+# can be given in PROFILER_ARGS, like for minebench.sh.
+#
+# usage: bench/throttlebench.sh [bytes per second] [delay ms] [seconds] [server binary]
+cd "$(dirname "$0")/.." || exit 1
+rate=$1
+delay=${2:-0}
+seconds=${3:-30}
+server=${4:-./blaze}
+
+"$server" > "${TMPDIR:-/tmp}/throttlebench.log" 2>&1 &
+server_pid=$!
+port=25565
+if [ -n "$rate" ]; then
+    python3 bench/throttle.py "$rate" "$delay" &
+    throttle_pid=$!
+    port=25566
+fi
+sleep 1
+python3 bench/streamer.py $port "$seconds" &
+streamer_pid=$!
+python3 bench/profiler.py $((seconds - 2)) 10 $PROFILER_ARGS
+wait $streamer_pid
+kill $server_pid $throttle_pid
+wait $server_pid
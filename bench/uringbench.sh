@@ -0,0 +1,33 @@
+#!/bin/sh
+# Builds the server twice, once with the plain socket backend and once with
+# the io_uring backend, and runs idlebench.sh with both for every given
+# number of players. MAX_PLAYERS is raised to the largest number of
+# players. The builds go to the temporary directory. Arguments for
+# profiler.py can be given in PROFILER_ARGS, like for minebench.sh.
+#
+# usage: bench/uringbench.sh [players...]
+cd "$(dirname "$0")/.." || exit 1
+[ $# -gt 0 ] || set -- 100 500 1000
+max_players=0
+for players in "$@"; do
+    [ "$players" -gt $max_players ] && max_players=$players
+done
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+for uring in 0 1; do
+    mkdir "$dir/src$uring"
+    cp src/*.c src/*.h "$dir/src$uring"
+    sed -e "s/^#define IO_URING_ENABLED (1)/#define IO_URING_ENABLED ($uring)/" \
+            -e "s/^#define MAX_PLAYERS (100)/#define MAX_PLAYERS ($max_players)/" \
+            src/shared.h > "$dir/src$uring/shared.h"
+    cc -o "$dir/blaze$uring" "$dir/src$uring"/*.c -lz -lm -pthread || exit 1
+done
+
+for players in "$@"; do
+    for uring in 0 1; do
+        [ $uring = 1 ] && backend=io_uring || backend=plain
+        echo "$players players, $backend backend"
+        bench/idlebench.sh "$players" "$dir/blaze$uring"
+    done
+done
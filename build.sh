@@ -1 +1 @@
-cc -o blaze src/*.c -lz -lm
+cc -o blaze src/*.c -lz -lm -pthread
@@ -4631,6 +4631,140 @@ register_cross_block_models(int start_index, block_box centre_box,
     }
 }
 
+static int
+get_emitted_light(block_state_info * info) {
+    switch (info->block_type) {
+    case BLOCK_GLOWSTONE:
+    case BLOCK_JACK_O_LANTERN:
+    case BLOCK_SEA_LANTERN:
+    case BLOCK_BEACON:
+    case BLOCK_CONDUIT:
+    case BLOCK_END_PORTAL:
+    case BLOCK_END_GATEWAY:
+    case BLOCK_FIRE:
+    case BLOCK_LAVA:
+    case BLOCK_LANTERN:
+    case BLOCK_SHROOMLIGHT:
+        return 15;
+    case BLOCK_CAMPFIRE:
+    case BLOCK_REDSTONE_LAMP:
+        return info->lit ? 15 : 0;
+    case BLOCK_END_ROD:
+    case BLOCK_TORCH:
+    case BLOCK_WALL_TORCH:
+        return 14;
+    case BLOCK_FURNACE:
+    case BLOCK_SMOKER:
+    case BLOCK_BLAST_FURNACE:
+        return info->lit ? 13 : 0;
+    case BLOCK_NETHER_PORTAL:
+        return 11;
+    case BLOCK_SOUL_FIRE:
+    case BLOCK_SOUL_TORCH:
+    case BLOCK_SOUL_WALL_TORCH:
+    case BLOCK_SOUL_LANTERN:
+    case BLOCK_CRYING_OBSIDIAN:
+        return 10;
+    case BLOCK_SOUL_CAMPFIRE:
+        return info->lit ? 10 : 0;
+    case BLOCK_REDSTONE_ORE:
+        return info->lit ? 9 : 0;
+    case BLOCK_REDSTONE_TORCH:
+    case BLOCK_REDSTONE_WALL_TORCH:
+        return info->lit ? 7 : 0;
+    case BLOCK_ENDER_CHEST:
+        return 7;
+    case BLOCK_SEA_PICKLE:
+        return info->waterlogged ? 3 + 3 * info->pickles : 0;
+    case BLOCK_RESPAWN_ANCHOR:
+        return info->respawn_anchor_charges * 15 / 4;
+    case BLOCK_MAGMA_BLOCK:
+        return 3;
+    case BLOCK_BREWING_STAND:
+    case BLOCK_BROWN_MUSHROOM:
+    case BLOCK_DRAGON_EGG:
+    case BLOCK_END_PORTAL_FRAME:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int
+get_light_opacity(mc_ushort block_state, block_state_info * info) {
+    // Full blocks absorb all light, except for blocks light can shine
+    // through, like glass. Water and some see-through blocks only absorb a
+    // bit of light. Other blocks let all light through. Vanilla also lets
+    // some blocks with partial shapes, like slabs, block light in certain
+    // directions, which we don't do.
+    switch (info->block_type) {
+    case BLOCK_WATER:
+    case BLOCK_BUBBLE_COLUMN:
+    case BLOCK_LAVA:
+    case BLOCK_ICE:
+    case BLOCK_FROSTED_ICE:
+    case BLOCK_COBWEB:
+    case BLOCK_SLIME_BLOCK:
+    case BLOCK_HONEY_BLOCK:
+    case BLOCK_SPAWNER:
+    case BLOCK_JUNGLE_LEAVES:
+    case BLOCK_OAK_LEAVES:
+    case BLOCK_SPRUCE_LEAVES:
+    case BLOCK_DARK_OAK_LEAVES:
+    case BLOCK_ACACIA_LEAVES:
+    case BLOCK_BIRCH_LEAVES:
+    // waterlogged plants
+    case BLOCK_KELP:
+    case BLOCK_KELP_PLANT:
+    case BLOCK_SEAGRASS:
+    case BLOCK_TALL_SEAGRASS:
+        return 1;
+    case BLOCK_GLASS:
+    case BLOCK_WHITE_STAINED_GLASS:
+    case BLOCK_ORANGE_STAINED_GLASS:
+    case BLOCK_MAGENTA_STAINED_GLASS:
+    case BLOCK_LIGHT_BLUE_STAINED_GLASS:
+    case BLOCK_YELLOW_STAINED_GLASS:
+    case BLOCK_LIME_STAINED_GLASS:
+    case BLOCK_PINK_STAINED_GLASS:
+    case BLOCK_GRAY_STAINED_GLASS:
+    case BLOCK_LIGHT_GRAY_STAINED_GLASS:
+    case BLOCK_CYAN_STAINED_GLASS:
+    case BLOCK_PURPLE_STAINED_GLASS:
+    case BLOCK_BLUE_STAINED_GLASS:
+    case BLOCK_BROWN_STAINED_GLASS:
+    case BLOCK_GREEN_STAINED_GLASS:
+    case BLOCK_RED_STAINED_GLASS:
+    case BLOCK_BLACK_STAINED_GLASS:
+    case BLOCK_BEACON:
+    case BLOCK_BARRIER:
+    case BLOCK_STRUCTURE_VOID:
+        return 0;
+    // not full blocks, but opaque anyway
+    case BLOCK_SOUL_SAND:
+        return 15;
+    default:
+        if (info->waterlogged) {
+            return 1;
+        }
+        if (serv->collision_model_by_state[block_state] == BLOCK_MODEL_FULL) {
+            return 15;
+        }
+        return 0;
+    }
+}
+
+static void
+init_light_properties(void) {
+    for (int block_state = 0; block_state < serv->actual_block_state_count;
+            block_state++) {
+        block_state_info info = describe_block_state(block_state);
+        serv->emitted_light_by_state[block_state] = get_emitted_light(&info);
+        serv->light_opacity_by_state[block_state] = get_light_opacity(
+                block_state, &info);
+    }
+}
+
 void
 init_block_data(void) {
     register_block_model(BLOCK_MODEL_EMPTY, 0, NULL);
@@ -6284,4 +6418,6 @@ init_block_data(void) {
     serv->vanilla_block_state_count = serv->actual_block_state_count;
 
     init_simple_block(BLOCK_UNKNOWN, "blaze:unknown", BLOCK_MODEL_FULL);
+
+    init_light_properties();
 }
@@ -3,35 +3,103 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <zlib.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "shared.h"
 
-// @TODO(traks) don't use a hash map. Performance depends on the chunks loaded,
-// which depends on the positions of players in the world. Doesn't seem good
-// that players moving to certain locations can cause performance drops...
-//
-// Our goal is 1000 players, so if we construct our hash and hash map in an
-// appropriate way, we can ensure there are at most 1000 entries per bucket.
-// Not sure if that's any good.
-static chunk_bucket chunk_map[CHUNK_MAP_SIZE];
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Loaded chunks are indexed by an open-addressed hash map with linear probing.
+// The map stores pointers to chunks, so it stays small and chunks don't move
+// when the map grows or entries are removed. The hash mixes all bits of both
+// coordinates, so lookups take about the same time no matter where in the
+// world players are. The map is kept at most half full.
+static chunk_map_entry * chunk_map;
+static int chunk_map_size;
+static int chunk_map_size_log2;
+static int chunk_map_count;
+
+// Chunks are allocated in blocks and recycled through a free list. The first
+// bytes of a free chunk store the next free chunk.
+static chunk * free_chunks;
+
+// Loaded chunks no one is interested in anymore, from the most recently
+// retained to the least recently retained one
+static chunk * newest_retained_chunk;
+static chunk * oldest_retained_chunk;
+static mc_long retained_chunk_memory;
+static int retained_chunk_count;
+
+// Chunk sections are allocated by the chunk loader threads and freed by job
+// threads, so the buckets are protected by a mutex. Every size class has
+// its own buckets.
+static pthread_mutex_t chunk_section_mutex = PTHREAD_MUTEX_INITIALIZER;
+static chunk_section_bucket * full_chunk_section_buckets[CHUNK_SECTION_SIZE_CLASSES];
+static chunk_section_bucket * chunk_section_buckets_with_unused[CHUNK_SECTION_SIZE_CLASSES];
+
+static unsigned char section_size_class_bits[CHUNK_SECTION_SIZE_CLASSES] = {
+    4, 5, 6, 8, 16
+};
+
+// start of the first section in a bucket
+#define CHUNK_SECTION_BUCKET_HEADER_SIZE \
+        ((sizeof (chunk_section_bucket) + 15) & ~(size_t) 15)
 
-static chunk_section_bucket * full_chunk_section_buckets;
-static chunk_section_bucket * chunk_section_buckets_with_unused;
+static int
+get_section_palette_capacity(int bits_per_block) {
+    return bits_per_block == 16 ? 0 : 1 << bits_per_block;
+}
+
+static int
+get_section_data_longs(int bits_per_block) {
+    int blocks_per_long = 64 / bits_per_block;
+    return (4096 + blocks_per_long - 1) / blocks_per_long;
+}
+
+static size_t
+get_section_size(int bits_per_block) {
+    // the palette capacity is a multiple of 4, so the data stays aligned
+    return sizeof (chunk_section)
+            + get_section_palette_capacity(bits_per_block) * sizeof (mc_ushort)
+            + get_section_data_longs(bits_per_block) * sizeof (mc_ulong);
+}
+
+static size_t
+get_section_bucket_size(int size_class) {
+    int bits_per_block = section_size_class_bits[size_class];
+    return CHUNK_SECTION_BUCKET_HEADER_SIZE
+            + CHUNK_SECTIONS_PER_BUCKET * get_section_size(bits_per_block);
+}
 
 chunk_section *
-alloc_chunk_section() {
-    chunk_section_bucket * bucket = chunk_section_buckets_with_unused;
+alloc_chunk_section(int bits_per_block) {
+    // Allocates a section filled with air that uses at least the given
+    // number of bits per block.
+    int size_class = 0;
+    while (section_size_class_bits[size_class] < bits_per_block) {
+        size_class++;
+        assert(size_class < CHUNK_SECTION_SIZE_CLASSES);
+    }
+    bits_per_block = section_size_class_bits[size_class];
+    size_t section_size = get_section_size(bits_per_block);
+
+    pthread_mutex_lock(&chunk_section_mutex);
+
+    chunk_section_bucket * bucket = chunk_section_buckets_with_unused[size_class];
     if (bucket == NULL) {
         // initialises all memory to 0
-        bucket = mmap(NULL, sizeof *bucket, PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        bucket = mmap(NULL, get_section_bucket_size(size_class),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         if (bucket == MAP_FAILED) {
+            pthread_mutex_unlock(&chunk_section_mutex);
             return NULL;
         }
-        chunk_section_buckets_with_unused = bucket;
+        chunk_section_buckets_with_unused[size_class] = bucket;
     }
 
     int seci;
@@ -43,9 +111,8 @@ alloc_chunk_section() {
 
     assert(seci < CHUNK_SECTIONS_PER_BUCKET);
     assert(bucket->used_sections < CHUNK_SECTIONS_PER_BUCKET);
-    chunk_section * res = bucket->chunk_sections + seci;
-    *res = (chunk_section) {0};
-    res->index_in_bucket = seci;
+    chunk_section * res = (void *) ((unsigned char *) bucket
+            + CHUNK_SECTION_BUCKET_HEADER_SIZE + seci * section_size);
     bucket->used_map[seci] = 1;
     bucket->used_sections++;
 
@@ -55,23 +122,49 @@ alloc_chunk_section() {
         if (next != NULL) {
             next->prev = NULL;
         }
-        chunk_section_buckets_with_unused = next;
+        chunk_section_buckets_with_unused[size_class] = next;
 
-        bucket->next = full_chunk_section_buckets;
+        bucket->next = full_chunk_section_buckets[size_class];
         bucket->prev = NULL;
-        if (full_chunk_section_buckets != NULL) {
-            assert(full_chunk_section_buckets->prev == NULL);
-            full_chunk_section_buckets->prev = bucket;
+        if (full_chunk_section_buckets[size_class] != NULL) {
+            assert(full_chunk_section_buckets[size_class]->prev == NULL);
+            full_chunk_section_buckets[size_class]->prev = bucket;
         }
-        full_chunk_section_buckets = bucket;
+        full_chunk_section_buckets[size_class] = bucket;
     }
+
+    pthread_mutex_unlock(&chunk_section_mutex);
+
+    int palette_capacity = get_section_palette_capacity(bits_per_block);
+    mc_ushort * palette = palette_capacity == 0 ? NULL : (void *) (res + 1);
+    *res = (chunk_section) {
+        .index_in_bucket = seci,
+        .size_class = size_class,
+        .bits_per_block = bits_per_block,
+        .palette_size = palette_capacity == 0 ? 0 : 1,
+        .palette = palette,
+        .data = (void *) ((unsigned char *) (res + 1)
+                + palette_capacity * sizeof (mc_ushort))
+    };
+    if (palette != NULL) {
+        // palette index 0 is air
+        palette[0] = 0;
+    }
+    memset(res->data, 0, get_section_data_longs(bits_per_block)
+            * sizeof (mc_ulong));
     return res;
 }
 
 void
 free_chunk_section(chunk_section * section) {
+    int size_class = section->size_class;
     int index_in_bucket = section->index_in_bucket;
-    chunk_section_bucket * bucket = (void *) (section - index_in_bucket);
+    size_t section_size = get_section_size(section_size_class_bits[size_class]);
+    chunk_section_bucket * bucket = (void *) ((unsigned char *) section
+            - index_in_bucket * section_size - CHUNK_SECTION_BUCKET_HEADER_SIZE);
+
+    pthread_mutex_lock(&chunk_section_mutex);
+
     assert(bucket->used_map[index_in_bucket] == 1);
     assert(bucket->used_sections > 0);
     bucket->used_map[index_in_bucket] = 0;
@@ -83,34 +176,178 @@ free_chunk_section(chunk_section * section) {
         if (bucket->prev != NULL) {
             bucket->prev->next = bucket->next;
         } else {
-            full_chunk_section_buckets = bucket->next;
+            full_chunk_section_buckets[size_class] = bucket->next;
         }
         if (bucket->next != NULL) {
             bucket->next->prev = bucket->prev;
         }
 
         bucket->prev = NULL;
-        bucket->next = chunk_section_buckets_with_unused;
+        bucket->next = chunk_section_buckets_with_unused[size_class];
         if (bucket->next != NULL) {
             bucket->next->prev = bucket;
         }
-        chunk_section_buckets_with_unused = bucket;
-    } else if (bucket->used_sections == 0) {
+        chunk_section_buckets_with_unused[size_class] = bucket;
+    } else if (bucket->used_sections == 0
+            && (bucket->prev != NULL || bucket->next != NULL)) {
+        // Keep the last bucket of a size class around, so a chunk that gets
+        // loaded and unloaded repeatedly doesn't map and unmap memory every
+        // time.
         if (bucket->prev != NULL) {
             bucket->prev->next = bucket->next;
         } else {
-            chunk_section_buckets_with_unused = bucket->next;
+            chunk_section_buckets_with_unused[size_class] = bucket->next;
         }
         if (bucket->next != NULL) {
             bucket->next->prev = bucket->prev;
         }
 
-        // @TODO(traks) figure out whether this actually unmaps all memory used
-        // for the bucket, or if the last page is only partially unmapped or
-        // something.
-        int bad = munmap(bucket, sizeof *bucket);
+        int bad = munmap(bucket, get_section_bucket_size(size_class));
         assert(!bad);
     }
+
+    pthread_mutex_unlock(&chunk_section_mutex);
+}
+
+static mc_uint
+get_section_packed_value(chunk_section * section, int index) {
+    // Dividing by a constant is a lot cheaper than dividing by a variable,
+    // so handle every size separately.
+    mc_ulong * data = section->data;
+    switch (section->bits_per_block) {
+    case 4:
+        return (data[index >> 4] >> ((index & 0xf) << 2)) & 0xf;
+    case 5: {
+        int longi = index / 12;
+        return (data[longi] >> ((index - longi * 12) * 5)) & 0x1f;
+    }
+    case 6: {
+        int longi = index / 10;
+        return (data[longi] >> ((index - longi * 10) * 6)) & 0x3f;
+    }
+    case 8:
+        return (data[index >> 3] >> ((index & 0x7) << 3)) & 0xff;
+    default:
+        return ((mc_ushort *) data)[index];
+    }
+}
+
+static void
+set_section_packed_value(chunk_section * section, int index, mc_uint value) {
+    int bits_per_block = section->bits_per_block;
+    if (bits_per_block == 16) {
+        ((mc_ushort *) section->data)[index] = value;
+        return;
+    }
+
+    int blocks_per_long = 64 / bits_per_block;
+    int longi = index / blocks_per_long;
+    int shift = (index - longi * blocks_per_long) * bits_per_block;
+    mc_ulong mask = (((mc_ulong) 1 << bits_per_block) - 1) << shift;
+    section->data[longi] = (section->data[longi] & ~mask)
+            | ((mc_ulong) value << shift);
+}
+
+mc_ushort
+get_section_block_state(chunk_section * section, int index) {
+    mc_uint value = get_section_packed_value(section, index);
+    if (section->palette == NULL) {
+        return value;
+    }
+    return section->palette[value];
+}
+
+chunk_section *
+set_section_block_state(chunk_section * section, int index,
+        mc_ushort block_state) {
+    // Returns the section the block state ended up in, which is a new
+    // section if the palette had no more room. Returns NULL if allocating
+    // that section failed, in which case the old section is left alone.
+    if (section->palette == NULL) {
+        set_section_packed_value(section, index, block_state);
+        return section;
+    }
+
+    int palette_index;
+    for (palette_index = 0; palette_index < section->palette_size; palette_index++) {
+        if (section->palette[palette_index] == block_state) {
+            break;
+        }
+    }
+
+    if (palette_index == section->palette_size) {
+        if (section->palette_size == get_section_palette_capacity(section->bits_per_block)) {
+            // palette is full, move to a section with more bits per block
+            chunk_section * new_section = alloc_chunk_section(
+                    section->bits_per_block + 1);
+            if (new_section == NULL) {
+                return NULL;
+            }
+
+            if (new_section->palette == NULL) {
+                for (int i = 0; i < 4096; i++) {
+                    set_section_packed_value(new_section, i,
+                            get_section_block_state(section, i));
+                }
+            } else {
+                memcpy(new_section->palette, section->palette,
+                        section->palette_size * sizeof (mc_ushort));
+                new_section->palette_size = section->palette_size;
+                for (int i = 0; i < 4096; i++) {
+                    set_section_packed_value(new_section, i,
+                            get_section_packed_value(section, i));
+                }
+            }
+
+            free_chunk_section(section);
+            return set_section_block_state(new_section, index, block_state);
+        }
+
+        section->palette[palette_index] = block_state;
+        section->palette_size++;
+    }
+
+    set_section_packed_value(section, index, palette_index);
+    return section;
+}
+
+static inline void
+unpack_palette_indices(chunk_section * section, mc_ushort * block_states,
+        int bits_per_block) {
+    // inlined with a constant number of bits per block, so the compiler can
+    // unroll the inner loop
+    int blocks_per_long = 64 / bits_per_block;
+    int longs = get_section_data_longs(bits_per_block);
+    mc_ulong mask = ((mc_ulong) 1 << bits_per_block) - 1;
+    mc_ushort * palette = section->palette;
+    mc_ushort * out = block_states;
+
+    for (int longi = 0; longi < longs - 1; longi++) {
+        mc_ulong val = section->data[longi];
+        for (int i = 0; i < blocks_per_long; i++) {
+            out[i] = palette[(val >> (i * bits_per_block)) & mask];
+        }
+        out += blocks_per_long;
+    }
+
+    // the last long may not be full
+    mc_ulong val = section->data[longs - 1];
+    for (; out < block_states + 4096; out++) {
+        *out = palette[val & mask];
+        val >>= bits_per_block;
+    }
+}
+
+void
+unpack_chunk_section(chunk_section * section, mc_ushort * block_states) {
+    switch (section->bits_per_block) {
+    case 4: unpack_palette_indices(section, block_states, 4); break;
+    case 5: unpack_palette_indices(section, block_states, 5); break;
+    case 6: unpack_palette_indices(section, block_states, 6); break;
+    case 8: unpack_palette_indices(section, block_states, 8); break;
+    default:
+        memcpy(block_states, section->data, 4096 * sizeof (mc_ushort));
+    }
 }
 
 static int
@@ -122,7 +359,106 @@ chunk_pos_equal(chunk_pos a, chunk_pos b) {
 
 static int
 hash_chunk_pos(chunk_pos pos) {
-    return ((pos.x & 0x1f) << 5) | (pos.z & 0x1f);
+    // Fibonacci hashing: the multiplication mixes the bits of both
+    // coordinates into the upper bits, which we use as index
+    mc_uint key = ((mc_uint) (mc_ushort) pos.x << 16) | (mc_ushort) pos.z;
+    return (key * 0x9e3779b9u) >> (32 - chunk_map_size_log2);
+}
+
+static int
+find_chunk_map_slot(chunk_pos pos) {
+    // returns the slot of the chunk if it is in the map, and the slot where
+    // it should be inserted otherwise
+    int mask = chunk_map_size - 1;
+    int i = hash_chunk_pos(pos);
+    for (;;) {
+        chunk_map_entry * entry = chunk_map + i;
+        if (entry->ch == NULL || chunk_pos_equal(entry->pos, pos)) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void
+grow_chunk_map(void) {
+    chunk_map_entry * old_map = chunk_map;
+    int old_size = chunk_map_size;
+
+    if (old_map == NULL) {
+        chunk_map_size = INITIAL_CHUNK_MAP_SIZE;
+        chunk_map_size_log2 = 0;
+        while ((1 << chunk_map_size_log2) < chunk_map_size) {
+            chunk_map_size_log2++;
+        }
+    } else {
+        chunk_map_size *= 2;
+        chunk_map_size_log2++;
+    }
+
+    chunk_map = calloc(chunk_map_size, sizeof *chunk_map);
+    if (chunk_map == NULL) {
+        logs_errno("Failed to grow chunk map: %s");
+        exit(1);
+    }
+
+    for (int i = 0; i < old_size; i++) {
+        if (old_map[i].ch != NULL) {
+            chunk_map[find_chunk_map_slot(old_map[i].pos)] = old_map[i];
+        }
+    }
+    free(old_map);
+}
+
+static void
+remove_chunk_map_entry(int slot) {
+    // Shift entries after the removed one back, so no entry is separated
+    // from its home slot by an empty slot. This way we don't need tombstones.
+    int mask = chunk_map_size - 1;
+    int hole = slot;
+    int i = slot;
+    for (;;) {
+        i = (i + 1) & mask;
+        chunk_map_entry * entry = chunk_map + i;
+        if (entry->ch == NULL) {
+            break;
+        }
+
+        int home = hash_chunk_pos(entry->pos);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            // home slot of entry is not between the hole and the entry
+            chunk_map[hole] = *entry;
+            hole = i;
+        }
+    }
+    chunk_map[hole] = (chunk_map_entry) {0};
+    chunk_map_count--;
+}
+
+static chunk *
+alloc_chunk(void) {
+    if (free_chunks == NULL) {
+        chunk * block = malloc(CHUNKS_PER_POOL_BLOCK * sizeof *block);
+        if (block == NULL) {
+            logs_errno("Failed to allocate chunks: %s");
+            exit(1);
+        }
+        for (int i = 0; i < CHUNKS_PER_POOL_BLOCK; i++) {
+            *(chunk * *) (block + i) = free_chunks;
+            free_chunks = block + i;
+        }
+    }
+
+    chunk * ch = free_chunks;
+    free_chunks = *(chunk * *) ch;
+    *ch = (chunk) {0};
+    return ch;
+}
+
+static void
+free_chunk(chunk * ch) {
+    *(chunk * *) ch = free_chunks;
+    free_chunks = ch;
 }
 
 block_entity_base *
@@ -226,27 +562,53 @@ chunk_get_block_state(chunk * ch, int x, int y, int z) {
     chunk_section * section = ch->sections[section_y];
 
     if (section == NULL) {
-        // @TODO(traks) would it be possible to have a block type -> default state
-        // lookup here and have it expand to a constant once we pregenerate all
-        // the data tables?
-        return 0;
+        return ch->uniform_section_states[section_y];
     }
 
     int index = ((y & 0xf) << 8) | (z << 4) | x;
-    return section->block_states[index];
+    return get_section_block_state(section, index);
 }
 
 static void
 recalculate_chunk_motion_blocking_height_map(chunk * ch) {
+    // Go through the block layers from the top down, so we can stop once all
+    // columns have a height. A height of 0 means we haven't found a block in
+    // the column yet.
+    int remaining_columns = 16 * 16;
     for (int zx = 0; zx < 16 * 16; zx++) {
         ch->motion_blocking_height_map[zx] = 0;
-        for (int y = 255; y >= 0; y--) {
-            mc_ushort block_state = chunk_get_block_state(ch,
-                    zx & 0xf, y, zx >> 4);
-            // @TODO(traks) other airs
-            if (block_state != 0) {
-                ch->motion_blocking_height_map[zx] = y + 1;
-                break;
+    }
+
+    for (int section_y = 15; section_y >= 0; section_y--) {
+        chunk_section * section = ch->sections[section_y];
+        if (ch->non_air_count[section_y] == 0) {
+            continue;
+        }
+
+        if (section == NULL) {
+            // the section is filled with a non-air block
+            for (int zx = 0; zx < 16 * 16; zx++) {
+                if (ch->motion_blocking_height_map[zx] == 0) {
+                    ch->motion_blocking_height_map[zx] = (section_y << 4) + 16;
+                }
+            }
+            return;
+        }
+
+        mc_ushort block_states[4096];
+        unpack_chunk_section(section, block_states);
+
+        for (int y = 15; y >= 0; y--) {
+            mc_ushort * layer = block_states + (y << 8);
+            for (int zx = 0; zx < 16 * 16; zx++) {
+                // @TODO(traks) other airs
+                if (ch->motion_blocking_height_map[zx] == 0 && layer[zx] != 0) {
+                    ch->motion_blocking_height_map[zx] = (section_y << 4) + y + 1;
+                    remaining_columns--;
+                }
+            }
+            if (remaining_columns == 0) {
+                return;
             }
         }
     }
@@ -262,6 +624,22 @@ chunk_set_block_state(chunk * ch, int x, int y, int z, mc_ushort block_state) {
     // or make sure we appropriate handle cases in which too many changes occur
     // to a chunk per tick.
 
+    int section_y = y >> 4;
+    chunk_section * section = ch->sections[section_y];
+    int index = ((y & 0xf) << 8) | (z << 4) | x;
+    mc_ushort old_block_state;
+
+    if (section == NULL) {
+        old_block_state = ch->uniform_section_states[section_y];
+    } else {
+        old_block_state = get_section_block_state(section, index);
+    }
+
+    if (block_state == old_block_state) {
+        // nothing to send, save or re-encode
+        return;
+    }
+
     // @TODO(traks) This is currently O(N^2) where N is the number of different
     // blocks we changed in the chunk in a single tick. Should be faster.
     int match = 0;
@@ -281,30 +659,48 @@ chunk_set_block_state(chunk * ch, int x, int y, int z, mc_ushort block_state) {
         ch->changed_block_count++;
     }
 
-    int section_y = y >> 4;
-    chunk_section * section = ch->sections[section_y];
+    if (ch->dirty_sections == 0) {
+        ch->dirty_tick = serv->current_tick;
+    }
+    ch->dirty_sections |= 1 << section_y;
+
+    if (old_block_state == 0) {
+        ch->non_air_count[section_y]++;
+    }
+    if (block_state == 0) {
+        ch->non_air_count[section_y]--;
+    }
+
+    if (serv->light_opacity_by_state[block_state]
+            != serv->light_opacity_by_state[old_block_state]
+            || serv->emitted_light_by_state[block_state]
+            != serv->emitted_light_by_state[old_block_state]) {
+        request_light_update(ch, x, y, z);
+    }
 
     if (section == NULL) {
+        // expand the uniform section. It is collapsed again at the end of
+        // the tick if it becomes uniform.
         // @TODO(traks) instead of making block setting fallible, perhaps
         // getting the chunk should fail if chunk sections cannot be allocated
-        section = alloc_chunk_section();
+        section = alloc_chunk_section(4);
         if (section == NULL) {
             logs_errno("Failed to allocate section: %s");
             exit(1);
         }
-        ch->sections[section_y] = section;
+        section->palette[0] = old_block_state;
     }
 
-    int index = ((y & 0xf) << 8) | (z << 4) | x;
-
-    if (section->block_states[index] == 0) {
-        ch->non_air_count[section_y]++;
-    }
-    if (block_state == 0) {
-        ch->non_air_count[section_y]--;
+    section = set_section_block_state(section, index, block_state);
+    if (section == NULL) {
+        logs_errno("Failed to allocate section: %s");
+        exit(1);
     }
+    ch->sections[section_y] = section;
 
-    section->block_states[index] = block_state;
+    // the cached packets no longer match the chunk
+    free(ch->packet_cache);
+    ch->packet_cache = NULL;
 
     int height_map_index = (z << 4) | x;
 
@@ -365,12 +761,13 @@ ceil_log2u(mc_uint x) {
 }
 
 static void
-fill_buffer_from_file(int fd, buffer_cursor * cursor) {
+fill_buffer_from_file(int fd, mc_long offset, buffer_cursor * cursor) {
     int start_index = cursor->index;
 
     while (cursor->index < cursor->limit) {
-        int bytes_read = read(fd, cursor->buf + cursor->index,
-                cursor->limit - cursor->index);
+        int bytes_read = pread(fd, cursor->buf + cursor->index,
+                cursor->limit - cursor->index,
+                offset + cursor->index - start_index);
         if (bytes_read == -1) {
             logs_errno("Failed to read region file: %s");
             cursor->error = 1;
@@ -391,443 +788,1503 @@ fill_buffer_from_file(int fd, buffer_cursor * cursor) {
     cursor->index = start_index;
 }
 
-void
-try_read_chunk_from_storage(chunk_pos pos, chunk * ch,
-        memory_arena * scratch_arena) {
-    begin_timed_block("read chunk");
-
-    // @TODO(traks) error handling and/or error messages for all failure cases
-    // in this entire function?
-
-    int region_x = pos.x >> 5;
-    int region_z = pos.z >> 5;
-
+static int
+open_native_region_file(region_file * region) {
+    // Returns whether the region now refers to a usable native region file.
+    // If there is none, we fall back to the Anvil region file.
     unsigned char file_name[64];
-    int file_name_size = sprintf((void *) file_name,
-            "world/region/r.%d.%d.mca", region_x, region_z);
+    sprintf((void *) file_name, "world/blaze/r.%d.%d.blz",
+            region->region_x, region->region_z);
 
-    int region_fd = open((void *) file_name, O_RDONLY);
-    if (region_fd == -1) {
-        logs_errno("Failed to open region file: %s");
-        goto bail;
+    int fd = open((void *) file_name, O_RDONLY);
+    if (fd == -1) {
+        // most worlds haven't been converted, so don't log anything
+        return 0;
     }
 
     struct stat region_stat;
-    if (fstat(region_fd, &region_stat)) {
-        logs_errno("Failed to get region file stat: %s");
-        goto bail;
+    if (fstat(fd, &region_stat)) {
+        logs_errno("Failed to get native region file stat: %s");
+        close(fd);
+        return 0;
     }
-
-    buffer_cursor header_cursor = {
-        .buf = alloc_in_arena(scratch_arena, 4096),
-        .limit = 4096
-    };
-    fill_buffer_from_file(region_fd, &header_cursor);
-    if (header_cursor.error) {
-        goto bail;
+    if (region_stat.st_size < sizeof (native_region_header)) {
+        logs("Native region file %s too small", file_name);
+        close(fd);
+        return 0;
     }
 
-    // First read from the chunk location table at which sector (4096 byte
-    // block) the chunk data starts.
-    int index = ((pos.z & 0x1f) << 5) | (pos.x & 0x1f);
-    header_cursor.index = index << 2;
-    mc_uint loc = net_read_uint(&header_cursor);
-
-    if (loc == 0) {
-        // chunk not present in region file
-        goto bail;
+    unsigned char * map = mmap(NULL, region_stat.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        logs_errno("Failed to map native region file: %s");
+        close(fd);
+        return 0;
     }
 
-    mc_uint sector_offset = loc >> 8;
-    mc_uint sector_count = loc & 0xff;
-
-    if (sector_offset < 2) {
-        logs("Chunk data in header");
-        goto bail;
-    }
-    if (sector_count == 0) {
-        logs("Chunk data uses 0 sectors");
-        goto bail;
-    }
-    if (((sector_offset + sector_count) << 12) > region_stat.st_size) {
-        logs("Chunk data out of bounds");
-        goto bail;
+    native_region_header * header = (void *) map;
+    if (header->magic != NATIVE_REGION_MAGIC
+            || header->version != NATIVE_REGION_VERSION
+            || header->data_version != SERVER_WORLD_VERSION
+            || header->block_state_count != serv->actual_block_state_count) {
+        logs("Native region file %s is outdated, reconvert the world",
+                file_name);
+        munmap(map, region_stat.st_size);
+        close(fd);
+        return 0;
     }
 
-    if (lseek(region_fd, sector_offset << 12, SEEK_SET) == -1) {
-        logs_errno("Failed to seek to chunk data: %s");
-        goto bail;
+    for (int i = 0; i < 1024; i++) {
+        if (header->chunk_offsets[i] != 0) {
+            region->present_chunks[i >> 6] |= (mc_ulong) 1 << (i & 0x3f);
+        }
     }
 
-    buffer_cursor cursor = {
-        .buf = alloc_in_arena(scratch_arena, sector_count << 12),
-        .limit = sector_count << 12
-    };
-    fill_buffer_from_file(region_fd, &cursor);
+    region->fd = fd;
+    region->file_size = region_stat.st_size;
+    region->map = map;
+    region->native = 1;
+    return 1;
+}
 
-    mc_uint size_in_bytes = net_read_uint(&cursor);
+// Incremented by the chunk saver thread after it changed a region file, so
+// threads that have the region file open know to open it again.
+static atomic_uint region_file_versions[REGION_FILE_VERSION_SLOTS];
 
-    if (size_in_bytes > cursor.limit - cursor.index) {
-        logs("Chunk data outside of its sectors");
-        goto bail;
-    }
+static atomic_uint *
+get_region_file_version(int region_x, int region_z) {
+    mc_uint key = ((mc_uint) region_x * 0x9e3779b9u) ^ (mc_uint) region_z;
+    key *= 0x85ebca6bu;
+    return region_file_versions + ((key >> 16) & (REGION_FILE_VERSION_SLOTS - 1));
+}
 
-    cursor.limit = cursor.index + size_in_bytes;
-    mc_ubyte storage_type = net_read_ubyte(&cursor);
+void
+bump_region_file_version(int region_x, int region_z) {
+    atomic_fetch_add_explicit(get_region_file_version(region_x, region_z),
+            1, memory_order_release);
+}
 
-    if (cursor.error) {
-        logs("Chunk header reading error");
-        goto bail;
+static region_file *
+get_region_file(int region_x, int region_z, region_file_cache * cache,
+        memory_arena * scratch_arena) {
+    cache->use_counter++;
+    mc_uint version = atomic_load_explicit(
+            get_region_file_version(region_x, region_z),
+            memory_order_acquire);
+
+    region_file * lru = cache->files;
+    for (int i = 0; i < REGION_FILE_CACHE_SIZE; i++) {
+        region_file * region = cache->files + i;
+        if (region->last_use != 0 && region->region_x == region_x
+                && region->region_z == region_z) {
+            if (region->version == version) {
+                region->last_use = cache->use_counter;
+                return region;
+            }
+            // the region file changed since we opened it
+            lru = region;
+            break;
+        }
+        if (region->last_use < lru->last_use) {
+            lru = region;
+        }
     }
 
-    if (storage_type & 0x80) {
-        // @TODO(traks) separate file is used to store the chunk
-        logs("External chunk storage");
-        goto bail;
+    if (lru->last_use != 0 && lru->fd != -1) {
+        if (lru->map != NULL) {
+            munmap(lru->map, lru->file_size);
+        }
+        close(lru->fd);
     }
 
-    int windowBits;
+    region_file * region = lru;
+    *region = (region_file) {
+        .region_x = region_x,
+        .region_z = region_z,
+        .fd = -1,
+        .last_use = cache->use_counter,
+        .version = version
+    };
+    cache->open_count++;
 
-    if (storage_type == 1) {
-        // gzip compressed
-        // 16 means: gzip stream and determine window size from header
-        windowBits = 16;
-    } else if (storage_type == 2) {
-        // zlib compressed
-        // 0 means: zlib stream and determine window size from header
-        windowBits = 0;
-    } else {
-        logs("Unknown chunk compression method");
-        goto bail;
+    if (REGION_FILE_MMAP_ENABLED && !cache->anvil_only
+            && open_native_region_file(region)) {
+        return region;
     }
 
-    begin_timed_block("inflate");
-    // @TODO(traks) perhaps use https://github.com/ebiggers/libdeflate instead
-    // of zlib. Using zlib now just because I had the code for it laying around.
-    // If we don't end up doing this, make sure the code below is actually
-    // correct (when do we need to clean stuff up?)!
-    z_stream zstream;
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
+    unsigned char file_name[64];
+    sprintf((void *) file_name, "world/region/r.%d.%d.mca",
+            region_x, region_z);
 
-    if (inflateInit2(&zstream, windowBits) != Z_OK) {
-        logs("inflateInit failed");
-        goto bail;
+    int fd = open((void *) file_name, O_RDONLY);
+    if (fd == -1) {
+        logs_errno("Failed to open region file: %s");
+        return region;
     }
 
-    zstream.next_in = cursor.buf + cursor.index;
-    zstream.avail_in = cursor.limit - cursor.index;
-
-    size_t max_uncompressed_size = 2 * (1 << 20);
-    unsigned char * uncompressed = alloc_in_arena(scratch_arena,
-            max_uncompressed_size);
-
-    zstream.next_out = uncompressed;
-    zstream.avail_out = max_uncompressed_size;
+    struct stat region_stat;
+    if (fstat(fd, &region_stat)) {
+        logs_errno("Failed to get region file stat: %s");
+        close(fd);
+        return region;
+    }
 
-    if (inflate(&zstream, Z_FINISH) != Z_STREAM_END) {
-        logs("Failed to finish inflating chunk: %s", zstream.msg);
-        goto bail;
+    unsigned char * map = NULL;
+    if (REGION_FILE_MMAP_ENABLED && region_stat.st_size >= 4096) {
+        // Note that reading from the mapping raises SIGBUS if someone else
+        // truncates the file while we have it mapped.
+        map = mmap(NULL, region_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            logs_errno("Failed to map region file: %s");
+            map = NULL;
+        }
     }
 
-    if (inflateEnd(&zstream) != Z_OK) {
-        logs("inflateEnd failed");
-        goto bail;
+    buffer_cursor header_cursor;
+    if (map != NULL) {
+        header_cursor = (buffer_cursor) {.buf = map, .limit = 4096};
+    } else {
+        memory_arena temp_arena = *scratch_arena;
+        header_cursor = (buffer_cursor) {
+            .buf = alloc_in_arena(&temp_arena, 4096),
+            .limit = 4096
+        };
+        fill_buffer_from_file(fd, 0, &header_cursor);
+        if (header_cursor.error) {
+            close(fd);
+            return region;
+        }
     }
 
-    if (zstream.avail_in != 0) {
-        logs("Didn't inflate entire chunk");
-        goto bail;
+    for (int i = 0; i < 1024; i++) {
+        mc_uint loc = net_read_uint(&header_cursor);
+        region->locations[i] = loc;
+        if (loc != 0) {
+            region->present_chunks[i >> 6] |= (mc_ulong) 1 << (i & 0x3f);
+        }
     }
-    end_timed_block();
 
-    cursor = (buffer_cursor) {
-        .buf = uncompressed,
-        .limit = zstream.total_out
-    };
+    region->fd = fd;
+    region->file_size = region_stat.st_size;
+    region->map = map;
+    return region;
+}
 
-    // @TODO(traks) more appropriate max level
-    int max_levels = 1024;
-    nbt_tape_entry * chunk_nbt = load_nbt(&cursor, scratch_arena, max_levels);
+static void
+mark_chunk_absent(region_file * region, int index) {
+    region->present_chunks[index >> 6] &= ~((mc_ulong) 1 << (index & 0x3f));
+}
 
-    if (cursor.error) {
-        logs("Failed to load NBT data");
-        goto bail;
+enum chunk_decode_result {
+    CHUNK_DECODE_OK,
+    CHUNK_DECODE_NOT_GENERATED,
+    CHUNK_DECODE_ERROR,
+};
+
+// Resolving a palette entry of an Anvil chunk to a block state means looking
+// up its name and all its properties, and the same few palette entries show
+// up in almost every chunk. So we cache the block state of palette entries,
+// keyed on their raw NBT data. The cache is shared by all chunk loader
+// threads. Entries are never removed, so lookups don't need a lock: an entry
+// is published by storing its hash after the rest of the entry, and never
+// changes afterwards. Inserts are rare and take a mutex.
+typedef struct {
+    // 0 if the slot is unused
+    atomic_ullong hash;
+    mc_ushort size;
+    mc_ushort block_state;
+    unsigned char data[PALETTE_CACHE_MAX_ENTRY_SIZE];
+} palette_cache_entry;
+
+static palette_cache_entry palette_cache[PALETTE_CACHE_SIZE];
+static int palette_cache_count;
+static pthread_mutex_t palette_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Hits and misses are counted per thread and added to the totals once per
+// chunk, so the loader threads don't fight over the counters.
+static atomic_ullong palette_cache_hits;
+static atomic_ullong palette_cache_misses;
+static _Thread_local mc_ulong local_palette_cache_hits;
+static _Thread_local mc_ulong local_palette_cache_misses;
+
+static mc_ulong
+hash_palette_entry(unsigned char * data, int size) {
+    mc_ulong hash = size;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        mc_ulong word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+        hash ^= hash >> 29;
     }
-
-    for (int section_y = 0; section_y < 16; section_y++) {
-        assert(ch->sections[section_y] == NULL);
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x9e3779b97f4a7c15;
     }
+    hash ^= hash >> 32;
+    // 0 marks unused slots
+    return hash == 0 ? 1 : hash;
+}
 
-    nbt_move_to_key(NET_STRING("DataVersion"), chunk_nbt, &cursor);
-    mc_int data_version = net_read_int(&cursor);
-    if (data_version != SERVER_WORLD_VERSION) {
-        logs("Data version %jd != %jd", (intmax_t) data_version,
-                (intmax_t) SERVER_WORLD_VERSION);
-        goto bail;
+static int
+find_palette_cache_entry(mc_ulong hash, unsigned char * data, int size,
+        int * slot) {
+    // Returns whether the entry exists. If it doesn't exist, the slot is
+    // set to the unused slot where it should be inserted.
+    int i = hash & (PALETTE_CACHE_SIZE - 1);
+    for (;;) {
+        palette_cache_entry * entry = palette_cache + i;
+        mc_ulong entry_hash = atomic_load_explicit(&entry->hash,
+                memory_order_acquire);
+        if (entry_hash == 0) {
+            *slot = i;
+            return 0;
+        }
+        if (entry_hash == hash && entry->size == size
+                && memcmp(entry->data, data, size) == 0) {
+            *slot = i;
+            return 1;
+        }
+        i = (i + 1) & (PALETTE_CACHE_SIZE - 1);
     }
+}
 
-    nbt_tape_entry * level_nbt = nbt_get_compound(NET_STRING("Level"),
-            chunk_nbt, &cursor);
-
-    net_string status = nbt_get_string(NET_STRING("Status"), level_nbt, &cursor);
-    if (!net_string_equal(status, NET_STRING("full"))) {
-        // @TODO(traks) this message gets spammed on the edges of pregenerated
-        // terrain. Maybe turn it into a debug message.
-        logs("Chunk not fully generated");
-        goto bail;
+static void
+insert_palette_cache_entry(mc_ulong hash, unsigned char * data, int size,
+        mc_ushort block_state) {
+    pthread_mutex_lock(&palette_cache_mutex);
+
+    // another thread may have inserted the entry in the meantime
+    int slot;
+    if (palette_cache_count < PALETTE_CACHE_SIZE / 2
+            && !find_palette_cache_entry(hash, data, size, &slot)) {
+        palette_cache_entry * entry = palette_cache + slot;
+        entry->size = size;
+        entry->block_state = block_state;
+        memcpy(entry->data, data, size);
+        atomic_store_explicit(&entry->hash, hash, memory_order_release);
+        palette_cache_count++;
     }
 
-    nbt_tape_entry * section_start = nbt_move_to_key(NET_STRING("Sections"),
-            level_nbt, &cursor);
+    pthread_mutex_unlock(&palette_cache_mutex);
+}
+
+void
+take_palette_cache_stats(mc_ulong * hits, mc_ulong * misses) {
+    // returns the hits and misses since the last call
+    *hits = atomic_exchange_explicit(&palette_cache_hits, 0,
+            memory_order_relaxed);
+    *misses = atomic_exchange_explicit(&palette_cache_misses, 0,
+            memory_order_relaxed);
+}
 
-    mc_uint section_count;
-    nbt_tape_entry * section_nbt;
+static int
+resolve_palette_entry(buffer_cursor * cursor, mc_ushort * block_state) {
+    net_string resource_loc = {0};
+    int props_index = -1;
+
+    for (;;) {
+        net_string key;
+        mc_ubyte tag = nbt_read_compound_entry(cursor, &key);
+        if (tag == NBT_TAG_END) {
+            break;
+        }
 
-    if (section_start->tag != NBT_TAG_LIST) {
-        section_count = 0;
-        section_nbt = NULL;
-    } else {
-        section_count = section_start[2].list_size;
-        section_nbt = section_start + 3;
+        if (tag == NBT_TAG_STRING && net_string_equal(key, NET_STRING("Name"))) {
+            resource_loc = nbt_read_string_value(cursor);
+        } else {
+            if (tag == NBT_TAG_COMPOUND
+                    && net_string_equal(key, NET_STRING("Properties"))) {
+                // the name may come after the properties, so come back to
+                // the properties once we know the block type
+                props_index = cursor->index;
+            }
+            nbt_skip_value(tag, cursor);
+        }
     }
 
-    // maximum amount of memory the palette will ever use
-    int max_palette_map_size = 4096;
-    mc_ushort * palette_map = alloc_in_arena(scratch_arena,
-            max_palette_map_size * sizeof (mc_ushort));
+    if (cursor->error) {
+        return 0;
+    }
 
-    if (section_count > 18) {
-        logs("Too many chunk sections: %ju", (uintmax_t) section_count);
-        goto bail;
+    mc_short type_id = resolve_resource_loc_id(resource_loc,
+            &serv->block_resource_table);
+    if (type_id == -1) {
+        // @TODO(traks) should probably just error out
+        type_id = 2;
     }
 
-    for (mc_uint sectioni = 0; sectioni < section_count; sectioni++) {
-        nbt_move_to_key(NET_STRING("Y"), section_nbt, &cursor);
-        mc_byte section_y = net_read_byte(&cursor);
+    block_properties * props = serv->block_properties_table + type_id;
+    int val_indices[ARRAY_SIZE(props->property_specs)];
+    for (int propi = 0; propi < props->property_count; propi++) {
+        val_indices[propi] = props->default_value_indices[propi];
+    }
 
-        nbt_tape_entry * palette_start = nbt_move_to_key(NET_STRING("Palette"),
-                section_nbt, &cursor);
+    if (props_index != -1) {
+        buffer_cursor props_cursor = *cursor;
+        props_cursor.index = props_index;
 
-        if (palette_start->tag != NBT_TAG_END) {
-            if (section_y < 0 || section_y >= 16) {
-                logs("Section Y %d with palette", (int) section_y);
-                goto bail;
+        for (;;) {
+            net_string prop_name;
+            mc_ubyte tag = nbt_read_compound_entry(&props_cursor, &prop_name);
+            if (tag == NBT_TAG_END) {
+                break;
             }
-
-            if (ch->sections[section_y] != NULL) {
-                logs("Duplicate section Y %d", (int) section_y);
-                goto bail;
+            if (tag != NBT_TAG_STRING) {
+                nbt_skip_value(tag, &props_cursor);
+                continue;
             }
 
-            chunk_section * section = alloc_chunk_section();
-            if (section == NULL) {
-                logs_errno("Failed to allocate section: %s");
-                goto bail;
+            net_string prop_val = nbt_read_string_value(&props_cursor);
+            for (int propi = 0; propi < props->property_count; propi++) {
+                block_property_spec * prop_spec = serv->block_property_specs
+                        + props->property_specs[propi];
+                net_string spec_name = {
+                    .size = prop_spec->tape[0],
+                    .ptr = prop_spec->tape + 1
+                };
+                if (net_string_equal(prop_name, spec_name)) {
+                    int val_index = find_property_value_index(prop_spec,
+                            prop_val);
+                    if (val_index != -1) {
+                        val_indices[propi] = val_index;
+                    }
+                    break;
+                }
             }
-            // Note that the section allocation will be freed when the chunk
-            // gets removed somewhere else in the code base.
-            ch->sections[section_y] = section;
+        }
+
+        if (props_cursor.error) {
+            return 0;
+        }
+    }
+
+    mc_ushort stride = 0;
+    for (int propi = 0; propi < props->property_count; propi++) {
+        block_property_spec * prop_spec = serv->block_property_specs
+                + props->property_specs[propi];
+        stride = stride * prop_spec->value_count + val_indices[propi];
+    }
+
+    *block_state = props->base_state + stride;
+    return 1;
+}
+
+static int
+decode_palette_entry(buffer_cursor * cursor, mc_ushort * block_state) {
+    // find the end of the entry first, so we can look up its data
+    int start = cursor->index;
+    nbt_skip_value(NBT_TAG_COMPOUND, cursor);
+    if (cursor->error) {
+        return 0;
+    }
 
-            mc_uint palette_size = palette_start[2].list_size;
-            nbt_tape_entry * palette_entry = palette_start + 3;
+    int end = cursor->index;
+    int size = end - start;
+    if (size > PALETTE_CACHE_MAX_ENTRY_SIZE) {
+        cursor->index = start;
+        return resolve_palette_entry(cursor, block_state);
+    }
+
+    unsigned char * data = cursor->buf + start;
+    mc_ulong hash = hash_palette_entry(data, size);
+    int slot;
+    if (find_palette_cache_entry(hash, data, size, &slot)) {
+        *block_state = palette_cache[slot].block_state;
+        local_palette_cache_hits++;
+        return 1;
+    }
+
+    local_palette_cache_misses++;
+    cursor->index = start;
+    if (!resolve_palette_entry(cursor, block_state)) {
+        return 0;
+    }
+    assert(cursor->index == end);
+    insert_palette_cache_entry(hash, data, size, *block_state);
+    return 1;
+}
+
+typedef struct {
+    mc_uint min_id;
+    mc_uint max_id;
+    // number of IDs that map to air
+    int air_count;
+} packed_id_stats;
+
+static inline packed_id_stats
+scan_packed_ids(mc_ulong * data, int bits_per_id, unsigned char * is_air) {
+    // Called with constant bits per ID, so the compiler can turn the
+    // divisions and shifts into cheap instructions.
+    int ids_per_long = 64 / bits_per_id;
+    mc_uint id_mask = (1 << bits_per_id) - 1;
+    packed_id_stats stats = {.min_id = id_mask};
+    int j = 0;
+
+    for (int longi = 0; j < 4096; longi++) {
+        mc_ulong entry = data[longi];
+        int end = MIN(4096, j + ids_per_long);
+        for (; j < end; j++) {
+            mc_uint id = entry & id_mask;
+            entry >>= bits_per_id;
+            stats.min_id = MIN(stats.min_id, id);
+            stats.max_id = MAX(stats.max_id, id);
+            stats.air_count += is_air[id];
+        }
+    }
+    return stats;
+}
 
-            if (palette_size == 0 || palette_size > max_palette_map_size) {
+#if defined(__SSE2__)
+static void
+scan_id_bytes(__m128i v, __m128i air_id, __m128i * min, __m128i * max,
+        __m128i * air_count) {
+    *min = _mm_min_epu8(*min, v);
+    *max = _mm_max_epu8(*max, v);
+    __m128i is_air = _mm_and_si128(_mm_cmpeq_epi8(v, air_id),
+            _mm_set1_epi8(1));
+    *air_count = _mm_add_epi64(*air_count,
+            _mm_sad_epu8(is_air, _mm_setzero_si128()));
+}
+
+static packed_id_stats
+scan_packed_ids_sse2(mc_ulong * data, int bits_per_id, int air_id) {
+    // Only for 4 and 8 bits per ID, where IDs line up with bytes. Doesn't
+    // count air if the air ID is -1.
+    __m128i min = _mm_set1_epi8(-1);
+    __m128i max = _mm_setzero_si128();
+    __m128i air_count = _mm_setzero_si128();
+    __m128i air_id_vec = _mm_set1_epi8(air_id);
+    __m128i * vecs = (__m128i *) data;
+    __m128i nibble_mask = _mm_set1_epi8(0xf);
+    int vec_count = 4096 * bits_per_id / 128;
+
+    for (int i = 0; i < vec_count; i++) {
+        __m128i v = _mm_loadu_si128(vecs + i);
+        if (bits_per_id == 4) {
+            scan_id_bytes(_mm_and_si128(v, nibble_mask), air_id_vec,
+                    &min, &max, &air_count);
+            scan_id_bytes(_mm_and_si128(_mm_srli_epi16(v, 4), nibble_mask),
+                    air_id_vec, &min, &max, &air_count);
+        } else {
+            scan_id_bytes(v, air_id_vec, &min, &max, &air_count);
+        }
+    }
+
+    unsigned char min_bytes[16];
+    unsigned char max_bytes[16];
+    _mm_storeu_si128((__m128i *) min_bytes, min);
+    _mm_storeu_si128((__m128i *) max_bytes, max);
+    packed_id_stats stats = {.min_id = 0xff};
+    for (int i = 0; i < 16; i++) {
+        stats.min_id = MIN(stats.min_id, min_bytes[i]);
+        stats.max_id = MAX(stats.max_id, max_bytes[i]);
+    }
+    if (air_id != -1) {
+        air_count = _mm_add_epi64(air_count,
+                _mm_unpackhi_epi64(air_count, air_count));
+        stats.air_count = _mm_cvtsi128_si32(air_count);
+    }
+    return stats;
+}
+#endif
+
+static packed_id_stats
+scan_section_ids(mc_ulong * data, int bits_per_id, int palette_size,
+        mc_ushort * palette_map) {
+    unsigned char is_air[256] = {0};
+    int air_ids = 0;
+    int air_id = -1;
+    for (int i = 0; i < palette_size; i++) {
+        if (palette_map[i] == 0) {
+            is_air[i] = 1;
+            air_ids++;
+            air_id = i;
+        }
+    }
+
+#if defined(__SSE2__)
+    // palettes rarely contain air twice
+    if ((bits_per_id == 4 || bits_per_id == 8) && air_ids <= 1) {
+        return scan_packed_ids_sse2(data, bits_per_id, air_id);
+    }
+#endif
+
+    switch (bits_per_id) {
+    case 4: return scan_packed_ids(data, 4, is_air);
+    case 5: return scan_packed_ids(data, 5, is_air);
+    case 6: return scan_packed_ids(data, 6, is_air);
+    default: return scan_packed_ids(data, 8, is_air);
+    }
+}
+
+static void
+widen_7_bit_ids(mc_ulong * in, mc_ulong * out) {
+    // Sections don't use 7 bits per block, so 7-bit IDs are stored in bytes
+    int j = 0;
+    for (int longi = 0; j < 4096; longi++) {
+        mc_ulong entry = in[longi];
+        int end = MIN(4096, j + 9);
+        for (; j < end; j++) {
+            out[j >> 3] = (j & 0x7) == 0 ? 0 : out[j >> 3];
+            out[j >> 3] |= (entry & 0x7f) << ((j & 0x7) << 3);
+            entry >>= 7;
+        }
+    }
+}
+
+static inline int
+unpack_direct_block_states(mc_ulong * data, int bits_per_id,
+        mc_uint palette_size, mc_ushort * palette_map,
+        mc_ushort * block_states, int * non_air_count, int * uniform) {
+    // Returns 0 if an ID is outside the palette. Called with constant bits
+    // per ID, like scan_packed_ids.
+    int ids_per_long = 64 / bits_per_id;
+    mc_uint id_mask = (1 << bits_per_id) - 1;
+    mc_uint max_id = 0;
+    int air_count = 0;
+    mc_ushort first_block_state = palette_map[data[0] & id_mask & 0xfff];
+    int differences = 0;
+    int j = 0;
+
+    for (int longi = 0; j < 4096; longi++) {
+        mc_ulong entry = data[longi];
+        int end = MIN(4096, j + ids_per_long);
+        for (; j < end; j++) {
+            mc_uint id = entry & id_mask;
+            entry >>= bits_per_id;
+            max_id = MAX(max_id, id);
+            // IDs outside the palette are caught below, so make sure we
+            // don't read outside the palette map in the meantime
+            mc_ushort block_state = palette_map[id & 0xfff];
+            block_states[j] = block_state;
+            air_count += (block_state == 0);
+            differences += (block_state != first_block_state);
+        }
+    }
+
+    *non_air_count = 4096 - air_count;
+    *uniform = (differences == 0);
+    return max_id < palette_size;
+}
+
+static int
+decode_section(buffer_cursor * cursor, chunk * ch, mc_ushort * palette_map,
+        mc_uint * decoded_sections) {
+    mc_byte section_y = 0;
+    int has_palette = 0;
+    mc_uint palette_size = 0;
+    int block_states_index = -1;
+    mc_uint block_states_count = 0;
+
+    for (;;) {
+        net_string key;
+        mc_ubyte tag = nbt_read_compound_entry(cursor, &key);
+        if (tag == NBT_TAG_END) {
+            break;
+        }
+
+        if (tag == NBT_TAG_BYTE && net_string_equal(key, NET_STRING("Y"))) {
+            section_y = net_read_byte(cursor);
+        } else if (tag == NBT_TAG_LIST
+                && net_string_equal(key, NET_STRING("Palette"))) {
+            has_palette = 1;
+            mc_ubyte element_tag = net_read_ubyte(cursor);
+            palette_size = net_read_uint(cursor);
+            if (palette_size == 0 || palette_size > 4096) {
                 logs("Invalid palette size %ju", (uintmax_t) palette_size);
-                goto bail;
+                return 0;
+            }
+            if (element_tag != NBT_TAG_COMPOUND) {
+                logs("Palette entries aren't compounds");
+                return 0;
             }
 
-            for (uint palettei = 0; palettei < palette_size; palettei++) {
-                net_string resource_loc = nbt_get_string(NET_STRING("Name"),
-                        palette_entry, &cursor);
-                mc_short type_id = resolve_resource_loc_id(resource_loc,
-                        &serv->block_resource_table);
-                if (type_id == -1) {
-                    // @TODO(traks) should probably just error out
-                    type_id = 2;
+            for (mc_uint palettei = 0; palettei < palette_size; palettei++) {
+                if (!decode_palette_entry(cursor, palette_map + palettei)) {
+                    return 0;
                 }
+            }
+        } else if (tag == NBT_TAG_LONG_ARRAY
+                && net_string_equal(key, NET_STRING("BlockStates"))) {
+            // the palette may come after the block states, so decode them
+            // once we're through the section
+            block_states_index = cursor->index;
+            block_states_count = net_read_uint(cursor);
+            cursor->index = block_states_index;
+            nbt_skip_value(tag, cursor);
+        } else {
+            nbt_skip_value(tag, cursor);
+        }
+    }
 
-                mc_ushort stride = 0;
+    if (cursor->error) {
+        return 0;
+    }
+    if (!has_palette) {
+        // section without blocks, e.g. one that only stores light
+        return 1;
+    }
 
-                nbt_tape_entry * props_nbt = nbt_get_compound(
-                        NET_STRING("Properties"), palette_entry, &cursor);
+    if (section_y < 0 || section_y >= 16) {
+        logs("Section Y %d with palette", (int) section_y);
+        return 0;
+    }
+    if (*decoded_sections & (1u << section_y)) {
+        logs("Duplicate section Y %d", (int) section_y);
+        return 0;
+    }
+    *decoded_sections |= 1u << section_y;
+
+    int palette_size_ceil_log2 = ceil_log2u(palette_size);
+    int bits_per_id = MAX(4, palette_size_ceil_log2);
+    int ids_per_long = 64 / bits_per_id;
+    mc_uint needed_longs = (4096 + ids_per_long - 1) / ids_per_long;
+    if (block_states_index == -1 || block_states_count < needed_longs) {
+        logs("Not enough block states: %ju", (uintmax_t) block_states_count);
+        return 0;
+    }
 
-                block_properties * props = serv->block_properties_table + type_id;
-                for (int propi = 0; propi < props->property_count; propi++) {
-                    block_property_spec * prop_spec = serv->block_property_specs
-                            + props->property_specs[propi];
-                    net_string prop_name = {
-                        .size = prop_spec->tape[0],
-                        .ptr = prop_spec->tape + 1
-                    };
+    if (palette_size == 1) {
+        // all blocks are the same, so we don't need to look at the data
+        ch->uniform_section_states[section_y] = palette_map[0];
+        ch->non_air_count[section_y] = (palette_map[0] != 0) ? 4096 : 0;
+        return 1;
+    }
 
-                    net_string prop_val = nbt_get_string(prop_name,
-                            props_nbt, &cursor);
+    // palettes that don't fit in 8 bits per block are dropped and the
+    // block states are stored directly
+    chunk_section * section = alloc_chunk_section(bits_per_id);
+    if (section == NULL) {
+        logs_errno("Failed to allocate section: %s");
+        return 0;
+    }
+    // Note that the section allocation will be freed when the chunk
+    // gets removed somewhere else in the code base.
+    ch->sections[section_y] = section;
+
+    // skip array size
+    buffer_cursor longs_cursor = {
+        .buf = cursor->buf + block_states_index + 4,
+        .limit = needed_longs * 8
+    };
+    int non_air_count;
+
+    if (section->palette != NULL) {
+        memcpy(section->palette, palette_map, palette_size * sizeof (mc_ushort));
+        section->palette_size = palette_size;
+
+        // The section uses the same layout as the stored data, except that
+        // 7-bit IDs are widened to 8 bits.
+        if (bits_per_id == 7) {
+            mc_ulong packed[586];
+            net_read_ulongs(&longs_cursor, packed, needed_longs);
+            widen_7_bit_ids(packed, section->data);
+        } else {
+            net_read_ulongs(&longs_cursor, section->data, needed_longs);
+        }
 
-                    int val_index = find_property_value_index(prop_spec, prop_val);
-                    if (val_index == -1) {
-                        val_index = props->default_value_indices[propi];
-                    }
+        packed_id_stats stats = scan_section_ids(section->data,
+                section->bits_per_block, palette_size, palette_map);
+        if (stats.max_id >= palette_size) {
+            logs("Out of bounds palette ID");
+            return 0;
+        }
 
-                    stride = stride * prop_spec->value_count + val_index;
-                }
+        if (stats.min_id == stats.max_id) {
+            // palettes can contain entries that aren't used
+            free_chunk_section(section);
+            ch->sections[section_y] = NULL;
+            ch->uniform_section_states[section_y] = palette_map[stats.min_id];
+        }
+        non_air_count = 4096 - stats.air_count;
+    } else {
+        mc_ulong packed[820];
+        net_read_ulongs(&longs_cursor, packed, needed_longs);
+        mc_ushort * block_states = (mc_ushort *) section->data;
+
+        int valid;
+        int uniform;
+        switch (bits_per_id) {
+        case 9:
+            valid = unpack_direct_block_states(packed, 9, palette_size,
+                    palette_map, block_states, &non_air_count, &uniform);
+            break;
+        case 10:
+            valid = unpack_direct_block_states(packed, 10, palette_size,
+                    palette_map, block_states, &non_air_count, &uniform);
+            break;
+        case 11:
+            valid = unpack_direct_block_states(packed, 11, palette_size,
+                    palette_map, block_states, &non_air_count, &uniform);
+            break;
+        default:
+            valid = unpack_direct_block_states(packed, 12, palette_size,
+                    palette_map, block_states, &non_air_count, &uniform);
+            break;
+        }
+        if (!valid) {
+            logs("Out of bounds palette ID");
+            return 0;
+        }
+        if (uniform) {
+            ch->uniform_section_states[section_y] = block_states[0];
+            free_chunk_section(section);
+            ch->sections[section_y] = NULL;
+        }
+    }
 
-                palette_map[palettei] = props->base_state + stride;
+    ch->non_air_count[section_y] = non_air_count;
+    return 1;
+}
 
-                // move to end of palette entry compound
-                while (palette_entry->tag != NBT_TAG_END) {
-                    palette_entry++;
-                    palette_entry += palette_entry->next_compound_entry_offset;
-                }
-                palette_entry += 1;
-            }
+static int
+decode_chunk_nbt(buffer_cursor * cursor, chunk * ch,
+        memory_arena * scratch_arena) {
+    // Walks over the NBT data of a chunk once, only looking at the data we
+    // use and skipping everything else. Since the order of the entries in
+    // compounds is undefined, we can only check the data version and the
+    // status at the end.
+    mc_ushort * palette_map = alloc_in_arena(scratch_arena,
+            4096 * sizeof (mc_ushort));
+    mc_uint decoded_sections = 0;
+    mc_int data_version = -1;
+    int fully_generated = 0;
+
+    if (net_read_ubyte(cursor) != NBT_TAG_COMPOUND) {
+        logs("Root tag not a compound");
+        return CHUNK_DECODE_ERROR;
+    }
+    // skip key of root compound
+    nbt_read_string_value(cursor);
+
+    for (;;) {
+        net_string key;
+        mc_ubyte tag = nbt_read_compound_entry(cursor, &key);
+        if (tag == NBT_TAG_END) {
+            break;
+        }
 
-            nbt_move_to_key(NET_STRING("BlockStates"), section_nbt, &cursor);
-            mc_uint entry_count = net_read_uint(&cursor);
+        if (tag == NBT_TAG_INT
+                && net_string_equal(key, NET_STRING("DataVersion"))) {
+            data_version = net_read_int(cursor);
+            continue;
+        }
+        if (tag != NBT_TAG_COMPOUND
+                || !net_string_equal(key, NET_STRING("Level"))) {
+            nbt_skip_value(tag, cursor);
+            continue;
+        }
 
-            if (entry_count > 4096) {
-                logs("Too many entries: %ju", (uintmax_t) entry_count);
-                goto bail;
+        for (;;) {
+            tag = nbt_read_compound_entry(cursor, &key);
+            if (tag == NBT_TAG_END) {
+                break;
             }
 
-            int palette_size_ceil_log2 = ceil_log2u(palette_size);
-            int bits_per_id = MAX(4, palette_size_ceil_log2);
-            mc_uint id_mask = (1 << bits_per_id) - 1;
-            int offset = 0;
-            mc_ulong entry = net_read_ulong(&cursor);
-
-            for (int j = 0; j < 4096; j++) {
-                mc_uint id = (entry >> offset) & id_mask;
-                offset += bits_per_id;
-                if (offset > 64 - bits_per_id) {
-                    entry = net_read_ulong(&cursor);
-                    offset = 0;
+            if (tag == NBT_TAG_STRING
+                    && net_string_equal(key, NET_STRING("Status"))) {
+                net_string status = nbt_read_string_value(cursor);
+                fully_generated = net_string_equal(status, NET_STRING("full"));
+            } else if (tag == NBT_TAG_LIST
+                    && net_string_equal(key, NET_STRING("Sections"))) {
+                mc_ubyte element_tag = net_read_ubyte(cursor);
+                mc_uint section_count = net_read_uint(cursor);
+                if (section_count == 0) {
+                    continue;
+                }
+                if (element_tag != NBT_TAG_COMPOUND) {
+                    logs("Chunk sections aren't compounds");
+                    return CHUNK_DECODE_ERROR;
+                }
+                if (section_count > 18) {
+                    logs("Too many chunk sections: %ju",
+                            (uintmax_t) section_count);
+                    return CHUNK_DECODE_ERROR;
                 }
 
-                if (id >= palette_size) {
-                    logs("Out of bounds palette ID");
-                    goto bail;
+                for (mc_uint sectioni = 0; sectioni < section_count; sectioni++) {
+                    if (!decode_section(cursor, ch, palette_map,
+                            &decoded_sections)) {
+                        if (cursor->error) {
+                            logs("Failed to decipher NBT data");
+                        }
+                        return CHUNK_DECODE_ERROR;
+                    }
                 }
+            } else {
+                nbt_skip_value(tag, cursor);
+            }
+        }
+    }
 
-                mc_ushort block_state = palette_map[id];
-                section->block_states[j] = block_state;
+    if (cursor->error) {
+        logs("Failed to decipher NBT data");
+        return CHUNK_DECODE_ERROR;
+    }
+    if (data_version != SERVER_WORLD_VERSION) {
+        logs("Data version %jd != %jd", (intmax_t) data_version,
+                (intmax_t) SERVER_WORLD_VERSION);
+        return CHUNK_DECODE_ERROR;
+    }
+    if (!fully_generated) {
+        return CHUNK_DECODE_NOT_GENERATED;
+    }
+    return CHUNK_DECODE_OK;
+}
 
-                if (block_state != 0) {
-                    ch->non_air_count[section_y]++;
-                }
+void
+prefetch_chunk_from_storage(chunk_pos pos, memory_arena * scratch_arena,
+        region_file_cache * region_cache) {
+    region_file * region = get_region_file(pos.x >> 5, pos.z >> 5,
+            region_cache, scratch_arena);
+
+    int index = ((pos.z & 0x1f) << 5) | (pos.x & 0x1f);
+    if (!(region->present_chunks[index >> 6] & ((mc_ulong) 1 << (index & 0x3f)))) {
+        return;
+    }
+
+    // invalid locations are reported once the chunk is actually read
+    mc_long start;
+    mc_long size;
+    if (region->native) {
+        native_region_header * header = (void *) region->map;
+        start = header->chunk_offsets[index];
+        size = header->chunk_sizes[index];
+    } else {
+        mc_uint loc = region->locations[index];
+        start = (mc_long) (loc >> 8) << 12;
+        size = (mc_long) (loc & 0xff) << 12;
+    }
+    if (start < 8192 || start + size > region->file_size) {
+        return;
+    }
+
+    // Ask the kernel to start reading the chunk data in the background. This
+    // is only a hint, so failures are ignored.
+    if (region->map != NULL) {
+        madvise(region->map + start, size, MADV_WILLNEED);
+    } else {
+#if defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(region->fd, start, size, POSIX_FADV_WILLNEED);
+#endif
+    }
+}
+
+static int
+is_valid_section_bits(int bits_per_block) {
+    for (int i = 0; i < CHUNK_SECTION_SIZE_CLASSES; i++) {
+        if (section_size_class_bits[i] == bits_per_block) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+decode_native_chunk(unsigned char * record, mc_long size, chunk * ch) {
+    // The record must be 8-byte aligned. It was written by us, but a file
+    // may still be corrupt. We make sure not to read outside the record and
+    // that all block states are valid, but trust the counts and height map.
+    // Sections that were allocated before an error are left in the chunk.
+    if (size < sizeof (native_chunk_header)) {
+        logs("Native chunk record too small");
+        return 0;
+    }
+
+    native_chunk_header * header = (void *) record;
+    mc_long record_index = sizeof *header;
+    int block_state_count = serv->actual_block_state_count;
+
+    for (int section_y = 0; section_y < 16; section_y++) {
+        int bits_per_block = header->bits_per_block[section_y];
+        if (bits_per_block == 0) {
+            if (header->uniform_section_states[section_y] >= block_state_count) {
+                logs("Invalid block state in native chunk");
+                return 0;
+            }
+            continue;
+        }
+        if (!is_valid_section_bits(bits_per_block)) {
+            logs("Invalid bits per block %d in native chunk", bits_per_block);
+            return 0;
+        }
+
+        int palette_size = header->palette_size[section_y];
+        int palette_capacity = get_section_palette_capacity(bits_per_block);
+        if (palette_size > palette_capacity
+                || (palette_capacity != 0 && palette_size == 0)) {
+            logs("Invalid palette size %d in native chunk", palette_size);
+            return 0;
+        }
+
+        mc_long palette_bytes = ((palette_size + 3) & ~3) * sizeof (mc_ushort);
+        mc_long data_bytes = get_section_data_longs(bits_per_block)
+                * sizeof (mc_ulong);
+        if (record_index + palette_bytes + data_bytes > size) {
+            logs("Native chunk sections outside of record");
+            return 0;
+        }
+
+        mc_ushort * palette = (void *) (record + record_index);
+        for (int i = 0; i < palette_size; i++) {
+            if (palette[i] >= block_state_count) {
+                logs("Invalid block state in native chunk");
+                return 0;
             }
         }
 
-        // move to end of section compound
-        while (section_nbt->tag != NBT_TAG_END) {
-            section_nbt++;
-            section_nbt += section_nbt->next_compound_entry_offset;
+        chunk_section * section = alloc_chunk_section(bits_per_block);
+        if (section == NULL) {
+            logs_errno("Failed to allocate section: %s");
+            return 0;
+        }
+        // Note that the section allocation will be freed when the chunk
+        // gets removed somewhere else in the code base.
+        ch->sections[section_y] = section;
+
+        if (palette_size != 0) {
+            memcpy(section->palette, palette, palette_size * sizeof (mc_ushort));
+            section->palette_size = palette_size;
+        }
+        record_index += palette_bytes;
+        memcpy(section->data, record + record_index, data_bytes);
+        record_index += data_bytes;
+
+        if (section->palette == NULL) {
+            mc_ushort * block_states = (mc_ushort *) section->data;
+            int invalid = 0;
+            for (int i = 0; i < 4096; i++) {
+                invalid |= (block_states[i] >= block_state_count);
+            }
+            if (invalid) {
+                logs("Invalid block state in native chunk");
+                return 0;
+            }
+        } else {
+            // palette slots past the palette size may hold anything
+            packed_id_stats stats = scan_section_ids(section->data,
+                    bits_per_block, palette_size, section->palette);
+            if (stats.max_id >= palette_size) {
+                logs("Invalid palette index in native chunk");
+                return 0;
+            }
         }
-        section_nbt += 1;
     }
 
-    recalculate_chunk_motion_blocking_height_map(ch);
+    memcpy(ch->uniform_section_states, header->uniform_section_states,
+            sizeof ch->uniform_section_states);
+    memcpy(ch->non_air_count, header->non_air_count,
+            sizeof ch->non_air_count);
+    memcpy(ch->motion_blocking_height_map, header->motion_blocking_height_map,
+            sizeof ch->motion_blocking_height_map);
+    ch->flags |= CHUNK_LOADED;
+    return 1;
+}
+
+static void
+read_native_chunk(region_file * region, int index, chunk * ch) {
+    native_region_header * region_header = (void *) region->map;
+    mc_long offset = region_header->chunk_offsets[index];
+    mc_long size = region_header->chunk_sizes[index];
+    if (offset < sizeof (native_region_header) || (offset & 0x7) != 0
+            || offset + size > region->file_size) {
+        logs("Invalid native chunk location");
+        mark_chunk_absent(region, index);
+        return;
+    }
+
+    decode_native_chunk(region->map + offset, size, ch);
+}
+
+int
+get_native_chunk_size(chunk * ch) {
+    int size = sizeof (native_chunk_header);
+    for (int section_y = 0; section_y < 16; section_y++) {
+        chunk_section * section = ch->sections[section_y];
+        if (section == NULL) {
+            continue;
+        }
+        size += ((section->palette_size + 3) & ~3) * sizeof (mc_ushort);
+        size += get_section_data_longs(section->bits_per_block)
+                * sizeof (mc_ulong);
+    }
+    return size;
+}
+
+void
+write_native_chunk(chunk * ch, unsigned char * record) {
+    // The record must have room for get_native_chunk_size bytes. Padding
+    // is set to 0, so converting the same world twice gives the same files.
+    int size = get_native_chunk_size(ch);
+    memset(record, 0, size);
+
+    native_chunk_header * header = (void *) record;
+    memcpy(header->uniform_section_states, ch->uniform_section_states,
+            sizeof ch->uniform_section_states);
+    memcpy(header->non_air_count, ch->non_air_count,
+            sizeof ch->non_air_count);
+    memcpy(header->motion_blocking_height_map, ch->motion_blocking_height_map,
+            sizeof ch->motion_blocking_height_map);
+
+    int record_index = sizeof *header;
+    for (int section_y = 0; section_y < 16; section_y++) {
+        chunk_section * section = ch->sections[section_y];
+        if (section == NULL) {
+            continue;
+        }
+
+        header->bits_per_block[section_y] = section->bits_per_block;
+        header->palette_size[section_y] = section->palette_size;
+        // stale uniform states of expanded sections shouldn't end up in the
+        // file
+        header->uniform_section_states[section_y] = 0;
+
+        if (section->palette != NULL) {
+            memcpy(record + record_index, section->palette,
+                    section->palette_size * sizeof (mc_ushort));
+        }
+        record_index += ((section->palette_size + 3) & ~3) * sizeof (mc_ushort);
+
+        int data_bytes = get_section_data_longs(section->bits_per_block)
+                * sizeof (mc_ulong);
+        memcpy(record + record_index, section->data, data_bytes);
+        record_index += data_bytes;
+    }
+    assert(record_index == size);
+}
+
+void
+try_read_chunk_from_storage(chunk_pos pos, chunk * ch,
+        memory_arena * scratch_arena, region_file_cache * region_cache) {
+    // @TODO(traks) error handling and/or error messages for all failure cases
+    // in this entire function?
+
+    region_file * region = get_region_file(pos.x >> 5, pos.z >> 5,
+            region_cache, scratch_arena);
+
+    // If the region file doesn't contain the chunk or we found out earlier
+    // the chunk isn't fully generated, we don't need to touch the file.
+    int index = ((pos.z & 0x1f) << 5) | (pos.x & 0x1f);
+    if (!(region->present_chunks[index >> 6] & ((mc_ulong) 1 << (index & 0x3f)))) {
+        return;
+    }
+
+    if (region->native) {
+        read_native_chunk(region, index, ch);
+        return;
+    }
+
+    // First read from the chunk location table at which sector (4096 byte
+    // block) the chunk data starts.
+    mc_uint loc = region->locations[index];
+    mc_uint sector_offset = loc >> 8;
+    mc_uint sector_count = loc & 0xff;
+
+    if (sector_offset < 2) {
+        logs("Chunk data in header");
+        mark_chunk_absent(region, index);
+        return;
+    }
+    if (sector_count == 0) {
+        logs("Chunk data uses 0 sectors");
+        mark_chunk_absent(region, index);
+        return;
+    }
+    if (((mc_long) (sector_offset + sector_count) << 12) > region->file_size) {
+        logs("Chunk data out of bounds");
+        mark_chunk_absent(region, index);
+        return;
+    }
+
+    buffer_cursor cursor;
+    if (region->map != NULL) {
+        // inflate straight from the mapped file
+        cursor = (buffer_cursor) {
+            .buf = region->map + ((mc_long) sector_offset << 12),
+            .limit = sector_count << 12
+        };
+    } else {
+        cursor = (buffer_cursor) {
+            .buf = alloc_in_arena(scratch_arena, sector_count << 12),
+            .limit = sector_count << 12
+        };
+        fill_buffer_from_file(region->fd, (mc_long) sector_offset << 12,
+                &cursor);
+    }
+
+    mc_uint size_in_bytes = net_read_uint(&cursor);
+
+    if (size_in_bytes > cursor.limit - cursor.index) {
+        logs("Chunk data outside of its sectors");
+        return;
+    }
+
+    cursor.limit = cursor.index + size_in_bytes;
+    mc_ubyte storage_type = net_read_ubyte(&cursor);
 
     if (cursor.error) {
-        logs("Failed to decipher NBT data");
-        print_nbt(chunk_nbt, &cursor, scratch_arena, max_levels);
-        goto bail;
+        logs("Chunk header reading error");
+        return;
     }
 
-    ch->flags |= CHUNK_LOADED;
+    if (storage_type & 0x80) {
+        // @TODO(traks) separate file is used to store the chunk
+        logs("External chunk storage");
+        return;
+    }
 
-bail:
-    end_timed_block();
+    int format;
+
+    if (storage_type == 1) {
+        format = COMPRESSION_FORMAT_GZIP;
+    } else if (storage_type == 2) {
+        format = COMPRESSION_FORMAT_ZLIB;
+    } else {
+        logs("Unknown chunk compression method");
+        return;
+    }
+
+    size_t max_uncompressed_size = 2 * (1 << 20);
+    unsigned char * uncompressed = alloc_in_arena(scratch_arena,
+            max_uncompressed_size);
+
+    int uncompressed_size = decompress_data(cursor.buf + cursor.index,
+            cursor.limit - cursor.index, uncompressed, max_uncompressed_size,
+            format);
+
+    if (uncompressed_size == -1) {
+        logs("Failed to inflate chunk");
+        return;
+    }
+
+    cursor = (buffer_cursor) {
+        .buf = uncompressed,
+        .limit = uncompressed_size
+    };
 
-    if (region_fd != -1) {
-        close(region_fd);
+    for (int section_y = 0; section_y < 16; section_y++) {
+        assert(ch->sections[section_y] == NULL);
     }
+
+    int res = decode_chunk_nbt(&cursor, ch, scratch_arena);
+
+    atomic_fetch_add_explicit(&palette_cache_hits, local_palette_cache_hits,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(&palette_cache_misses,
+            local_palette_cache_misses, memory_order_relaxed);
+    local_palette_cache_hits = 0;
+    local_palette_cache_misses = 0;
+    if (res == CHUNK_DECODE_NOT_GENERATED) {
+        // Happens a lot on the edges of pregenerated terrain, so don't log
+        // anything. Remember it, so we don't read the chunk again.
+        mark_chunk_absent(region, index);
+        return;
+    }
+    if (res != CHUNK_DECODE_OK) {
+        return;
+    }
+
+    recalculate_chunk_motion_blocking_height_map(ch);
+
+    ch->flags |= CHUNK_LOADED;
 }
 
 chunk *
 get_or_create_chunk(chunk_pos pos) {
-    int hash = hash_chunk_pos(pos);
-    chunk_bucket * bucket = chunk_map + hash;
-    int bucket_size = bucket->size;
-
-    int i;
-    for (i = 0; i < bucket_size; i++) {
-        if (chunk_pos_equal(bucket->positions[i], pos)) {
-            return bucket->chunks + i;
-        }
+    if (2 * (chunk_map_count + 1) > chunk_map_size) {
+        grow_chunk_map();
     }
 
-    assert(i < CHUNKS_PER_BUCKET);
+    chunk_map_entry * entry = chunk_map + find_chunk_map_slot(pos);
+    if (entry->ch == NULL) {
+        entry->pos = pos;
+        entry->ch = alloc_chunk();
+        entry->ch->pos = pos;
+        chunk_map_count++;
+    }
+    return entry->ch;
+}
 
-    bucket->positions[i] = pos;
-    bucket->size++;
-    chunk * ch = bucket->chunks + i;
-    *ch = (chunk) {0};
+chunk *
+get_chunk_if_loaded(chunk_pos pos) {
+    chunk * ch = get_chunk_if_available(pos);
+    if (ch != NULL && !(ch->flags & CHUNK_LOADED)) {
+        ch = NULL;
+    }
     return ch;
 }
 
 chunk *
-get_chunk_if_loaded(chunk_pos pos) {
-    int hash = hash_chunk_pos(pos);
-    chunk_bucket * bucket = chunk_map + hash;
-    int bucket_size = bucket->size;
-    chunk * res = NULL;
-
-    for (int i = 0; i < bucket_size; i++) {
-        if (chunk_pos_equal(bucket->positions[i], pos)) {
-            chunk * ch = bucket->chunks + i;
-            if (ch->flags & CHUNK_LOADED) {
-                res = ch;
+get_chunk_if_available(chunk_pos pos) {
+    if (chunk_map == NULL) {
+        return NULL;
+    }
+    return chunk_map[find_chunk_map_slot(pos)].ch;
+}
+
+static void
+collapse_uniform_sections(chunk * ch) {
+    // Frees sections that changed this tick and now consist of a single
+    // block state. Only sections without air or with only air can be
+    // uniform, so we don't need to look at the blocks of most sections.
+    unsigned changed_sections = 0;
+    for (int i = 0; i < ch->changed_block_count; i++) {
+        changed_sections |= 1u << (ch->changed_blocks[i].y >> 4);
+    }
+
+    for (int section_y = 0; section_y < 16; section_y++) {
+        chunk_section * section = ch->sections[section_y];
+        if (section == NULL || !(changed_sections & (1u << section_y))) {
+            continue;
+        }
+
+        mc_ushort non_air_count = ch->non_air_count[section_y];
+        mc_ushort block_state;
+        if (non_air_count == 0) {
+            block_state = 0;
+        } else if (non_air_count == 4096) {
+            mc_ushort block_states[4096];
+            unpack_chunk_section(section, block_states);
+            block_state = block_states[0];
+
+            int i;
+            for (i = 1; i < 4096; i++) {
+                if (block_states[i] != block_state) {
+                    break;
+                }
             }
-            break;
+            if (i < 4096) {
+                continue;
+            }
+        } else {
+            continue;
         }
+
+        free_chunk_section(section);
+        ch->sections[section_y] = NULL;
+        ch->uniform_section_states[section_y] = block_state;
     }
+}
 
+static mc_long
+get_chunk_memory(chunk * ch) {
+    mc_long res = sizeof *ch + ch->packet_cache_size
+            + get_chunk_light_memory(&ch->light);
+    for (int section_y = 0; section_y < 16; section_y++) {
+        chunk_section * section = ch->sections[section_y];
+        if (section != NULL) {
+            res += get_section_size(section->bits_per_block);
+        }
+    }
     return res;
 }
 
-chunk *
-get_chunk_if_available(chunk_pos pos) {
-    int hash = hash_chunk_pos(pos);
-    chunk_bucket * bucket = chunk_map + hash;
-    int bucket_size = bucket->size;
-    chunk * res = NULL;
-
-    for (int i = 0; i < bucket_size; i++) {
-        if (chunk_pos_equal(bucket->positions[i], pos)) {
-            res = bucket->chunks + i;
+static void
+retain_chunk(chunk * ch) {
+    ch->flags |= CHUNK_RETAINED;
+    ch->retained_tick = serv->current_tick;
+    ch->retained_memory = get_chunk_memory(ch);
+
+    ch->retained_newer = NULL;
+    ch->retained_older = newest_retained_chunk;
+    if (newest_retained_chunk != NULL) {
+        newest_retained_chunk->retained_newer = ch;
+    } else {
+        oldest_retained_chunk = ch;
+    }
+    newest_retained_chunk = ch;
+
+    retained_chunk_memory += ch->retained_memory;
+    retained_chunk_count++;
+}
+
+static void
+unretain_chunk(chunk * ch) {
+    if (ch->retained_newer != NULL) {
+        ch->retained_newer->retained_older = ch->retained_older;
+    } else {
+        newest_retained_chunk = ch->retained_older;
+    }
+    if (ch->retained_older != NULL) {
+        ch->retained_older->retained_newer = ch->retained_newer;
+    } else {
+        oldest_retained_chunk = ch->retained_newer;
+    }
+
+    ch->flags &= ~CHUNK_RETAINED;
+    retained_chunk_memory -= ch->retained_memory;
+    retained_chunk_count--;
+}
+
+static void
+unload_chunk(chunk * ch) {
+    for (int sectioni = 0; sectioni < 16; sectioni++) {
+        if (ch->sections[sectioni] != NULL) {
+            free_chunk_section(ch->sections[sectioni]);
+        }
+    }
+    free_chunk_light(&ch->light);
+    free(ch->packet_cache);
+    free(ch->light_update_cache);
+    free_chunk(ch);
+}
+
+void
+flush_chunk_saves(void) {
+    // Called on shutdown. Saves all changed chunks, however recent their
+    // changes, and returns once everything has been written.
+    int saved = 0;
+    for (;;) {
+        // there may be more changed chunks than saves fit in flight
+        for (int slot = 0; slot < chunk_map_size; slot++) {
+            chunk * ch = chunk_map[slot].ch;
+            if (ch == NULL || ch->dirty_sections == 0
+                    || (ch->flags & CHUNK_SAVE_IN_FLIGHT)) {
+                continue;
+            }
+            if (!request_chunk_save(ch)) {
+                break;
+            }
+            saved++;
+        }
+
+        int in_flight = wait_for_chunk_saves();
+        if (in_flight == 0) {
+            break;
+        }
+        int failed = finish_chunk_saves();
+        if (failed == in_flight) {
+            // Nothing got saved, so trying again won't help. Failed chunks
+            // are marked as changed again and would be retried forever.
+            logs("Failed to save %d chunks", failed);
             break;
         }
     }
 
-    return res;
+    if (saved > 0) {
+        logs("Saved %d changed chunks", saved);
+    }
+}
+
+typedef struct {
+    chunk * ch;
+    int compressed_evicted;
+} retained_chunk_eviction;
+
+static void
+compress_evicted_chunk(void * data, int index, memory_arena * scratch_arena) {
+    retained_chunk_eviction * eviction = (retained_chunk_eviction *) data + index;
+    eviction->compressed_evicted = store_compressed_chunk(eviction->ch);
 }
 
 void
-clean_up_unused_chunks(void) {
-    for (int bucketi = 0; bucketi < ARRAY_SIZE(chunk_map); bucketi++) {
-        chunk_bucket * bucket = chunk_map + bucketi;
-
-        for (int chunki = 0; chunki < bucket->size; chunki++) {
-            chunk * ch = bucket->chunks + chunki;
-            ch->changed_block_count = 0;
-            ch->local_event_count = 0;
-
-            if (ch->available_interest == 0) {
-                for (int sectioni = 0; sectioni < 16; sectioni++) {
-                    if (ch->sections[sectioni] != NULL) {
-                        free_chunk_section(ch->sections[sectioni]);
-                    }
-                }
+clean_up_unused_chunks(memory_arena * scratch_arena) {
+    int reloads_avoided = 0;
+    int slot = 0;
+    while (slot < chunk_map_size) {
+        chunk * ch = chunk_map[slot].ch;
+        if (ch == NULL) {
+            slot++;
+            continue;
+        }
+
+        if (ch->changed_block_count > 0) {
+            collapse_uniform_sections(ch);
+        }
+
+        ch->changed_block_count = 0;
+        ch->changed_sky_light = 0;
+        ch->changed_block_light = 0;
+        free(ch->light_update_cache);
+        ch->light_update_cache = NULL;
+        ch->light_update_cache_size = 0;
+        ch->local_event_count = 0;
+
+        if (ch->dirty_sections != 0 && !(ch->flags & CHUNK_SAVE_IN_FLIGHT)
+                && serv->current_tick - ch->dirty_tick >= CHUNK_SAVE_DELAY_TICKS) {
+            // if there are too many saves in flight, try again next tick
+            request_chunk_save(ch);
+        }
+
+        if (ch->available_interest != 0) {
+            if (ch->flags & CHUNK_RETAINED) {
+                // someone is interested in the chunk again, and we don't
+                // need to load it from storage
+                unretain_chunk(ch);
+                reloads_avoided++;
+            }
+            slot++;
+        } else if (ch->flags & CHUNK_RETAINED) {
+            slot++;
+        } else if (ch->flags & CHUNK_LOADED) {
+            retain_chunk(ch);
+            slot++;
+        } else {
+            unload_chunk(ch);
 
-                int last = bucket->size - 1;
-                assert(last >= 0);
-                bucket->chunks[chunki] = bucket->chunks[last];
-                bucket->positions[chunki] = bucket->positions[last];
-                bucket->size--;
-                chunki--;
+            // Removing the entry may move another entry into this slot, so
+            // look at the same slot again. An entry that wraps around from
+            // the start of the map may be visited twice, which is harmless.
+            remove_chunk_map_entry(slot);
+        }
+    }
+
+    // Unload retained chunks that are too old or don't fit in the budget.
+    // They move to the compressed chunk cache. Changed chunks are unloaded
+    // once they're saved, so they can't be loaded from storage before their
+    // changes are written.
+    begin_timed_block("unload retained chunks");
+    retained_chunk_eviction * evictions = alloc_in_arena(scratch_arena,
+            retained_chunk_count * sizeof *evictions);
+    int evicted = 0;
+    int compressed_evicted = 0;
+    int waiting_for_save = 0;
+    chunk * next_retained = oldest_retained_chunk;
+    while (next_retained != NULL) {
+        chunk * ch = next_retained;
+        if (serv->current_tick - ch->retained_tick < CHUNK_RETENTION_TICKS
+                && retained_chunk_memory <= CHUNK_RETENTION_MEMORY_BUDGET) {
+            break;
+        }
+        next_retained = ch->retained_newer;
+
+        if (ch->dirty_sections != 0 || (ch->flags & CHUNK_SAVE_IN_FLIGHT)) {
+            if (!(ch->flags & CHUNK_SAVE_IN_FLIGHT)) {
+                request_chunk_save(ch);
             }
+            waiting_for_save++;
+            continue;
         }
+
+        unretain_chunk(ch);
+        evictions[evicted] = (retained_chunk_eviction) {.ch = ch};
+        evicted++;
+    }
+
+    // Compressing is by far the most expensive part, and chunks compress
+    // independently of each other.
+    run_jobs(compress_evicted_chunk, evictions, evicted);
+
+    for (int i = 0; i < evicted; i++) {
+        chunk * ch = evictions[i].ch;
+        compressed_evicted += evictions[i].compressed_evicted;
+        int ch_slot = find_chunk_map_slot(ch->pos);
+        assert(chunk_map[ch_slot].ch == ch);
+        unload_chunk(ch);
+        remove_chunk_map_entry(ch_slot);
     }
+    end_timed_block();
+
+    int compressed_count;
+    mc_long compressed_memory;
+    get_compressed_chunk_cache_usage(&compressed_count, &compressed_memory);
+
+    add_profiler_counter("chunk reloads avoided", reloads_avoided);
+    add_profiler_counter("retained chunks evicted", evicted);
+    add_profiler_counter("retained chunks waiting for save", waiting_for_save);
+    add_profiler_counter("retained chunks", retained_chunk_count);
+    add_profiler_counter("retained chunk KB", retained_chunk_memory >> 10);
+    add_profiler_counter("compressed chunks evicted", compressed_evicted);
+    add_profiler_counter("compressed chunks", compressed_count);
+    add_profiler_counter("compressed chunk KB", compressed_memory >> 10);
 }
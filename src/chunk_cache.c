@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "shared.h"
+
+// Second tier of the chunk cache, after retained chunks. Chunks unloaded from
+// memory are kept here as compressed native chunk records, so the chunk
+// loader threads can restore them without reading and decoding them from
+// storage again. Job threads add chunks and the chunk loader threads take
+// them out again, so the cache is protected by a mutex. Compressing and
+// decompressing happens outside the lock.
+
+typedef struct compressed_chunk compressed_chunk;
+
+struct compressed_chunk {
+    chunk_pos pos;
+    compressed_chunk * next_in_bucket;
+    // Compressed chunks are in a list ordered by the time they were added.
+    // Newer chunks come first.
+    compressed_chunk * newer;
+    compressed_chunk * older;
+    int record_size;
+    int compressed_size;
+    unsigned char data[];
+};
+
+static pthread_mutex_t compressed_chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static compressed_chunk * compressed_chunk_buckets[1 << COMPRESSED_CHUNK_CACHE_BUCKETS_LOG2];
+static compressed_chunk * newest_compressed_chunk;
+static compressed_chunk * oldest_compressed_chunk;
+static mc_long compressed_chunk_memory;
+static int compressed_chunk_count;
+
+static int
+hash_compressed_chunk_pos(chunk_pos pos) {
+    mc_uint key = ((mc_uint) (mc_ushort) pos.x << 16) | (mc_ushort) pos.z;
+    return (key * 0x9e3779b9u) >> (32 - COMPRESSED_CHUNK_CACHE_BUCKETS_LOG2);
+}
+
+static compressed_chunk *
+remove_compressed_chunk(chunk_pos pos) {
+    // Removes the chunk from the cache and returns it, or returns NULL if
+    // the chunk isn't in the cache. Must hold the mutex.
+    compressed_chunk * * link = compressed_chunk_buckets
+            + hash_compressed_chunk_pos(pos);
+    while (*link != NULL) {
+        compressed_chunk * entry = *link;
+        if (entry->pos.x == pos.x && entry->pos.z == pos.z) {
+            break;
+        }
+        link = &entry->next_in_bucket;
+    }
+
+    compressed_chunk * entry = *link;
+    if (entry == NULL) {
+        return NULL;
+    }
+    *link = entry->next_in_bucket;
+
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        newest_compressed_chunk = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        oldest_compressed_chunk = entry->newer;
+    }
+
+    compressed_chunk_memory -= sizeof *entry + entry->compressed_size;
+    compressed_chunk_count--;
+    return entry;
+}
+
+int
+store_compressed_chunk(chunk * ch) {
+    // Called by job threads for loaded chunks that are being unloaded.
+    // If the chunk can't be compressed, it is simply not cached. Returns the
+    // number of older chunks removed from the cache to make room.
+
+    int record_size = get_native_chunk_size(ch);
+    unsigned char * record = malloc(record_size);
+    int max_compressed_size = compress_bound(record_size);
+    compressed_chunk * entry = malloc(sizeof *entry + max_compressed_size);
+    if (record == NULL || entry == NULL) {
+        free(record);
+        free(entry);
+        return 0;
+    }
+
+    write_native_chunk(ch, record);
+    int compressed_size = compress_data_fast(record, record_size,
+            entry->data, max_compressed_size);
+    free(record);
+    if (compressed_size == -1) {
+        free(entry);
+        return 0;
+    }
+
+    // give back the memory we didn't use
+    compressed_chunk * shrunk = realloc(entry,
+            sizeof *entry + compressed_size);
+    if (shrunk != NULL) {
+        entry = shrunk;
+    }
+    entry->pos = ch->pos;
+    entry->record_size = record_size;
+    entry->compressed_size = compressed_size;
+
+    int evicted = 0;
+    compressed_chunk * evicted_list = NULL;
+
+    pthread_mutex_lock(&compressed_chunk_mutex);
+
+    // Chunks are taken out of the cache when they're loaded again, so there
+    // is rarely an older copy. It can happen if the chunk was loaded twice at
+    // the same time, in which case the older copy is outdated.
+    compressed_chunk * old_copy = remove_compressed_chunk(ch->pos);
+    if (old_copy != NULL) {
+        old_copy->next_in_bucket = evicted_list;
+        evicted_list = old_copy;
+    }
+
+    int bucket = hash_compressed_chunk_pos(entry->pos);
+    entry->next_in_bucket = compressed_chunk_buckets[bucket];
+    compressed_chunk_buckets[bucket] = entry;
+
+    entry->newer = NULL;
+    entry->older = newest_compressed_chunk;
+    if (newest_compressed_chunk != NULL) {
+        newest_compressed_chunk->newer = entry;
+    } else {
+        oldest_compressed_chunk = entry;
+    }
+    newest_compressed_chunk = entry;
+
+    compressed_chunk_memory += sizeof *entry + entry->compressed_size;
+    compressed_chunk_count++;
+
+    while (compressed_chunk_memory > COMPRESSED_CHUNK_CACHE_BUDGET) {
+        compressed_chunk * oldest = remove_compressed_chunk(
+                oldest_compressed_chunk->pos);
+        // free outside the lock
+        oldest->next_in_bucket = evicted_list;
+        evicted_list = oldest;
+        evicted++;
+    }
+
+    pthread_mutex_unlock(&compressed_chunk_mutex);
+
+    while (evicted_list != NULL) {
+        compressed_chunk * next = evicted_list->next_in_bucket;
+        free(evicted_list);
+        evicted_list = next;
+    }
+
+    return evicted;
+}
+
+int
+restore_compressed_chunk(chunk_pos pos, chunk * ch,
+        memory_arena * scratch_arena) {
+    // Called by the chunk loader threads. Returns whether the chunk was in
+    // the cache. The chunk is taken out of the cache, since the loaded chunk
+    // replaces it.
+    pthread_mutex_lock(&compressed_chunk_mutex);
+    compressed_chunk * entry = remove_compressed_chunk(pos);
+    pthread_mutex_unlock(&compressed_chunk_mutex);
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    // native chunk records must be 8-byte aligned
+    memory_arena temp_arena = *scratch_arena;
+    unsigned char * record = alloc_in_arena(&temp_arena, entry->record_size);
+    int record_size = decompress_data(entry->data, entry->compressed_size,
+            record, entry->record_size, COMPRESSION_FORMAT_ZLIB);
+    int success = 0;
+    if (record_size != entry->record_size) {
+        logs("Failed to inflate compressed chunk");
+    } else {
+        success = decode_native_chunk(record, record_size, ch);
+    }
+
+    if (!success) {
+        // The caller loads the chunk from storage next, which expects an
+        // empty chunk.
+        for (int section_y = 0; section_y < 16; section_y++) {
+            if (ch->sections[section_y] != NULL) {
+                free_chunk_section(ch->sections[section_y]);
+                ch->sections[section_y] = NULL;
+            }
+        }
+        memset(ch->uniform_section_states, 0,
+                sizeof ch->uniform_section_states);
+    }
+
+    free(entry);
+    return success;
+}
+
+void
+get_compressed_chunk_cache_usage(int * chunk_count, mc_long * memory) {
+    pthread_mutex_lock(&compressed_chunk_mutex);
+    *chunk_count = compressed_chunk_count;
+    *memory = compressed_chunk_memory;
+    pthread_mutex_unlock(&compressed_chunk_mutex);
+}
@@ -0,0 +1,319 @@
+// needed for SCHED_BATCH on Linux
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "shared.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// Chunks are read from storage and decoded by a pool of loader threads, so
+// slow disks and expensive chunk decoding don't hold up ticks. The request
+// chunk loads phase submits load requests, and the link loaded chunks phase
+// links the chunk sections produced by the loader threads into chunks once
+// the loads are done. Those phases may run on any job thread, but the phase
+// graph must always run them one after the other, never alongside each
+// other, since they share the state below that isn't protected by the mutex.
+//
+// Both queues below are protected by the same mutex. The tick never has more
+// loads in flight than fit in the queues, so loader threads never need to
+// wait for room in the completion queue.
+
+typedef struct {
+    chunk_pos pos;
+    long long request_time;
+} chunk_load_request;
+
+typedef struct {
+    chunk_pos pos;
+    long long request_time;
+    long long load_time;
+    long long light_time;
+    int region_files_opened;
+    int restored;
+    chunk_section * sections[16];
+    mc_ushort uniform_section_states[16];
+    mc_ushort non_air_count[16];
+    mc_ushort motion_blocking_height_map[256];
+    chunk_light light;
+} loaded_chunk;
+
+static pthread_mutex_t chunk_loader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_loader_cond = PTHREAD_COND_INITIALIZER;
+
+// consumed by the loader threads
+static chunk_load_request load_queue[MAX_CHUNK_LOADS_IN_FLIGHT];
+static unsigned load_queue_head;
+static unsigned load_queue_tail;
+// Requests before this index have been prefetched. Requests are queued in
+// the order of the players' chunk spirals, so the next requests in the queue
+// are the chunks players need next.
+static unsigned load_queue_prefetch_index;
+
+// Consumed by the link loaded chunks phase. Slots before the tail are only
+// written by the loader threads while holding the mutex, so the phase can
+// read them after reading the tail.
+static loaded_chunk completion_queue[MAX_CHUNK_LOADS_IN_FLIGHT];
+static unsigned completion_queue_head;
+static unsigned completion_queue_tail;
+
+// only touched by the request chunk loads and link loaded chunks phases
+static int chunk_loads_in_flight;
+
+static void
+generate_chunk(chunk * ch) {
+    // @TODO(traks) fall back to stone plateau at y = 0 for now
+    // clean up some of the mess the chunk loader might've left behind
+    // @TODO(traks) perhaps this should be in a separate struct so we
+    // can easily clear it
+    for (int sectioni = 0; sectioni < 16; sectioni++) {
+        if (ch->sections[sectioni] != NULL) {
+            free_chunk_section(ch->sections[sectioni]);
+            ch->sections[sectioni] = NULL;
+        }
+        ch->uniform_section_states[sectioni] = 0;
+        ch->non_air_count[sectioni] = 0;
+    }
+
+    // @TODO(traks) perhaps should require enough chunk sections to be
+    // available for chunk before even trying to load/generate it.
+    chunk_section * section = alloc_chunk_section(4);
+    if (section == NULL) {
+        logs("Failed to allocate chunk section during generation");
+        exit(1);
+    }
+
+    for (int x = 0; x < 16; x++) {
+        for (int z = 0; z < 16; z++) {
+            int index = (z << 4) | x;
+            // the palette has plenty of room, so this can't fail
+            section = set_section_block_state(section, index, 2);
+            ch->motion_blocking_height_map[index] = 1;
+            ch->non_air_count[0]++;
+        }
+    }
+
+    ch->sections[0] = section;
+
+    ch->flags |= CHUNK_LOADED;
+}
+
+static void *
+run_chunk_loader_thread(void * arg) {
+#if defined(__linux__)
+    // Don't let loader threads that just got work preempt the job threads
+    // when there are fewer processors than threads. A failure here only
+    // affects scheduling, so it is ignored.
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+#endif
+
+    memory_arena scratch_arena = {
+        .ptr = malloc(CHUNK_LOADER_SCRATCH_SIZE),
+        .size = CHUNK_LOADER_SCRATCH_SIZE
+    };
+    region_file_cache * region_cache = calloc(1, sizeof *region_cache);
+    // chunk the loaded data is written to, before it is handed over
+    chunk * ch = malloc(sizeof *ch);
+    if (scratch_arena.ptr == NULL || region_cache == NULL || ch == NULL) {
+        logs_errno("Failed to allocate chunk loader memory: %s");
+        exit(1);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&chunk_loader_mutex);
+        while (load_queue_head == load_queue_tail) {
+            pthread_cond_wait(&chunk_loader_cond, &chunk_loader_mutex);
+        }
+        chunk_load_request request = load_queue[load_queue_head
+                & (MAX_CHUNK_LOADS_IN_FLIGHT - 1)];
+        load_queue_head++;
+
+        // claim the requests after this one for prefetching
+        chunk_pos prefetch_positions[CHUNK_PREFETCH_DISTANCE];
+        int prefetch_count = 0;
+        if ((int) (load_queue_prefetch_index - load_queue_head) < 0) {
+            load_queue_prefetch_index = load_queue_head;
+        }
+        while (load_queue_prefetch_index != load_queue_tail
+                && load_queue_prefetch_index - load_queue_head
+                < CHUNK_PREFETCH_DISTANCE) {
+            prefetch_positions[prefetch_count] = load_queue[
+                    load_queue_prefetch_index
+                    & (MAX_CHUNK_LOADS_IN_FLIGHT - 1)].pos;
+            prefetch_count++;
+            load_queue_prefetch_index++;
+        }
+        pthread_mutex_unlock(&chunk_loader_mutex);
+
+        for (int i = 0; i < prefetch_count; i++) {
+            scratch_arena.index = 0;
+            prefetch_chunk_from_storage(prefetch_positions[i],
+                    &scratch_arena, region_cache);
+        }
+
+        long long start_time = program_nano_time();
+        mc_long region_files_opened = region_cache->open_count;
+
+        for (int sectioni = 0; sectioni < 16; sectioni++) {
+            ch->sections[sectioni] = NULL;
+            ch->uniform_section_states[sectioni] = 0;
+            ch->non_air_count[sectioni] = 0;
+        }
+        ch->flags = 0;
+        scratch_arena.index = 0;
+        int restored = restore_compressed_chunk(request.pos, ch,
+                &scratch_arena);
+        if (!restored) {
+            try_read_chunk_from_storage(request.pos, ch, &scratch_arena,
+                    region_cache);
+        }
+
+        if (!(ch->flags & CHUNK_LOADED)) {
+            generate_chunk(ch);
+        }
+
+        long long light_start_time = program_nano_time();
+        scratch_arena.index = 0;
+        light_chunk(ch, &scratch_arena);
+
+        long long end_time = program_nano_time();
+
+        pthread_mutex_lock(&chunk_loader_mutex);
+        loaded_chunk * res = completion_queue + (completion_queue_tail
+                & (MAX_CHUNK_LOADS_IN_FLIGHT - 1));
+        res->pos = request.pos;
+        res->request_time = request.request_time;
+        res->load_time = end_time - start_time;
+        res->light_time = end_time - light_start_time;
+        res->region_files_opened = region_cache->open_count
+                - region_files_opened;
+        res->restored = restored;
+        memcpy(res->sections, ch->sections, sizeof ch->sections);
+        memcpy(res->uniform_section_states, ch->uniform_section_states,
+                sizeof ch->uniform_section_states);
+        memcpy(res->non_air_count, ch->non_air_count,
+                sizeof ch->non_air_count);
+        memcpy(res->motion_blocking_height_map, ch->motion_blocking_height_map,
+                sizeof ch->motion_blocking_height_map);
+        res->light = ch->light;
+        completion_queue_tail++;
+        pthread_mutex_unlock(&chunk_loader_mutex);
+    }
+
+    return NULL;
+}
+
+void
+start_chunk_loader_threads(void) {
+    long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = MAX(1, MIN(MAX_CHUNK_LOADER_THREADS,
+            processor_count - 1));
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        if (pthread_attr_init(&attr) != 0
+                || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
+                || pthread_create(&thread, &attr, run_chunk_loader_thread, NULL) != 0) {
+            logs("Failed to start chunk loader thread");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+int
+request_chunk_loads(chunk_pos * positions, int count) {
+    // All requests are queued at once, so the loader threads don't get woken
+    // up for every single request.
+    int room = MAX_CHUNK_LOADS_IN_FLIGHT - chunk_loads_in_flight;
+    int requested = MIN(count, room);
+    chunk_loads_in_flight += requested;
+    add_profiler_counter("chunk loads in flight", chunk_loads_in_flight);
+
+    if (requested == 0) {
+        return 0;
+    }
+
+    long long now = program_nano_time();
+    pthread_mutex_lock(&chunk_loader_mutex);
+    for (int i = 0; i < requested; i++) {
+        load_queue[load_queue_tail & (MAX_CHUNK_LOADS_IN_FLIGHT - 1)] =
+                (chunk_load_request) {.pos = positions[i], .request_time = now};
+        load_queue_tail++;
+    }
+    pthread_cond_broadcast(&chunk_loader_cond);
+    pthread_mutex_unlock(&chunk_loader_mutex);
+    return requested;
+}
+
+void
+link_loaded_chunks(void) {
+    pthread_mutex_lock(&chunk_loader_mutex);
+    unsigned tail = completion_queue_tail;
+    pthread_mutex_unlock(&chunk_loader_mutex);
+
+    long long now = program_nano_time();
+    int completed = 0;
+
+    for (; completion_queue_head != tail; completion_queue_head++) {
+        loaded_chunk * res = completion_queue + (completion_queue_head
+                & (MAX_CHUNK_LOADS_IN_FLIGHT - 1));
+        completed++;
+        add_profiler_counter("chunk load latency micros",
+                (now - res->request_time) / 1000);
+        add_profiler_counter("chunk load micros", res->load_time / 1000);
+        add_profiler_counter("chunk light micros", res->light_time / 1000);
+        add_profiler_counter("region file opens", res->region_files_opened);
+        if (res->restored) {
+            add_profiler_counter("chunk loads from compressed cache", 1);
+            add_profiler_counter("compressed chunk restore micros",
+                    res->load_time / 1000);
+        } else {
+            add_profiler_counter("chunk loads from storage", 1);
+        }
+
+        // The chunk may have been removed while it was being loaded. It may
+        // even have been added again and have another load in flight.
+        chunk * ch = get_chunk_if_available(res->pos);
+        if (ch == NULL || (ch->flags & CHUNK_LOADED)) {
+            for (int sectioni = 0; sectioni < 16; sectioni++) {
+                if (res->sections[sectioni] != NULL) {
+                    free_chunk_section(res->sections[sectioni]);
+                }
+            }
+            free_chunk_light(&res->light);
+            continue;
+        }
+
+        for (int sectioni = 0; sectioni < 16; sectioni++) {
+            assert(ch->sections[sectioni] == NULL);
+        }
+        memcpy(ch->sections, res->sections, sizeof ch->sections);
+        memcpy(ch->uniform_section_states, res->uniform_section_states,
+                sizeof ch->uniform_section_states);
+        memcpy(ch->non_air_count, res->non_air_count,
+                sizeof ch->non_air_count);
+        memcpy(ch->motion_blocking_height_map, res->motion_blocking_height_map,
+                sizeof ch->motion_blocking_height_map);
+        ch->light = res->light;
+        ch->flags |= CHUNK_LOADED;
+        ch->flags &= ~CHUNK_LOAD_REQUESTED;
+        link_chunk_light(ch);
+    }
+
+    chunk_loads_in_flight -= completed;
+    add_profiler_counter("chunk loads completed", completed);
+
+    mc_ulong palette_cache_hits;
+    mc_ulong palette_cache_misses;
+    take_palette_cache_stats(&palette_cache_hits, &palette_cache_misses);
+    add_profiler_counter("palette cache hits", palette_cache_hits);
+    add_profiler_counter("palette cache misses", palette_cache_misses);
+}
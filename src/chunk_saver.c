@@ -0,0 +1,883 @@
+// needed for SCHED_BATCH on Linux
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "shared.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// Changed chunks are written back to the Anvil region files by a saver
+// thread, so encoding, compressing and writing chunks doesn't hold up ticks.
+// The update chunks phase hands over a snapshot of the chunk as a native
+// chunk record, which is cheap to take. Chunks aren't unloaded while they're being
+// saved, so a chunk is never loaded from storage before its latest changes
+// are written.
+//
+// The block states are merged into the chunk NBT that is already in the
+// region file, so the data we don't use, like entities and biomes, is kept.
+// Light and height maps are dropped, so the vanilla server calculates them
+// again.
+//
+// Chunk data is always written to free sectors before the location table
+// points to it, and both writes are flushed to storage before the sectors of
+// the old chunk data are reused. A crash or power loss therefore leaves
+// either the old or the new chunk in the region file. Native region files of
+// regions we save to are removed, since they'd be outdated.
+
+typedef struct {
+    chunk_pos pos;
+    long long request_time;
+    mc_ushort dirty_sections;
+    int record_size;
+    // allocated with malloc, freed by the saver thread
+    unsigned char * record;
+} chunk_save_request;
+
+typedef struct {
+    chunk_pos pos;
+    long long request_time;
+    long long save_time;
+    mc_ushort dirty_sections;
+    int success;
+    // size of the chunk data written to the region file
+    int saved_bytes;
+} chunk_save_result;
+
+typedef struct {
+    int region_x;
+    int region_z;
+    // -1 if the region file couldn't be opened
+    int fd;
+    // 0 if the cache slot is unused
+    mc_long last_use;
+    mc_uint locations[1024];
+    mc_uint sector_count;
+    // a bit is set for every sector in use, with room for
+    // used_sector_capacity sectors
+    mc_ulong * used_sectors;
+    mc_uint used_sector_capacity;
+} region_writer;
+
+// Both queues are protected by the same mutex, like the chunk loader queues.
+// The tick never has more saves in flight than fit in the queues.
+
+static pthread_mutex_t chunk_saver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_saver_cond = PTHREAD_COND_INITIALIZER;
+// signalled whenever a save has completed
+static pthread_cond_t chunk_saved_cond = PTHREAD_COND_INITIALIZER;
+
+// consumed by the saver thread
+static chunk_save_request save_queue[MAX_CHUNK_SAVES_IN_FLIGHT];
+static unsigned save_queue_head;
+static unsigned save_queue_tail;
+
+// consumed by the update chunks phase
+static chunk_save_result save_completion_queue[MAX_CHUNK_SAVES_IN_FLIGHT];
+static unsigned save_completion_queue_head;
+static unsigned save_completion_queue_tail;
+
+// Only touched by the update chunks phase, which may run on any job thread.
+// The phase graph must never run another phase that saves chunks alongside
+// it.
+static int chunk_saves_in_flight;
+
+// only touched by the saver thread
+static region_writer region_writers[REGION_WRITER_CACHE_SIZE];
+static mc_long region_writer_use_counter;
+
+static int
+read_fully(int fd, unsigned char * data, mc_long size, mc_long offset) {
+    mc_long bytes_read = 0;
+    while (bytes_read < size) {
+        ssize_t res = pread(fd, data + bytes_read, size - bytes_read,
+                offset + bytes_read);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        if (res == 0) {
+            return 0;
+        }
+        bytes_read += res;
+    }
+    return 1;
+}
+
+static int
+write_fully(int fd, unsigned char * data, mc_long size, mc_long offset) {
+    mc_long written = 0;
+    while (written < size) {
+        ssize_t res = pwrite(fd, data + written, size - written,
+                offset + written);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        written += res;
+    }
+    return 1;
+}
+
+static int
+sync_data(int fd) {
+    // makes sure earlier writes reach storage before later ones
+#if defined(__linux__)
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+static int
+is_sector_used(region_writer * writer, mc_uint sector) {
+    return (writer->used_sectors[sector >> 6] >> (sector & 0x3f)) & 1;
+}
+
+static void
+mark_sectors(region_writer * writer, mc_uint start, mc_uint count, int used) {
+    for (mc_uint sector = start; sector < start + count; sector++) {
+        mc_ulong bit = (mc_ulong) 1 << (sector & 0x3f);
+        if (used) {
+            writer->used_sectors[sector >> 6] |= bit;
+        } else {
+            writer->used_sectors[sector >> 6] &= ~bit;
+        }
+    }
+}
+
+static int
+grow_used_sectors(region_writer * writer, mc_uint sector_count) {
+    if (sector_count <= writer->used_sector_capacity) {
+        return 1;
+    }
+
+    mc_uint new_capacity = MAX(1024, writer->used_sector_capacity);
+    while (new_capacity < sector_count) {
+        new_capacity *= 2;
+    }
+    mc_ulong * new_sectors = realloc(writer->used_sectors,
+            new_capacity / 8);
+    if (new_sectors == NULL) {
+        return 0;
+    }
+    memset(new_sectors + writer->used_sector_capacity / 64, 0,
+            (new_capacity - writer->used_sector_capacity) / 8);
+    writer->used_sectors = new_sectors;
+    writer->used_sector_capacity = new_capacity;
+    return 1;
+}
+
+static mc_uint
+alloc_sectors(region_writer * writer, mc_uint count) {
+    // Returns the first sector of the first free run of sectors that is long
+    // enough, or 0 if we ran out of memory or sector numbers. Grows the file
+    // if there is no such run.
+    mc_uint run_start = 2;
+    for (mc_uint sector = 2; sector < writer->sector_count; sector++) {
+        if (is_sector_used(writer, sector)) {
+            run_start = sector + 1;
+        } else if (sector + 1 - run_start == count) {
+            mark_sectors(writer, run_start, count, 1);
+            return run_start;
+        }
+    }
+
+    // the last run continues past the end of the file
+    mc_uint new_sector_count = run_start + count;
+    if (new_sector_count > 0xffffff) {
+        return 0;
+    }
+    if (!grow_used_sectors(writer, new_sector_count)) {
+        return 0;
+    }
+    writer->sector_count = new_sector_count;
+    mark_sectors(writer, run_start, count, 1);
+    return run_start;
+}
+
+static int
+is_valid_location(region_writer * writer, mc_uint loc) {
+    mc_uint sector_offset = loc >> 8;
+    mc_uint sector_count = loc & 0xff;
+    return sector_offset >= 2 && sector_count != 0
+            && sector_offset + sector_count <= writer->sector_count;
+}
+
+static int
+open_region_writer(region_writer * writer) {
+    // Returns whether the region file is ready for writing.
+    unsigned char file_name[64];
+    sprintf((void *) file_name, "world/blaze/r.%d.%d.blz",
+            writer->region_x, writer->region_z);
+    if (unlink((void *) file_name) == 0) {
+        logs("Removed outdated native region file %s", file_name);
+    } else if (errno != ENOENT) {
+        logs_errno("Failed to remove outdated native region file: %s");
+        return 0;
+    }
+
+    if (mkdir("world/region", 0755) == -1 && errno != EEXIST) {
+        logs_errno("Failed to create world/region: %s");
+        return 0;
+    }
+
+    sprintf((void *) file_name, "world/region/r.%d.%d.mca",
+            writer->region_x, writer->region_z);
+    int fd = open((void *) file_name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        logs_errno("Failed to open region file for writing: %s");
+        return 0;
+    }
+
+    struct stat region_stat;
+    if (fstat(fd, &region_stat)) {
+        logs_errno("Failed to get region file stat: %s");
+        close(fd);
+        return 0;
+    }
+
+    unsigned char header[8192] = {0};
+    if (region_stat.st_size < 8192) {
+        // new region file, or one without a complete header
+        if (!write_fully(fd, header, 8192, 0)) {
+            logs_errno("Failed to write region file header: %s");
+            close(fd);
+            return 0;
+        }
+    } else if (!read_fully(fd, header, 4096, 0)) {
+        logs_errno("Failed to read region file header: %s");
+        close(fd);
+        return 0;
+    }
+
+    writer->sector_count = MAX(2, (region_stat.st_size + 4095) >> 12);
+    if (!grow_used_sectors(writer, writer->sector_count)) {
+        logs("Failed to allocate sector map");
+        close(fd);
+        return 0;
+    }
+    memset(writer->used_sectors, 0, writer->used_sector_capacity / 8);
+    mark_sectors(writer, 0, 2, 1);
+
+    buffer_cursor header_cursor = {.buf = header, .limit = 4096};
+    for (int i = 0; i < 1024; i++) {
+        mc_uint loc = net_read_uint(&header_cursor);
+        writer->locations[i] = loc;
+        // Invalid locations are ignored. Their sectors may be handed out
+        // again.
+        if (is_valid_location(writer, loc)) {
+            mark_sectors(writer, loc >> 8, loc & 0xff, 1);
+        }
+    }
+
+    writer->fd = fd;
+    return 1;
+}
+
+static region_writer *
+get_region_writer(int region_x, int region_z) {
+    region_writer_use_counter++;
+
+    region_writer * lru = region_writers;
+    for (int i = 0; i < REGION_WRITER_CACHE_SIZE; i++) {
+        region_writer * writer = region_writers + i;
+        if (writer->last_use != 0 && writer->region_x == region_x
+                && writer->region_z == region_z) {
+            writer->last_use = region_writer_use_counter;
+            return writer;
+        }
+        if (writer->last_use < lru->last_use) {
+            lru = writer;
+        }
+    }
+
+    if (lru->last_use != 0 && lru->fd != -1) {
+        close(lru->fd);
+    }
+
+    region_writer * writer = lru;
+    writer->region_x = region_x;
+    writer->region_z = region_z;
+    writer->fd = -1;
+    writer->last_use = region_writer_use_counter;
+    // Retry opening the file on the next save if it fails, since it may
+    // be a temporary problem.
+    if (!open_region_writer(writer)) {
+        writer->last_use = 0;
+    }
+    return writer;
+}
+
+static int
+read_old_chunk_nbt(region_writer * writer, int index,
+        memory_arena * scratch_arena, buffer_cursor * nbt) {
+    // Returns whether the region file has a readable chunk at the index.
+    mc_uint loc = writer->locations[index];
+    if (!is_valid_location(writer, loc)) {
+        return 0;
+    }
+
+    mc_uint sector_count = loc & 0xff;
+    buffer_cursor cursor = {
+        .buf = alloc_in_arena(scratch_arena, sector_count << 12),
+        .limit = sector_count << 12
+    };
+    if (!read_fully(writer->fd, cursor.buf, cursor.limit,
+            (mc_long) (loc >> 8) << 12)) {
+        logs_errno("Failed to read old chunk: %s");
+        return 0;
+    }
+
+    mc_uint size_in_bytes = net_read_uint(&cursor);
+    if (size_in_bytes > cursor.limit - cursor.index || size_in_bytes < 1) {
+        return 0;
+    }
+    cursor.limit = cursor.index + size_in_bytes;
+    mc_ubyte storage_type = net_read_ubyte(&cursor);
+
+    int format;
+    if (storage_type == 1) {
+        format = COMPRESSION_FORMAT_GZIP;
+    } else if (storage_type == 2) {
+        format = COMPRESSION_FORMAT_ZLIB;
+    } else {
+        return 0;
+    }
+
+    int max_uncompressed_size = 2 * (1 << 20);
+    *nbt = (buffer_cursor) {
+        .buf = alloc_in_arena(scratch_arena, max_uncompressed_size)
+    };
+    int uncompressed_size = decompress_data(cursor.buf + cursor.index,
+            cursor.limit - cursor.index, nbt->buf, max_uncompressed_size,
+            format);
+    if (uncompressed_size == -1) {
+        return 0;
+    }
+    nbt->limit = uncompressed_size;
+    return 1;
+}
+
+static int
+has_current_data_version(buffer_cursor cursor) {
+    if (net_read_ubyte(&cursor) != NBT_TAG_COMPOUND) {
+        return 0;
+    }
+    nbt_read_string_value(&cursor);
+
+    for (;;) {
+        net_string key;
+        mc_ubyte tag = nbt_read_compound_entry(&cursor, &key);
+        if (tag == NBT_TAG_END) {
+            return 0;
+        }
+        if (tag == NBT_TAG_INT
+                && net_string_equal(key, NET_STRING("DataVersion"))) {
+            return net_read_int(&cursor) == SERVER_WORLD_VERSION;
+        }
+        nbt_skip_value(tag, &cursor);
+    }
+}
+
+static void
+write_palette_entry(buffer_cursor * out, mc_ushort block_state) {
+    int block_type = serv->block_type_by_state[block_state];
+    block_properties * props = serv->block_properties_table + block_type;
+
+    nbt_write_key(out, NBT_TAG_STRING, NET_STRING("Name"));
+    nbt_write_string(out, get_resource_loc(block_type,
+            &serv->block_resource_table));
+
+    if (props->property_count > 0) {
+        // the last property changes fastest between block states
+        int val_indices[ARRAY_SIZE(props->property_specs)];
+        int stride = block_state - props->base_state;
+        for (int propi = props->property_count - 1; propi >= 0; propi--) {
+            block_property_spec * prop_spec = serv->block_property_specs
+                    + props->property_specs[propi];
+            val_indices[propi] = stride % prop_spec->value_count;
+            stride /= prop_spec->value_count;
+        }
+
+        nbt_write_key(out, NBT_TAG_COMPOUND, NET_STRING("Properties"));
+        for (int propi = 0; propi < props->property_count; propi++) {
+            block_property_spec * prop_spec = serv->block_property_specs
+                    + props->property_specs[propi];
+            unsigned char * tape = prop_spec->tape;
+            net_string prop_name = {.size = tape[0], .ptr = tape + 1};
+            tape += 1 + tape[0];
+            for (int i = 0; i < val_indices[propi]; i++) {
+                tape += 1 + tape[0];
+            }
+            net_string prop_val = {.size = tape[0], .ptr = tape + 1};
+
+            nbt_write_key(out, NBT_TAG_STRING, prop_name);
+            nbt_write_string(out, prop_val);
+        }
+        net_write_ubyte(out, NBT_TAG_END);
+    }
+
+    net_write_ubyte(out, NBT_TAG_END);
+}
+
+static void
+write_section(buffer_cursor * out, int section_y, mc_ushort * block_states,
+        mc_ushort * palette_map) {
+    // The palette map maps block states to their palette index plus 1, and
+    // is all 0 before and after this function. Only block states that occur
+    // in the section end up in the palette.
+    mc_ushort palette[4096];
+    int palette_size = 0;
+    for (int i = 0; i < 4096; i++) {
+        mc_ushort block_state = block_states[i];
+        if (palette_map[block_state] == 0) {
+            palette[palette_size] = block_state;
+            palette_size++;
+            palette_map[block_state] = palette_size;
+        }
+    }
+
+    // the vanilla server derives the number of bits from the palette size
+    int bits_per_id = 4;
+    while ((1 << bits_per_id) < palette_size) {
+        bits_per_id++;
+    }
+    int ids_per_long = 64 / bits_per_id;
+    int long_count = (4096 + ids_per_long - 1) / ids_per_long;
+
+    nbt_write_key(out, NBT_TAG_BYTE, NET_STRING("Y"));
+    net_write_byte(out, section_y);
+
+    nbt_write_key(out, NBT_TAG_LIST, NET_STRING("Palette"));
+    net_write_ubyte(out, NBT_TAG_COMPOUND);
+    net_write_uint(out, palette_size);
+    for (int i = 0; i < palette_size; i++) {
+        write_palette_entry(out, palette[i]);
+    }
+
+    nbt_write_key(out, NBT_TAG_LONG_ARRAY, NET_STRING("BlockStates"));
+    net_write_uint(out, long_count);
+    int j = 0;
+    for (int longi = 0; longi < long_count; longi++) {
+        mc_ulong entry = 0;
+        int end = MIN(4096, j + ids_per_long);
+        for (int shift = 0; j < end; j++, shift += bits_per_id) {
+            entry |= (mc_ulong) (palette_map[block_states[j]] - 1) << shift;
+        }
+        net_write_ulong(out, entry);
+    }
+
+    net_write_ubyte(out, NBT_TAG_END);
+
+    for (int i = 0; i < palette_size; i++) {
+        palette_map[palette[i]] = 0;
+    }
+}
+
+static void
+copy_compound_entry(buffer_cursor * in, int entry_start, mc_ubyte tag,
+        buffer_cursor * out) {
+    // the cursor must be at the value of the entry
+    nbt_skip_value(tag, in);
+    net_write_data(out, in->buf + entry_start, in->index - entry_start);
+}
+
+static void
+write_level(buffer_cursor * out, chunk_pos pos, chunk * ch,
+        buffer_cursor * old_level, mc_ushort * palette_map) {
+    // Writes the entries of the level compound. If there is an old level
+    // compound, the entries we don't replace are copied from it.
+    if (old_level != NULL) {
+        for (;;) {
+            int entry_start = old_level->index;
+            net_string key;
+            mc_ubyte tag = nbt_read_compound_entry(old_level, &key);
+            if (tag == NBT_TAG_END) {
+                break;
+            }
+
+            if (net_string_equal(key, NET_STRING("Sections"))
+                    || net_string_equal(key, NET_STRING("Status"))
+                    || net_string_equal(key, NET_STRING("isLightOn"))
+                    || net_string_equal(key, NET_STRING("Heightmaps"))
+                    || net_string_equal(key, NET_STRING("xPos"))
+                    || net_string_equal(key, NET_STRING("zPos"))) {
+                nbt_skip_value(tag, old_level);
+            } else {
+                copy_compound_entry(old_level, entry_start, tag, out);
+            }
+        }
+    }
+
+    nbt_write_key(out, NBT_TAG_INT, NET_STRING("xPos"));
+    net_write_int(out, pos.x);
+    nbt_write_key(out, NBT_TAG_INT, NET_STRING("zPos"));
+    net_write_int(out, pos.z);
+    nbt_write_key(out, NBT_TAG_STRING, NET_STRING("Status"));
+    nbt_write_string(out, NET_STRING("full"));
+    // our changes invalidate the stored light
+    nbt_write_key(out, NBT_TAG_BYTE, NET_STRING("isLightOn"));
+    net_write_byte(out, 0);
+
+    nbt_write_key(out, NBT_TAG_LIST, NET_STRING("Sections"));
+    net_write_ubyte(out, NBT_TAG_COMPOUND);
+    // the section count is filled in once we know it
+    int section_count_index = out->index;
+    net_write_uint(out, 0);
+    int section_count = 0;
+
+    mc_ushort block_states[4096];
+    for (int section_y = 0; section_y < 16; section_y++) {
+        chunk_section * section = ch->sections[section_y];
+        if (section != NULL) {
+            unpack_chunk_section(section, block_states);
+        } else if (ch->uniform_section_states[section_y] != 0) {
+            for (int i = 0; i < 4096; i++) {
+                block_states[i] = ch->uniform_section_states[section_y];
+            }
+        } else {
+            // sections with only air aren't stored
+            continue;
+        }
+
+        write_section(out, section_y, block_states, palette_map);
+        section_count++;
+    }
+
+    if (!out->error) {
+        buffer_cursor count_cursor = *out;
+        count_cursor.index = section_count_index;
+        net_write_uint(&count_cursor, section_count);
+    }
+
+    net_write_ubyte(out, NBT_TAG_END);
+}
+
+static void
+write_chunk_nbt(buffer_cursor * out, chunk_pos pos, chunk * ch,
+        buffer_cursor * old_nbt, mc_ushort * palette_map) {
+    nbt_write_key(out, NBT_TAG_COMPOUND, NET_STRING(""));
+    nbt_write_key(out, NBT_TAG_INT, NET_STRING("DataVersion"));
+    net_write_int(out, SERVER_WORLD_VERSION);
+
+    int wrote_level = 0;
+    if (old_nbt != NULL) {
+        // skip root tag and key
+        net_read_ubyte(old_nbt);
+        nbt_read_string_value(old_nbt);
+
+        for (;;) {
+            int entry_start = old_nbt->index;
+            net_string key;
+            mc_ubyte tag = nbt_read_compound_entry(old_nbt, &key);
+            if (tag == NBT_TAG_END) {
+                break;
+            }
+
+            if (net_string_equal(key, NET_STRING("DataVersion"))) {
+                nbt_skip_value(tag, old_nbt);
+            } else if (net_string_equal(key, NET_STRING("Level"))) {
+                if (tag == NBT_TAG_COMPOUND && !wrote_level) {
+                    nbt_write_key(out, NBT_TAG_COMPOUND, NET_STRING("Level"));
+                    write_level(out, pos, ch, old_nbt, palette_map);
+                    wrote_level = 1;
+                } else {
+                    nbt_skip_value(tag, old_nbt);
+                }
+            } else {
+                copy_compound_entry(old_nbt, entry_start, tag, out);
+            }
+        }
+    }
+
+    if (!wrote_level) {
+        nbt_write_key(out, NBT_TAG_COMPOUND, NET_STRING("Level"));
+        write_level(out, pos, ch, NULL, palette_map);
+    }
+
+    net_write_ubyte(out, NBT_TAG_END);
+}
+
+static int
+save_chunk(chunk_save_request * request, chunk * ch,
+        mc_ushort * palette_map, memory_arena * scratch_arena) {
+    // Returns the number of bytes written to the region file, or -1 if the
+    // chunk couldn't be saved.
+    chunk_pos pos = request->pos;
+    region_writer * writer = get_region_writer(pos.x >> 5, pos.z >> 5);
+    if (writer->fd == -1) {
+        return -1;
+    }
+
+    *ch = (chunk) {0};
+    if (!decode_native_chunk(request->record, request->record_size, ch)) {
+        logs("Failed to decode chunk snapshot");
+        for (int section_y = 0; section_y < 16; section_y++) {
+            if (ch->sections[section_y] != NULL) {
+                free_chunk_section(ch->sections[section_y]);
+            }
+        }
+        return -1;
+    }
+
+    int index = ((pos.z & 0x1f) << 5) | (pos.x & 0x1f);
+    buffer_cursor old_nbt = {0};
+    int has_old_nbt = read_old_chunk_nbt(writer, index, scratch_arena,
+            &old_nbt) && has_current_data_version(old_nbt);
+
+    int max_nbt_size = 2 * (1 << 20);
+    buffer_cursor nbt = {
+        .buf = alloc_in_arena(scratch_arena, max_nbt_size),
+        .limit = max_nbt_size
+    };
+    write_chunk_nbt(&nbt, pos, ch, has_old_nbt ? &old_nbt : NULL,
+            palette_map);
+
+    for (int section_y = 0; section_y < 16; section_y++) {
+        if (ch->sections[section_y] != NULL) {
+            free_chunk_section(ch->sections[section_y]);
+        }
+    }
+
+    if (nbt.error || old_nbt.error) {
+        logs("Failed to write chunk NBT");
+        return -1;
+    }
+
+    // chunk data starts with its size and compression method, and is padded
+    // to whole sectors
+    int max_compressed_size = compress_bound(nbt.index);
+    unsigned char * data = alloc_in_arena(scratch_arena,
+            5 + max_compressed_size + 4096);
+    int compressed_size = compress_chunk_data(nbt.buf, nbt.index,
+            data + 5, max_compressed_size);
+    if (compressed_size == -1) {
+        logs("Failed to compress chunk");
+        return -1;
+    }
+
+    buffer_cursor data_cursor = {.buf = data, .limit = 5};
+    net_write_uint(&data_cursor, compressed_size + 1);
+    net_write_ubyte(&data_cursor, 2);
+
+    int data_size = 5 + compressed_size;
+    mc_uint sector_count = (data_size + 4095) >> 12;
+    if (sector_count > 0xff) {
+        logs("Chunk too large for region file");
+        return -1;
+    }
+    memset(data + data_size, 0, (sector_count << 12) - data_size);
+
+    mc_uint sector_offset = alloc_sectors(writer, sector_count);
+    if (sector_offset == 0) {
+        logs("Failed to allocate region file sectors");
+        return -1;
+    }
+
+    unsigned char header_entries[8];
+    mc_uint loc = (sector_offset << 8) | sector_count;
+    buffer_cursor header_cursor = {.buf = header_entries, .limit = 8};
+    net_write_uint(&header_cursor, loc);
+    net_write_uint(&header_cursor, time(NULL));
+
+    if (!write_fully(writer->fd, data, sector_count << 12,
+            (mc_long) sector_offset << 12)
+            || !sync_data(writer->fd)
+            || !write_fully(writer->fd, header_entries, 4, index * 4)
+            || !write_fully(writer->fd, header_entries + 4, 4,
+            4096 + index * 4)
+            || !sync_data(writer->fd)) {
+        logs_errno("Failed to write region file: %s");
+        mark_sectors(writer, sector_offset, sector_count, 0);
+        return -1;
+    }
+
+    mc_uint old_loc = writer->locations[index];
+    if (is_valid_location(writer, old_loc)) {
+        mark_sectors(writer, old_loc >> 8, old_loc & 0xff, 0);
+    }
+    writer->locations[index] = loc;
+
+    bump_region_file_version(writer->region_x, writer->region_z);
+    return sector_count << 12;
+}
+
+static void *
+run_chunk_saver_thread(void * arg) {
+#if defined(__linux__)
+    // same as the chunk loader threads
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+#endif
+
+    memory_arena scratch_arena = {
+        .ptr = malloc(CHUNK_SAVER_SCRATCH_SIZE),
+        .size = CHUNK_SAVER_SCRATCH_SIZE
+    };
+    // chunk the snapshots are decoded into
+    chunk * ch = malloc(sizeof *ch);
+    mc_ushort * palette_map = calloc(serv->actual_block_state_count,
+            sizeof *palette_map);
+    if (scratch_arena.ptr == NULL || ch == NULL || palette_map == NULL) {
+        logs_errno("Failed to allocate chunk saver memory: %s");
+        exit(1);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&chunk_saver_mutex);
+        while (save_queue_head == save_queue_tail) {
+            pthread_cond_wait(&chunk_saver_cond, &chunk_saver_mutex);
+        }
+        chunk_save_request request = save_queue[save_queue_head
+                & (MAX_CHUNK_SAVES_IN_FLIGHT - 1)];
+        save_queue_head++;
+        pthread_mutex_unlock(&chunk_saver_mutex);
+
+        long long start_time = program_nano_time();
+        scratch_arena.index = 0;
+        int saved_bytes = save_chunk(&request, ch, palette_map,
+                &scratch_arena);
+        free(request.record);
+        long long end_time = program_nano_time();
+
+        pthread_mutex_lock(&chunk_saver_mutex);
+        chunk_save_result * res = save_completion_queue
+                + (save_completion_queue_tail
+                & (MAX_CHUNK_SAVES_IN_FLIGHT - 1));
+        *res = (chunk_save_result) {
+            .pos = request.pos,
+            .request_time = request.request_time,
+            .save_time = end_time - start_time,
+            .dirty_sections = request.dirty_sections,
+            .success = (saved_bytes != -1),
+            .saved_bytes = MAX(0, saved_bytes)
+        };
+        save_completion_queue_tail++;
+        pthread_cond_signal(&chunk_saved_cond);
+        pthread_mutex_unlock(&chunk_saver_mutex);
+    }
+
+    return NULL;
+}
+
+void
+start_chunk_saver_thread(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    if (pthread_attr_init(&attr) != 0
+            || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
+            || pthread_create(&thread, &attr, run_chunk_saver_thread, NULL) != 0) {
+        logs("Failed to start chunk saver thread");
+        exit(1);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+int
+request_chunk_save(chunk * ch) {
+    // Returns whether the save was requested. Fails if there are too many
+    // saves in flight. The chunk stays in the chunk map until the save is
+    // finished.
+    assert(ch->flags & CHUNK_LOADED);
+    assert(!(ch->flags & CHUNK_SAVE_IN_FLIGHT));
+    if (chunk_saves_in_flight == MAX_CHUNK_SAVES_IN_FLIGHT) {
+        return 0;
+    }
+
+    int record_size = get_native_chunk_size(ch);
+    unsigned char * record = malloc(record_size);
+    if (record == NULL) {
+        return 0;
+    }
+    write_native_chunk(ch, record);
+
+    chunk_save_request request = {
+        .pos = ch->pos,
+        .request_time = program_nano_time(),
+        .dirty_sections = ch->dirty_sections,
+        .record_size = record_size,
+        .record = record
+    };
+    ch->dirty_sections = 0;
+    ch->flags |= CHUNK_SAVE_IN_FLIGHT;
+    chunk_saves_in_flight++;
+
+    pthread_mutex_lock(&chunk_saver_mutex);
+    save_queue[save_queue_tail & (MAX_CHUNK_SAVES_IN_FLIGHT - 1)] = request;
+    save_queue_tail++;
+    pthread_cond_signal(&chunk_saver_cond);
+    pthread_mutex_unlock(&chunk_saver_mutex);
+    return 1;
+}
+
+int
+wait_for_chunk_saves(void) {
+    // Blocks until all saves in flight have completed and returns how many
+    // there were. Their results still need to be processed by
+    // finish_chunk_saves.
+    pthread_mutex_lock(&chunk_saver_mutex);
+    while (save_completion_queue_tail - save_completion_queue_head
+            != chunk_saves_in_flight) {
+        pthread_cond_wait(&chunk_saved_cond, &chunk_saver_mutex);
+    }
+    pthread_mutex_unlock(&chunk_saver_mutex);
+    return chunk_saves_in_flight;
+}
+
+int
+finish_chunk_saves(void) {
+    // Returns the number of saves that failed.
+    pthread_mutex_lock(&chunk_saver_mutex);
+    unsigned tail = save_completion_queue_tail;
+    pthread_mutex_unlock(&chunk_saver_mutex);
+
+    long long now = program_nano_time();
+    int completed = 0;
+    int failed = 0;
+
+    for (; save_completion_queue_head != tail; save_completion_queue_head++) {
+        chunk_save_result * res = save_completion_queue
+                + (save_completion_queue_head
+                & (MAX_CHUNK_SAVES_IN_FLIGHT - 1));
+        completed++;
+        add_profiler_counter("chunk save latency micros",
+                (now - res->request_time) / 1000);
+        add_profiler_counter("chunk save micros", res->save_time / 1000);
+        add_profiler_counter("chunk save bytes", res->saved_bytes);
+
+        // chunks with saves in flight aren't unloaded
+        chunk * ch = get_chunk_if_available(res->pos);
+        assert(ch != NULL);
+        ch->flags &= ~CHUNK_SAVE_IN_FLIGHT;
+
+        if (!res->success) {
+            // try again later
+            failed++;
+            if (ch->dirty_sections == 0) {
+                ch->dirty_tick = serv->current_tick;
+            }
+            ch->dirty_sections |= res->dirty_sections;
+        }
+    }
+
+    chunk_saves_in_flight -= completed;
+    add_profiler_counter("chunk saves completed", completed);
+    add_profiler_counter("chunk saves failed", failed);
+    add_profiler_counter("chunk saves in flight", chunk_saves_in_flight);
+    return failed;
+}
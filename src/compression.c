@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdalign.h>
+#include <zlib.h>
+#include "shared.h"
+
+#if LIBDEFLATE_ENABLED
+#include <libdeflate.h>
+#endif
+
+// Compression of packets and decompression of packets and chunks. All data
+// is compressed and decompressed in a single pass, since we always have the
+// full input and a large enough output buffer at hand.
+//
+// Every thread that compresses or decompresses data gets its own compressors
+// and decompressor, which are set up the first time they are used. Packets
+// are compressed by several job threads at once. All compressors produce
+// zlib data, so the same compression bound and decompressor apply.
+
+#if LIBDEFLATE_ENABLED
+
+static _Thread_local struct libdeflate_compressor * compressor;
+static _Thread_local struct libdeflate_compressor * fast_compressor;
+static _Thread_local struct libdeflate_compressor * chunk_compressor;
+static _Thread_local struct libdeflate_decompressor * decompressor;
+
+static struct libdeflate_compressor *
+get_compressor(struct libdeflate_compressor * * compressor, int level) {
+    if (*compressor == NULL) {
+        *compressor = libdeflate_alloc_compressor(level);
+        if (*compressor == NULL) {
+            logs("Failed to set up libdeflate compressor");
+            exit(1);
+        }
+    }
+    return *compressor;
+}
+
+int
+compress_bound(int size) {
+    // bounds don't depend on the compressor, so any thread can call this
+    return libdeflate_zlib_compress_bound(NULL, size);
+}
+
+int
+compress_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    size_t res = libdeflate_zlib_compress(
+            get_compressor(&compressor, PACKET_COMPRESSION_LEVEL),
+            in, in_size, out, out_size);
+    if (res == 0) {
+        return -1;
+    }
+    return res;
+}
+
+int
+compress_data_fast(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    size_t res = libdeflate_zlib_compress(
+            get_compressor(&fast_compressor, FAST_COMPRESSION_LEVEL),
+            in, in_size, out, out_size);
+    if (res == 0) {
+        return -1;
+    }
+    return res;
+}
+
+int
+compress_chunk_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    size_t res = libdeflate_zlib_compress(
+            get_compressor(&chunk_compressor, CHUNK_COMPRESSION_LEVEL),
+            in, in_size, out, out_size);
+    if (res == 0) {
+        return -1;
+    }
+    return res;
+}
+
+int
+decompress_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size, int format) {
+    if (decompressor == NULL) {
+        decompressor = libdeflate_alloc_decompressor();
+        if (decompressor == NULL) {
+            logs("Failed to set up libdeflate decompressor");
+            exit(1);
+        }
+    }
+
+    size_t in_used;
+    size_t out_used;
+    enum libdeflate_result res;
+    if (format == COMPRESSION_FORMAT_GZIP) {
+        res = libdeflate_gzip_decompress_ex(decompressor, in, in_size,
+                out, out_size, &in_used, &out_used);
+    } else {
+        res = libdeflate_zlib_decompress_ex(decompressor, in, in_size,
+                out, out_size, &in_used, &out_used);
+    }
+    if (res != LIBDEFLATE_SUCCESS || in_used != in_size) {
+        return -1;
+    }
+    return out_used;
+}
+
+#else
+
+// Every zlib stream needs a few hundred KB of state, which zlib normally
+// allocates when the stream is set up and frees when it ends. Instead of
+// doing that for every packet, we keep the streams around and reset them in
+// between uses. Their state lives in arenas that are allocated once.
+static _Thread_local z_stream deflater;
+static _Thread_local memory_arena deflater_arena;
+static _Thread_local z_stream fast_deflater;
+static _Thread_local memory_arena fast_deflater_arena;
+static _Thread_local z_stream chunk_deflater;
+static _Thread_local memory_arena chunk_deflater_arena;
+static _Thread_local z_stream inflater;
+static _Thread_local memory_arena inflater_arena;
+
+static voidpf
+alloc_zlib_memory(voidpf opaque, uInt items, uInt size) {
+    memory_arena * arena = opaque;
+    mc_int align = alignof (max_align_t);
+    size_t needed = (size_t) items * size + align;
+    if (needed > arena->size - arena->index) {
+        return Z_NULL;
+    }
+    return alloc_in_arena(arena, items * size);
+}
+
+static void
+free_zlib_memory(voidpf opaque, voidpf address) {
+    // arena memory is never freed
+}
+
+static void
+init_zlib_arena(memory_arena * arena, int size) {
+    arena->size = size;
+    arena->ptr = calloc(arena->size, 1);
+    if (arena->ptr == NULL) {
+        logs_errno("Failed to allocate zlib arena: %s");
+        exit(1);
+    }
+}
+
+static z_stream *
+get_deflater(z_stream * zstream, memory_arena * arena, int level) {
+    if (arena->ptr == NULL) {
+        // enough for a deflate stream with default settings (about 270 KB)
+        init_zlib_arena(arena, 1 << 19);
+
+        *zstream = (z_stream) {
+            .zalloc = alloc_zlib_memory,
+            .zfree = free_zlib_memory,
+            .opaque = arena
+        };
+        if (deflateInit(zstream, level) != Z_OK) {
+            logs("Failed to set up deflater");
+            exit(1);
+        }
+    }
+    return zstream;
+}
+
+static void
+init_inflater(void) {
+    // enough for an inflate stream with a full window (about 40 KB)
+    init_zlib_arena(&inflater_arena, 1 << 16);
+
+    inflater = (z_stream) {
+        .zalloc = alloc_zlib_memory,
+        .zfree = free_zlib_memory,
+        .opaque = &inflater_arena
+    };
+    // Use the largest window size, so we can inflate data compressed with
+    // any window size. Otherwise the window size of the first stream would
+    // stick around after resetting. The 32 enables detection of both zlib
+    // and gzip headers.
+    if (inflateInit2(&inflater, 32 + 15) != Z_OK) {
+        logs("Failed to set up inflater");
+        exit(1);
+    }
+}
+
+int
+compress_bound(int size) {
+    // doesn't touch the deflater, so any thread can call this
+    return compressBound(size);
+}
+
+static int
+deflate_data(z_stream * zstream, unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    if (deflateReset(zstream) != Z_OK) {
+        return -1;
+    }
+
+    zstream->next_in = in;
+    zstream->avail_in = in_size;
+    zstream->next_out = out;
+    zstream->avail_out = out_size;
+
+    if (deflate(zstream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return zstream->total_out;
+}
+
+int
+compress_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    return deflate_data(get_deflater(&deflater, &deflater_arena,
+            PACKET_COMPRESSION_LEVEL), in, in_size, out, out_size);
+}
+
+int
+compress_data_fast(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    return deflate_data(get_deflater(&fast_deflater, &fast_deflater_arena,
+            FAST_COMPRESSION_LEVEL), in, in_size, out, out_size);
+}
+
+int
+compress_chunk_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size) {
+    return deflate_data(get_deflater(&chunk_deflater, &chunk_deflater_arena,
+            CHUNK_COMPRESSION_LEVEL), in, in_size, out, out_size);
+}
+
+int
+decompress_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size, int format) {
+    if (inflater_arena.ptr == NULL) {
+        init_inflater();
+    }
+
+    z_stream * zstream = &inflater;
+
+    if (inflateReset(zstream) != Z_OK) {
+        return -1;
+    }
+
+    zstream->next_in = in;
+    zstream->avail_in = in_size;
+    zstream->next_out = out;
+    zstream->avail_out = out_size;
+
+    if (inflate(zstream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    if (zstream->avail_in != 0) {
+        return -1;
+    }
+    return zstream->total_out;
+}
+
+#endif
@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "shared.h"
+
+// Connections that haven't joined the game yet (server list pings, logins)
+// are handled on a separate thread, so a flood of them can't slow down the
+// game. Once a player has logged in, the socket is handed over to the add
+// joined players phase of the tick through a queue.
+
+// upper limit of connections being handshaken at the same time
+#define MAX_INITIAL_CONNECTIONS (1024)
+
+// Connections must finish their handshake within this time. This gets rid of
+// half-open connections and clients that send data really slowly.
+#define INITIAL_CONNECTION_TIMEOUT_MILLIS (10000)
+
+#define INITIAL_CONNECTION_IN_USE ((unsigned) (1 << 0))
+
+enum initial_protocol_state {
+    PROTOCOL_HANDSHAKE,
+    PROTOCOL_AWAIT_STATUS_REQUEST,
+    PROTOCOL_AWAIT_PING_REQUEST,
+    PROTOCOL_AWAIT_HELLO,
+    PROTOCOL_JOIN_WHEN_SENT,
+};
+
+typedef struct {
+    int sock;
+    unsigned flags;
+    long long deadline;
+
+    // Should be large enough to:
+    //
+    //  1. Receive a client intention (handshake) packet, status request and
+    //     ping request packet all in one go and store them together in the
+    //     buffer.
+    //
+    //  2. Receive a client intention packet and hello packet and store them
+    //     together inside the receive buffer.
+    // @TODO(traks) can maybe be a bit smaller
+    unsigned char rec_buf[300];
+    int rec_cursor;
+
+    // @TODO(traks) figure out appropriate size
+    unsigned char send_buf[2048];
+    int send_cursor;
+
+    int protocol_state;
+    unsigned char username[16];
+    int username_size;
+} initial_connection;
+
+// Only touched by the handshake thread. The table grows when it runs out of
+// free slots, up to the maximum number of initial connections.
+static initial_connection * initial_connections;
+static int initial_connection_table_size;
+static int initial_connection_count;
+static int * free_connection_slots;
+static int free_connection_slot_count;
+
+static int listener_sock;
+static int handshake_watcher;
+static unsigned random_seed;
+// Set if some connection couldn't send all its data or couldn't join yet.
+// We only get notified about incoming data, so these need to be retried.
+static int needs_send_retry;
+static int needs_accept_retry;
+
+// Single producer (handshake thread), single consumer (add joined players
+// phase) queue of connections ready to join. The phase may run on any job
+// thread, but the phase graph never runs it alongside itself, so there is
+// still a single consumer. The producer owns the tail and the consumer owns
+// the head. Must be a power of 2 in size.
+static pending_join join_queue[64];
+static atomic_uint join_queue_head;
+static atomic_uint join_queue_tail;
+
+// Copy of the player list made by the update tab list phase for status
+// responses.
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int status_player_count;
+static unsigned char status_usernames[MAX_PLAYERS][16];
+static int status_username_sizes[MAX_PLAYERS];
+
+void
+update_server_status(void) {
+    pthread_mutex_lock(&status_mutex);
+
+    status_player_count = 0;
+    for (int i = 0; i < serv->tab_list_size; i++) {
+        entity_base * entity = resolve_entity(serv->tab_list[i]);
+        if (entity->type != ENTITY_PLAYER) {
+            continue;
+        }
+        int j = status_player_count;
+        memcpy(status_usernames[j], entity->player.username,
+                entity->player.username_size);
+        status_username_sizes[j] = entity->player.username_size;
+        status_player_count++;
+    }
+
+    pthread_mutex_unlock(&status_mutex);
+}
+
+int
+pop_pending_join(pending_join * join) {
+    unsigned head = atomic_load_explicit(&join_queue_head,
+            memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&join_queue_tail,
+            memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+
+    *join = join_queue[head & (ARRAY_SIZE(join_queue) - 1)];
+    atomic_store_explicit(&join_queue_head, head + 1, memory_order_release);
+    return 1;
+}
+
+static int
+join_queue_has_room(void) {
+    unsigned head = atomic_load_explicit(&join_queue_head,
+            memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&join_queue_tail,
+            memory_order_relaxed);
+    return tail - head < ARRAY_SIZE(join_queue);
+}
+
+static void
+push_pending_join(pending_join * join) {
+    unsigned tail = atomic_load_explicit(&join_queue_tail,
+            memory_order_relaxed);
+    join_queue[tail & (ARRAY_SIZE(join_queue) - 1)] = *join;
+    atomic_store_explicit(&join_queue_tail, tail + 1, memory_order_release);
+}
+
+static void
+free_initial_connection(int index) {
+    initial_connection * init_con = initial_connections + index;
+    init_con->flags = 0;
+    initial_connection_count--;
+    free_connection_slots[free_connection_slot_count] = index;
+    free_connection_slot_count++;
+}
+
+static void
+close_initial_connection(int index) {
+    close(initial_connections[index].sock);
+    free_initial_connection(index);
+}
+
+static int
+grow_initial_connection_table(void) {
+    int old_size = initial_connection_table_size;
+    int new_size = MIN(MAX(2 * old_size, 32), MAX_INITIAL_CONNECTIONS);
+    if (new_size == old_size) {
+        return 0;
+    }
+
+    initial_connection * new_connections = realloc(initial_connections,
+            new_size * sizeof *new_connections);
+    if (new_connections == NULL) {
+        return 0;
+    }
+    initial_connections = new_connections;
+
+    int * new_free_slots = realloc(free_connection_slots,
+            new_size * sizeof *new_free_slots);
+    if (new_free_slots == NULL) {
+        return 0;
+    }
+    free_connection_slots = new_free_slots;
+
+    for (int i = new_size - 1; i >= old_size; i--) {
+        initial_connections[i].flags = 0;
+        free_connection_slots[free_connection_slot_count] = i;
+        free_connection_slot_count++;
+    }
+    initial_connection_table_size = new_size;
+    return 1;
+}
+
+static void
+accept_initial_connections(long long now) {
+    for (;;) {
+        int accepted = accept(listener_sock, NULL, NULL);
+        if (accepted == -1) {
+            // If something other than running out of pending connections went
+            // wrong (e.g. the file descriptor limit was hit), we won't get
+            // another notification for connections that are already pending,
+            // so try again in a bit.
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                logs_errno("Failed to accept connection: %s");
+                needs_accept_retry = 1;
+            }
+            break;
+        }
+
+        if (free_connection_slot_count == 0) {
+            if (!grow_initial_connection_table()) {
+                close(accepted);
+                continue;
+            }
+        }
+
+        int flags = fcntl(accepted, F_GETFL, 0);
+
+        if (flags == -1) {
+            close(accepted);
+            continue;
+        }
+
+        if (fcntl(accepted, F_SETFL, flags | O_NONBLOCK) == -1) {
+            close(accepted);
+            continue;
+        }
+
+        // @TODO(traks) should we lower the receive and send buffer sizes? For
+        // hanshakes/status/login they don't need to be as large as the default
+        // (probably around 200KB).
+
+        free_connection_slot_count--;
+        int new_index = free_connection_slots[free_connection_slot_count];
+        initial_connection * new_connection = initial_connections + new_index;
+
+        if (!watch_socket(handshake_watcher, accepted,
+                SOCKET_TAG_INITIAL_CONNECTION | new_index)) {
+            free_connection_slot_count++;
+            close(accepted);
+            continue;
+        }
+
+        *new_connection = (initial_connection) {0};
+        new_connection->sock = accepted;
+        new_connection->flags |= INITIAL_CONNECTION_IN_USE;
+        new_connection->deadline = now
+                + (long long) INITIAL_CONNECTION_TIMEOUT_MILLIS * 1000000;
+        initial_connection_count++;
+        logs("Created initial connection");
+    }
+}
+
+static void
+write_status_response(buffer_cursor * send_cursor) {
+    unsigned char response[2048];
+    int response_size = 0;
+
+    pthread_mutex_lock(&status_mutex);
+
+    int list_size = status_player_count;
+    int sample_size = MIN(12, list_size);
+    int sample[MAX_PLAYERS];
+    for (int i = 0; i < list_size; i++) {
+        sample[i] = i;
+    }
+
+    response_size += sprintf((char *) response + response_size,
+            "{\"version\":{\"name\":\"%s\",\"protocol\":%d},"
+            "\"players\":{\"max\":%d,\"online\":%d,\"sample\":[",
+            "1.16.4, 1.16.5", SERVER_PROTOCOL_VERSION,
+            (int) MAX_PLAYERS, (int) list_size);
+
+    for (int i = 0; i < sample_size; i++) {
+        int target = i + (rand_r(&random_seed) % (list_size - i));
+        int sampled = sample[target];
+
+        if (i > 0) {
+            response[response_size] = ',';
+            response_size += 1;
+        }
+
+        // @TODO(traks) actual UUID
+        response_size += sprintf((char *) response + response_size,
+                "{\"id\":\"01234567-89ab-cdef-0123-456789abcdef\","
+                "\"name\":\"%.*s\"}",
+                (int) status_username_sizes[sampled],
+                status_usernames[sampled]);
+
+        sample[target] = sample[i];
+    }
+
+    pthread_mutex_unlock(&status_mutex);
+
+    response_size += sprintf((char *) response + response_size,
+            "]},\"description\":{\"text\":\"Running Blaze\"}}");
+
+    int out_size = net_varint_size(0)
+            + net_varint_size(response_size)
+            + response_size;
+    net_write_varint(send_cursor, out_size);
+    net_write_varint(send_cursor, 0);
+    net_write_varint(send_cursor, response_size);
+    net_write_data(send_cursor, response, response_size);
+}
+
+// Returns 0 if the connection was closed.
+static int
+receive_initial_connection(int index) {
+    initial_connection * init_con = initial_connections + index;
+    int sock = init_con->sock;
+
+    // Edge-triggered notifications only tell us about new data, so keep
+    // reading until the socket is drained.
+    for (;;) {
+        int max_rec_size = sizeof init_con->rec_buf - init_con->rec_cursor;
+        ssize_t rec_size = recv(sock, init_con->rec_buf + init_con->rec_cursor,
+                max_rec_size, 0);
+
+        if (rec_size == 0) {
+            close_initial_connection(index);
+            return 0;
+        } else if (rec_size == -1) {
+            // EAGAIN means no data received
+            if (errno != EAGAIN) {
+                logs_errno("Couldn't receive protocol data: %s");
+                close_initial_connection(index);
+                return 0;
+            }
+            return 1;
+        }
+
+        init_con->rec_cursor += rec_size;
+
+        buffer_cursor rec_cursor = {
+            .buf = init_con->rec_buf,
+            .limit = init_con->rec_cursor
+        };
+        buffer_cursor send_cursor = {
+            .buf = init_con->send_buf,
+            .limit = sizeof init_con->send_buf,
+            .index = init_con->send_cursor
+        };
+
+        for (;;) {
+            buffer_cursor packet_cursor = rec_cursor;
+            mc_int packet_size = net_read_varint(&packet_cursor);
+
+            if (packet_cursor.error != 0) {
+                // packet size not fully received yet
+                break;
+            }
+            if (packet_size <= 0 || packet_size > sizeof init_con->rec_buf) {
+                close_initial_connection(index);
+                return 0;
+            }
+            if (packet_size > packet_cursor.limit - packet_cursor.index) {
+                // packet not fully received yet
+                break;
+            }
+
+            int packet_start = packet_cursor.index;
+            rec_cursor.index = packet_start + packet_size;
+            mc_int packet_id = net_read_varint(&packet_cursor);
+            logs("Initial packet %d", packet_id);
+
+            switch (init_con->protocol_state) {
+            case PROTOCOL_HANDSHAKE: {
+                if (packet_id != 0) {
+                    packet_cursor.error = 1;
+                }
+
+                // read client intention packet
+                mc_int protocol_version = net_read_varint(&packet_cursor);
+                net_string address = net_read_string(&packet_cursor, 255);
+                mc_ushort port = net_read_ushort(&packet_cursor);
+                mc_int next_state = net_read_varint(&packet_cursor);
+
+                if (next_state == 1) {
+                    init_con->protocol_state = PROTOCOL_AWAIT_STATUS_REQUEST;
+                } else if (next_state == 2) {
+                    if (protocol_version != SERVER_PROTOCOL_VERSION) {
+                        logs("Client protocol version %jd != %jd",
+                                (intmax_t) protocol_version,
+                                (intmax_t) SERVER_PROTOCOL_VERSION);
+                        packet_cursor.error = 1;
+                    } else {
+                        init_con->protocol_state = PROTOCOL_AWAIT_HELLO;
+                    }
+                } else {
+                    packet_cursor.error = 1;
+                }
+                break;
+            }
+            case PROTOCOL_AWAIT_STATUS_REQUEST: {
+                if (packet_id != 0) {
+                    packet_cursor.error = 1;
+                }
+
+                // read status request packet
+                // empty
+
+                write_status_response(&send_cursor);
+
+                init_con->protocol_state = PROTOCOL_AWAIT_PING_REQUEST;
+                break;
+            }
+            case PROTOCOL_AWAIT_PING_REQUEST: {
+                if (packet_id != 1) {
+                    packet_cursor.error = 1;
+                }
+
+                // read ping request packet
+                mc_ulong payload = net_read_ulong(&packet_cursor);
+
+                int out_size = net_varint_size(1) + 8;
+                net_write_varint(&send_cursor, out_size);
+                net_write_varint(&send_cursor, 1);
+                net_write_ulong(&send_cursor, payload);
+                break;
+            }
+            case PROTOCOL_AWAIT_HELLO: {
+                if (packet_id != 0) {
+                    packet_cursor.error = 1;
+                }
+
+                // read hello packet
+                net_string username = net_read_string(&packet_cursor, 16);
+                // @TODO(traks) more username validation
+                if (username.size == 0) {
+                    packet_cursor.error = 1;
+                    break;
+                }
+                memcpy(init_con->username, username.ptr, username.size);
+                init_con->username_size = username.size;
+
+                // @TODO(traks) online mode
+                // @TODO(traks) enable compression
+
+                init_con->protocol_state = PROTOCOL_JOIN_WHEN_SENT;
+                break;
+            }
+            default:
+                logs("Protocol state %d not accepting packets",
+                        init_con->protocol_state);
+                packet_cursor.error = 1;
+                break;
+            }
+
+            assert(send_cursor.error == 0);
+
+            if (packet_cursor.index != rec_cursor.index) {
+                packet_cursor.error = 1;
+            }
+
+            if (packet_cursor.error != 0) {
+                logs("Initial connection protocol error occurred");
+                close_initial_connection(index);
+                return 0;
+            }
+        }
+
+        memmove(rec_cursor.buf, rec_cursor.buf + rec_cursor.index,
+                rec_cursor.limit - rec_cursor.index);
+        init_con->rec_cursor = rec_cursor.limit - rec_cursor.index;
+
+        init_con->send_cursor = send_cursor.index;
+
+        if (rec_size < max_rec_size) {
+            // socket drained
+            return 1;
+        }
+    }
+}
+
+// Returns 0 if the connection was closed or handed over to the server.
+static int
+send_initial_connection(int index) {
+    initial_connection * init_con = initial_connections + index;
+    int sock = init_con->sock;
+
+    if (init_con->send_cursor > 0) {
+        ssize_t send_size = send(sock, init_con->send_buf,
+                init_con->send_cursor, 0);
+
+        if (send_size == -1) {
+            // EAGAIN means no data sent
+            if (errno != EAGAIN) {
+                logs_errno("Couldn't send protocol data: %s");
+                close_initial_connection(index);
+                return 0;
+            }
+            needs_send_retry = 1;
+            return 1;
+        }
+
+        memmove(init_con->send_buf, init_con->send_buf + send_size,
+                init_con->send_cursor - send_size);
+        init_con->send_cursor -= send_size;
+
+        if (init_con->send_cursor > 0) {
+            needs_send_retry = 1;
+            return 1;
+        }
+    }
+
+    if (init_con->send_cursor == 0
+            && init_con->protocol_state == PROTOCOL_JOIN_WHEN_SENT) {
+        if (!join_queue_has_room()) {
+            // the server is lagging behind, try again later
+            needs_send_retry = 1;
+            return 1;
+        }
+
+        // The server watches the socket from now on. Stop watching it
+        // before handing it over, because the server may close it (and
+        // the descriptor may be reused) at any moment afterwards.
+        if (!unwatch_socket(handshake_watcher, sock)) {
+            close_initial_connection(index);
+            return 0;
+        }
+
+        pending_join join = {.sock = sock};
+        memcpy(join.username, init_con->username, init_con->username_size);
+        join.username_size = init_con->username_size;
+        push_pending_join(&join);
+
+        free_initial_connection(index);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+update_initial_connection(int index) {
+    if (!receive_initial_connection(index)) {
+        return;
+    }
+    send_initial_connection(index);
+}
+
+static void *
+run_handshake_thread(void * arg) {
+    long long next_timeout_check = 0;
+
+    for (;;) {
+        // Wake up regularly to time out connections and to retry sends.
+        // Without readiness notifications all connections are polled, so do
+        // that at a reasonable rate.
+        int retry_sends = needs_send_retry;
+        int retry_accept = needs_accept_retry;
+        needs_send_retry = 0;
+        needs_accept_retry = 0;
+        int timeout_millis = 1000;
+        if (handshake_watcher == -1 || retry_sends || retry_accept) {
+            timeout_millis = 50;
+        }
+
+        mc_ulong tags[256];
+        int event_count = wait_for_socket_events(handshake_watcher,
+                tags, ARRAY_SIZE(tags), timeout_millis);
+        long long now = program_nano_time();
+
+        if (event_count == -1) {
+            // readiness unknown, so try all sockets
+            accept_initial_connections(now);
+
+            for (int i = 0; i < initial_connection_table_size; i++) {
+                if (initial_connections[i].flags & INITIAL_CONNECTION_IN_USE) {
+                    update_initial_connection(i);
+                }
+            }
+        } else {
+            if (retry_accept) {
+                accept_initial_connections(now);
+            }
+
+            for (int i = 0; i < event_count; i++) {
+                mc_ulong tag = tags[i];
+                mc_uint id = tag & ~SOCKET_TAG_KIND_MASK;
+
+                switch (tag & SOCKET_TAG_KIND_MASK) {
+                case SOCKET_TAG_LISTENER:
+                    accept_initial_connections(now);
+                    break;
+                case SOCKET_TAG_INITIAL_CONNECTION:
+                    // The slot may have been reused for another connection
+                    // since the event was generated. That only costs us a
+                    // spurious recv() on the new connection.
+                    if (initial_connections[id].flags & INITIAL_CONNECTION_IN_USE) {
+                        update_initial_connection(id);
+                    }
+                    break;
+                }
+            }
+
+            if (retry_sends) {
+                for (int i = 0; i < initial_connection_table_size; i++) {
+                    initial_connection * init_con = initial_connections + i;
+                    if ((init_con->flags & INITIAL_CONNECTION_IN_USE) == 0) {
+                        continue;
+                    }
+                    if (init_con->send_cursor > 0
+                            || init_con->protocol_state == PROTOCOL_JOIN_WHEN_SENT) {
+                        send_initial_connection(i);
+                    }
+                }
+            }
+        }
+
+        if (now >= next_timeout_check) {
+            for (int i = 0; i < initial_connection_table_size; i++) {
+                initial_connection * init_con = initial_connections + i;
+                if ((init_con->flags & INITIAL_CONNECTION_IN_USE)
+                        && now >= init_con->deadline) {
+                    logs("Initial connection timed out");
+                    close_initial_connection(i);
+                }
+            }
+            next_timeout_check = now + 1000000000LL;
+        }
+    }
+
+    return NULL;
+}
+
+void
+start_handshake_thread(int server_sock) {
+    listener_sock = server_sock;
+    random_seed = time(NULL);
+
+    handshake_watcher = create_socket_watcher();
+    if (handshake_watcher == -1) {
+        logs("Socket readiness notifications unavailable, polling all sockets");
+    } else if (!watch_socket(handshake_watcher, listener_sock,
+            SOCKET_TAG_LISTENER)) {
+        exit(1);
+    }
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    if (pthread_attr_init(&attr) != 0
+            || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
+            || pthread_create(&thread, &attr, run_handshake_thread, NULL) != 0) {
+        logs("Failed to start handshake thread");
+        exit(1);
+    }
+    pthread_attr_destroy(&attr);
+}
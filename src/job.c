@@ -0,0 +1,426 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "shared.h"
+
+// Work within a tick is spread over a pool of job threads. The thread that
+// runs the tick is job thread 0, and the other job threads sleep until it
+// hands out jobs. Every job thread has its own scratch arena, which is reset
+// at the start of every tick.
+//
+// Every job thread has its own deque of jobs. A thread pushes jobs to and
+// takes jobs from the bottom of its own deque, while other threads steal
+// jobs from the top. This is the lock-free deque of Chase and Lev, with the
+// memory orderings from "Correct and Efficient Work-Stealing for Weak Memory
+// Models" by Lê et al. Deques don't grow. If a deque is full, the job is run
+// right away instead.
+//
+// Threads waiting for their jobs to finish run other jobs in the meantime,
+// so jobs can hand out jobs of their own. If there is nothing to run, they
+// spin for a short while and then sleep until their jobs have finished.
+//
+// The tick consists of phases that wait for the phases they depend on.
+// Phases run on whichever job thread is free, so code that used to run on
+// the tick thread can now run on any job thread, but never at the same time
+// as a phase it conflicts with. Phases are kept apart from other jobs, and
+// a thread waiting for jobs inside a phase only runs other jobs, never
+// another phase.
+
+typedef struct {
+    job_function run;
+    void * data;
+    int index;
+    // decremented once the job has finished
+    atomic_int * unfinished;
+} job;
+
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(job *) slots[JOB_DEQUE_SIZE];
+} job_deque;
+
+typedef struct {
+    job_deque deque;
+    // Tick phases ready to run. Threads waiting for jobs they handed out
+    // don't take phases, so a phase never runs in the middle of another one
+    // on the same thread and the profiler attributes time correctly.
+    job_deque phase_deque;
+    memory_arena scratch_arena;
+} job_thread;
+
+typedef struct {
+    tick_phase * phases;
+    int phase_count;
+    job jobs[MAX_TICK_PHASES];
+    // number of unfinished phases each phase is waiting for
+    atomic_int waiting_for[MAX_TICK_PHASES];
+    atomic_int unfinished;
+} phase_graph;
+
+static job_thread * job_threads;
+static int job_thread_count;
+static _Thread_local int job_thread_index = -1;
+
+// Sleeping job threads wake up when the generation changes, which happens
+// whenever jobs are handed out.
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static unsigned job_generation;
+
+static int
+push_job(job_deque * deque, job * j) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= JOB_DEQUE_SIZE) {
+        return 0;
+    }
+    atomic_store_explicit(deque->slots + (bottom & (JOB_DEQUE_SIZE - 1)), j,
+            memory_order_relaxed);
+    // thieves load the bottom with acquire, so they see the job's contents
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return 1;
+}
+
+static job *
+take_job(job_deque * deque) {
+    long bottom = atomic_load_explicit(&deque->bottom,
+            memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // deque was empty
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                memory_order_relaxed);
+        return NULL;
+    }
+
+    job * res = atomic_load_explicit(
+            deque->slots + (bottom & (JOB_DEQUE_SIZE - 1)),
+            memory_order_relaxed);
+    if (top == bottom) {
+        // the last job, which a thief may be trying to steal as well
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top,
+                top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            res = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                memory_order_relaxed);
+    }
+    return res;
+}
+
+static job *
+steal_job(job_deque * deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    job * res = atomic_load_explicit(
+            deque->slots + (top & (JOB_DEQUE_SIZE - 1)),
+            memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        // lost the race against the owner or another thief
+        return NULL;
+    }
+    return res;
+}
+
+static job_deque *
+get_deque(int thread_index, int phases) {
+    job_thread * thread = job_threads + thread_index;
+    return phases ? &thread->phase_deque : &thread->deque;
+}
+
+static job *
+find_job_in(int thread_index, int phases) {
+    job * res = take_job(get_deque(thread_index, phases));
+    if (res != NULL) {
+        return res;
+    }
+    for (int i = 1; i < job_thread_count; i++) {
+        int victim = (thread_index + i) % job_thread_count;
+        res = steal_job(get_deque(victim, phases));
+        if (res != NULL) {
+            return res;
+        }
+    }
+    return NULL;
+}
+
+static job *
+find_job(int thread_index, int take_phases) {
+    // jobs of running phases first, since those phases wait for them
+    job * res = find_job_in(thread_index, 0);
+    if (res == NULL && take_phases) {
+        res = find_job_in(thread_index, 1);
+    }
+    return res;
+}
+
+static void
+run_job(job * j) {
+    // Jobs allocate from the scratch arena of the thread they run on, and
+    // that memory stays around until the end of the tick.
+    j->run(j->data, j->index, &job_threads[job_thread_index].scratch_arena);
+    if (atomic_fetch_sub_explicit(j->unfinished, 1, memory_order_acq_rel) == 1
+            && job_thread_count > 1) {
+        // the thread waiting for the jobs may be asleep
+        pthread_mutex_lock(&job_mutex);
+        pthread_cond_broadcast(&job_cond);
+        pthread_mutex_unlock(&job_mutex);
+    }
+}
+
+static void
+wake_job_threads(void) {
+    if (job_thread_count == 1) {
+        return;
+    }
+    pthread_mutex_lock(&job_mutex);
+    job_generation++;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+}
+
+static void
+submit_job(job * j) {
+    if (!push_job(&job_threads[job_thread_index].deque, j)) {
+        run_job(j);
+    }
+}
+
+static void
+submit_phase(job * j) {
+    // there are fewer phases than fit in a deque, so this always succeeds
+    push_job(&job_threads[job_thread_index].phase_deque, j);
+}
+
+static void
+wait_for_jobs(atomic_int * unfinished, int take_phases) {
+    int spins = 0;
+    while (atomic_load_explicit(unfinished, memory_order_acquire) > 0) {
+        job * j = find_job(job_thread_index, take_phases);
+        if (j != NULL) {
+            run_job(j);
+            spins = 0;
+            continue;
+        }
+        if (spins < JOB_WAIT_SPINS) {
+            // the remaining jobs are running on other threads
+            spins++;
+            sched_yield();
+            continue;
+        }
+
+        // The remaining jobs take a while, so stop taking processor time
+        // from the other threads. Sleep until the jobs have finished or new
+        // jobs are handed out.
+        pthread_mutex_lock(&job_mutex);
+        unsigned seen_generation = job_generation;
+        pthread_mutex_unlock(&job_mutex);
+
+        j = find_job(job_thread_index, take_phases);
+        if (j != NULL) {
+            run_job(j);
+            spins = 0;
+            continue;
+        }
+
+        pthread_mutex_lock(&job_mutex);
+        while (job_generation == seen_generation
+                && atomic_load_explicit(unfinished, memory_order_acquire) > 0) {
+            pthread_cond_wait(&job_cond, &job_mutex);
+        }
+        pthread_mutex_unlock(&job_mutex);
+    }
+}
+
+static void *
+run_job_thread(void * arg) {
+    job_thread_index = (int) (intptr_t) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&job_mutex);
+        unsigned seen_generation = job_generation;
+        pthread_mutex_unlock(&job_mutex);
+
+        job * j = find_job(job_thread_index, 1);
+        if (j != NULL) {
+            run_job(j);
+            continue;
+        }
+
+        pthread_mutex_lock(&job_mutex);
+        while (job_generation == seen_generation) {
+            pthread_cond_wait(&job_cond, &job_mutex);
+        }
+        pthread_mutex_unlock(&job_mutex);
+    }
+
+    return NULL;
+}
+
+void
+init_job_system(void) {
+    // The calling thread becomes job thread 0. The other job threads are
+    // started later.
+    long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+    job_thread_count = MAX(1, MIN(MAX_JOB_THREADS, processor_count));
+
+    job_threads = calloc(job_thread_count, sizeof *job_threads);
+    if (job_threads == NULL) {
+        logs_errno("Failed to allocate job threads: %s");
+        exit(1);
+    }
+
+    for (int i = 0; i < job_thread_count; i++) {
+        job_threads[i].scratch_arena = (memory_arena) {
+            .ptr = calloc(JOB_THREAD_SCRATCH_SIZE, 1),
+            .size = JOB_THREAD_SCRATCH_SIZE
+        };
+        if (job_threads[i].scratch_arena.ptr == NULL) {
+            logs_errno("Failed to allocate job thread scratch arena: %s");
+            exit(1);
+        }
+    }
+
+    job_thread_index = 0;
+}
+
+void
+start_job_threads(void) {
+    for (int i = 1; i < job_thread_count; i++) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        if (pthread_attr_init(&attr) != 0
+                || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
+                || pthread_create(&thread, &attr, run_job_thread,
+                (void *) (intptr_t) i) != 0) {
+            logs("Failed to start job thread");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    if (job_thread_count > 1) {
+        logs("Using %d job threads", job_thread_count);
+    }
+}
+
+int
+get_job_thread_count(void) {
+    return job_thread_count;
+}
+
+int
+get_job_thread_index(void) {
+    return job_thread_index;
+}
+
+memory_arena *
+get_scratch_arena(void) {
+    return &job_threads[job_thread_index].scratch_arena;
+}
+
+void
+reset_scratch_arenas(void) {
+    // only called while no jobs are running
+    for (int i = 0; i < job_thread_count; i++) {
+        job_threads[i].scratch_arena.index = 0;
+    }
+}
+
+void
+run_jobs(job_function run, void * data, int count) {
+    // Runs the job for every index from 0 to count and returns once all of
+    // them have finished.
+    if (count == 0) {
+        return;
+    }
+
+    atomic_int unfinished = count;
+    job * jobs = alloc_in_arena(get_scratch_arena(), count * sizeof *jobs);
+    // push in reverse, so this thread takes the first jobs first
+    for (int i = count - 1; i >= 0; i--) {
+        jobs[i] = (job) {
+            .run = run,
+            .data = data,
+            .index = i,
+            .unfinished = &unfinished
+        };
+        submit_job(jobs + i);
+    }
+
+    wake_job_threads();
+    wait_for_jobs(&unfinished, 0);
+}
+
+static void
+run_tick_phase(void * data, int index, memory_arena * scratch_arena) {
+    phase_graph * graph = data;
+    tick_phase * phase = graph->phases + index;
+
+    begin_timed_block(phase->name);
+    phase->run(scratch_arena);
+    end_timed_block();
+
+    // start the phases that were only waiting for this one
+    int started = 0;
+    for (int i = 0; i < graph->phase_count; i++) {
+        if (!(graph->phases[i].dependencies & ((mc_uint) 1 << index))) {
+            continue;
+        }
+        if (atomic_fetch_sub_explicit(graph->waiting_for + i, 1,
+                memory_order_acq_rel) == 1) {
+            submit_phase(graph->jobs + i);
+            started++;
+        }
+    }
+    if (started > 1) {
+        wake_job_threads();
+    }
+}
+
+void
+run_tick_phases(tick_phase * phases, int phase_count) {
+    // Phases may only depend on phases that come before them.
+    assert(phase_count <= MAX_TICK_PHASES);
+    static_assert(MAX_TICK_PHASES <= JOB_DEQUE_SIZE, "Phase deques too small");
+
+    phase_graph * graph = alloc_in_arena(get_scratch_arena(), sizeof *graph);
+    graph->phases = phases;
+    graph->phase_count = phase_count;
+    atomic_init(&graph->unfinished, phase_count);
+
+    for (int i = 0; i < phase_count; i++) {
+        assert((phases[i].dependencies >> i) == 0);
+        graph->jobs[i] = (job) {
+            .run = run_tick_phase,
+            .data = graph,
+            .index = i,
+            .unfinished = &graph->unfinished
+        };
+        atomic_init(graph->waiting_for + i,
+                __builtin_popcount(phases[i].dependencies));
+    }
+
+    for (int i = 0; i < phase_count; i++) {
+        if (phases[i].dependencies == 0) {
+            submit_phase(graph->jobs + i);
+        }
+    }
+
+    wake_job_threads();
+    wait_for_jobs(&graph->unfinished, 1);
+}
@@ -0,0 +1,668 @@
+#include <stdlib.h>
+#include <string.h>
+#include "shared.h"
+
+// Sky light and block light of loaded chunks. Chunk loader threads light
+// chunks using only their own blocks when they load them. The link loaded
+// chunks and update light phases then let light flow between neighbouring
+// chunks once both are loaded, and update light incrementally when blocks
+// change.
+//
+// Light spreads from block to block in a breadth-first search, and gets
+// weaker by the opacity of the block it enters, but by at least 1. The only
+// exception is sky light of level 15, which travels straight down without
+// getting weaker through blocks that don't absorb any light. Blocks are
+// processed in order of decreasing light level, so every block gets its
+// final light level the first time light reaches it.
+//
+// Light is removed with a second search from the changed blocks, which clears
+// all light that could have come from them. The brighter blocks around the
+// cleared area then light it up again.
+
+typedef struct {
+    net_block_pos pos;
+    int level;
+} light_node;
+
+typedef struct {
+    light_node * nodes;
+    int count;
+    int capacity;
+} light_queue;
+
+static const int light_directions[6][3] = {
+    {0, -1, 0},
+    {0, 1, 0},
+    {0, 0, -1},
+    {0, 0, 1},
+    {-1, 0, 0},
+    {1, 0, 0},
+};
+
+#define LIGHT_DIRECTION_DOWN (0)
+
+// The queues below are owned by the phases that change blocks, link loaded
+// chunks and update light. Those phases may run on any job thread, so the
+// phase graph must run them one after the other, never alongside each other
+// or another user of the queues. Light updates requested for changed blocks,
+// nodes to remove light from, and nodes to spread light from for sky light
+// and block light, by light level.
+static light_queue light_update_queue;
+static light_queue light_removal_queue;
+static light_queue light_spread_queues[2][16];
+
+// The last chunk looked up, since light often stays in the same chunk for a
+// while. Reset after every use of the queues, because chunks can be unloaded
+// in between.
+static chunk * cached_light_chunk;
+
+static mc_ubyte
+get_section_light(unsigned char * nibbles, mc_ubyte uniform_light,
+        int index) {
+    if (nibbles == NULL) {
+        return uniform_light;
+    }
+    return (nibbles[index >> 1] >> ((index & 1) << 2)) & 0xf;
+}
+
+static unsigned char *
+alloc_section_light(mc_ubyte uniform_light) {
+    unsigned char * nibbles = malloc(2048);
+    if (nibbles == NULL) {
+        logs_errno("Failed to allocate section light: %s");
+        exit(1);
+    }
+    memset(nibbles, uniform_light * 0x11, 2048);
+    return nibbles;
+}
+
+void
+free_chunk_light(chunk_light * light) {
+    for (int section_y = 0; section_y < 16; section_y++) {
+        free(light->sky[section_y]);
+        free(light->block[section_y]);
+        light->sky[section_y] = NULL;
+        light->block[section_y] = NULL;
+    }
+}
+
+int
+get_chunk_light_memory(chunk_light * light) {
+    int res = 0;
+    for (int section_y = 0; section_y < 16; section_y++) {
+        res += (light->sky[section_y] != NULL) * 2048;
+        res += (light->block[section_y] != NULL) * 2048;
+    }
+    return res;
+}
+
+static void
+store_section_light(mc_ubyte * levels, unsigned char * * nibbles,
+        mc_ubyte * uniform_light) {
+    // sections with the same light everywhere aren't allocated
+    *uniform_light = levels[0];
+    if (memcmp(levels, levels + 1, 4095) == 0) {
+        *nibbles = NULL;
+        return;
+    }
+
+    *nibbles = alloc_section_light(0);
+    for (int i = 0; i < 2048; i++) {
+        (*nibbles)[i] = levels[2 * i] | (levels[2 * i + 1] << 4);
+    }
+}
+
+typedef struct {
+    // Light levels of all blocks in the chunk, indexed by y, z and x like
+    // block states. Blocks are added to the list of their light level.
+    mc_ubyte * levels;
+    mc_ubyte * opacities;
+    mc_ushort * blocks;
+    int * next;
+    int heads[16];
+    int count;
+} chunk_light_search;
+
+static void
+add_chunk_light_node(chunk_light_search * search, int index, int level) {
+    search->levels[index] = level;
+    search->blocks[search->count] = index;
+    search->next[search->count] = search->heads[level];
+    search->heads[level] = search->count;
+    search->count++;
+}
+
+static void
+spread_chunk_light(chunk_light_search * search, int sky) {
+    for (int level = 15; level > 0; level--) {
+        while (search->heads[level] != -1) {
+            int node = search->heads[level];
+            search->heads[level] = search->next[node];
+            int index = search->blocks[node];
+            if (search->levels[index] != level) {
+                // block got brighter after it was added
+                continue;
+            }
+
+            int x = index & 0xf;
+            int z = (index >> 4) & 0xf;
+            int y = index >> 8;
+            for (int dir = 0; dir < 6; dir++) {
+                int nx = x + light_directions[dir][0];
+                int ny = y + light_directions[dir][1];
+                int nz = z + light_directions[dir][2];
+                if ((nx | ny | nz) < 0 || nx > 15 || nz > 15
+                        || ny > MAX_WORLD_Y) {
+                    continue;
+                }
+
+                int neighbour = (ny << 8) | (nz << 4) | nx;
+                int opacity = search->opacities[neighbour];
+                int new_level = level - MAX(1, opacity);
+                if (sky && dir == LIGHT_DIRECTION_DOWN && level == 15
+                        && opacity == 0) {
+                    new_level = 15;
+                }
+                if (new_level > search->levels[neighbour]) {
+                    add_chunk_light_node(search, neighbour, new_level);
+                }
+            }
+        }
+    }
+}
+
+void
+light_chunk(chunk * ch, memory_arena * scratch_arena) {
+    // Called by the chunk loader threads. Light from neighbouring chunks is
+    // added once the chunk is linked.
+    memory_arena temp_arena = *scratch_arena;
+    chunk_light_search search = {
+        .levels = alloc_in_arena(&temp_arena, 65536),
+        .opacities = alloc_in_arena(&temp_arena, 65536),
+        // blocks are added at most once per light level they get, and
+        // light sources are added one extra time
+        .blocks = alloc_in_arena(&temp_arena, 2 * 65536 * sizeof (mc_ushort)),
+        .next = alloc_in_arena(&temp_arena, 2 * 65536 * sizeof (int)),
+    };
+    mc_ubyte * emitted = alloc_in_arena(&temp_arena, 65536);
+    mc_ushort block_states[4096];
+    // Most sections only contain blocks that absorb the same amount of light
+    // and don't emit light, like air or stone with ores. We don't need to
+    // look at every block of those sections.
+    unsigned transparent_sections = 0;
+    unsigned emitting_sections = 0;
+
+    for (int section_y = 0; section_y < 16; section_y++) {
+        mc_ubyte * opacities = search.opacities + (section_y << 12);
+        mc_ubyte * emitted_light = emitted + (section_y << 12);
+        chunk_section * section = ch->sections[section_y];
+        int uniform_opacity = -1;
+        int emits = 1;
+
+        if (section == NULL) {
+            mc_ushort block_state = ch->uniform_section_states[section_y];
+            uniform_opacity = serv->light_opacity_by_state[block_state];
+            emits = serv->emitted_light_by_state[block_state] != 0;
+        } else if (section->palette != NULL) {
+            uniform_opacity = serv->light_opacity_by_state[section->palette[0]];
+            emits = 0;
+            for (int i = 0; i < section->palette_size; i++) {
+                mc_ushort block_state = section->palette[i];
+                if (serv->light_opacity_by_state[block_state]
+                        != uniform_opacity) {
+                    uniform_opacity = -1;
+                }
+                emits |= serv->emitted_light_by_state[block_state] != 0;
+            }
+        }
+
+        if (uniform_opacity != -1 && !emits) {
+            memset(opacities, uniform_opacity, 4096);
+            if (uniform_opacity == 0) {
+                transparent_sections |= 1u << section_y;
+            }
+            continue;
+        }
+
+        emitting_sections |= 1u << section_y;
+        if (section == NULL) {
+            mc_ushort block_state = ch->uniform_section_states[section_y];
+            memset(opacities, uniform_opacity, 4096);
+            memset(emitted_light, serv->emitted_light_by_state[block_state],
+                    4096);
+            continue;
+        }
+
+        unpack_chunk_section(section, block_states);
+        for (int i = 0; i < 4096; i++) {
+            opacities[i] = serv->light_opacity_by_state[block_states[i]];
+            emitted_light[i] = serv->emitted_light_by_state[block_states[i]];
+        }
+    }
+
+    // Sky light shines straight down until it hits a block that absorbs
+    // light. Only the lowest of those blocks and blocks next to darker
+    // columns need to spread light further.
+    memset(search.heads, -1, sizeof search.heads);
+    search.count = 0;
+
+    int top_section = 15;
+    while (top_section >= 0 && (transparent_sections & (1u << top_section))) {
+        top_section--;
+    }
+    int top_y = (top_section << 4) + 15;
+    memset(search.levels, 0, (top_y + 1) << 8);
+    memset(search.levels + ((top_y + 1) << 8), 15, (MAX_WORLD_Y - top_y) << 8);
+
+    int lowest_lit_y[256];
+    for (int zx = 0; zx < 256; zx++) {
+        int y = top_y;
+        for (; y >= 0; y--) {
+            int index = (y << 8) | zx;
+            if (search.opacities[index] != 0) {
+                break;
+            }
+            search.levels[index] = 15;
+        }
+        lowest_lit_y[zx] = y + 1;
+    }
+
+    for (int zx = 0; zx < 256; zx++) {
+        int x = zx & 0xf;
+        int z = zx >> 4;
+        int lowest = lowest_lit_y[zx];
+        int highest_neighbour = lowest;
+        if (x > 0) {
+            highest_neighbour = MAX(highest_neighbour, lowest_lit_y[zx - 1]);
+        }
+        if (x < 15) {
+            highest_neighbour = MAX(highest_neighbour, lowest_lit_y[zx + 1]);
+        }
+        if (z > 0) {
+            highest_neighbour = MAX(highest_neighbour, lowest_lit_y[zx - 16]);
+        }
+        if (z < 15) {
+            highest_neighbour = MAX(highest_neighbour, lowest_lit_y[zx + 16]);
+        }
+
+        if (lowest <= MAX_WORLD_Y) {
+            add_chunk_light_node(&search, (lowest << 8) | zx, 15);
+        }
+        for (int y = lowest + 1; y < highest_neighbour; y++) {
+            add_chunk_light_node(&search, (y << 8) | zx, 15);
+        }
+    }
+
+    spread_chunk_light(&search, 1);
+    for (int section_y = 0; section_y < 16; section_y++) {
+        store_section_light(search.levels + (section_y << 12),
+                ch->light.sky + section_y, ch->light.uniform_sky + section_y);
+    }
+
+    // block light spreads from the blocks that emit light
+    memset(search.levels, 0, 65536);
+    memset(search.heads, -1, sizeof search.heads);
+    search.count = 0;
+
+    for (int section_y = 0; section_y < 16; section_y++) {
+        if (!(emitting_sections & (1u << section_y))) {
+            continue;
+        }
+        for (int index = section_y << 12; index < (section_y + 1) << 12;
+                index++) {
+            if (emitted[index] != 0) {
+                add_chunk_light_node(&search, index, emitted[index]);
+            }
+        }
+    }
+
+    spread_chunk_light(&search, 0);
+    for (int section_y = 0; section_y < 16; section_y++) {
+        store_section_light(search.levels + (section_y << 12),
+                ch->light.block + section_y,
+                ch->light.uniform_block + section_y);
+    }
+}
+
+static void
+push_light_node(light_queue * queue, net_block_pos pos, int level) {
+    if (queue->count == queue->capacity) {
+        int new_capacity = MAX(1024, 2 * queue->capacity);
+        light_node * nodes = realloc(queue->nodes,
+                new_capacity * sizeof *nodes);
+        if (nodes == NULL) {
+            logs_errno("Failed to grow light queue: %s");
+            exit(1);
+        }
+        queue->nodes = nodes;
+        queue->capacity = new_capacity;
+    }
+    queue->nodes[queue->count] = (light_node) {.pos = pos, .level = level};
+    queue->count++;
+}
+
+static chunk *
+get_light_chunk(net_block_pos pos) {
+    // returns NULL if the block's light can't be changed
+    if (pos.y < 0 || pos.y > MAX_WORLD_Y) {
+        return NULL;
+    }
+    chunk_pos ch_pos = {.x = pos.x >> 4, .z = pos.z >> 4};
+    chunk * ch = cached_light_chunk;
+    if (ch == NULL || ch->pos.x != ch_pos.x || ch->pos.z != ch_pos.z) {
+        ch = get_chunk_if_loaded(ch_pos);
+        if (ch == NULL) {
+            return NULL;
+        }
+        cached_light_chunk = ch;
+    }
+    return ch;
+}
+
+static int
+get_light(chunk * ch, int sky, net_block_pos pos) {
+    int section_y = pos.y >> 4;
+    int index = ((pos.y & 0xf) << 8) | ((pos.z & 0xf) << 4) | (pos.x & 0xf);
+    if (sky) {
+        return get_section_light(ch->light.sky[section_y],
+                ch->light.uniform_sky[section_y], index);
+    }
+    return get_section_light(ch->light.block[section_y],
+            ch->light.uniform_block[section_y], index);
+}
+
+static void
+set_light(chunk * ch, int sky, net_block_pos pos, int level) {
+    int section_y = pos.y >> 4;
+    int index = ((pos.y & 0xf) << 8) | ((pos.z & 0xf) << 4) | (pos.x & 0xf);
+    unsigned char * * nibbles;
+    mc_ubyte uniform_light;
+    if (sky) {
+        nibbles = ch->light.sky + section_y;
+        uniform_light = ch->light.uniform_sky[section_y];
+        ch->changed_sky_light |= 1 << section_y;
+    } else {
+        nibbles = ch->light.block + section_y;
+        uniform_light = ch->light.uniform_block[section_y];
+        ch->changed_block_light |= 1 << section_y;
+    }
+
+    if (*nibbles == NULL) {
+        *nibbles = alloc_section_light(uniform_light);
+    }
+    int shift = (index & 1) << 2;
+    unsigned char * byte = *nibbles + (index >> 1);
+    *byte = (*byte & ~(0xf << shift)) | (level << shift);
+
+    // the cached packets no longer match the chunk
+    free(ch->packet_cache);
+    ch->packet_cache = NULL;
+}
+
+static int
+get_block_opacity(chunk * ch, net_block_pos pos) {
+    mc_ushort block_state = chunk_get_block_state(ch, pos.x & 0xf, pos.y,
+            pos.z & 0xf);
+    return serv->light_opacity_by_state[block_state];
+}
+
+static int
+get_block_emitted_light(chunk * ch, net_block_pos pos) {
+    mc_ushort block_state = chunk_get_block_state(ch, pos.x & 0xf, pos.y,
+            pos.z & 0xf);
+    return serv->emitted_light_by_state[block_state];
+}
+
+static net_block_pos
+get_light_neighbour(net_block_pos pos, int dir) {
+    pos.x += light_directions[dir][0];
+    pos.y += light_directions[dir][1];
+    pos.z += light_directions[dir][2];
+    return pos;
+}
+
+static void
+spread_light_from(chunk * ch, int sky, net_block_pos pos, int level) {
+    // lights the block if it isn't bright enough already
+    if (get_light(ch, sky, pos) < level) {
+        set_light(ch, sky, pos, level);
+        push_light_node(light_spread_queues[sky] + level, pos, level);
+    }
+}
+
+static int
+remove_light(int sky) {
+    // Returns the number of processed nodes. The queue grows while we
+    // process it.
+    light_queue * queue = &light_removal_queue;
+    int processed = 0;
+    for (int i = 0; i < queue->count; i++) {
+        light_node node = queue->nodes[i];
+        processed++;
+
+        for (int dir = 0; dir < 6; dir++) {
+            net_block_pos neighbour = get_light_neighbour(node.pos, dir);
+            chunk * ch = get_light_chunk(neighbour);
+            if (ch == NULL) {
+                continue;
+            }
+            int level = get_light(ch, sky, neighbour);
+            if (level == 0) {
+                continue;
+            }
+
+            if (level < node.level || (sky && dir == LIGHT_DIRECTION_DOWN
+                    && node.level == 15 && level == 15)) {
+                // light could have come from the removed light
+                set_light(ch, sky, neighbour, 0);
+                push_light_node(queue, neighbour, level);
+                if (!sky) {
+                    int emitted = get_block_emitted_light(ch, neighbour);
+                    if (emitted != 0) {
+                        spread_light_from(ch, sky, neighbour, emitted);
+                    }
+                }
+            } else {
+                // light came from elsewhere, so spread it into the removed
+                // light again
+                push_light_node(light_spread_queues[sky] + level,
+                        neighbour, level);
+            }
+        }
+    }
+    queue->count = 0;
+    return processed;
+}
+
+static int
+spread_light(int sky) {
+    // Returns the number of processed nodes. Processing a light level only
+    // adds nodes with lower light levels, except for sky light going down.
+    int processed = 0;
+    for (int level = 15; level > 0; level--) {
+        light_queue * queue = light_spread_queues[sky] + level;
+        for (int i = 0; i < queue->count; i++) {
+            net_block_pos pos = queue->nodes[i].pos;
+            chunk * ch = get_light_chunk(pos);
+            if (ch == NULL || get_light(ch, sky, pos) != level) {
+                // light changed after the node was added
+                continue;
+            }
+            processed++;
+
+            for (int dir = 0; dir < 6; dir++) {
+                net_block_pos neighbour = get_light_neighbour(pos, dir);
+                chunk * neighbour_ch = get_light_chunk(neighbour);
+                if (neighbour_ch == NULL) {
+                    continue;
+                }
+
+                int opacity = get_block_opacity(neighbour_ch, neighbour);
+                int new_level = level - MAX(1, opacity);
+                if (sky && dir == LIGHT_DIRECTION_DOWN && level == 15
+                        && opacity == 0) {
+                    new_level = 15;
+                }
+                if (new_level > 0) {
+                    spread_light_from(neighbour_ch, sky, neighbour, new_level);
+                }
+            }
+        }
+        queue->count = 0;
+    }
+    return processed;
+}
+
+void
+request_light_update(chunk * ch, int x, int y, int z) {
+    // Called if a block changed into one that absorbs or emits a different
+    // amount of light.
+    net_block_pos pos = {
+        .x = (ch->pos.x << 4) | x,
+        .y = y,
+        .z = (ch->pos.z << 4) | z
+    };
+    push_light_node(&light_update_queue, pos, 0);
+}
+
+static void
+seed_light_update(int sky, net_block_pos pos) {
+    // Light spreads into the block from its neighbours, unless they were
+    // darkened as well.
+    chunk * ch = get_light_chunk(pos);
+    if (ch == NULL) {
+        return;
+    }
+
+    if (sky) {
+        if (pos.y == MAX_WORLD_Y && get_block_opacity(ch, pos) == 0) {
+            // sky light comes in from above the world
+            spread_light_from(ch, sky, pos, 15);
+        }
+    } else {
+        int emitted = get_block_emitted_light(ch, pos);
+        if (emitted != 0) {
+            spread_light_from(ch, sky, pos, emitted);
+        }
+    }
+
+    for (int dir = 0; dir < 6; dir++) {
+        net_block_pos neighbour = get_light_neighbour(pos, dir);
+        chunk * neighbour_ch = get_light_chunk(neighbour);
+        if (neighbour_ch == NULL) {
+            continue;
+        }
+        int level = get_light(neighbour_ch, sky, neighbour);
+        if (level > 1) {
+            push_light_node(light_spread_queues[sky] + level, neighbour,
+                    level);
+        }
+    }
+}
+
+static void
+link_light_border(chunk * ch, chunk * neighbour_ch, int dir) {
+    // Adds the brighter of two blocks next to each other at the border of two
+    // chunks, if light can flow from one to the other. Sections with a single
+    // light level on both sides can often be skipped.
+    int dx = light_directions[dir][0];
+    int dz = light_directions[dir][2];
+    int base_x = (ch->pos.x << 4) + (dx > 0 ? 15 : 0);
+    int base_z = (ch->pos.z << 4) + (dz > 0 ? 15 : 0);
+
+    for (int sky = 0; sky < 2; sky++) {
+        unsigned char * * nibbles = sky ? ch->light.sky : ch->light.block;
+        unsigned char * * neighbour_nibbles = sky ? neighbour_ch->light.sky
+                : neighbour_ch->light.block;
+        mc_ubyte * uniform_light = sky ? ch->light.uniform_sky
+                : ch->light.uniform_block;
+        mc_ubyte * neighbour_uniform_light = sky
+                ? neighbour_ch->light.uniform_sky
+                : neighbour_ch->light.uniform_block;
+
+        for (int section_y = 0; section_y < 16; section_y++) {
+            if (nibbles[section_y] == NULL
+                    && neighbour_nibbles[section_y] == NULL
+                    && abs(uniform_light[section_y]
+                    - neighbour_uniform_light[section_y]) <= 1) {
+                continue;
+            }
+
+            for (int y = section_y << 4; y < (section_y + 1) << 4; y++) {
+                for (int i = 0; i < 16; i++) {
+                    net_block_pos pos = {
+                        .x = base_x + (dx == 0 ? i : 0),
+                        .y = y,
+                        .z = base_z + (dz == 0 ? i : 0)
+                    };
+                    net_block_pos neighbour = get_light_neighbour(pos, dir);
+                    int level = get_light(ch, sky, pos);
+                    int neighbour_level = get_light(neighbour_ch, sky,
+                            neighbour);
+                    if (level > neighbour_level + 1) {
+                        push_light_node(light_spread_queues[sky] + level,
+                                pos, level);
+                    } else if (neighbour_level > level + 1) {
+                        push_light_node(light_spread_queues[sky]
+                                + neighbour_level, neighbour,
+                                neighbour_level);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void
+link_chunk_light(chunk * ch) {
+    // Called by the link loaded chunks phase when a chunk is loaded. Light
+    // flows between the chunk and its loaded neighbours during the next
+    // light update.
+    for (int dir = 2; dir < 6; dir++) {
+        chunk_pos neighbour_pos = {
+            .x = ch->pos.x + light_directions[dir][0],
+            .z = ch->pos.z + light_directions[dir][2]
+        };
+        chunk * neighbour_ch = get_chunk_if_loaded(neighbour_pos);
+        if (neighbour_ch != NULL) {
+            link_light_border(ch, neighbour_ch, dir);
+        }
+    }
+}
+
+void
+update_light(void) {
+    // Called by the update light phase after blocks have changed and chunks
+    // have been linked, before chunks and changes are sent to players.
+    int updates = light_update_queue.count;
+    int processed = 0;
+
+    for (int sky = 0; sky < 2; sky++) {
+        for (int i = 0; i < updates; i++) {
+            net_block_pos pos = light_update_queue.nodes[i].pos;
+            chunk * ch = get_light_chunk(pos);
+            if (ch == NULL) {
+                continue;
+            }
+            int level = get_light(ch, sky, pos);
+            if (level != 0) {
+                set_light(ch, sky, pos, 0);
+                push_light_node(&light_removal_queue, pos, level);
+            }
+        }
+
+        processed += remove_light(sky);
+
+        for (int i = 0; i < updates; i++) {
+            seed_light_update(sky, light_update_queue.nodes[i].pos);
+        }
+
+        processed += spread_light(sky);
+    }
+
+    light_update_queue.count = 0;
+    cached_light_chunk = NULL;
+
+    add_profiler_counter("light updates", updates);
+    add_profiler_counter("light nodes", processed);
+}
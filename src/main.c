@@ -23,58 +23,37 @@
 #endif
 
 static int server_sock;
+static int socket_watcher;
 static volatile sig_atomic_t got_sigint;
 
 server * serv;
 
-#define INITIAL_CONNECTION_IN_USE ((unsigned) (1 << 0))
-
-enum initial_protocol_state {
-    PROTOCOL_HANDSHAKE,
-    PROTOCOL_AWAIT_STATUS_REQUEST,
-    PROTOCOL_AWAIT_PING_REQUEST,
-    PROTOCOL_AWAIT_HELLO,
-    PROTOCOL_JOIN_WHEN_SENT,
-};
-
-typedef struct {
-    int sock;
-    unsigned flags;
-
-    // Should be large enough to:
-    //
-    //  1. Receive a client intention (handshake) packet, status request and
-    //     ping request packet all in one go and store them together in the
-    //     buffer.
-    //
-    //  2. Receive a client intention packet and hello packet and store them
-    //     together inside the receive buffer.
-    // @TODO(traks) can maybe be a bit smaller
-    unsigned char rec_buf[300];
-    int rec_cursor;
-
-    // @TODO(traks) figure out appropriate size
-    unsigned char send_buf[2048];
-    int send_cursor;
-
-    int protocol_state;
-    unsigned char username[16];
-    int username_size;
-} initial_connection;
-
 typedef struct {
     long long start_time;
     long long end_time;
     char * name;
 } timed_block;
 
-static initial_connection initial_connections[32];
-static int initial_connection_count;
+typedef struct {
+    char * name;
+    mc_long value;
+} profiler_counter;
+
+typedef struct {
+    timed_block timed_blocks[1 << 16];
+    int timed_block_count;
+    int timed_block_depth_stack[64];
+    int cur_timed_block_depth;
+
+    // Counters are reset every tick and sent to the profiler after the timed
+    // blocks. Once a counter is used, it is sent every tick from then on.
+    profiler_counter profiler_counters[64];
+    int profiler_counter_count;
+} thread_profile;
 
-static timed_block timed_blocks[1 << 16];
-static int timed_block_count;
-static int timed_block_depth_stack[64];
-static int cur_timed_block_depth;
+// Every job thread records its own timed blocks and counters, so profiling
+// needs no synchronisation. Threads outside the job system aren't profiled.
+static thread_profile thread_profiles[MAX_JOB_THREADS];
 
 #if defined(__APPLE__) && defined(__MACH__)
 
@@ -87,8 +66,8 @@ init_program_nano_time() {
     program_start_time = mach_absolute_time();
 }
 
-static long long
-program_nano_time() {
+long long
+program_nano_time(void) {
     long long diff = mach_absolute_time() - program_start_time;
     return diff * timebase_info.numer / timebase_info.denom;
 }
@@ -102,8 +81,8 @@ init_program_nano_time() {
     clock_gettime(CLOCK_MONOTONIC, &program_start_time);
 }
 
-static long long
-program_nano_time() {
+long long
+program_nano_time(void) {
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
     long long diff_sec_nanos = (now.tv_sec - program_start_time.tv_sec) * 1000000000;
@@ -113,23 +92,73 @@ program_nano_time() {
 
 #endif
 
+static thread_profile *
+get_thread_profile(void) {
+    int thread_index = get_job_thread_index();
+    if (thread_index < 0) {
+        return NULL;
+    }
+    return thread_profiles + thread_index;
+}
+
 void
 begin_timed_block(char * name) {
-    int i = timed_block_count;
-    timed_block_count++;
-    timed_block_depth_stack[cur_timed_block_depth] = i;
-    cur_timed_block_depth++;
-    timed_blocks[i].name = name;
-    timed_blocks[i].start_time = program_nano_time();
+    thread_profile * profile = get_thread_profile();
+    if (profile == NULL) {
+        return;
+    }
+    int i = profile->timed_block_count;
+    profile->timed_block_count++;
+    profile->timed_block_depth_stack[profile->cur_timed_block_depth] = i;
+    profile->cur_timed_block_depth++;
+    profile->timed_blocks[i].name = name;
+    profile->timed_blocks[i].start_time = program_nano_time();
 }
 
 void
 end_timed_block() {
-    cur_timed_block_depth--;
-    timed_block * block = timed_blocks + timed_block_depth_stack[cur_timed_block_depth];
+    thread_profile * profile = get_thread_profile();
+    if (profile == NULL) {
+        return;
+    }
+    profile->cur_timed_block_depth--;
+    timed_block * block = profile->timed_blocks
+            + profile->timed_block_depth_stack[profile->cur_timed_block_depth];
     block->end_time = program_nano_time();
 }
 
+static void
+add_counter(profiler_counter * counters, int * counter_count,
+        int max_counters, char * name, mc_long value) {
+    int i;
+    for (i = 0; i < *counter_count; i++) {
+        if (strcmp(counters[i].name, name) == 0) {
+            counters[i].value += value;
+            return;
+        }
+    }
+
+    if (i == max_counters) {
+        return;
+    }
+
+    counters[i] = (profiler_counter) {
+        .name = name,
+        .value = value
+    };
+    (*counter_count)++;
+}
+
+void
+add_profiler_counter(char * name, mc_long value) {
+    thread_profile * profile = get_thread_profile();
+    if (profile == NULL) {
+        return;
+    }
+    add_counter(profile->profiler_counters, &profile->profiler_counter_count,
+            ARRAY_SIZE(profile->profiler_counters), name, value);
+}
+
 void
 logs(void * format, ...) {
     char msg[256];
@@ -205,6 +234,7 @@ alloc_in_arena(memory_arena * arena, mc_int size) {
 static void
 handle_sigint(int sig) {
     got_sigint = 1;
+    signal(sig, SIG_DFL);
 }
 
 int
@@ -700,402 +730,205 @@ tick_entity(entity_base * entity, memory_arena * tick_arena) {
 }
 
 static void
-server_tick(void) {
-    begin_timed_block("server tick");
-
-    // accept new connections
-    begin_timed_block("accept initial connections");
-
-    for (;;) {
-        int accepted = accept(server_sock, NULL, NULL);
-        if (accepted == -1) {
-            break;
+mark_all_sockets_readable(void) {
+    for (int i = 0; i < ARRAY_SIZE(serv->entities); i++) {
+        entity_base * entity = serv->entities + i;
+        if ((entity->flags & ENTITY_IN_USE) && entity->type == ENTITY_PLAYER) {
+            entity->flags |= PLAYER_SOCKET_READABLE;
         }
+    }
+}
 
-        if (initial_connection_count == ARRAY_SIZE(initial_connections)) {
-            close(accepted);
-            continue;
-        }
+static void
+process_socket_events(void) {
+    mc_ulong tags[256];
+    int total_events = 0;
 
-        int flags = fcntl(accepted, F_GETFL, 0);
+    for (;;) {
+        int event_count = wait_for_socket_events(socket_watcher,
+                tags, ARRAY_SIZE(tags), 0);
+        add_profiler_counter("socket syscalls", 1);
 
-        if (flags == -1) {
-            close(accepted);
-            continue;
+        if (event_count == -1) {
+            // readiness unknown, so try all sockets
+            mark_all_sockets_readable();
+            break;
         }
 
-        if (fcntl(accepted, F_SETFL, flags | O_NONBLOCK) == -1) {
-            close(accepted);
-            continue;
-        }
+        total_events += event_count;
 
-        // @TODO(traks) should we lower the receive and send buffer sizes? For
-        // hanshakes/status/login they don't need to be as large as the default
-        // (probably around 200KB).
+        for (int i = 0; i < event_count; i++) {
+            mc_ulong tag = tags[i];
+            mc_uint id = tag & ~SOCKET_TAG_KIND_MASK;
 
-        initial_connection * new_connection;
-        for (int i = 0; ; i++) {
-            new_connection = initial_connections + i;
-            if ((new_connection->flags & INITIAL_CONNECTION_IN_USE) == 0) {
+            switch (tag & SOCKET_TAG_KIND_MASK) {
+            case SOCKET_TAG_PLAYER: {
+                entity_base * entity = resolve_entity(id);
+                if (entity->type == ENTITY_PLAYER) {
+                    entity->flags |= PLAYER_SOCKET_READABLE;
+                }
                 break;
             }
+            }
         }
 
-        *new_connection = (initial_connection) {0};
-        new_connection->sock = accepted;
-        new_connection->flags |= INITIAL_CONNECTION_IN_USE;
-        initial_connection_count++;
-        logs("Created initial connection");
+        if (event_count < ARRAY_SIZE(tags)) {
+            break;
+        }
     }
 
-    end_timed_block();
-
-    // update initial connections
-    begin_timed_block("update initial connections");
+    add_profiler_counter("socket events", total_events);
+}
 
-    for (int i = 0; i < ARRAY_SIZE(initial_connections); i++) {
-        initial_connection * init_con = initial_connections + i;
-        if ((init_con->flags & INITIAL_CONNECTION_IN_USE) == 0) {
+static void
+exchange_player_data_via_ring(void) {
+    // Queue receives for all players with new data, then hand them to the
+    // kernel together with waiting for last tick's sends to complete.
+    for (int i = 0; i < ARRAY_SIZE(serv->entities); i++) {
+        entity_base * entity = serv->entities + i;
+        if ((entity->flags & ENTITY_IN_USE) == 0) {
+            continue;
+        }
+        if (entity->type != ENTITY_PLAYER) {
+            continue;
+        }
+        if ((entity->flags & PLAYER_SOCKET_READABLE) == 0) {
             continue;
         }
 
-        int sock = init_con->sock;
-        ssize_t rec_size = recv(sock, init_con->rec_buf + init_con->rec_cursor,
-                sizeof init_con->rec_buf - init_con->rec_cursor, 0);
-
-        if (rec_size == 0) {
-            close(sock);
-            init_con->flags &= ~INITIAL_CONNECTION_IN_USE;
-            initial_connection_count--;
-        } else if (rec_size == -1) {
-            // EAGAIN means no data received
-            if (errno != EAGAIN) {
-                logs_errno("Couldn't receive protocol data: %s");
-                close(sock);
-                init_con->flags &= ~INITIAL_CONNECTION_IN_USE;
-                initial_connection_count--;
-            }
-        } else {
-            init_con->rec_cursor += rec_size;
-
-            buffer_cursor rec_cursor = {
-                .buf = init_con->rec_buf,
-                .limit = init_con->rec_cursor
-            };
-            buffer_cursor send_cursor = {
-                .buf = init_con->send_buf,
-                .limit = sizeof init_con->send_buf,
-                .index = init_con->send_cursor
-            };
-
-            for (;;) {
-                mc_int packet_size = net_read_varint(&rec_cursor);
-
-                if (rec_cursor.error != 0) {
-                    // packet size not fully received yet
-                    break;
-                }
-                if (packet_size <= 0 || packet_size > sizeof init_con->rec_buf) {
-                    close(sock);
-                    init_con->flags &= ~INITIAL_CONNECTION_IN_USE;
-                    initial_connection_count--;
-                    break;
-                }
-                if (packet_size > rec_cursor.limit) {
-                    // packet not fully received yet
-                    break;
-                }
-
-                int packet_start = rec_cursor.index;
-                mc_int packet_id = net_read_varint(&rec_cursor);
-                logs("Initial packet %d", packet_id);
-
-                switch (init_con->protocol_state) {
-                case PROTOCOL_HANDSHAKE: {
-                    if (packet_id != 0) {
-                        rec_cursor.error = 1;
-                    }
-
-                    // read client intention packet
-                    mc_int protocol_version = net_read_varint(&rec_cursor);
-                    net_string address = net_read_string(&rec_cursor, 255);
-                    mc_ushort port = net_read_ushort(&rec_cursor);
-                    mc_int next_state = net_read_varint(&rec_cursor);
-
-                    if (next_state == 1) {
-                        init_con->protocol_state = PROTOCOL_AWAIT_STATUS_REQUEST;
-                    } else if (next_state == 2) {
-                        if (protocol_version != SERVER_PROTOCOL_VERSION) {
-                            logs("Client protocol version %jd != %jd",
-                                    (intmax_t) protocol_version,
-                                    (intmax_t) SERVER_PROTOCOL_VERSION);
-                            rec_cursor.error = 1;
-                        } else {
-                            init_con->protocol_state = PROTOCOL_AWAIT_HELLO;
-                        }
-                    } else {
-                        rec_cursor.error = 1;
-                    }
-                    break;
-                }
-                case PROTOCOL_AWAIT_STATUS_REQUEST: {
-                    if (packet_id != 0) {
-                        rec_cursor.error = 1;
-                    }
-
-                    // read status request packet
-                    // empty
-
-                    memory_arena scratch_arena = {
-                        .ptr = serv->short_lived_scratch,
-                        .size = serv->short_lived_scratch_size
-                    };
-
-                    int list_size = serv->tab_list_size;
-                    size_t list_bytes = list_size * sizeof (entity_id);
-                    entity_id * list = alloc_in_arena(
-                            &scratch_arena, list_bytes);
-                    memcpy(list, serv->tab_list, list_bytes);
-                    int sample_size = MIN(12, list_size);
-
-                    unsigned char * response = alloc_in_arena(&scratch_arena, 2048);
-                    int response_size = 0;
-                    response_size += sprintf((char *) response + response_size,
-                            "{\"version\":{\"name\":\"%s\",\"protocol\":%d},"
-                            "\"players\":{\"max\":%d,\"online\":%d,\"sample\":[",
-                            "1.16.4, 1.16.5", SERVER_PROTOCOL_VERSION,
-                            (int) MAX_PLAYERS, (int) list_size);
-
-                    for (int i = 0; i < sample_size; i++) {
-                        int target = i + (rand() % (list_size - i));
-                        entity_id * sampled = list + target;
-
-                        if (i > 0) {
-                            response[response_size] = ',';
-                            response_size += 1;
-                        }
-
-                        entity_base * entity = resolve_entity(*sampled);
-                        // @TODO(traks) this assert fired, not sure how that
-                        // happened. Can leave it for now, since these things
-                        // will may need to be rewritten anyway if we decide to
-                        // move all initial session stuff to a separate thread.
-                        assert(entity->type == ENTITY_PLAYER);
-                        // @TODO(traks) actual UUID
-                        response_size += sprintf((char *) response + response_size,
-                                "{\"id\":\"01234567-89ab-cdef-0123-456789abcdef\","
-                                "\"name\":\"%.*s\"}",
-                                (int) entity->player.username_size,
-                                entity->player.username);
-
-                        *sampled = list[i];
-                    }
-
-                    response_size += sprintf((char *) response + response_size,
-                            "]},\"description\":{\"text\":\"Running Blaze\"}}");
-
-                    int out_size = net_varint_size(0)
-                            + net_varint_size(response_size)
-                            + response_size;
-                    net_write_varint(&send_cursor, out_size);
-                    net_write_varint(&send_cursor, 0);
-                    net_write_varint(&send_cursor, response_size);
-                    net_write_data(&send_cursor, response, response_size);
-
-                    init_con->protocol_state = PROTOCOL_AWAIT_PING_REQUEST;
-                    break;
-                }
-                case PROTOCOL_AWAIT_PING_REQUEST: {
-                    if (packet_id != 1) {
-                        rec_cursor.error = 1;
-                    }
-
-                    // read ping request packet
-                    mc_ulong payload = net_read_ulong(&rec_cursor);
-
-                    int out_size = net_varint_size(1) + 8;
-                    net_write_varint(&send_cursor, out_size);
-                    net_write_varint(&send_cursor, 1);
-                    net_write_ulong(&send_cursor, payload);
-                    break;
-                }
-                case PROTOCOL_AWAIT_HELLO: {
-                    if (packet_id != 0) {
-                        rec_cursor.error = 1;
-                    }
-
-                    // read hello packet
-                    net_string username = net_read_string(&rec_cursor, 16);
-                    // @TODO(traks) more username validation
-                    if (username.size == 0) {
-                        rec_cursor.error = 1;
-                        break;
-                    }
-                    memcpy(init_con->username, username.ptr, username.size);
-                    init_con->username_size = username.size;
-
-                    // @TODO(traks) online mode
-                    // @TODO(traks) enable compression
-
-                    init_con->protocol_state = PROTOCOL_JOIN_WHEN_SENT;
-                    break;
-                }
-                default:
-                    logs("Protocol state %d not accepting packets",
-                            init_con->protocol_state);
-                    rec_cursor.error = 1;
-                    break;
-                }
-
-                assert(send_cursor.error == 0);
-
-                if (packet_size != rec_cursor.index - packet_start) {
-                    rec_cursor.error = 1;
-                }
+        entity_player * player = &entity->player;
+        if (!queue_socket_recv(player->sock,
+                player->rec_buf + player->rec_cursor,
+                player->rec_buf_size - player->rec_cursor,
+                SOCKET_TAG_PLAYER_RECV | entity->eid)) {
+            // ring is full, the player will call recv() itself
+            break;
+        }
+    }
 
-                if (rec_cursor.error != 0) {
-                    logs("Initial connection protocol error occurred");
-                    close(sock);
-                    init_con->flags = 0;
-                    initial_connection_count--;
-                    break;
-                }
-            }
+    if (!submit_socket_ops(1)) {
+        logs("Failed to exchange player data via io_uring");
+        exit(1);
+    }
 
-            memmove(rec_cursor.buf, rec_cursor.buf + rec_cursor.index,
-                    rec_cursor.limit - rec_cursor.index);
-            init_con->rec_cursor = rec_cursor.limit - rec_cursor.index;
+    mc_ulong tag;
+    int result;
+    while (reap_socket_op(&tag, &result)) {
+        entity_base * entity = resolve_entity(tag & ~SOCKET_TAG_KIND_MASK);
+        // players can't disconnect while they have operations in flight
+        assert(entity->type == ENTITY_PLAYER);
 
-            init_con->send_cursor = send_cursor.index;
+        switch (tag & SOCKET_TAG_KIND_MASK) {
+        case SOCKET_TAG_PLAYER_RECV:
+            entity->player.ring_rec_result = result;
+            entity->flags |= PLAYER_RING_RECEIVED;
+            break;
+        case SOCKET_TAG_PLAYER_SEND:
+            complete_player_send(entity, result);
+            break;
+        default:
+            assert(0);
         }
     }
+}
 
-    end_timed_block();
+static void
+receive_socket_events(memory_arena * scratch_arena) {
+    process_socket_events();
+}
+
+static void
+exchange_player_data(memory_arena * scratch_arena) {
+    if (io_ring_available()) {
+        exchange_player_data_via_ring();
+    }
+}
 
-    begin_timed_block("send initial connections");
+static void
+add_joined_players(memory_arena * scratch_arena) {
+    // add players that logged in on the handshake thread
+    pending_join join;
+    while (pop_pending_join(&join)) {
+        entity_base * entity = try_reserve_entity(ENTITY_PLAYER);
 
-    for (int i = 0; i < ARRAY_SIZE(initial_connections); i++) {
-        initial_connection * init_con = initial_connections + i;
-        if ((init_con->flags & INITIAL_CONNECTION_IN_USE) == 0) {
+        if (entity->type == ENTITY_NULL) {
+            // @TODO(traks) send some message and disconnect
+            close(join.sock);
             continue;
         }
 
-        int sock = init_con->sock;
-        ssize_t send_size = send(sock, init_con->send_buf,
-                init_con->send_cursor, 0);
-
-        if (send_size == -1) {
-            // EAGAIN means no data sent
-            if (errno != EAGAIN) {
-                logs_errno("Couldn't send protocol data: %s");
-                close(sock);
-                init_con->flags = 0;
-                initial_connection_count--;
-            }
-        } else {
-            memmove(init_con->send_buf, init_con->send_buf + send_size,
-                    init_con->send_cursor - send_size);
-            init_con->send_cursor -= send_size;
-
-            if (init_con->send_cursor == 0
-                    && init_con->protocol_state == PROTOCOL_JOIN_WHEN_SENT) {
-                init_con->flags = 0;
-                initial_connection_count--;
+        entity_player * player = &entity->player;
 
-                entity_base * entity = try_reserve_entity(ENTITY_PLAYER);
+        // the send buffer is only allocated once data piles up
+        player->rec_buf_size = 1 << 16;
+        player->rec_buf = malloc(player->rec_buf_size);
 
-                if (entity->type == ENTITY_NULL) {
-                    // @TODO(traks) send some message and disconnect
-                    close(init_con->sock);
-                    continue;
-                }
-
-                entity_player * player = &entity->player;
-
-                // @TODO(traks) don't malloc this much when a player joins. AAA
-                // games send a lot less than 1MB/tick. For example, according
-                // to some website, Fortnite sends about 1.5KB/tick. Although we
-                // sometimes have to send a bunch of chunk data, which can be
-                // tens of KB. Minecraft even allows up to 2MB of chunk data.
-                player->rec_buf_size = 1 << 16;
-                player->rec_buf = malloc(player->rec_buf_size);
-
-                player->send_buf_size = 1 << 20;
-                player->send_buf = malloc(player->send_buf_size);
-
-                if (player->rec_buf == NULL || player->send_buf == NULL) {
-                    // @TODO(traks) send some message on disconnect
-                    free(player->send_buf);
-                    free(player->rec_buf);
-                    evict_entity(entity->eid);
-                    close(init_con->sock);
-                    continue;
-                }
+        if (player->rec_buf == NULL) {
+            // @TODO(traks) send some message on disconnect
+            evict_entity(entity->eid);
+            close(join.sock);
+            continue;
+        }
 
-                player->sock = init_con->sock;
-                memcpy(player->username, init_con->username,
-                        init_con->username_size);
-                player->username_size = init_con->username_size;
-                player->chunk_cache_radius = -1;
-                // @TODO(traks) configurable server-wide global
-                player->new_chunk_cache_radius = MAX_CHUNK_CACHE_RADIUS;
-                player->last_keep_alive_sent_tick = serv->current_tick;
-                entity->flags |= PLAYER_GOT_ALIVE_RESPONSE;
-                player->selected_slot = PLAYER_FIRST_HOTBAR_SLOT;
-                // @TODO(traks) collision width and height of player depending
-                // on player pose
-                entity->collision_width = 0.6;
-                entity->collision_height = 1.8;
-                set_player_gamemode(entity, GAMEMODE_CREATIVE);
-
-                teleport_player(entity, 88, 70, 73, 0, 0);
-
-                // @TODO(traks) ensure this can never happen instead of assering
-                // it never will hopefully happen
-                assert(serv->tab_list_added_count < ARRAY_SIZE(serv->tab_list_added));
-                serv->tab_list_added[serv->tab_list_added_count] = entity->eid;
-                serv->tab_list_added_count++;
-
-                logs("Player '%.*s' joined", (int) init_con->username_size,
-                        init_con->username);
-            }
+        if (!watch_socket(socket_watcher, join.sock,
+                SOCKET_TAG_PLAYER | entity->eid)) {
+            free(player->rec_buf);
+            evict_entity(entity->eid);
+            close(join.sock);
+            continue;
         }
-    }
 
-    end_timed_block();
+        player->sock = join.sock;
+        // the client may have sent data after the hello packet
+        entity->flags |= PLAYER_SOCKET_READABLE;
+        memcpy(player->username, join.username, join.username_size);
+        player->username_size = join.username_size;
+        player->chunk_cache_radius = -1;
+        // @TODO(traks) configurable server-wide global
+        player->new_chunk_cache_radius = MAX_CHUNK_CACHE_RADIUS;
+        player->last_keep_alive_sent_tick = serv->current_tick;
+        entity->player.send_flags |= PLAYER_GOT_ALIVE_RESPONSE;
+        player->selected_slot = PLAYER_FIRST_HOTBAR_SLOT;
+        // @TODO(traks) collision width and height of player depending
+        // on player pose
+        entity->collision_width = 0.6;
+        entity->collision_height = 1.8;
+        set_player_gamemode(entity, GAMEMODE_CREATIVE);
+
+        teleport_player(entity, 88, 70, 73, 0, 0);
+
+        // @TODO(traks) ensure this can never happen instead of assering
+        // it never will hopefully happen
+        assert(serv->tab_list_added_count < ARRAY_SIZE(serv->tab_list_added));
+        serv->tab_list_added[serv->tab_list_added_count] = entity->eid;
+        serv->tab_list_added_count++;
+
+        logs("Player '%.*s' joined", (int) join.username_size, join.username);
+    }
 
-    // run scheduled block updates
-    begin_timed_block("scheduled updates");
+}
 
-    memory_arena scheduled_update_arena = {
-        .ptr = serv->short_lived_scratch,
-        .size = serv->short_lived_scratch_size
-    };
+static void
+run_scheduled_updates(memory_arena * scratch_arena) {
+    memory_arena scheduled_update_arena = *scratch_arena;
     propagate_delayed_block_updates(&scheduled_update_arena);
+}
 
-    end_timed_block();
-
-    // update entities
-    begin_timed_block("tick entities");
-
+static void
+tick_entities(memory_arena * scratch_arena) {
     for (int i = 0; i < ARRAY_SIZE(serv->entities); i++) {
         entity_base * entity = serv->entities + i;
         if ((entity->flags & ENTITY_IN_USE) == 0) {
             continue;
         }
 
-        memory_arena tick_arena = {
-            .ptr = serv->short_lived_scratch,
-            .size = serv->short_lived_scratch_size
-        };
-
+        memory_arena tick_arena = *scratch_arena;
         tick_entity(entity, &tick_arena);
     }
+}
 
-    end_timed_block();
-
-    begin_timed_block("update tab list");
-
+static void
+update_tab_list(memory_arena * scratch_arena) {
     // remove players from tab list if necessary
     for (int i = 0; i < serv->tab_list_size; i++) {
         entity_id eid = serv->tab_list[i];
@@ -1122,10 +955,31 @@ server_tick(void) {
         serv->tab_list_size++;
     }
 
-    end_timed_block();
+    if (serv->tab_list_added_count > 0 || serv->tab_list_removed_count > 0) {
+        update_server_status();
+    }
+
+}
+
+static void
+link_chunks(memory_arena * scratch_arena) {
+    link_loaded_chunks();
+}
 
-    begin_timed_block("send players");
+static void
+spread_light(memory_arena * scratch_arena) {
+    update_light();
+}
+
+static void
+prepare_broadcast(memory_arena * scratch_arena) {
+    // Packets shared by all players are allocated for the rest of the tick,
+    // since the players are sent their packets in a later phase.
+    prepare_broadcast_packets(scratch_arena);
+}
 
+static void
+update_chunk_interest(memory_arena * scratch_arena) {
     for (int i = 0; i < ARRAY_SIZE(serv->entities); i++) {
         entity_base * entity = serv->entities + i;
         if (entity->type != ENTITY_PLAYER) {
@@ -1134,16 +988,50 @@ server_tick(void) {
         if ((entity->flags & ENTITY_IN_USE) == 0) {
             continue;
         }
+        update_player_chunk_interest(entity);
+    }
+}
 
-        memory_arena tick_arena = {
-            .ptr = serv->short_lived_scratch,
-            .size = serv->short_lived_scratch_size
-        };
-        send_packets_to_player(entity, &tick_arena);
+static void
+send_player_job(void * data, int index, memory_arena * scratch_arena) {
+    entity_base * * players = data;
+    memory_arena tick_arena = *scratch_arena;
+    send_packets_to_player(players[index], &tick_arena);
+}
+
+static void
+send_players(memory_arena * scratch_arena) {
+    entity_base * * players = alloc_in_arena(scratch_arena,
+            ARRAY_SIZE(serv->entities) * sizeof *players);
+    int player_count = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(serv->entities); i++) {
+        entity_base * entity = serv->entities + i;
+        if (entity->type != ENTITY_PLAYER) {
+            continue;
+        }
+        if ((entity->flags & ENTITY_IN_USE) == 0) {
+            continue;
+        }
+        players[player_count] = entity;
+        player_count++;
     }
 
+    // players are independent of each other, so send to them in parallel
+    run_jobs(send_player_job, players, player_count);
+
+    // send everything queued up for the players in one go
+    begin_timed_block("submit player sends");
+    queue_player_sends();
+    if (!submit_socket_ops(0)) {
+        logs("Failed to send player data via io_uring");
+        exit(1);
+    }
     end_timed_block();
+}
 
+static void
+clear_entity_changes(memory_arena * scratch_arena) {
     // clear global messages
     serv->global_msg_count = 0;
 
@@ -1151,8 +1039,6 @@ server_tick(void) {
     serv->tab_list_added_count = 0;
     serv->tab_list_removed_count = 0;
 
-    begin_timed_block("clear entity changes");
-
     for (int i = 0; i < ARRAY_SIZE(serv->entities); i++) {
         entity_base * entity = serv->entities + i;
         if ((entity->flags & ENTITY_IN_USE) == 0) {
@@ -1161,11 +1047,13 @@ server_tick(void) {
 
         entity->changed_data = 0;
     }
+}
 
-    end_timed_block();
-
-    // load chunks from requests
-    begin_timed_block("load chunks");
+static void
+request_loads(memory_arena * scratch_arena) {
+    // hand chunk load requests to the chunk loader threads
+    chunk_pos load_positions[ARRAY_SIZE(serv->chunk_load_requests)];
+    int load_count = 0;
 
     for (int i = 0; i < serv->chunk_load_request_count; i++) {
         chunk_pos pos = serv->chunk_load_requests[i];
@@ -1177,62 +1065,103 @@ server_tick(void) {
             // no one cares about the chunk anymore, so don't bother loading it
             continue;
         }
-        if (ch->flags & CHUNK_LOADED) {
+        if (ch->flags & (CHUNK_LOADED | CHUNK_LOAD_REQUESTED)) {
             continue;
         }
+        // also prevents duplicate requests from different players
+        ch->flags |= CHUNK_LOAD_REQUESTED;
+        load_positions[load_count] = pos;
+        load_count++;
+    }
 
-        // @TODO(traks) actual chunk loading from whatever storage provider
-        memory_arena scratch_arena = {
-            .ptr = serv->short_lived_scratch,
-            .size = serv->short_lived_scratch_size
-        };
-        try_read_chunk_from_storage(pos, ch, &scratch_arena);
-
-        if (!(ch->flags & CHUNK_LOADED)) {
-            // @TODO(traks) fall back to stone plateau at y = 0 for now
-            // clean up some of the mess the chunk loader might've left behind
-            // @TODO(traks) perhaps this should be in a separate struct so we
-            // can easily clear it
-            for (int sectioni = 0; sectioni < 16; sectioni++) {
-                if (ch->sections[sectioni] != NULL) {
-                    free_chunk_section(ch->sections[sectioni]);
-                    ch->sections[sectioni] = NULL;
-                }
-                ch->non_air_count[sectioni] = 0;
-            }
-
-            // @TODO(traks) perhaps should require enough chunk sections to be
-            // available for chunk before even trying to load/generate it.
-            ch->sections[0] = alloc_chunk_section();
-            if (ch->sections[0] == NULL) {
-                logs("Failed to allocate chunk section during generation");
-                exit(1);
-            }
-
-            for (int x = 0; x < 16; x++) {
-                for (int z = 0; z < 16; z++) {
-                    int index = (z << 4) | x;
-                    ch->sections[0]->block_states[index] = 2;
-                    ch->motion_blocking_height_map[index] = 1;
-                    ch->non_air_count[0]++;
-                }
-            }
-
-            ch->flags |= CHUNK_LOADED;
-        }
+    int requested = request_chunk_loads(load_positions, load_count);
+    for (int i = requested; i < load_count; i++) {
+        // too many loads in flight, players will request these again later
+        chunk * ch = get_chunk_if_available(load_positions[i]);
+        ch->flags &= ~CHUNK_LOAD_REQUESTED;
     }
 
     serv->chunk_load_request_count = 0;
 
-    end_timed_block();
+}
 
-    // update chunks
-    begin_timed_block("update chunks");
-    clean_up_unused_chunks();
-    end_timed_block();
+static void
+update_chunks(memory_arena * scratch_arena) {
+    // chunks that are done saving may be unloaded now
+    finish_chunk_saves();
+    clean_up_unused_chunks(scratch_arena);
+}
+
+enum tick_phase_index {
+    PHASE_SOCKET_EVENTS,
+    PHASE_EXCHANGE_PLAYER_DATA,
+    PHASE_ADD_JOINED_PLAYERS,
+    PHASE_SCHEDULED_UPDATES,
+    PHASE_TICK_ENTITIES,
+    PHASE_UPDATE_TAB_LIST,
+    PHASE_LINK_LOADED_CHUNKS,
+    PHASE_UPDATE_LIGHT,
+    PHASE_PREPARE_BROADCAST,
+    PHASE_UPDATE_CHUNK_INTEREST,
+    PHASE_SEND_PLAYERS,
+    PHASE_CLEAR_ENTITY_CHANGES,
+    PHASE_REQUEST_CHUNK_LOADS,
+    PHASE_UPDATE_CHUNKS,
+    PHASE_COUNT,
+};
+
+#define AFTER(phase) ((mc_uint) 1 << (phase))
+
+// A phase starts once all phases it depends on have finished. Phases that
+// don't depend on each other may run at the same time, so they must not
+// touch the same data. Chunks are linked and lit while the broadcast packets
+// are prepared, and unused chunks are cleaned up while entity changes are
+// cleared.
+static tick_phase tick_phases[PHASE_COUNT] = {
+    [PHASE_SOCKET_EVENTS] = {"process socket events",
+            receive_socket_events, 0},
+    [PHASE_EXCHANGE_PLAYER_DATA] = {"exchange player data",
+            exchange_player_data, AFTER(PHASE_SOCKET_EVENTS)},
+    [PHASE_ADD_JOINED_PLAYERS] = {"add joined players",
+            add_joined_players, AFTER(PHASE_EXCHANGE_PLAYER_DATA)},
+    [PHASE_SCHEDULED_UPDATES] = {"scheduled updates",
+            run_scheduled_updates, AFTER(PHASE_ADD_JOINED_PLAYERS)},
+    [PHASE_TICK_ENTITIES] = {"tick entities",
+            tick_entities, AFTER(PHASE_SCHEDULED_UPDATES)},
+    [PHASE_UPDATE_TAB_LIST] = {"update tab list",
+            update_tab_list, AFTER(PHASE_TICK_ENTITIES)},
+    // link chunks the chunk loader threads finished loading, so they can be
+    // sent to players this tick
+    [PHASE_LINK_LOADED_CHUNKS] = {"link loaded chunks",
+            link_chunks, AFTER(PHASE_TICK_ENTITIES)},
+    // spread light from changed blocks and into linked chunks before
+    // anything is sent
+    [PHASE_UPDATE_LIGHT] = {"update light",
+            spread_light, AFTER(PHASE_LINK_LOADED_CHUNKS)},
+    [PHASE_PREPARE_BROADCAST] = {"prepare broadcast packets",
+            prepare_broadcast, AFTER(PHASE_UPDATE_TAB_LIST)},
+    [PHASE_UPDATE_CHUNK_INTEREST] = {"update chunk interest",
+            update_chunk_interest, AFTER(PHASE_UPDATE_LIGHT)},
+    [PHASE_SEND_PLAYERS] = {"send players",
+            send_players, AFTER(PHASE_UPDATE_CHUNK_INTEREST)
+            | AFTER(PHASE_PREPARE_BROADCAST)},
+    [PHASE_CLEAR_ENTITY_CHANGES] = {"clear entity changes",
+            clear_entity_changes, AFTER(PHASE_SEND_PLAYERS)},
+    [PHASE_REQUEST_CHUNK_LOADS] = {"request chunk loads",
+            request_loads, AFTER(PHASE_SEND_PLAYERS)},
+    [PHASE_UPDATE_CHUNKS] = {"update chunks",
+            update_chunks, AFTER(PHASE_REQUEST_CHUNK_LOADS)},
+};
 
+static void
+server_tick(void) {
+    begin_timed_block("server tick");
+    run_tick_phases(tick_phases, PHASE_COUNT);
     serv->current_tick++;
     end_timed_block();
+
+    // scratch memory only lives for a single tick
+    reset_scratch_arenas();
 }
 
 static int
@@ -1457,10 +1386,7 @@ init_fluid_data(void) {
 
 static void
 load_tags(char * file_name, tag_list * tags, resource_loc_table * table) {
-    memory_arena arena = {
-        .ptr = serv->short_lived_scratch,
-        .size = serv->short_lived_scratch_size,
-    };
+    memory_arena arena = *get_scratch_arena();
     buffer_cursor cursor = read_file(&arena, file_name);
 
     net_string args[16];
@@ -1593,18 +1519,66 @@ init_biomes(void) {
 }
 
 int
-main(void) {
+main(int argc, char ** argv) {
     init_program_nano_time();
 
+    int convert_world_only = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--convert-world") == 0) {
+            convert_world_only = 1;
+        } else {
+            logs("Unknown argument: %s", argv[i]);
+            exit(1);
+        }
+    }
+
     logs("Running Blaze");
 
+    serv = calloc(sizeof * serv, 1);
+    if (serv == NULL) {
+        logs_errno("Failed to allocate server struct: %s");
+        exit(1);
+    }
+
+    // reserve null entity
+    serv->entities[0].flags |= ENTITY_IN_USE;
+    serv->entities[0].type = ENTITY_NULL;
+
+    // sets up the scratch arenas as well
+    init_job_system();
+
+    // @TODO(traks) better sizes
+    alloc_resource_loc_table(&serv->block_resource_table, 1 << 10, 1 << 16, ACTUAL_BLOCK_TYPE_COUNT);
+    alloc_resource_loc_table(&serv->item_resource_table, 1 << 10, 1 << 16, ITEM_TYPE_COUNT);
+    alloc_resource_loc_table(&serv->entity_resource_table, 1 << 10, 1 << 12, ENTITY_TYPE_COUNT);
+    alloc_resource_loc_table(&serv->fluid_resource_table, 1 << 10, 1 << 10, 5);
+
+    init_item_data();
+    init_block_data();
+    init_entity_data();
+    init_fluid_data();
+    load_tags("blocktags.txt", &serv->block_tags, &serv->block_resource_table);
+    load_tags("itemtags.txt", &serv->item_tags, &serv->item_resource_table);
+    load_tags("entitytags.txt", &serv->entity_tags, &serv->entity_resource_table);
+    load_tags("fluidtags.txt", &serv->fluid_tags, &serv->fluid_resource_table);
+
+    init_dimension_types();
+    init_biomes();
+
+    if (convert_world_only) {
+        convert_world();
+        return 0;
+    }
+
     // Ignore SIGPIPE so the server doesn't crash (by getting signals) if a
     // client decides to abruptly close its end of the connection.
     signal(SIGPIPE, SIG_IGN);
 
-    // @TODO(traks) ctrl+c is useful for debugging if the program ends up inside
-    // an infinite loop
-    // signal(SIGINT, handle_sigint);
+    // Stop cleanly on ctrl+c or a termination request, so changed chunks are
+    // saved. The handler restores the default action, so a second ctrl+c
+    // still kills a server stuck in an infinite loop.
+    signal(SIGINT, handle_sigint);
+    signal(SIGTERM, handle_sigint);
 
     struct sockaddr_in server_addr = {
         .sin_family = AF_INET,
@@ -1661,41 +1635,25 @@ main(void) {
 
     logs("Bound to address");
 
-    serv = calloc(sizeof * serv, 1);
-    if (serv == NULL) {
-        logs_errno("Failed to allocate server struct: %s");
-        exit(1);
+    socket_watcher = create_socket_watcher();
+    if (socket_watcher == -1) {
+        logs("Socket readiness notifications unavailable, polling all sockets");
     }
 
-    // reserve null entity
-    serv->entities[0].flags |= ENTITY_IN_USE;
-    serv->entities[0].type = ENTITY_NULL;
-
-    // allocate memory for arenas
-    serv->short_lived_scratch_size = 4194304;
-    serv->short_lived_scratch = calloc(serv->short_lived_scratch_size, 1);
-    if (serv->short_lived_scratch == NULL) {
-        logs_errno("Failed to allocate short lived scratch arena: %s");
-        exit(1);
+    if (IO_URING_ENABLED) {
+        // room for a receive and a send for every player
+        if (create_io_ring(2 * MAX_PLAYERS)) {
+            logs("Using io_uring for player sockets");
+        } else {
+            logs("Falling back to plain socket calls for player sockets");
+        }
     }
 
-    // @TODO(traks) better sizes
-    alloc_resource_loc_table(&serv->block_resource_table, 1 << 10, 1 << 16, ACTUAL_BLOCK_TYPE_COUNT);
-    alloc_resource_loc_table(&serv->item_resource_table, 1 << 10, 1 << 16, ITEM_TYPE_COUNT);
-    alloc_resource_loc_table(&serv->entity_resource_table, 1 << 10, 1 << 12, ENTITY_TYPE_COUNT);
-    alloc_resource_loc_table(&serv->fluid_resource_table, 1 << 10, 1 << 10, 5);
-
-    init_item_data();
-    init_block_data();
-    init_entity_data();
-    init_fluid_data();
-    load_tags("blocktags.txt", &serv->block_tags, &serv->block_resource_table);
-    load_tags("itemtags.txt", &serv->item_tags, &serv->item_resource_table);
-    load_tags("entitytags.txt", &serv->entity_tags, &serv->entity_resource_table);
-    load_tags("fluidtags.txt", &serv->fluid_tags, &serv->fluid_resource_table);
 
-    init_dimension_types();
-    init_biomes();
+    start_handshake_thread(server_sock);
+    start_chunk_loader_threads();
+    start_chunk_saver_thread();
+    start_job_threads();
 
     int profiler_sock = -1;
 
@@ -1724,23 +1682,56 @@ main(void) {
             }
         }
         if (profiler_sock != -1) {
+            memory_arena * scratch_arena = get_scratch_arena();
             buffer_cursor cursor = {
-                .buf = serv->short_lived_scratch,
-                .limit = serv->short_lived_scratch_size
+                .buf = scratch_arena->ptr,
+                .limit = scratch_arena->size
             };
 
             // fill in length after writing all the data
             cursor.index += 4;
 
-            net_write_int(&cursor, timed_block_count);
-            for (int i = 0; i < timed_block_count; i++) {
-                timed_block * block = timed_blocks + i;
-                int name_size = strlen(block->name);
+            int thread_count = get_job_thread_count();
+            int total_block_count = 0;
+            for (int t = 0; t < thread_count; t++) {
+                total_block_count += thread_profiles[t].timed_block_count;
+            }
+
+            // every block is tagged with the job thread that ran it
+            net_write_int(&cursor, total_block_count);
+            for (int t = 0; t < thread_count; t++) {
+                thread_profile * profile = thread_profiles + t;
+                for (int i = 0; i < profile->timed_block_count; i++) {
+                    timed_block * block = profile->timed_blocks + i;
+                    int name_size = strlen(block->name);
+                    net_write_ubyte(&cursor, t);
+                    net_write_ubyte(&cursor, name_size);
+                    net_write_data(&cursor, block->name, name_size);
+                    net_write_ulong(&cursor, block->start_time);
+                    net_write_uint(&cursor, block->end_time - block->start_time);
+                    assert(block->start_time < block->end_time);
+                }
+            }
+
+            // counters are summed over all job threads
+            profiler_counter counters[ARRAY_SIZE(thread_profiles[0].profiler_counters)];
+            int counter_count = 0;
+            for (int t = 0; t < thread_count; t++) {
+                thread_profile * profile = thread_profiles + t;
+                for (int i = 0; i < profile->profiler_counter_count; i++) {
+                    profiler_counter * counter = profile->profiler_counters + i;
+                    add_counter(counters, &counter_count, ARRAY_SIZE(counters),
+                            counter->name, counter->value);
+                }
+            }
+
+            net_write_int(&cursor, counter_count);
+            for (int i = 0; i < counter_count; i++) {
+                profiler_counter * counter = counters + i;
+                int name_size = strlen(counter->name);
                 net_write_ubyte(&cursor, name_size);
-                net_write_data(&cursor, block->name, name_size);
-                net_write_ulong(&cursor, block->start_time);
-                net_write_uint(&cursor, block->end_time - block->start_time);
-                assert(block->start_time < block->end_time);
+                net_write_data(&cursor, counter->name, name_size);
+                net_write_ulong(&cursor, counter->value);
             }
 
             int end = cursor.index;
@@ -1768,8 +1759,15 @@ main(void) {
             }
         }
 
-        timed_block_count = 0;
-        cur_timed_block_depth = 0;
+        for (int t = 0; t < get_job_thread_count(); t++) {
+            thread_profile * profile = thread_profiles + t;
+            profile->timed_block_count = 0;
+            profile->cur_timed_block_depth = 0;
+
+            for (int i = 0; i < profile->profiler_counter_count; i++) {
+                profile->profiler_counters[i].value = 0;
+            }
+        }
 
         long long end_time = program_nano_time();
         long long elapsed_micros = (end_time - start_time) / 1000;
@@ -1784,6 +1782,9 @@ main(void) {
         }
     }
 
+    // edits that are too recent to have been saved would be lost otherwise
+    flush_chunk_saves();
+
     logs("Goodbye!");
     return 0;
 }
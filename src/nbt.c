@@ -70,6 +70,160 @@ nbt_get_compound(net_string matcher, nbt_tape_entry * tape,
     return found + 2;
 }
 
+mc_ubyte
+nbt_read_compound_entry(buffer_cursor * cursor, net_string * key) {
+    // Reads the tag and key of the next entry of a compound. The cursor is
+    // left at the value of the entry. Returns the end tag at the end of the
+    // compound or on errors.
+    mc_ubyte tag = net_read_ubyte(cursor);
+    if (tag == NBT_TAG_END || cursor->error) {
+        return NBT_TAG_END;
+    }
+
+    mc_ushort key_size = net_read_ushort(cursor);
+    if (key_size > cursor->limit - cursor->index) {
+        cursor->error = 1;
+        return NBT_TAG_END;
+    }
+    *key = (net_string) {
+        .size = key_size,
+        .ptr = cursor->buf + cursor->index
+    };
+    cursor->index += key_size;
+    return tag;
+}
+
+net_string
+nbt_read_string_value(buffer_cursor * cursor) {
+    mc_ushort size = net_read_ushort(cursor);
+    if (size > cursor->limit - cursor->index) {
+        cursor->error = 1;
+        net_string res = {0};
+        return res;
+    }
+    net_string res = {
+        .size = size,
+        .ptr = cursor->buf + cursor->index
+    };
+    cursor->index += size;
+    return res;
+}
+
+void
+nbt_write_key(buffer_cursor * cursor, mc_ubyte tag, net_string key) {
+    net_write_ubyte(cursor, tag);
+    net_write_ushort(cursor, key.size);
+    net_write_data(cursor, key.ptr, key.size);
+}
+
+void
+nbt_write_string(buffer_cursor * cursor, net_string val) {
+    net_write_ushort(cursor, val.size);
+    net_write_data(cursor, val.ptr, val.size);
+}
+
+void
+nbt_skip_value(mc_ubyte tag, buffer_cursor * cursor) {
+    // Moves the cursor past the value of the given tag, without looking at
+    // the contents of compounds and lists other than the lengths.
+    typedef struct {
+        unsigned char is_list;
+        unsigned char element_tag;
+        mc_uint list_elems_remaining;
+    } skip_level_info;
+
+    skip_level_info level_info[NBT_MAX_SKIP_LEVELS];
+    int cur_level = -1;
+
+    static mc_byte elem_bytes[] = {0, 1, 2, 4, 8, 4, 8};
+    static mc_byte array_elem_bytes[] = {1, 0, 0, 0, 4, 8};
+
+    for (;;) {
+        switch (tag) {
+        case NBT_TAG_BYTE:
+        case NBT_TAG_SHORT:
+        case NBT_TAG_INT:
+        case NBT_TAG_LONG:
+        case NBT_TAG_FLOAT:
+        case NBT_TAG_DOUBLE: {
+            int bytes = elem_bytes[tag];
+            if (cursor->index > cursor->limit - bytes) {
+                cursor->error = 1;
+            } else {
+                cursor->index += bytes;
+            }
+            break;
+        }
+        case NBT_TAG_BYTE_ARRAY:
+        case NBT_TAG_INT_ARRAY:
+        case NBT_TAG_LONG_ARRAY: {
+            mc_long elem_bytes = array_elem_bytes[tag - NBT_TAG_BYTE_ARRAY];
+            mc_long array_size = net_read_uint(cursor);
+            if (cursor->index > (mc_long) cursor->limit
+                    - elem_bytes * array_size) {
+                cursor->error = 1;
+            } else {
+                cursor->index += elem_bytes * array_size;
+            }
+            break;
+        }
+        case NBT_TAG_STRING:
+            nbt_read_string_value(cursor);
+            break;
+        case NBT_TAG_LIST:
+        case NBT_TAG_COMPOUND:
+            if (cur_level == NBT_MAX_SKIP_LEVELS - 1) {
+                cursor->error = 1;
+                break;
+            }
+            cur_level++;
+            level_info[cur_level] = (skip_level_info) {
+                .is_list = (tag == NBT_TAG_LIST)
+            };
+            if (tag == NBT_TAG_LIST) {
+                level_info[cur_level].element_tag = net_read_ubyte(cursor);
+                level_info[cur_level].list_elems_remaining = net_read_uint(cursor);
+            }
+            break;
+        default:
+            cursor->error = 1;
+        }
+
+        if (cursor->error) {
+            return;
+        }
+
+        // find the next value to skip
+        for (;;) {
+            if (cur_level == -1) {
+                return;
+            }
+
+            skip_level_info * level = level_info + cur_level;
+            if (level->is_list) {
+                if (level->list_elems_remaining == 0) {
+                    cur_level--;
+                    continue;
+                }
+                level->list_elems_remaining--;
+                tag = level->element_tag;
+                break;
+            } else {
+                net_string key;
+                tag = nbt_read_compound_entry(cursor, &key);
+                if (cursor->error) {
+                    return;
+                }
+                if (tag == NBT_TAG_END) {
+                    cur_level--;
+                    continue;
+                }
+                break;
+            }
+        }
+    }
+}
+
 nbt_tape_entry *
 load_nbt(buffer_cursor * cursor, memory_arena * arena, int max_levels) {
     // Currently the tape format is as follows:
@@ -0,0 +1,420 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "shared.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+#if defined(__linux__) && IO_URING_ENABLED
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// Socket readiness notifications. Instead of calling recv() and accept() on
+// every socket every tick, we ask the kernel which sockets actually have
+// something for us. All sockets are registered edge-triggered, so a socket
+// only shows up again once new data arrives. This means users must keep
+// reading from a socket until it would block (or until a read returns less
+// than requested) before forgetting about it.
+//
+// On systems without epoll, waiting for events returns -1, which means that
+// readiness is unknown and callers should treat all sockets as ready.
+
+int
+create_socket_watcher(void) {
+#if defined(__linux__)
+    return epoll_create1(0);
+#else
+    return -1;
+#endif
+}
+
+int
+watch_socket(int watcher, int sock, mc_ulong tag) {
+#if defined(__linux__)
+    if (watcher == -1) {
+        return 1;
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+        .data = {.u64 = tag}
+    };
+    if (epoll_ctl(watcher, EPOLL_CTL_ADD, sock, &event) == -1) {
+        logs_errno("Failed to watch socket: %s");
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+int
+retag_watched_socket(int watcher, int sock, mc_ulong tag) {
+#if defined(__linux__)
+    if (watcher == -1) {
+        return 1;
+    }
+
+    // Modifying the registration also re-evaluates the socket's readiness,
+    // so data received before this call is not lost.
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+        .data = {.u64 = tag}
+    };
+    if (epoll_ctl(watcher, EPOLL_CTL_MOD, sock, &event) == -1) {
+        logs_errno("Failed to retag watched socket: %s");
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+int
+unwatch_socket(int watcher, int sock) {
+#if defined(__linux__)
+    if (watcher == -1) {
+        return 1;
+    }
+
+    // the event argument is ignored, but old kernels require it to be set
+    struct epoll_event event = {0};
+    if (epoll_ctl(watcher, EPOLL_CTL_DEL, sock, &event) == -1) {
+        logs_errno("Failed to unwatch socket: %s");
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+int
+wait_for_socket_events(int watcher, mc_ulong * tags, int max_tags,
+        int timeout_millis) {
+#if defined(__linux__)
+    if (watcher != -1) {
+        struct epoll_event events[256];
+        int max_events = MIN(max_tags, (int) ARRAY_SIZE(events));
+        int event_count;
+
+        for (;;) {
+            event_count = epoll_wait(watcher, events, max_events,
+                    timeout_millis);
+            if (event_count != -1 || errno != EINTR) {
+                break;
+            }
+        }
+
+        if (event_count == -1) {
+            logs_errno("Failed to wait for socket events: %s");
+            return -1;
+        }
+
+        for (int i = 0; i < event_count; i++) {
+            tags[i] = events[i].data.u64;
+        }
+        return event_count;
+    }
+#endif
+
+    if (timeout_millis > 0) {
+        usleep(timeout_millis * 1000);
+    }
+    return -1;
+}
+
+// Returns the number of bytes in the socket's send queue, including bytes
+// that were sent but not acknowledged by the peer yet. Returns 0 if the
+// platform doesn't tell us.
+int
+get_socket_send_queue_size(int sock) {
+#if defined(__linux__)
+    int size;
+    if (ioctl(sock, SIOCOUTQ, &size) == 0) {
+        return size;
+    }
+#endif
+    return 0;
+}
+
+// Batched socket operations through io_uring. Instead of calling recv() and
+// send() once per player, operations are queued and handed to the kernel in
+// one go. All operations use MSG_DONTWAIT, so the kernel completes them
+// while submitting them instead of waiting for the socket to become ready.
+// That keeps the rules simple: a buffer is only in use by the kernel from
+// the moment its operation is queued until its completion is reaped, and
+// completions are always reaped before the next batch is assembled.
+//
+// Registered buffers are not used, because plain socket sends and receives
+// can't make use of them.
+//
+// If io_uring is disabled at build time or unavailable at run time,
+// queueing an operation fails and callers should use plain socket calls.
+
+#if defined(__linux__) && IO_URING_ENABLED
+
+typedef struct {
+    int fd;
+
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned sq_entries;
+
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+    unsigned cq_entries;
+
+    // operations queued in the submission ring, not yet given to the kernel
+    unsigned queued;
+    // operations given to the kernel whose completion hasn't been reaped
+    unsigned in_flight;
+} io_ring;
+
+static io_ring ring = {.fd = -1};
+
+static int
+io_ring_supports_socket_ops(int fd) {
+    // enough room for all operations up to and including IORING_OP_RECV
+    size_t probe_size = sizeof (struct io_uring_probe)
+            + (IORING_OP_RECV + 1) * sizeof (struct io_uring_probe_op);
+    unsigned char probe_buf[probe_size];
+    memset(probe_buf, 0, probe_size);
+    struct io_uring_probe * probe = (struct io_uring_probe *) probe_buf;
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+            probe, IORING_OP_RECV + 1) == -1) {
+        return 0;
+    }
+    if (probe->last_op < IORING_OP_RECV) {
+        return 0;
+    }
+    if (!(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED)) {
+        return 0;
+    }
+    if (!(probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED)) {
+        return 0;
+    }
+    return 1;
+}
+
+int
+create_io_ring(unsigned entries) {
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) {
+        logs_errno("Failed to set up io_uring: %s");
+        return 0;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        logs("io_uring lacks single mmap support");
+        goto bail;
+    }
+    if (!io_ring_supports_socket_ops(fd)) {
+        logs("io_uring doesn't support socket sends and receives");
+        goto bail;
+    }
+
+    // the submission and completion rings share a single mapping
+    size_t sq_ring_size = params.sq_off.array
+            + params.sq_entries * sizeof (unsigned);
+    size_t cq_ring_size = params.cq_off.cqes
+            + params.cq_entries * sizeof (struct io_uring_cqe);
+    size_t ring_size = MAX(sq_ring_size, cq_ring_size);
+
+    unsigned char * ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring_ptr == MAP_FAILED) {
+        logs_errno("Failed to map io_uring: %s");
+        goto bail;
+    }
+
+    size_t sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    struct io_uring_sqe * sqes = mmap(NULL, sqes_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        logs_errno("Failed to map io_uring entries: %s");
+        munmap(ring_ptr, ring_size);
+        goto bail;
+    }
+
+    ring = (io_ring) {
+        .fd = fd,
+        .sq_tail = (unsigned *) (ring_ptr + params.sq_off.tail),
+        .sq_mask = (unsigned *) (ring_ptr + params.sq_off.ring_mask),
+        .sq_array = (unsigned *) (ring_ptr + params.sq_off.array),
+        .sqes = sqes,
+        .sq_entries = params.sq_entries,
+        .cq_head = (unsigned *) (ring_ptr + params.cq_off.head),
+        .cq_tail = (unsigned *) (ring_ptr + params.cq_off.tail),
+        .cq_mask = (unsigned *) (ring_ptr + params.cq_off.ring_mask),
+        .cqes = (struct io_uring_cqe *) (ring_ptr + params.cq_off.cqes),
+        .cq_entries = params.cq_entries,
+    };
+    return 1;
+
+bail:
+    close(fd);
+    return 0;
+}
+
+int
+io_ring_available(void) {
+    return ring.fd != -1;
+}
+
+static int
+queue_socket_op(int opcode, int sock, void * buf, int size, mc_ulong tag) {
+    if (ring.fd == -1) {
+        return 0;
+    }
+    if (ring.queued == ring.sq_entries) {
+        return 0;
+    }
+    // never let the completion ring overflow
+    if (ring.queued + ring.in_flight == ring.cq_entries) {
+        return 0;
+    }
+
+    // only we write the tail, the kernel writes the head
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe * sqe = ring.sqes + index;
+
+    *sqe = (struct io_uring_sqe) {0};
+    sqe->opcode = opcode;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = size;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = tag;
+
+    ring.sq_array[index] = index;
+    // publish the entry before the kernel can see the new tail
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    add_profiler_counter("io_uring ops", 1);
+    return 1;
+}
+
+int
+queue_socket_recv(int sock, void * buf, int size, mc_ulong tag) {
+    return queue_socket_op(IORING_OP_RECV, sock, buf, size, tag);
+}
+
+int
+queue_socket_send(int sock, void * buf, int size, mc_ulong tag) {
+    return queue_socket_op(IORING_OP_SEND, sock, buf, size, tag);
+}
+
+int
+submit_socket_ops(int wait_for_completions) {
+    if (ring.fd == -1) {
+        return 1;
+    }
+
+    for (;;) {
+        unsigned to_submit = ring.queued;
+        unsigned min_complete = 0;
+        unsigned flags = 0;
+
+        if (wait_for_completions) {
+            unsigned completed = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)
+                    - *ring.cq_head;
+            if (completed < ring.in_flight + to_submit) {
+                min_complete = ring.in_flight + to_submit;
+                flags |= IORING_ENTER_GETEVENTS;
+            }
+        }
+
+        if (to_submit == 0 && min_complete == 0) {
+            return 1;
+        }
+
+        int submitted = syscall(__NR_io_uring_enter, ring.fd, to_submit,
+                min_complete, flags, NULL, 0);
+        add_profiler_counter("socket syscalls", 1);
+
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logs_errno("Failed to submit socket operations: %s");
+            return 0;
+        }
+
+        ring.queued -= submitted;
+        ring.in_flight += submitted;
+
+        // The kernel doesn't wait for completions if it couldn't submit
+        // everything, so keep going until everything is submitted.
+        if (ring.queued == 0) {
+            return 1;
+        }
+    }
+}
+
+int
+reap_socket_op(mc_ulong * tag, int * result) {
+    if (ring.fd == -1) {
+        return 0;
+    }
+
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    struct io_uring_cqe * cqe = ring.cqes + (head & *ring.cq_mask);
+    *tag = cqe->user_data;
+    *result = cqe->res;
+
+    // hand the entry back to the kernel after we're done reading it
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    ring.in_flight--;
+    return 1;
+}
+
+#else
+
+int
+create_io_ring(unsigned entries) {
+    return 0;
+}
+
+int
+io_ring_available(void) {
+    return 0;
+}
+
+int
+queue_socket_recv(int sock, void * buf, int size, mc_ulong tag) {
+    return 0;
+}
+
+int
+queue_socket_send(int sock, void * buf, int size, mc_ulong tag) {
+    return 0;
+}
+
+int
+submit_socket_ops(int wait_for_completions) {
+    return 1;
+}
+
+int
+reap_socket_op(mc_ulong * tag, int * result) {
+    return 0;
+}
+
+#endif
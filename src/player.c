@@ -1,13 +1,27 @@
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
-#include <zlib.h>
 #include "shared.h"
 
+// IOV_MAX is only defined with some feature test macros. Fall back to the
+// Linux limit, or to the minimum POSIX allows elsewhere.
+#ifndef IOV_MAX
+#if defined(__linux__)
+#define IOV_MAX (1024)
+#else
+#define IOV_MAX (16)
+#endif
+#endif
+
+#define NANOS_PER_TICK (50000000)
+
 // Implicit packet IDs for ease of updating. Updating packet IDs manually is a
 // pain because packet types are ordered alphabetically and Mojang doesn't
 // provide an explicit list of packet IDs.
@@ -159,19 +173,6 @@ enum clientbound_packet_type {
     CLIENTBOUND_PACKET_COUNT,
 };
 
-static void
-nbt_write_key(buffer_cursor * cursor, mc_ubyte tag, net_string key) {
-    net_write_ubyte(cursor, tag);
-    net_write_ushort(cursor, key.size);
-    net_write_data(cursor, key.ptr, key.size);
-}
-
-static void
-nbt_write_string(buffer_cursor * cursor, net_string val) {
-    net_write_ushort(cursor, val.size);
-    net_write_data(cursor, val.ptr, val.size);
-}
-
 void
 teleport_player(entity_base * entity,
         double new_x, double new_y, double new_z,
@@ -337,10 +338,10 @@ process_packet(entity_base * entity, buffer_cursor * rec_cursor,
         mc_int teleport_id = net_read_varint(rec_cursor);
 
         if ((entity->flags & ENTITY_TELEPORTING)
-                && (entity->flags & PLAYER_SENT_TELEPORT)
+                && (entity->player.send_flags & PLAYER_SENT_TELEPORT)
                 && teleport_id == player->current_teleport_id) {
             entity->flags &= ~ENTITY_TELEPORTING;
-            entity->flags &= ~PLAYER_SENT_TELEPORT;
+            entity->player.send_flags &= ~PLAYER_SENT_TELEPORT;
         }
         break;
     }
@@ -573,7 +574,19 @@ process_packet(entity_base * entity, buffer_cursor * rec_cursor,
     case SBP_KEEP_ALIVE: {
         mc_ulong id = net_read_ulong(rec_cursor);
         if (player->last_keep_alive_sent_tick == id) {
-            entity->flags |= PLAYER_GOT_ALIVE_RESPONSE;
+            entity->player.send_flags |= PLAYER_GOT_ALIVE_RESPONSE;
+
+            // If more data was waiting in front of the keep alive than the
+            // connection delivers in a tick, the round trip time mostly tells
+            // us how long it took to send that data, so skip it. Of the
+            // others we use the lowest.
+            mc_long rtt = program_nano_time()
+                    - player->last_keep_alive_sent_nanos;
+            if (player->keep_alive_sent_backlog <= player->send_drain_rate
+                    && (player->min_rtt_nanos == 0
+                    || rtt < player->min_rtt_nanos)) {
+                player->min_rtt_nanos = rtt;
+            }
         }
         break;
     }
@@ -1075,6 +1088,11 @@ chunk_cache_index(chunk_pos pos) {
     return (x * MAX_CHUNK_CACHE_DIAM + z) % n;
 }
 
+// Internal header bits of packets written to the send buffer. The lowest 3
+// bits contain the number of bytes to skip before the packet size.
+#define PACKET_SHOULD_COMPRESS (0x80)
+#define PACKET_BY_REFERENCE (0x40)
+
 static void
 begin_packet(buffer_cursor * send_cursor, mc_int id) {
     if (send_cursor->limit - send_cursor->index < 6) {
@@ -1112,8 +1130,8 @@ finish_packet(buffer_cursor * send_cursor, entity_base * player) {
 
     int size_offset = 5 - net_varint_size(packet_size);
     int internal_header = size_offset;
-    if (player->flags & PLAYER_PACKET_COMPRESSION) {
-        internal_header |= 0x80;
+    if (player->player.send_flags & PLAYER_PACKET_COMPRESSION) {
+        internal_header |= PACKET_SHOULD_COMPRESS;
     }
     send_cursor->buf[send_cursor->index] = internal_header;
     send_cursor->index += 1 + size_offset;
@@ -1123,6 +1141,334 @@ finish_packet(buffer_cursor * send_cursor, entity_base * player) {
     send_cursor->index = packet_end;
 }
 
+#define PACKET_REFERENCE_SIZE (1 + sizeof (unsigned char *) + sizeof (int))
+
+// Converts the packet at the cursor, written with begin_packet and
+// finish_packet, into the format sent over the wire and moves the cursor to
+// the next packet. Packets are compressed if necessary. Where possible the
+// result is written in place, otherwise it is allocated in the arena.
+// Returns 0 on failure.
+static int
+finalise_packet(buffer_cursor * send_cursor, memory_arena * arena,
+        unsigned char ** wire_data, int * wire_size) {
+    int internal_header = send_cursor->buf[send_cursor->index];
+    int size_offset = internal_header & 0x7;
+    int should_compress = internal_header & PACKET_SHOULD_COMPRESS;
+
+    if (internal_header & PACKET_BY_REFERENCE) {
+        // packet data was finalised in advance and lives elsewhere
+        unsigned char * reference = send_cursor->buf + send_cursor->index + 1;
+        memcpy(wire_data, reference, sizeof *wire_data);
+        memcpy(wire_size, reference + sizeof *wire_data, sizeof *wire_size);
+        send_cursor->index += PACKET_REFERENCE_SIZE;
+        return 1;
+    }
+
+    send_cursor->index += 1 + size_offset;
+
+    int packet_start = send_cursor->index;
+    mc_int packet_size = net_read_varint(send_cursor);
+    unsigned char * payload = send_cursor->buf + send_cursor->index;
+    send_cursor->index += packet_size;
+
+    if (should_compress && packet_size >= PACKET_COMPRESSION_THRESHOLD) {
+        // leave room in front of the compressed data for the packet size and
+        // the uncompressed size
+        int max_prefix_size = 10;
+        int max_compressed_size = compress_bound(packet_size);
+        unsigned char * compressed = (unsigned char *) alloc_in_arena(arena,
+                max_prefix_size + max_compressed_size) + max_prefix_size;
+
+        long long start_time = program_nano_time();
+        int compressed_size = compress_data(payload, packet_size,
+                compressed, max_compressed_size);
+        add_profiler_counter("compression nanos",
+                program_nano_time() - start_time);
+
+        if (compressed_size == -1) {
+            return 0;
+        }
+
+        add_profiler_counter("compression bytes in", packet_size);
+        add_profiler_counter("compression bytes out", compressed_size);
+
+        int data_size = net_varint_size(packet_size) + compressed_size;
+        int prefix_size = net_varint_size(data_size)
+                + net_varint_size(packet_size);
+        buffer_cursor prefix_cursor = {
+            .buf = compressed - prefix_size,
+            .limit = prefix_size
+        };
+        net_write_varint(&prefix_cursor, data_size);
+        net_write_varint(&prefix_cursor, packet_size);
+
+        *wire_data = prefix_cursor.buf;
+        *wire_size = prefix_size + compressed_size;
+    } else if (should_compress) {
+        // Too small to be worth compressing, so send it uncompressed with an
+        // uncompressed size of 0. The prefix fits in the space reserved for
+        // the internal header.
+        int prefix_size = net_varint_size(packet_size + 1) + 1;
+        buffer_cursor prefix_cursor = {
+            .buf = payload - prefix_size,
+            .limit = prefix_size
+        };
+        net_write_varint(&prefix_cursor, packet_size + 1);
+        net_write_varint(&prefix_cursor, 0);
+
+        *wire_data = prefix_cursor.buf;
+        *wire_size = prefix_size + packet_size;
+    } else {
+        *wire_data = send_cursor->buf + packet_start;
+        *wire_size = send_cursor->index - packet_start;
+    }
+    return 1;
+}
+
+// Converts all packets written to the send cursor into the format sent over
+// the wire, and copies them to the final cursor.
+static void
+finalise_packets(buffer_cursor * send_cursor, buffer_cursor * final_cursor,
+        memory_arena * arena) {
+    send_cursor->limit = send_cursor->index;
+    send_cursor->index = 0;
+    while (send_cursor->index != send_cursor->limit) {
+        memory_arena temp_arena = *arena;
+        unsigned char * wire_data;
+        int wire_size;
+        if (!finalise_packet(send_cursor, &temp_arena,
+                &wire_data, &wire_size)) {
+            final_cursor->error = 1;
+            break;
+        }
+        net_write_data(final_cursor, wire_data, wire_size);
+    }
+}
+
+static int
+count_packets(buffer_cursor * send_cursor) {
+    buffer_cursor cursor = {
+        .buf = send_cursor->buf,
+        .limit = send_cursor->index
+    };
+    int count = 0;
+    while (cursor.index != cursor.limit) {
+        int internal_header = cursor.buf[cursor.index];
+        if (internal_header & PACKET_BY_REFERENCE) {
+            cursor.index += PACKET_REFERENCE_SIZE;
+        } else {
+            cursor.index += 1 + (internal_header & 0x7);
+            mc_int packet_size = net_read_varint(&cursor);
+            cursor.index += packet_size;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Converts all packets written to the send cursor into the format sent over
+// the wire, as a list of segments to be sent in order. Small packets are
+// moved together to the front of the send cursor's buffer, so they can be
+// sent as one segment. Compressed packets and packets added by reference
+// each get a segment of their own. Returns 0 on failure.
+static int
+finalise_packets_to_segments(buffer_cursor * send_cursor,
+        memory_arena * arena, struct iovec * segments, int * segment_count) {
+    int compact_index = 0;
+    int count = *segment_count;
+    int run_segment = -1;
+
+    send_cursor->limit = send_cursor->index;
+    send_cursor->index = 0;
+    while (send_cursor->index != send_cursor->limit) {
+        unsigned char * wire_data;
+        int wire_size;
+        if (!finalise_packet(send_cursor, arena, &wire_data, &wire_size)) {
+            return 0;
+        }
+        if (wire_size == 0) {
+            continue;
+        }
+
+        if (wire_data >= send_cursor->buf
+                && wire_data < send_cursor->buf + send_cursor->limit) {
+            // Packet was finalised in place. Everything before the read
+            // index is no longer needed, and the finalised packet isn't
+            // larger than the original, so this never overwrites packets
+            // that still need to be finalised.
+            unsigned char * dest = send_cursor->buf + compact_index;
+            memmove(dest, wire_data, wire_size);
+            compact_index += wire_size;
+
+            if (run_segment != -1 && run_segment == count - 1) {
+                // directly follows the previous packet
+                segments[run_segment].iov_len += wire_size;
+                continue;
+            }
+            run_segment = count;
+            wire_data = dest;
+        }
+
+        segments[count] = (struct iovec) {
+            .iov_base = wire_data,
+            .iov_len = wire_size
+        };
+        count++;
+    }
+
+    add_profiler_counter("send segments", count - *segment_count);
+    *segment_count = count;
+    return 1;
+}
+
+// Upper bound for the size of packets after they have been finalised.
+static int
+finalised_packets_bound(buffer_cursor * send_cursor) {
+    // Every packet has an internal header of 6 bytes, which easily covers
+    // the framing of packets that aren't compressed. The overhead of
+    // compressed packets is covered by the compression bound.
+    return send_cursor->index + compress_bound(send_cursor->index);
+}
+
+// Adds data that is already in its final wire format to the packets being
+// sent, without copying it. The data must stay around until the packets have
+// been handed to the socket or copied to the player's send buffer.
+static void
+write_packet_reference(buffer_cursor * send_cursor, unsigned char * data,
+        int data_size) {
+    if (send_cursor->limit - send_cursor->index < PACKET_REFERENCE_SIZE) {
+        send_cursor->error = 1;
+        return;
+    }
+
+    unsigned char * reference = send_cursor->buf + send_cursor->index;
+    reference[0] = PACKET_BY_REFERENCE;
+    memcpy(reference + 1, &data, sizeof data);
+    memcpy(reference + 1 + sizeof data, &data_size, sizeof data_size);
+    send_cursor->index += PACKET_REFERENCE_SIZE;
+}
+
+static inline void
+pack_palette_indices(mc_ushort * block_states, mc_ushort * palette_map,
+        int bits_per_id, mc_ulong * out) {
+    // Packs palette indices the same way as chunk sections: indices don't
+    // span multiple longs and the first index is in the least significant
+    // bits. Called with constant bits per ID, so the compiler can unroll the
+    // inner loop.
+    int ids_per_long = 64 / bits_per_id;
+    int j = 0;
+    for (int longi = 0; j < 4096; longi++) {
+        mc_ulong entry = 0;
+        int end = MIN(4096, j + ids_per_long);
+        for (int shift = 0; j < end; j++, shift += bits_per_id) {
+            entry |= (mc_ulong) palette_map[block_states[j]] << shift;
+        }
+        out[longi] = entry;
+    }
+}
+
+static void
+write_section_for_client(buffer_cursor * send_cursor, chunk * ch,
+        int section_y, mc_ushort * palette_map) {
+    // The client uses a palette for 4 to 8 bits per block and the global
+    // palette otherwise. The palette map maps block states to palette
+    // indices, and is only valid for block states in the palette.
+    net_write_ushort(send_cursor, ch->non_air_count[section_y]);
+
+    chunk_section * section = ch->sections[section_y];
+    if (section == NULL) {
+        net_write_ubyte(send_cursor, 4);
+        net_write_varint(send_cursor, 1);
+        net_write_varint(send_cursor, ch->uniform_section_states[section_y]);
+        // all palette indices are 0
+        int longs = 4096 / 16;
+        net_write_varint(send_cursor, longs);
+        if (send_cursor->limit - send_cursor->index < longs * 8) {
+            send_cursor->error = 1;
+            return;
+        }
+        memset(send_cursor->buf + send_cursor->index, 0, longs * 8);
+        send_cursor->index += longs * 8;
+        return;
+    }
+
+    if (section->palette != NULL) {
+        // sections use the same data layout as the protocol
+        int bits_per_block = section->bits_per_block;
+        net_write_ubyte(send_cursor, bits_per_block);
+        net_write_varint(send_cursor, section->palette_size);
+        for (int i = 0; i < section->palette_size; i++) {
+            net_write_varint(send_cursor, section->palette[i]);
+        }
+        int blocks_per_long = 64 / bits_per_block;
+        int longs = (4096 + blocks_per_long - 1) / blocks_per_long;
+        net_write_varint(send_cursor, longs);
+        net_write_ulongs(send_cursor, section->data, longs);
+        return;
+    }
+
+    // Sections with block states stored directly can have few different
+    // block states after blocks have been changed, so check whether a
+    // palette is possible.
+    mc_ushort * block_states = (mc_ushort *) section->data;
+    mc_ushort palette[256];
+    int palette_size = 0;
+    for (int i = 0; i < 4096; i++) {
+        mc_ushort block_state = block_states[i];
+        int index = palette_map[block_state];
+        if (index < palette_size && palette[index] == block_state) {
+            continue;
+        }
+        if (palette_size == 256) {
+            palette_size++;
+            break;
+        }
+        palette[palette_size] = block_state;
+        palette_map[block_state] = palette_size;
+        palette_size++;
+    }
+
+    mc_ulong packed[1024];
+
+    if (palette_size > 256) {
+        // the client derives the number of bits from the global palette
+        int bits_per_block = 15;
+        net_write_ubyte(send_cursor, bits_per_block);
+        int longs = 4096 / 4;
+        for (int i = 0; i < longs; i++) {
+            packed[i] = (mc_ulong) block_states[4 * i]
+                    | ((mc_ulong) block_states[4 * i + 1] << 15)
+                    | ((mc_ulong) block_states[4 * i + 2] << 30)
+                    | ((mc_ulong) block_states[4 * i + 3] << 45);
+        }
+        net_write_varint(send_cursor, longs);
+        net_write_ulongs(send_cursor, packed, longs);
+        return;
+    }
+
+    int bits_per_block = 4;
+    while ((1 << bits_per_block) < palette_size) {
+        bits_per_block++;
+    }
+    net_write_ubyte(send_cursor, bits_per_block);
+    net_write_varint(send_cursor, palette_size);
+    for (int i = 0; i < palette_size; i++) {
+        net_write_varint(send_cursor, palette[i]);
+    }
+
+    switch (bits_per_block) {
+    case 4: pack_palette_indices(block_states, palette_map, 4, packed); break;
+    case 5: pack_palette_indices(block_states, palette_map, 5, packed); break;
+    case 6: pack_palette_indices(block_states, palette_map, 6, packed); break;
+    case 7: pack_palette_indices(block_states, palette_map, 7, packed); break;
+    default: pack_palette_indices(block_states, palette_map, 8, packed); break;
+    }
+    int blocks_per_long = 64 / bits_per_block;
+    int longs = (4096 + blocks_per_long - 1) / blocks_per_long;
+    net_write_varint(send_cursor, longs);
+    net_write_ulongs(send_cursor, packed, longs);
+}
+
 static void
 send_chunk_fully(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
         entity_base * entity, memory_arena * tick_arena) {
@@ -1132,32 +1478,12 @@ send_chunk_fully(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
     // significant bit
     mc_ushort section_mask = 0;
     for (int i = 0; i < 16; i++) {
-        if (ch->sections[i] != NULL) {
+        // sections with only air don't need to be sent
+        if (ch->non_air_count[i] != 0) {
             section_mask |= 1 << i;
         }
     }
 
-    // calculate total size of chunk section data
-    mc_int section_data_size = 0;
-    // @TODO(traks) compute bits per block using block type table
-    int bits_per_block = 15;
-    int blocks_per_long = 64 / bits_per_block;
-
-    for (int i = 0; i < 16; i++) {
-        chunk_section * section = ch->sections[i];
-        if (section == NULL) {
-            continue;
-        }
-
-        // size of non-air count + bits per block
-        section_data_size += 2 + 1;
-        // size of block state data in longs
-        int longs = 16 * 16 * 16 / blocks_per_long;
-        section_data_size += net_varint_size(longs);
-        // number of bytes used to store block state data
-        section_data_size += longs * 8;
-    }
-
     begin_packet(send_cursor, CBP_LEVEL_CHUNK);
     net_write_int(send_cursor, pos.x);
     net_write_int(send_cursor, pos.z);
@@ -1207,39 +1533,29 @@ send_chunk_fully(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
         net_write_varint(send_cursor, 1);
     }
 
-    net_write_varint(send_cursor, section_data_size);
+    // The size of the section data is written before the data, so encode
+    // the sections elsewhere first. Sections with the global palette are
+    // the largest.
+    memory_arena temp_arena = *tick_arena;
+    int max_section_data_size = 16 * (2 + 1 + 2 + 1024 * 8);
+    buffer_cursor section_cursor = {
+        .buf = alloc_in_arena(&temp_arena, max_section_data_size),
+        .limit = max_section_data_size
+    };
+    mc_ushort * palette_map = alloc_in_arena(&temp_arena,
+            serv->actual_block_state_count * sizeof (mc_ushort));
 
     for (int i = 0; i < 16; i++) {
-        chunk_section * section = ch->sections[i];
-        if (section == NULL) {
-            continue;
-        }
-
-        net_write_ushort(send_cursor, ch->non_air_count[i]);
-        net_write_ubyte(send_cursor, bits_per_block);
-
-        // number of longs used for the block states
-        int longs = 16 * 16 * 16 / blocks_per_long;
-        net_write_varint(send_cursor, longs);
-        mc_ulong val = 0;
-        int offset = 0;
-
-        for (int j = 0; j < 16 * 16 * 16; j++) {
-            mc_ulong block_state = section->block_states[j];
-            val |= block_state << offset;
-            offset += bits_per_block;
-
-            if (offset > 64 - bits_per_block) {
-                net_write_ulong(send_cursor, val);
-                val = 0;
-                offset = 0;
-            }
-        }
-
-        if (offset != 0) {
-            net_write_ulong(send_cursor, val);
+        if (section_mask & (1 << i)) {
+            write_section_for_client(&section_cursor, ch, i, palette_map);
         }
     }
+    if (section_cursor.error) {
+        send_cursor->error = 1;
+    }
+
+    net_write_varint(send_cursor, section_cursor.index);
+    net_write_data(send_cursor, section_cursor.buf, section_cursor.index);
 
     // number of block entities
     net_write_varint(send_cursor, 0);
@@ -1248,24 +1564,78 @@ send_chunk_fully(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
     end_timed_block();
 }
 
+static void
+write_section_light(buffer_cursor * send_cursor, unsigned char * nibbles,
+        mc_ubyte uniform_light) {
+    net_write_varint(send_cursor, 2048);
+    if (nibbles != NULL) {
+        net_write_data(send_cursor, nibbles, 2048);
+        return;
+    }
+    if (send_cursor->limit - send_cursor->index < 2048) {
+        send_cursor->error = 1;
+        return;
+    }
+    memset(send_cursor->buf + send_cursor->index, uniform_light * 0x11, 2048);
+    send_cursor->index += 2048;
+}
+
 static void
 send_light_update(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
-        entity_base * entity, memory_arena * tick_arena) {
-    // There are 18 chunk sections from 1 section below the world to 1 section
-    // above the world. The lowest chunk section comes first (and is the least
-    // significant bit).
+        entity_base * entity, int whole_chunk) {
+    // Sends the light of the whole chunk, or of the sections whose light
+    // changed this tick. There are 18 light sections from 1 section below
+    // the world to 1 section above the world. The lowest section comes first
+    // and is the least significant bit of the masks. Sections that are
+    // completely dark are sent without data.
 
     begin_timed_block("send light update");
 
-    // @TODO(traks) send the real lighting data
-
+    mc_ushort sky_sections = ch->changed_sky_light;
+    mc_ushort block_sections = ch->changed_block_light;
     // light sections present as arrays in this packet
-    mc_int sky_light_mask = 0x3ffff;
-    mc_int block_light_mask = 0x3ffff;
+    mc_int sky_light_mask = 0;
+    mc_int block_light_mask = 0;
     // sections with all light values equal to 0
     mc_int zero_sky_light_mask = 0;
     mc_int zero_block_light_mask = 0;
 
+    if (whole_chunk) {
+        // There is no light below the world or block light above the world.
+        // For the client, sky light is 15 in sections above the highest
+        // section it got sky light for, so fully lit sections at the top
+        // don't need to be sent.
+        zero_sky_light_mask = 0x1;
+        zero_block_light_mask = 0x1 | (0x1 << 17);
+        sky_sections = 0;
+        for (int section_y = 0; section_y < 16; section_y++) {
+            if (ch->light.sky[section_y] != NULL
+                    || ch->light.uniform_sky[section_y] != 15) {
+                sky_sections = (2 << section_y) - 1;
+            }
+        }
+        block_sections = 0xffff;
+    }
+
+    for (int section_y = 0; section_y < 16; section_y++) {
+        if (sky_sections & (1 << section_y)) {
+            if (ch->light.sky[section_y] == NULL
+                    && ch->light.uniform_sky[section_y] == 0) {
+                zero_sky_light_mask |= 2 << section_y;
+            } else {
+                sky_light_mask |= 2 << section_y;
+            }
+        }
+        if (block_sections & (1 << section_y)) {
+            if (ch->light.block[section_y] == NULL
+                    && ch->light.uniform_block[section_y] == 0) {
+                zero_block_light_mask |= 2 << section_y;
+            } else {
+                block_light_mask |= 2 << section_y;
+            }
+        }
+    }
+
     begin_packet(send_cursor, CBP_LIGHT_UPDATE);
     net_write_varint(send_cursor, pos.x);
     net_write_varint(send_cursor, pos.z);
@@ -1275,19 +1645,16 @@ send_light_update(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
     net_write_varint(send_cursor, zero_sky_light_mask);
     net_write_varint(send_cursor, zero_block_light_mask);
 
-    for (int i = 0; i < 18; i++) {
-        net_write_varint(send_cursor, 2048);
-        for (int j = 0; j < 4096; j += 2) {
-            mc_ubyte light = 0xff;
-            net_write_ubyte(send_cursor, light);
+    for (int section_y = 0; section_y < 16; section_y++) {
+        if (sky_light_mask & (2 << section_y)) {
+            write_section_light(send_cursor, ch->light.sky[section_y],
+                    ch->light.uniform_sky[section_y]);
         }
     }
-
-    for (int i = 0; i < 18; i++) {
-        net_write_varint(send_cursor, 2048);
-        for (int j = 0; j < 4096; j += 2) {
-            mc_ubyte light = 0;
-            net_write_ubyte(send_cursor, light);
+    for (int section_y = 0; section_y < 16; section_y++) {
+        if (block_light_mask & (2 << section_y)) {
+            write_section_light(send_cursor, ch->light.block[section_y],
+                    ch->light.uniform_block[section_y]);
         }
     }
     finish_packet(send_cursor, entity);
@@ -1295,6 +1662,204 @@ send_light_update(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
     end_timed_block();
 }
 
+// Players are sent packets in parallel, and may need the shared packets of
+// the same chunk at the same time. Whoever gets a chunk's lock first encodes
+// the packets, and the others wait for them.
+static pthread_mutex_t chunk_packet_locks[CHUNK_PACKET_LOCK_COUNT];
+static pthread_once_t chunk_packet_locks_once = PTHREAD_ONCE_INIT;
+
+static void
+init_chunk_packet_locks(void) {
+    for (int i = 0; i < CHUNK_PACKET_LOCK_COUNT; i++) {
+        if (pthread_mutex_init(chunk_packet_locks + i, NULL) != 0) {
+            logs("Failed to set up chunk packet lock");
+            exit(1);
+        }
+    }
+}
+
+static pthread_mutex_t *
+lock_chunk_packets(chunk_pos pos) {
+    pthread_once(&chunk_packet_locks_once, init_chunk_packet_locks);
+    mc_uint key = ((mc_uint) (mc_ushort) pos.x << 16) | (mc_ushort) pos.z;
+    int index = (key * 0x9e3779b9u) >> (32 - CHUNK_PACKET_LOCK_COUNT_LOG2);
+    pthread_mutex_t * lock = chunk_packet_locks + index;
+    pthread_mutex_lock(lock);
+    return lock;
+}
+
+static int
+send_shared_chunk_and_light(buffer_cursor * send_cursor, chunk_pos pos,
+        chunk * ch, entity_base * entity, memory_arena * tick_arena) {
+    // must hold the chunk's packet lock
+    if (ch->packet_cache != NULL) {
+        add_profiler_counter("chunk packet cache hits", 1);
+        write_packet_reference(send_cursor, ch->packet_cache,
+                ch->packet_cache_size);
+        return ch->packet_cache_size;
+    }
+
+    add_profiler_counter("chunk packet cache misses", 1);
+    begin_timed_block("encode chunk packets");
+
+    memory_arena temp_arena = *tick_arena;
+    int max_packets_size = 1 << 19;
+    buffer_cursor packets_cursor = {
+        .buf = alloc_in_arena(&temp_arena, max_packets_size),
+        .limit = max_packets_size
+    };
+    send_chunk_fully(&packets_cursor, pos, ch, entity, &temp_arena);
+    send_light_update(&packets_cursor, pos, ch, entity, 1);
+
+    int max_final_size = finalised_packets_bound(&packets_cursor);
+    buffer_cursor final_cursor = {
+        .buf = alloc_in_arena(&temp_arena, max_final_size),
+        .limit = max_final_size
+    };
+    if (packets_cursor.error == 0) {
+        finalise_packets(&packets_cursor, &final_cursor, &temp_arena);
+    }
+
+    end_timed_block();
+
+    if (packets_cursor.error != 0 || final_cursor.error != 0) {
+        send_cursor->error = 1;
+        return 0;
+    }
+
+    ch->packet_cache = malloc(final_cursor.index);
+    if (ch->packet_cache == NULL) {
+        // Just send the packets without caching them. Finalising rewrote the
+        // packets in place and the finalised copy lives in temporary memory,
+        // so encode them again for this player only.
+        int start = send_cursor->index;
+        send_chunk_fully(send_cursor, pos, ch, entity, tick_arena);
+        send_light_update(send_cursor, pos, ch, entity, 1);
+        return send_cursor->index - start;
+    }
+    memcpy(ch->packet_cache, final_cursor.buf, final_cursor.index);
+    ch->packet_cache_size = final_cursor.index;
+
+    write_packet_reference(send_cursor, ch->packet_cache,
+            ch->packet_cache_size);
+    return ch->packet_cache_size;
+}
+
+// Returns roughly how many bytes will be sent over the wire.
+static int
+send_chunk_and_light(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
+        entity_base * entity, memory_arena * tick_arena) {
+    // The packets are the same for all players with packet compression, so
+    // encode and compress them once and share them.
+    if (!(entity->player.send_flags & PLAYER_PACKET_COMPRESSION)) {
+        int start = send_cursor->index;
+        send_chunk_fully(send_cursor, pos, ch, entity, tick_arena);
+        send_light_update(send_cursor, pos, ch, entity, 1);
+        return send_cursor->index - start;
+    }
+
+    pthread_mutex_t * lock = lock_chunk_packets(pos);
+    int res = send_shared_chunk_and_light(send_cursor, pos, ch, entity,
+            tick_arena);
+    pthread_mutex_unlock(lock);
+    return res;
+}
+
+static void
+send_shared_changed_light(buffer_cursor * send_cursor, chunk_pos pos,
+        chunk * ch, entity_base * entity, memory_arena * tick_arena) {
+    // must hold the chunk's packet lock
+    if (ch->light_update_cache != NULL) {
+        write_packet_reference(send_cursor, ch->light_update_cache,
+                ch->light_update_cache_size);
+        return;
+    }
+
+    memory_arena temp_arena = *tick_arena;
+    // at most 32 sections of light
+    int max_packet_size = 1 << 17;
+    buffer_cursor packet_cursor = {
+        .buf = alloc_in_arena(&temp_arena, max_packet_size),
+        .limit = max_packet_size
+    };
+    send_light_update(&packet_cursor, pos, ch, entity, 0);
+
+    int max_final_size = finalised_packets_bound(&packet_cursor);
+    buffer_cursor final_cursor = {
+        .buf = alloc_in_arena(&temp_arena, max_final_size),
+        .limit = max_final_size
+    };
+    if (packet_cursor.error == 0) {
+        finalise_packets(&packet_cursor, &final_cursor, &temp_arena);
+    }
+
+    if (packet_cursor.error != 0 || final_cursor.error != 0) {
+        send_cursor->error = 1;
+        return;
+    }
+
+    ch->light_update_cache = malloc(final_cursor.index);
+    if (ch->light_update_cache == NULL) {
+        // Just send the packet without sharing it. Like for chunk packets,
+        // the finalised packet can't be used, so encode it again.
+        send_light_update(send_cursor, pos, ch, entity, 0);
+        return;
+    }
+    memcpy(ch->light_update_cache, final_cursor.buf, final_cursor.index);
+    ch->light_update_cache_size = final_cursor.index;
+
+    write_packet_reference(send_cursor, ch->light_update_cache,
+            ch->light_update_cache_size);
+}
+
+static void
+send_changed_light(buffer_cursor * send_cursor, chunk_pos pos, chunk * ch,
+        entity_base * entity, memory_arena * tick_arena) {
+    // Light changes are the same for all players with packet compression as
+    // well, so they're also compressed once per tick and shared.
+    if (!(entity->player.send_flags & PLAYER_PACKET_COMPRESSION)) {
+        send_light_update(send_cursor, pos, ch, entity, 0);
+        return;
+    }
+
+    pthread_mutex_t * lock = lock_chunk_packets(pos);
+    send_shared_changed_light(send_cursor, pos, ch, entity, tick_arena);
+    pthread_mutex_unlock(lock);
+}
+
+// Determines how many bytes of chunk data can be sent to the player this
+// tick. We aim to have about one round trip plus one tick worth of data
+// waiting to be sent or acknowledged. That is enough to keep the connection
+// busy, without letting data pile up in the socket and the send buffer.
+// Piled up data delays everything else we send, and eventually gets the
+// player disconnected.
+static int
+get_chunk_send_budget(entity_base * player) {
+    entity_player * p = &player->player;
+    int backlog = get_socket_send_queue_size(p->sock)
+            + (p->send_cursor - p->send_start);
+
+    // The data delivered since the last tick shows what the connection can
+    // handle. If everything was delivered, we didn't give the connection
+    // enough to find out its limit, so only let the estimate grow.
+    // Deliveries come in bursts, so average them out otherwise.
+    int drained = p->send_backlog + p->new_send_bytes - backlog;
+    if (backlog == 0) {
+        p->send_drain_rate = MAX(p->send_drain_rate, drained);
+    } else {
+        p->send_drain_rate += (drained - p->send_drain_rate) / 8;
+    }
+    p->send_backlog = backlog;
+
+    mc_long target = (mc_long) p->send_drain_rate
+            * (p->min_rtt_nanos + NANOS_PER_TICK) / NANOS_PER_TICK;
+    target = CLAMP(target, MIN_CHUNK_SEND_BACKLOG,
+            MAX_PLAYER_SEND_BUF_SIZE / 2);
+
+    add_profiler_counter("send backlog bytes", backlog);
+    return target - backlog;
+}
+
 static void
 disconnect_player_now(entity_base * entity) {
     entity_player * player = &entity->player;
@@ -1389,10 +1954,36 @@ tick_player(entity_base * player, memory_arena * tick_arena) {
 
     assert(player->type == ENTITY_PLAYER);
     int sock = player->player.sock;
-    ssize_t rec_size = recv(sock, player->player.rec_buf + player->player.rec_cursor,
-            player->player.rec_buf_size - player->player.rec_cursor, 0);
+    int readable = (player->flags & PLAYER_SOCKET_READABLE);
+    ssize_t rec_size = -1;
+
+    if (readable) {
+        int max_rec_size = player->player.rec_buf_size - player->player.rec_cursor;
+
+        if (player->flags & PLAYER_RING_RECEIVED) {
+            // already received through io_uring at the start of the tick
+            player->flags &= ~PLAYER_RING_RECEIVED;
+            rec_size = player->player.ring_rec_result;
+            if (rec_size < 0) {
+                errno = -rec_size;
+                rec_size = -1;
+            }
+        } else {
+            rec_size = recv(sock, player->player.rec_buf + player->player.rec_cursor,
+                    max_rec_size, 0);
+            add_profiler_counter("socket syscalls", 1);
+        }
+
+        if (rec_size < max_rec_size) {
+            // Socket drained (or failed). Edge-triggered notifications tell
+            // us when more data arrives.
+            player->flags &= ~PLAYER_SOCKET_READABLE;
+        }
+    }
 
-    if (rec_size == 0) {
+    if (!readable) {
+        // nothing new to receive
+    } else if (rec_size == 0) {
         disconnect_player_now(player);
     } else if (rec_size == -1) {
         // EAGAIN means no data received
@@ -1431,59 +2022,38 @@ tick_player(entity_base * player, memory_arena * tick_arena) {
             packet_cursor.limit = packet_cursor.index + packet_size;
             rec_cursor.index = packet_cursor.limit;
 
-            if (player->flags & PLAYER_PACKET_COMPRESSION) {
-                // ignore the uncompressed packet size, since we require all
-                // packets to be compressed
-                net_read_varint(&packet_cursor);
-
-                // @TODO(traks) move to a zlib alternative that is optimised
-                // for single pass inflate/deflate. If we don't end up doing
-                // this, make sure the code below is actually correct (when
-                // do we need to clean stuff up?)!
-
-                z_stream zstream;
-                zstream.zalloc = Z_NULL;
-                zstream.zfree = Z_NULL;
-                zstream.opaque = Z_NULL;
-
-                if (inflateInit2(&zstream, 0) != Z_OK) {
-                    logs("inflateInit failed");
-                    disconnect_player_now(player);
-                    break;
-                }
-
-                zstream.next_in = packet_cursor.buf + packet_cursor.index;
-                zstream.avail_in = packet_cursor.limit - packet_cursor.index;
-
-                size_t max_uncompressed_size = 2 * (1 << 20);
-                unsigned char * uncompressed = alloc_in_arena(&process_arena,
-                        max_uncompressed_size);
-
-                zstream.next_out = uncompressed;
-                zstream.avail_out = max_uncompressed_size;
-
-                if (inflate(&zstream, Z_FINISH) != Z_STREAM_END) {
-                    logs("Failed to finish inflating packet: %s", zstream.msg);
-                    disconnect_player_now(player);
-                    break;
-                }
+            if (player->player.send_flags & PLAYER_PACKET_COMPRESSION) {
+                mc_int uncompressed_size = net_read_varint(&packet_cursor);
 
-                if (inflateEnd(&zstream) != Z_OK) {
-                    logs("inflateEnd failed");
+                if (uncompressed_size == 0) {
+                    // packet is below the compression threshold and was sent
+                    // uncompressed
+                } else if (uncompressed_size < 0
+                        || uncompressed_size > MAX_UNCOMPRESSED_PACKET_SIZE) {
+                    logs("Bad uncompressed packet size %jd",
+                            (intmax_t) uncompressed_size);
                     disconnect_player_now(player);
                     break;
-                }
+                } else {
+                    unsigned char * uncompressed = alloc_in_arena(
+                            &process_arena, uncompressed_size);
+                    int inflated_size = decompress_data(
+                            packet_cursor.buf + packet_cursor.index,
+                            packet_cursor.limit - packet_cursor.index,
+                            uncompressed, uncompressed_size,
+                            COMPRESSION_FORMAT_ZLIB);
+
+                    if (inflated_size != uncompressed_size) {
+                        logs("Failed to inflate packet");
+                        disconnect_player_now(player);
+                        break;
+                    }
 
-                if (zstream.avail_in != 0) {
-                    logs("Didn't inflate entire packet");
-                    disconnect_player_now(player);
-                    break;
+                    packet_cursor = (buffer_cursor) {
+                        .buf = uncompressed,
+                        .limit = inflated_size,
+                    };
                 }
-
-                packet_cursor = (buffer_cursor) {
-                    .buf = uncompressed,
-                    .limit = zstream.total_out,
-                };
             }
 
             process_packet(player, &packet_cursor, &process_arena);
@@ -1933,6 +2503,35 @@ send_take_item_entity_packet(entity_base * player, buffer_cursor * send_cursor,
     finish_packet(send_cursor, player);
 }
 
+// Packets that are the same for every player are encoded and compressed once
+// per tick by prepare_broadcast_packets, and then added to each player's
+// packets by reference. Players whose packet format differs from the shared
+// packets get their own copies.
+typedef struct {
+    unsigned char * data;
+    int size;
+} broadcast_packets;
+
+typedef struct {
+    // shared view of the entity before this tick's update
+    tracked_entity before;
+    broadcast_packets packets;
+} broadcast_entity_update;
+
+// The view of each entity that players have if they receive all of the
+// entity's shared updates. Players start tracking an entity with this view,
+// so they can be sent the shared updates from then on.
+static tracked_entity shared_tracked_entities[MAX_ENTITIES];
+static broadcast_entity_update broadcast_entity_updates[MAX_ENTITIES];
+
+static broadcast_packets broadcast_chat;
+static broadcast_packets broadcast_tab_list_changes;
+static broadcast_packets broadcast_full_tab_list;
+
+// Pretend receiver of the shared packets. Only used to determine the format
+// of the packets.
+static entity_base broadcast_receiver;
+
 static void
 try_update_tracked_entity(entity_base * player,
         buffer_cursor * send_cursor, memory_arena * tick_arena,
@@ -1977,7 +2576,7 @@ try_update_tracked_entity(entity_base * player,
             net_write_short(send_cursor, encoded_dz);
             net_write_ubyte(send_cursor, encoded_rot_y);
             net_write_ubyte(send_cursor, encoded_rot_x);
-            net_write_ubyte(send_cursor, !!(player->flags & ENTITY_ON_GROUND));
+            net_write_ubyte(send_cursor, !!(entity->flags & ENTITY_ON_GROUND));
             finish_packet(send_cursor, player);
         } else if (sent_pos) {
             begin_packet(send_cursor, CBP_MOVE_ENTITY_POS);
@@ -1985,14 +2584,14 @@ try_update_tracked_entity(entity_base * player,
             net_write_short(send_cursor, encoded_dx);
             net_write_short(send_cursor, encoded_dy);
             net_write_short(send_cursor, encoded_dz);
-            net_write_ubyte(send_cursor, !!(player->flags & ENTITY_ON_GROUND));
+            net_write_ubyte(send_cursor, !!(entity->flags & ENTITY_ON_GROUND));
             finish_packet(send_cursor, player);
         } else if (sent_rot) {
             begin_packet(send_cursor, CBP_MOVE_ENTITY_ROT);
             net_write_varint(send_cursor, entity->eid);
             net_write_ubyte(send_cursor, encoded_rot_y);
             net_write_ubyte(send_cursor, encoded_rot_x);
-            net_write_ubyte(send_cursor, !!(player->flags & ENTITY_ON_GROUND));
+            net_write_ubyte(send_cursor, !!(entity->flags & ENTITY_ON_GROUND));
             finish_packet(send_cursor, player);
         }
 
@@ -2022,7 +2621,7 @@ try_update_tracked_entity(entity_base * player,
         net_write_double(send_cursor, entity->z);
         net_write_ubyte(send_cursor, encoded_rot_y);
         net_write_ubyte(send_cursor, encoded_rot_x);
-        net_write_ubyte(send_cursor, !!(player->flags & ENTITY_ON_GROUND));
+        net_write_ubyte(send_cursor, !!(entity->flags & ENTITY_ON_GROUND));
         finish_packet(send_cursor, player);
 
         tracked->last_tp_packet_tick = serv->current_tick;
@@ -2068,9 +2667,7 @@ try_update_tracked_entity(entity_base * player,
 }
 
 static void
-start_tracking_entity(entity_base * player,
-        buffer_cursor * send_cursor, memory_arena * tick_arena,
-        tracked_entity * tracked, entity_base * entity) {
+init_tracked_entity(tracked_entity * tracked, entity_base * entity) {
     *tracked = (tracked_entity) {0};
     tracked->eid = entity->eid;
 
@@ -2081,38 +2678,71 @@ start_tracking_entity(entity_base * player,
     unsigned char encoded_rot_y = (int) (entity->rot_y * 256.0f / 360.0f) & 0xff;
     tracked->last_sent_rot_x = encoded_rot_x;
     tracked->last_sent_rot_y = encoded_rot_y;
+    tracked->last_sent_head_rot_y = encoded_rot_y;
 
     tracked->last_tp_packet_tick = serv->current_tick;
     tracked->last_send_pos_tick = serv->current_tick;
     tracked->last_update_tick = serv->current_tick;
 
     switch (entity->type) {
-    case ENTITY_PLAYER: {
+    case ENTITY_PLAYER:
         tracked->update_interval = 2;
+        break;
+    case ENTITY_ITEM:
+        tracked->update_interval = 20;
+        break;
+    }
+}
 
-        begin_packet(send_cursor, CBP_ADD_PLAYER);
-        net_write_varint(send_cursor, entity->eid);
-        // @TODO(traks) appropriate UUID
-        net_write_ulong(send_cursor, 0);
-        net_write_ulong(send_cursor, entity->eid);
-        net_write_double(send_cursor, entity->x);
-        net_write_double(send_cursor, entity->y);
-        net_write_double(send_cursor, entity->z);
-        net_write_ubyte(send_cursor, encoded_rot_y);
-        net_write_ubyte(send_cursor, encoded_rot_x);
-        finish_packet(send_cursor, player);
+static int
+tracked_entity_in_sync(tracked_entity * a, tracked_entity * b) {
+    return a->eid == b->eid
+            && a->last_tp_packet_tick == b->last_tp_packet_tick
+            && a->last_send_pos_tick == b->last_send_pos_tick
+            && a->last_update_tick == b->last_update_tick
+            && a->update_interval == b->update_interval
+            && a->last_sent_x == b->last_sent_x
+            && a->last_sent_y == b->last_sent_y
+            && a->last_sent_z == b->last_sent_z
+            && a->last_sent_rot_x == b->last_sent_rot_x
+            && a->last_sent_rot_y == b->last_sent_rot_y
+            && a->last_sent_head_rot_y == b->last_sent_head_rot_y;
+}
+
+static void
+start_tracking_entity(entity_base * player,
+        buffer_cursor * send_cursor, memory_arena * tick_arena,
+        tracked_entity * tracked, entity_base * entity) {
+    // Start out with the same view of the entity as everyone else, so the
+    // entity's shared updates can be sent to this player too. The entity is
+    // spawned at the position everyone else last received, which may lag
+    // slightly behind the actual position until the next update.
+    tracked_entity * shared = shared_tracked_entities
+            + (entity->eid & ENTITY_INDEX_MASK);
+    assert(shared->eid == entity->eid);
+    *tracked = *shared;
 
-        tracked->last_sent_head_rot_y = encoded_rot_y;
+    switch (entity->type) {
+    case ENTITY_PLAYER: {
+        begin_packet(send_cursor, CBP_ADD_PLAYER);
+        net_write_varint(send_cursor, entity->eid);
+        // @TODO(traks) appropriate UUID
+        net_write_ulong(send_cursor, 0);
+        net_write_ulong(send_cursor, entity->eid);
+        net_write_double(send_cursor, tracked->last_sent_x);
+        net_write_double(send_cursor, tracked->last_sent_y);
+        net_write_double(send_cursor, tracked->last_sent_z);
+        net_write_ubyte(send_cursor, tracked->last_sent_rot_y);
+        net_write_ubyte(send_cursor, tracked->last_sent_rot_x);
+        finish_packet(send_cursor, player);
 
         begin_packet(send_cursor, CBP_ROTATE_HEAD);
         net_write_varint(send_cursor, entity->eid);
-        net_write_ubyte(send_cursor, encoded_rot_y);
+        net_write_ubyte(send_cursor, tracked->last_sent_head_rot_y);
         finish_packet(send_cursor, player);
         break;
     }
     case ENTITY_ITEM: {
-        tracked->update_interval = 20;
-
         // begin_packet(send_cursor, CBP_ADD_MOB);
         // net_write_varint(send_cursor, entity->eid);
         // // @TODO(traks) appropriate UUID
@@ -2137,9 +2767,9 @@ start_tracking_entity(entity_base * player,
         net_write_ulong(send_cursor, 0);
         net_write_ulong(send_cursor, entity->eid);
         net_write_varint(send_cursor, entity->type);
-        net_write_double(send_cursor, entity->x);
-        net_write_double(send_cursor, entity->y);
-        net_write_double(send_cursor, entity->z);
+        net_write_double(send_cursor, tracked->last_sent_x);
+        net_write_double(send_cursor, tracked->last_sent_y);
+        net_write_double(send_cursor, tracked->last_sent_z);
         // rotation of items is ignored
         net_write_ubyte(send_cursor, 0); // x rot
         net_write_ubyte(send_cursor, 0); // y rot
@@ -2166,6 +2796,235 @@ start_tracking_entity(entity_base * player,
     send_changed_entity_data(send_cursor, player, entity, 0xffffffff);
 }
 
+static void
+send_full_tab_list(buffer_cursor * send_cursor, entity_base * player) {
+    if (serv->tab_list_size == 0) {
+        return;
+    }
+
+    begin_packet(send_cursor, CBP_PLAYER_INFO);
+    net_write_varint(send_cursor, 0); // action: add
+    net_write_varint(send_cursor, serv->tab_list_size);
+
+    for (int i = 0; i < serv->tab_list_size; i++) {
+        entity_id eid = serv->tab_list[i];
+        entity_base * listed = resolve_entity(eid);
+        assert(listed->type == ENTITY_PLAYER);
+        // @TODO(traks) write UUID
+        net_write_ulong(send_cursor, 0);
+        net_write_ulong(send_cursor, eid);
+        net_string username = {
+            .ptr = listed->player.username,
+            .size = listed->player.username_size
+        };
+        net_write_string(send_cursor, username);
+        net_write_varint(send_cursor, 0); // num properties
+        net_write_varint(send_cursor, listed->player.gamemode);
+        net_write_varint(send_cursor, 0); // latency
+        net_write_ubyte(send_cursor, 0); // has display name
+    }
+    finish_packet(send_cursor, player);
+}
+
+static void
+send_tab_list_changes(buffer_cursor * send_cursor, entity_base * player) {
+    if (serv->tab_list_removed_count > 0) {
+        begin_packet(send_cursor, CBP_PLAYER_INFO);
+        net_write_varint(send_cursor, 4); // action: remove
+        net_write_varint(send_cursor, serv->tab_list_removed_count);
+
+        for (int i = 0; i < serv->tab_list_removed_count; i++) {
+            entity_id eid = serv->tab_list_removed[i];
+            // @TODO(traks) write UUID
+            net_write_ulong(send_cursor, 0);
+            net_write_ulong(send_cursor, eid);
+        }
+        finish_packet(send_cursor, player);
+    }
+    if (serv->tab_list_added_count > 0) {
+        begin_packet(send_cursor, CBP_PLAYER_INFO);
+        net_write_varint(send_cursor, 0); // action: add
+        net_write_varint(send_cursor, serv->tab_list_added_count);
+
+        for (int i = 0; i < serv->tab_list_added_count; i++) {
+            entity_id eid = serv->tab_list_added[i];
+            entity_base * listed = resolve_entity(eid);
+            assert(listed->type == ENTITY_PLAYER);
+            // @TODO(traks) write UUID
+            net_write_ulong(send_cursor, 0);
+            net_write_ulong(send_cursor, eid);
+            net_string username = {
+                .ptr = listed->player.username,
+                .size = listed->player.username_size
+            };
+            net_write_string(send_cursor, username);
+            net_write_varint(send_cursor, 0); // num properties
+            net_write_varint(send_cursor, listed->player.gamemode);
+            net_write_varint(send_cursor, 0); // latency
+            net_write_ubyte(send_cursor, 0); // has display name
+        }
+        finish_packet(send_cursor, player);
+    }
+
+    for (int i = 0; i < MAX_ENTITIES; i++) {
+        entity_base * entity = serv->entities + i;
+        if (!(entity->flags & ENTITY_IN_USE)) {
+            continue;
+        }
+        if (entity->type != ENTITY_PLAYER) {
+            continue;
+        }
+
+        if (entity->changed_data & PLAYER_GAMEMODE_CHANGED) {
+            begin_packet(send_cursor, CBP_PLAYER_INFO);
+            net_write_varint(send_cursor, 1); // action: update gamemode
+            net_write_varint(send_cursor, 1); // changed entries
+            // @TODO(traks) write uuid
+            net_write_ulong(send_cursor, 0);
+            net_write_ulong(send_cursor, entity->eid);
+            net_write_varint(send_cursor, entity->player.gamemode);
+            finish_packet(send_cursor, player);
+        }
+    }
+}
+
+static void
+send_chat_messages(buffer_cursor * send_cursor, entity_base * player) {
+    for (int i = 0; i < serv->global_msg_count; i++) {
+        global_msg * msg = serv->global_msgs + i;
+
+        // @TODO(traks) formatted messages and such
+        unsigned char buf[1024];
+        int buf_index = 0;
+        net_string prefix = NET_STRING("{\"text\":\"");
+        net_string suffix = NET_STRING("\"}");
+
+        memcpy(buf + buf_index, prefix.ptr, prefix.size);
+        buf_index += prefix.size;
+
+        for (int i = 0; i < msg->size; i++) {
+            if (msg->text[i] == '"' || msg->text[i] == '\\') {
+                buf[buf_index] = '\\';
+                buf_index++;
+            }
+            buf[buf_index] = msg->text[i];
+            buf_index++;
+        }
+
+        memcpy(buf + buf_index, suffix.ptr, suffix.size);
+        buf_index += suffix.size;
+
+        begin_packet(send_cursor, CBP_CHAT);
+        net_write_varint(send_cursor, buf_index);
+        net_write_data(send_cursor, buf, buf_index);
+        net_write_ubyte(send_cursor, 0); // chat box position
+        // @TODO(traks) write sender UUID. If UUID equals 0, client displays it
+        // regardless of client settings
+        net_write_ulong(send_cursor, 0);
+        net_write_ulong(send_cursor, 0);
+        finish_packet(send_cursor, player);
+    }
+}
+
+static int
+can_share_broadcast_packets(entity_base * player) {
+    return (player->player.send_flags & PLAYER_PACKET_COMPRESSION)
+            == (broadcast_receiver.player.send_flags & PLAYER_PACKET_COMPRESSION);
+}
+
+static void
+write_broadcast_packets(buffer_cursor * send_cursor,
+        broadcast_packets * packets) {
+    if (packets->size > 0) {
+        write_packet_reference(send_cursor, packets->data, packets->size);
+    }
+}
+
+static broadcast_packets
+finalise_broadcast_packets(buffer_cursor * packets_cursor,
+        memory_arena * arena) {
+    // no room for the packets is a programming error: the packet cursor is
+    // large enough for all shared packets
+    assert(packets_cursor->error == 0);
+
+    if (packets_cursor->index == 0) {
+        return (broadcast_packets) {0};
+    }
+
+    int max_final_size = finalised_packets_bound(packets_cursor);
+    buffer_cursor final_cursor = {
+        .buf = alloc_in_arena(arena, max_final_size),
+        .limit = max_final_size
+    };
+    // finalising changes the limit, so finalise a copy of the cursor
+    buffer_cursor finalised_cursor = *packets_cursor;
+    finalise_packets(&finalised_cursor, &final_cursor, arena);
+    assert(final_cursor.error == 0);
+
+    // reuse the packet cursor for the next batch of packets
+    packets_cursor->index = 0;
+
+    return (broadcast_packets) {
+        .data = final_cursor.buf,
+        .size = final_cursor.index
+    };
+}
+
+void
+prepare_broadcast_packets(memory_arena * arena) {
+    if (PACKET_COMPRESSION_ENABLED) {
+        broadcast_receiver.player.send_flags |= PLAYER_PACKET_COMPRESSION;
+    }
+
+    int max_packets_size = 1 << 17;
+    buffer_cursor packets_cursor = {
+        .buf = alloc_in_arena(arena, max_packets_size),
+        .limit = max_packets_size
+    };
+    entity_base * receiver = &broadcast_receiver;
+
+    send_chat_messages(&packets_cursor, receiver);
+    broadcast_chat = finalise_broadcast_packets(&packets_cursor, arena);
+
+    send_tab_list_changes(&packets_cursor, receiver);
+    broadcast_tab_list_changes = finalise_broadcast_packets(
+            &packets_cursor, arena);
+
+    // only players that just joined need the full tab list
+    broadcast_full_tab_list = (broadcast_packets) {0};
+    for (int i = 0; i < MAX_ENTITIES; i++) {
+        entity_base * entity = serv->entities + i;
+        if ((entity->flags & ENTITY_IN_USE)
+                && entity->type == ENTITY_PLAYER
+                && !(entity->player.send_flags & PLAYER_INITIALISED_TAB_LIST)) {
+            send_full_tab_list(&packets_cursor, receiver);
+            broadcast_full_tab_list = finalise_broadcast_packets(
+                    &packets_cursor, arena);
+            break;
+        }
+    }
+
+    for (int i = 1; i < MAX_ENTITIES; i++) {
+        entity_base * entity = serv->entities + i;
+        broadcast_entity_update * update = broadcast_entity_updates + i;
+        tracked_entity * shared = shared_tracked_entities + i;
+
+        if (!(entity->flags & ENTITY_IN_USE)) {
+            *update = (broadcast_entity_update) {0};
+            continue;
+        }
+
+        if (shared->eid != entity->eid) {
+            init_tracked_entity(shared, entity);
+        }
+
+        update->before = *shared;
+        try_update_tracked_entity(receiver, &packets_cursor, arena,
+                shared, entity);
+        update->packets = finalise_broadcast_packets(&packets_cursor, arena);
+    }
+}
+
 static void
 send_player_abilities(buffer_cursor * send_cursor, entity_base * player) {
     begin_packet(send_cursor, CBP_PLAYER_ABILITIES);
@@ -2190,8 +3049,156 @@ send_player_abilities(buffer_cursor * send_cursor, entity_base * player) {
     finish_packet(send_cursor, player);
 }
 
+// Adds data to the end of the data in the player's send buffer that still
+// needs to be sent. The send buffer grows as needed. Returns 0 if the player
+// has too much data waiting to be sent.
+static int
+append_to_send_buf(entity_base * player, void * data, int size) {
+    entity_player * p = &player->player;
+
+    if (p->send_buf_size - p->send_cursor < size) {
+        int pending = p->send_cursor - p->send_start;
+        int new_size = p->send_buf_size;
+
+        if (new_size - pending < size) {
+            new_size = MAX(new_size, 1 << 16);
+            while (new_size - pending < size) {
+                if (new_size >= MAX_PLAYER_SEND_BUF_SIZE) {
+                    return 0;
+                }
+                new_size *= 2;
+            }
+
+            unsigned char * new_buf = malloc(new_size);
+            if (new_buf == NULL) {
+                return 0;
+            }
+            memcpy(new_buf, p->send_buf + p->send_start, pending);
+            free(p->send_buf);
+            p->send_buf = new_buf;
+            p->send_buf_size = new_size;
+        } else {
+            memmove(p->send_buf, p->send_buf + p->send_start, pending);
+        }
+
+        p->send_start = 0;
+        p->send_cursor = pending;
+    }
+
+    memcpy(p->send_buf + p->send_cursor, data, size);
+    p->send_cursor += size;
+    add_profiler_counter("send bytes copied", size);
+    return 1;
+}
+
+static void
+step_chunk_spiral(int * off_x, int * off_z, int * step_x, int * step_z) {
+    *off_x += *step_x;
+    *off_z += *step_z;
+    // change direction of spiral when we hit a corner
+    if (*off_x == *off_z || (*off_x == -*off_z && *off_x < 0)
+            || (*off_x == -*off_z + 1 && *off_x > 0)) {
+        int prev_step_x = *step_x;
+        *step_x = -*step_z;
+        *step_z = prev_step_x;
+    }
+}
+
+void
+update_player_chunk_interest(entity_base * player) {
+    // Registers interest in the chunks around the player and requests loads
+    // for them. This changes the chunk map, so it is done for all players
+    // before they are sent packets in parallel. The player's chunk cache
+    // region moves along when the packets are sent.
+    entity_player * p = &player->player;
+    mc_short chunk_cache_min_x = p->chunk_cache_centre_x - p->chunk_cache_radius;
+    mc_short chunk_cache_min_z = p->chunk_cache_centre_z - p->chunk_cache_radius;
+    mc_short chunk_cache_max_x = p->chunk_cache_centre_x + p->chunk_cache_radius;
+    mc_short chunk_cache_max_z = p->chunk_cache_centre_z + p->chunk_cache_radius;
+
+    mc_short new_chunk_cache_centre_x = (mc_int) floor(player->x) >> 4;
+    mc_short new_chunk_cache_centre_z = (mc_int) floor(player->z) >> 4;
+    assert(p->new_chunk_cache_radius <= MAX_CHUNK_CACHE_RADIUS);
+    mc_short new_chunk_cache_min_x = new_chunk_cache_centre_x - p->new_chunk_cache_radius;
+    mc_short new_chunk_cache_min_z = new_chunk_cache_centre_z - p->new_chunk_cache_radius;
+    mc_short new_chunk_cache_max_x = new_chunk_cache_centre_x + p->new_chunk_cache_radius;
+    mc_short new_chunk_cache_max_z = new_chunk_cache_centre_z + p->new_chunk_cache_radius;
+
+    // untrack old chunks
+    for (mc_short x = chunk_cache_min_x; x <= chunk_cache_max_x; x++) {
+        for (mc_short z = chunk_cache_min_z; z <= chunk_cache_max_z; z++) {
+            if (x >= new_chunk_cache_min_x && x <= new_chunk_cache_max_x
+                    && z >= new_chunk_cache_min_z && z <= new_chunk_cache_max_z) {
+                // old chunk still in new region
+                continue;
+            }
+
+            chunk_pos pos = {.x = x, .z = z};
+            chunk * ch = get_chunk_if_available(pos);
+            assert(ch != NULL);
+            ch->available_interest--;
+        }
+    }
+
+    // track new chunks
+    for (mc_short x = new_chunk_cache_min_x; x <= new_chunk_cache_max_x; x++) {
+        for (mc_short z = new_chunk_cache_min_z; z <= new_chunk_cache_max_z; z++) {
+            if (x >= chunk_cache_min_x && x <= chunk_cache_max_x
+                    && z >= chunk_cache_min_z && z <= chunk_cache_max_z) {
+                // chunk already in old region
+                continue;
+            }
+
+            // chunk not in old region
+            chunk_pos pos = {.x = x, .z = z};
+            chunk * ch = get_or_create_chunk(pos);
+            ch->available_interest++;
+        }
+    }
+
+    // We iterate in a spiral around the player, so chunks near the player
+    // are processed first. This shortens server join times (since players
+    // don't need to wait for the chunk they are in to load) and allows
+    // players to move around much earlier.
+    int newly_loaded_chunks = 0;
+    // Load chunks a bit faster than we managed to send them, so loading
+    // doesn't hold back sending if the connection can handle more.
+    int max_chunk_loads = MAX(MIN_CHUNK_LOADS_PER_TICK,
+            2 * p->chunks_sent_last_tick);
+    int chunk_cache_diam = 2 * p->new_chunk_cache_radius + 1;
+    int chunk_cache_area = chunk_cache_diam * chunk_cache_diam;
+    int off_x = 0;
+    int off_z = 0;
+    int step_x = 1;
+    int step_z = 0;
+    for (int i = 0; i < chunk_cache_area; i++) {
+        if (newly_loaded_chunks >= max_chunk_loads
+                || serv->chunk_load_request_count
+                >= ARRAY_SIZE(serv->chunk_load_requests)) {
+            break;
+        }
+
+        chunk_pos pos = {
+            .x = new_chunk_cache_centre_x + off_x,
+            .z = new_chunk_cache_centre_z + off_z
+        };
+        chunk * ch = get_chunk_if_available(pos);
+        assert(ch != NULL);
+        assert(ch->available_interest > 0);
+        if (!(ch->flags & (CHUNK_LOADED | CHUNK_LOAD_REQUESTED))) {
+            serv->chunk_load_requests[serv->chunk_load_request_count] = pos;
+            serv->chunk_load_request_count++;
+            newly_loaded_chunks++;
+        }
+
+        step_chunk_spiral(&off_x, &off_z, &step_x, &step_z);
+    }
+}
+
 void
 send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
+    // Called for several players in parallel. Only the player's own state
+    // changes, apart from the shared chunk packets, which are locked.
     begin_timed_block("send packets");
 
     size_t max_uncompressed_packet_size = 1 << 20;
@@ -2201,16 +3208,16 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
     };
     buffer_cursor * send_cursor = &send_cursor_;
 
-    if (!(player->flags & PLAYER_DID_INIT_PACKETS)) {
-        player->flags |= PLAYER_DID_INIT_PACKETS;
+    if (!(player->player.send_flags & PLAYER_DID_INIT_PACKETS)) {
+        player->player.send_flags |= PLAYER_DID_INIT_PACKETS;
 
         if (PACKET_COMPRESSION_ENABLED) {
             // send login compression packet
             begin_packet(send_cursor, 3);
-            net_write_varint(send_cursor, 0);
+            net_write_varint(send_cursor, PACKET_COMPRESSION_THRESHOLD);
             finish_packet(send_cursor, player);
 
-            player->flags |= PLAYER_PACKET_COMPRESSION;
+            player->player.send_flags |= PLAYER_PACKET_COMPRESSION;
         }
 
         // send game profile packet
@@ -2384,17 +3391,21 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
 
     // send keep alive packet every so often
     if (serv->current_tick - player->player.last_keep_alive_sent_tick >= KEEP_ALIVE_SPACING
-            && (player->flags & PLAYER_GOT_ALIVE_RESPONSE)) {
+            && (player->player.send_flags & PLAYER_GOT_ALIVE_RESPONSE)) {
         begin_packet(send_cursor, CBP_KEEP_ALIVE);
         net_write_ulong(send_cursor, serv->current_tick);
         finish_packet(send_cursor, player);
 
         player->player.last_keep_alive_sent_tick = serv->current_tick;
-        player->flags &= ~PLAYER_GOT_ALIVE_RESPONSE;
+        player->player.last_keep_alive_sent_nanos = program_nano_time();
+        player->player.keep_alive_sent_backlog =
+                get_socket_send_queue_size(player->player.sock)
+                + player->player.send_cursor - player->player.send_start;
+        player->player.send_flags &= ~PLAYER_GOT_ALIVE_RESPONSE;
     }
 
     if ((player->flags & ENTITY_TELEPORTING)
-            && !(player->flags & PLAYER_SENT_TELEPORT)) {
+            && !(player->player.send_flags & PLAYER_SENT_TELEPORT)) {
         begin_packet(send_cursor, CBP_PLAYER_POSITION);
         net_write_double(send_cursor, player->x);
         net_write_double(send_cursor, player->y);
@@ -2405,7 +3416,7 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
         net_write_varint(send_cursor, player->player.current_teleport_id);
         finish_packet(send_cursor, player);
 
-        player->flags |= PLAYER_SENT_TELEPORT;
+        player->player.send_flags |= PLAYER_SENT_TELEPORT;
     }
 
     if (player->changed_data & PLAYER_GAMEMODE_CHANGED) {
@@ -2542,6 +3553,12 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
                     }
                 }
 
+                if (ch->changed_sky_light != 0
+                        || ch->changed_block_light != 0) {
+                    send_changed_light(send_cursor, pos, ch, player,
+                            tick_arena);
+                }
+
                 for (int i = 0; i < ch->local_event_count; i++) {
                     level_event * event = ch->local_events + i;
 
@@ -2556,10 +3573,6 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
             }
 
             // old chunk is not in the new region
-            chunk * ch = get_chunk_if_available(pos);
-            assert(ch != NULL);
-            ch->available_interest--;
-
             if (player->player.chunk_cache[index].sent) {
                 player->player.chunk_cache[index] = (chunk_cache_entry) {0};
 
@@ -2571,22 +3584,6 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
         }
     }
 
-    // track new chunks
-    for (mc_short x = new_chunk_cache_min_x; x <= new_chunk_cache_max_x; x++) {
-        for (mc_short z = new_chunk_cache_min_z; z <= new_chunk_cache_max_z; z++) {
-            if (x >= chunk_cache_min_x && x <= chunk_cache_max_x
-                    && z >= chunk_cache_min_z && z <= chunk_cache_max_z) {
-                // chunk already in old region
-                continue;
-            }
-
-            // chunk not in old region
-            chunk_pos pos = {.x = x, .z = z};
-            chunk * ch = get_or_create_chunk(pos);
-            ch->available_interest++;
-        }
-    }
-
     player->player.chunk_cache_radius = player->player.new_chunk_cache_radius;
     player->player.chunk_cache_centre_x = new_chunk_cache_centre_x;
     player->player.chunk_cache_centre_z = new_chunk_cache_centre_z;
@@ -2596,12 +3593,9 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
     // load and send tracked chunks
     begin_timed_block("load and send chunks");
 
-    // We iterate in a spiral around the player, so chunks near the player
-    // are processed first. This shortens server join times (since players
-    // don't need to wait for the chunk they are in to load) and allows
-    // players to move around much earlier.
+    // chunks near the player are sent first, like they're loaded first
     int newly_sent_chunks = 0;
-    int newly_loaded_chunks = 0;
+    int chunk_send_budget = get_chunk_send_budget(player);
     int chunk_cache_diam = 2 * player->player.new_chunk_cache_radius + 1;
     int chunk_cache_area = chunk_cache_diam * chunk_cache_diam;
     int off_x = 0;
@@ -2615,41 +3609,24 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
         chunk_cache_entry * entry = player->player.chunk_cache + cache_index;
         chunk_pos pos = {.x = x, .z = z};
 
-        if (newly_loaded_chunks < MAX_CHUNK_LOADS_PER_TICK
-                && serv->chunk_load_request_count
-                < ARRAY_SIZE(serv->chunk_load_requests)) {
-            chunk * ch = get_chunk_if_available(pos);
-            assert(ch != NULL);
-            assert(ch->available_interest > 0);
-            if (!(ch->flags & CHUNK_LOADED)) {
-                serv->chunk_load_requests[serv->chunk_load_request_count] = pos;
-                serv->chunk_load_request_count++;
-                newly_loaded_chunks++;
-            }
-        }
-
-        if (newly_sent_chunks < MAX_CHUNK_SENDS_PER_TICK && !entry->sent) {
+        if (newly_sent_chunks < MAX_CHUNK_SENDS_PER_TICK
+                && chunk_send_budget > 0 && !entry->sent) {
             chunk * ch = get_chunk_if_loaded(pos);
             if (ch != NULL) {
                 // send chunk blocks and lighting
-                send_chunk_fully(send_cursor, pos, ch, player, tick_arena);
-                send_light_update(send_cursor, pos, ch, player, tick_arena);
+                chunk_send_budget -= send_chunk_and_light(send_cursor, pos,
+                        ch, player, tick_arena);
                 entry->sent = 1;
                 newly_sent_chunks++;
             }
         }
 
-        off_x += step_x;
-        off_z += step_z;
-        // change direction of spiral when we hit a corner
-        if (off_x == off_z || (off_x == -off_z && off_x < 0)
-                || (off_x == -off_z + 1 && off_x > 0)) {
-            int prev_step_x = step_x;
-            step_x = -step_z;
-            step_z = prev_step_x;
-        }
+        step_chunk_spiral(&off_x, &off_z, &step_x, &step_z);
     }
 
+    player->player.chunks_sent_last_tick = newly_sent_chunks;
+    add_profiler_counter("chunks sent", newly_sent_chunks);
+
     end_timed_block();
 
     // send updates in player's own inventory
@@ -2688,90 +3665,18 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
     // tab list updates
     begin_timed_block("send tab list");
 
-    if (!(player->flags & PLAYER_INITIALISED_TAB_LIST)) {
-        player->flags |= PLAYER_INITIALISED_TAB_LIST;
-        if (serv->tab_list_size > 0) {
-            begin_packet(send_cursor, CBP_PLAYER_INFO);
-            net_write_varint(send_cursor, 0); // action: add
-            net_write_varint(send_cursor, serv->tab_list_size);
-
-            for (int i = 0; i < serv->tab_list_size; i++) {
-                entity_id eid = serv->tab_list[i];
-                entity_base * player = resolve_entity(eid);
-                assert(player->type == ENTITY_PLAYER);
-                // @TODO(traks) write UUID
-                net_write_ulong(send_cursor, 0);
-                net_write_ulong(send_cursor, eid);
-                net_string username = {
-                    .ptr = player->player.username,
-                    .size = player->player.username_size
-                };
-                net_write_string(send_cursor, username);
-                net_write_varint(send_cursor, 0); // num properties
-                net_write_varint(send_cursor, player->player.gamemode);
-                net_write_varint(send_cursor, 0); // latency
-                net_write_ubyte(send_cursor, 0); // has display name
-            }
-            finish_packet(send_cursor, player);
+    if (!(player->player.send_flags & PLAYER_INITIALISED_TAB_LIST)) {
+        player->player.send_flags |= PLAYER_INITIALISED_TAB_LIST;
+        if (can_share_broadcast_packets(player)) {
+            write_broadcast_packets(send_cursor, &broadcast_full_tab_list);
+        } else {
+            send_full_tab_list(send_cursor, player);
         }
     } else {
-        if (serv->tab_list_removed_count > 0) {
-            begin_packet(send_cursor, CBP_PLAYER_INFO);
-            net_write_varint(send_cursor, 4); // action: remove
-            net_write_varint(send_cursor, serv->tab_list_removed_count);
-
-            for (int i = 0; i < serv->tab_list_removed_count; i++) {
-                entity_id eid = serv->tab_list_removed[i];
-                // @TODO(traks) write UUID
-                net_write_ulong(send_cursor, 0);
-                net_write_ulong(send_cursor, eid);
-            }
-            finish_packet(send_cursor, player);
-        }
-        if (serv->tab_list_added_count > 0) {
-            begin_packet(send_cursor, CBP_PLAYER_INFO);
-            net_write_varint(send_cursor, 0); // action: add
-            net_write_varint(send_cursor, serv->tab_list_added_count);
-
-            for (int i = 0; i < serv->tab_list_added_count; i++) {
-                entity_id eid = serv->tab_list_added[i];
-                entity_base * player = resolve_entity(eid);
-                assert(player->type == ENTITY_PLAYER);
-                // @TODO(traks) write UUID
-                net_write_ulong(send_cursor, 0);
-                net_write_ulong(send_cursor, eid);
-                net_string username = {
-                    .ptr = player->player.username,
-                    .size = player->player.username_size
-                };
-                net_write_string(send_cursor, username);
-                net_write_varint(send_cursor, 0); // num properties
-                net_write_varint(send_cursor, player->player.gamemode);
-                net_write_varint(send_cursor, 0); // latency
-                net_write_ubyte(send_cursor, 0); // has display name
-            }
-            finish_packet(send_cursor, player);
-        }
-
-        for (int i = 0; i < MAX_ENTITIES; i++) {
-            entity_base * entity = serv->entities + i;
-            if (!(entity->flags & ENTITY_IN_USE)) {
-                continue;
-            }
-            if (entity->type != ENTITY_PLAYER) {
-                continue;
-            }
-
-            if (entity->changed_data & PLAYER_GAMEMODE_CHANGED) {
-                begin_packet(send_cursor, CBP_PLAYER_INFO);
-                net_write_varint(send_cursor, 1); // action: update gamemode
-                net_write_varint(send_cursor, 1); // changed entries
-                // @TODO(traks) write uuid
-                net_write_ulong(send_cursor, 0);
-                net_write_ulong(send_cursor, entity->eid);
-                net_write_varint(send_cursor, entity->player.gamemode);
-                finish_packet(send_cursor, player);
-            }
+        if (can_share_broadcast_packets(player)) {
+            write_broadcast_packets(send_cursor, &broadcast_tab_list_changes);
+        } else {
+            send_tab_list_changes(send_cursor, player);
         }
     }
 
@@ -2795,8 +3700,17 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
             double dy = candidate->y - player->y;
             double dz = candidate->z - player->z;
             if (dx * dx + dy * dy + dz * dz < 45 * 45) {
-                try_update_tracked_entity(player,
-                        send_cursor, tick_arena, tracked, candidate);
+                broadcast_entity_update * update = broadcast_entity_updates + j;
+                if (can_share_broadcast_packets(player)
+                        && tracked_entity_in_sync(tracked, &update->before)) {
+                    write_broadcast_packets(send_cursor, &update->packets);
+                    *tracked = shared_tracked_entities[j];
+                    add_profiler_counter("shared entity updates", 1);
+                } else {
+                    try_update_tracked_entity(player,
+                            send_cursor, tick_arena, tracked, candidate);
+                    add_profiler_counter("own entity updates", 1);
+                }
                 continue;
             }
         }
@@ -2852,39 +3766,10 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
     // send chat messages
     begin_timed_block("send chat");
 
-    for (int i = 0; i < serv->global_msg_count; i++) {
-        global_msg * msg = serv->global_msgs + i;
-
-        // @TODO(traks) formatted messages and such
-        unsigned char buf[1024];
-        int buf_index = 0;
-        net_string prefix = NET_STRING("{\"text\":\"");
-        net_string suffix = NET_STRING("\"}");
-
-        memcpy(buf + buf_index, prefix.ptr, prefix.size);
-        buf_index += prefix.size;
-
-        for (int i = 0; i < msg->size; i++) {
-            if (msg->text[i] == '"' || msg->text[i] == '\\') {
-                buf[buf_index] = '\\';
-                buf_index++;
-            }
-            buf[buf_index] = msg->text[i];
-            buf_index++;
-        }
-
-        memcpy(buf + buf_index, suffix.ptr, suffix.size);
-        buf_index += suffix.size;
-
-        begin_packet(send_cursor, CBP_CHAT);
-        net_write_varint(send_cursor, buf_index);
-        net_write_data(send_cursor, buf, buf_index);
-        net_write_ubyte(send_cursor, 0); // chat box position
-        // @TODO(traks) write sender UUID. If UUID equals 0, client displays it
-        // regardless of client settings
-        net_write_ulong(send_cursor, 0);
-        net_write_ulong(send_cursor, 0);
-        finish_packet(send_cursor, player);
+    if (can_share_broadcast_packets(player)) {
+        write_broadcast_packets(send_cursor, &broadcast_chat);
+    } else {
+        send_chat_messages(send_cursor, player);
     }
 
     end_timed_block();
@@ -2894,112 +3779,185 @@ send_packets_to_player(entity_base * player, memory_arena * tick_arena) {
     if (send_cursor->error != 0) {
         // just disconnect the player
         logs("Failed to create packets");
-        disconnect_player_now(player);
+        player->player.send_flags |= PLAYER_SEND_FAILED;
         goto bail;
     }
 
     begin_timed_block("finalise packets");
 
-    buffer_cursor final_cursor_ = {
-        .buf = player->player.send_buf,
-        .limit = player->player.send_buf_size,
-        .index = player->player.send_cursor
-    };
-    buffer_cursor * final_cursor = &final_cursor_;
-
-    send_cursor->limit = send_cursor->index;
-    send_cursor->index = 0;
-    while (send_cursor->index != send_cursor->limit) {
-        int internal_header = send_cursor->buf[send_cursor->index];
-        int size_offset = internal_header & 0x7;
-        int should_compress = internal_header & 0x80;
-
-        send_cursor->index += 1 + size_offset;
-
-        int packet_start = send_cursor->index;
-        mc_int packet_size = net_read_varint(send_cursor);
-        int packet_end = send_cursor->index + packet_size;
-
-        if (should_compress) {
-            // @TODO(traks) handle errors properly
+    entity_player * p = &player->player;
+    // one segment for each packet at most, plus one for the send buffer
+    int max_segments = count_packets(send_cursor) + 1;
+    struct iovec * segments = alloc_in_arena(tick_arena,
+            max_segments * sizeof *segments);
+    int segment_count = 0;
+    int has_pending = 0;
+
+    if (p->send_cursor > p->send_start) {
+        segments[0] = (struct iovec) {
+            .iov_base = p->send_buf + p->send_start,
+            .iov_len = p->send_cursor - p->send_start
+        };
+        segment_count = 1;
+        has_pending = 1;
+    }
 
-            z_stream zstream;
-            zstream.zalloc = Z_NULL;
-            zstream.zfree = Z_NULL;
-            zstream.opaque = Z_NULL;
+    int finalised = finalise_packets_to_segments(send_cursor, tick_arena,
+            segments, &segment_count);
 
-            if (deflateInit(&zstream, Z_DEFAULT_COMPRESSION) != Z_OK) {
-                final_cursor->error = 1;
-                break;
-            }
+    p->new_send_bytes = 0;
+    for (int i = has_pending; i < segment_count; i++) {
+        p->new_send_bytes += segments[i].iov_len;
+    }
 
-            zstream.next_in = send_cursor->buf + send_cursor->index;
-            zstream.avail_in = packet_end - send_cursor->index;
+    end_timed_block();
 
-            memory_arena temp_arena = *tick_arena;
-            // @TODO(traks) appropriate value
-            size_t max_compressed_size = 1 << 19;
-            unsigned char * compressed = alloc_in_arena(&temp_arena,
-                    max_compressed_size);
+    if (!finalised) {
+        // just disconnect the player
+        logs("Failed to finalise packets");
+        player->player.send_flags |= PLAYER_SEND_FAILED;
+        goto bail;
+    }
 
-            zstream.next_out = compressed;
-            zstream.avail_out = max_compressed_size;
+    if (segment_count == 0) {
+        goto bail;
+    }
 
-            if (deflate(&zstream, Z_FINISH) != Z_STREAM_END) {
-                final_cursor->error = 1;
-                break;
+    if (io_ring_available()) {
+        // The kernel only gets to see the send once all players have been
+        // handled. By then the tick memory has been reused, so everything
+        // needs to be in the send buffer, which must be left alone until the
+        // send completes at the start of the next tick. The send itself is
+        // queued by queue_player_sends.
+        for (int i = has_pending; i < segment_count; i++) {
+            if (!append_to_send_buf(player, segments[i].iov_base,
+                    segments[i].iov_len)) {
+                logs("Send buffer of player is full");
+                player->player.send_flags |= PLAYER_SEND_FAILED;
+                goto bail;
             }
+        }
+        goto bail;
+    }
 
-            if (deflateEnd(&zstream) != Z_OK) {
-                final_cursor->error = 1;
-                break;
-            }
+    begin_timed_block("send()");
 
-            if (zstream.avail_in != 0) {
-                final_cursor->error = 1;
-                break;
-            }
+    // send as much as the socket accepts
+    size_t sent = 0;
+    int send_error = 0;
+    for (int i = 0; i < segment_count; ) {
+        struct msghdr msg = {
+            .msg_iov = segments + i,
+            .msg_iovlen = MIN(segment_count - i, IOV_MAX)
+        };
+        size_t batch_size = 0;
+        for (int j = 0; j < msg.msg_iovlen; j++) {
+            batch_size += segments[i + j].iov_len;
+        }
 
-            net_write_varint(final_cursor, net_varint_size(packet_size) + zstream.total_out);
-            net_write_varint(final_cursor, packet_size);
-            net_write_data(final_cursor, compressed, zstream.total_out);
-        } else {
-            // @TODO(traks) should check somewhere that no error occurs
-            net_write_data(final_cursor, send_cursor->buf + packet_start,
-                    packet_end - packet_start);
+        ssize_t send_size = sendmsg(p->sock, &msg, 0);
+        add_profiler_counter("socket syscalls", 1);
+        if (send_size == -1) {
+            send_error = errno;
+            break;
         }
 
-        send_cursor->index = packet_end;
+        sent += send_size;
+        if (send_size < batch_size) {
+            break;
+        }
+        i += msg.msg_iovlen;
     }
 
     end_timed_block();
 
-    if (final_cursor->error != 0) {
-        // just disconnect the player
-        logs("Failed to finalise packets");
-        disconnect_player_now(player);
+    if (send_error != 0 && send_error != EAGAIN && send_error != EWOULDBLOCK) {
+        errno = send_error;
+        logs_errno("Couldn't send protocol data: %s");
+        player->player.send_flags |= PLAYER_SEND_FAILED;
         goto bail;
     }
 
-    begin_timed_block("send()");
-    ssize_t send_size = send(player->player.sock, final_cursor->buf,
-            final_cursor->index, 0);
+    // Whatever the socket didn't accept is kept in the send buffer. Data from
+    // the send buffer itself just stays where it is.
+    int i = 0;
+    if (has_pending) {
+        size_t pending_sent = MIN(sent, segments[0].iov_len);
+        complete_player_send(player, pending_sent);
+        sent -= pending_sent;
+        i = 1;
+    }
+    for (; i < segment_count; i++) {
+        size_t segment_sent = MIN(sent, segments[i].iov_len);
+        sent -= segment_sent;
+        if (segment_sent < segments[i].iov_len) {
+            unsigned char * unsent = segments[i].iov_base;
+            if (!append_to_send_buf(player, unsent + segment_sent,
+                    segments[i].iov_len - segment_sent)) {
+                logs("Send buffer of player is full");
+                player->player.send_flags |= PLAYER_SEND_FAILED;
+                goto bail;
+            }
+        }
+    }
+
+bail:
     end_timed_block();
+}
 
-    if (send_size == -1) {
+void
+queue_player_sends(void) {
+    // Called once all players have been sent their packets. Players for whom
+    // that failed are disconnected here, since that changes shared state.
+    for (int i = 0; i < MAX_ENTITIES; i++) {
+        entity_base * entity = serv->entities + i;
+        if (!(entity->flags & ENTITY_IN_USE) || entity->type != ENTITY_PLAYER) {
+            continue;
+        }
+
+        if (entity->player.send_flags & PLAYER_SEND_FAILED) {
+            disconnect_player_now(entity);
+            continue;
+        }
+
+        entity_player * p = &entity->player;
+        if (!io_ring_available() || p->send_cursor == p->send_start) {
+            continue;
+        }
+        if (queue_socket_send(p->sock, p->send_buf + p->send_start,
+                p->send_cursor - p->send_start,
+                SOCKET_TAG_PLAYER_SEND | entity->eid)) {
+            continue;
+        }
+
+        // no room in the ring, so send it ourselves
+        ssize_t sent = send(p->sock, p->send_buf + p->send_start,
+                p->send_cursor - p->send_start, 0);
+        add_profiler_counter("socket syscalls", 1);
+        complete_player_send(entity, sent == -1 ? -errno : sent);
+    }
+}
+
+void
+complete_player_send(entity_base * player, int result) {
+    if (result < 0) {
         // EAGAIN means no data sent
-        if (errno != EAGAIN) {
+        if (result != -EAGAIN) {
+            errno = -result;
             logs_errno("Couldn't send protocol data: %s");
             disconnect_player_now(player);
         }
-    } else {
-        memmove(final_cursor->buf, final_cursor->buf + send_size,
-                final_cursor->index - send_size);
-        player->player.send_cursor = final_cursor->index - send_size;
+        return;
     }
 
-bail:
-    end_timed_block();
+    // don't move the remaining data, the send buffer is compacted if it
+    // runs out of space
+    entity_player * p = &player->player;
+    p->send_start += result;
+    if (p->send_start == p->send_cursor) {
+        p->send_start = 0;
+        p->send_cursor = 0;
+    }
 }
 
 int
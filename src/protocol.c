@@ -3,6 +3,10 @@
 #include <math.h>
 #include "shared.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -276,6 +280,59 @@ net_write_ulong(buffer_cursor * cursor, mc_ulong val) {
     cursor->index += 8;
 }
 
+#if defined(__SSE2__)
+static int
+swap_long_bytes(void * in, void * out, int count) {
+    // Swaps the byte order of pairs of longs and returns how many longs were
+    // swapped. SSE2 has no byte shuffle, so reverse the 16-bit words of every
+    // long and then swap the bytes of every word. Little-endian only, like
+    // every processor with SSE2.
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128((__m128i *) in + i / 2);
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) out + i / 2, v);
+    }
+    return i;
+}
+#endif
+
+void
+net_read_ulongs(buffer_cursor * cursor, mc_ulong * vals, int count) {
+    if (cursor->limit - cursor->index < (mc_long) count * 8) {
+        cursor->error = 1;
+        return;
+    }
+
+    int i = 0;
+#if defined(__SSE2__)
+    i = swap_long_bytes(cursor->buf + cursor->index, vals, count);
+    cursor->index += i * 8;
+#endif
+    for (; i < count; i++) {
+        vals[i] = net_read_ulong(cursor);
+    }
+}
+
+void
+net_write_ulongs(buffer_cursor * cursor, mc_ulong * vals, int count) {
+    if (cursor->limit - cursor->index < (mc_long) count * 8) {
+        cursor->error = 1;
+        return;
+    }
+
+    int i = 0;
+#if defined(__SSE2__)
+    i = swap_long_bytes(vals, cursor->buf + cursor->index, count);
+    cursor->index += i * 8;
+#endif
+    for (; i < count; i++) {
+        net_write_ulong(cursor, vals[i]);
+    }
+}
+
 mc_uint
 net_read_uint(buffer_cursor * cursor) {
     if (cursor->limit - cursor->index < 4) {
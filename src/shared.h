@@ -95,6 +95,10 @@ typedef union {
     mc_uint list_size;
 } nbt_tape_entry;
 
+// maximum depth of nested lists and compounds when skipping NBT values, same
+// as the limit Minecraft uses
+#define NBT_MAX_SKIP_LEVELS (512)
+
 #define MAX_CHUNK_CACHE_RADIUS (10)
 
 #define MAX_CHUNK_CACHE_DIAM (2 * MAX_CHUNK_CACHE_RADIUS + 1)
@@ -103,18 +107,114 @@ typedef union {
 
 #define KEEP_ALIVE_TIMEOUT (30 * 20)
 
-#define MAX_CHUNK_SENDS_PER_TICK (2)
+// Chunks are sent as fast as a player's connection allows, but never more
+// than this many per tick.
+#define MAX_CHUNK_SENDS_PER_TICK (32)
+
+// Players get more chunks loaded per tick if they were sent more chunks last
+// tick, but always at least this many.
+#define MIN_CHUNK_LOADS_PER_TICK (2)
+
+// The amount of data allowed to wait to be sent to a player before chunks
+// are held back, if the player's connection hasn't shown it can handle more.
+#define MIN_CHUNK_SEND_BACKLOG (1 << 15)
+
+// Chunks are loaded by the chunk loader threads. We use one thread less than
+// the number of processors, but at least 1 and at most this many.
+#define MAX_CHUNK_LOADER_THREADS (4)
+
+// Work within a tick is spread over one job thread per processor, but at most
+// this many. The tick thread is one of the job threads.
+#define MAX_JOB_THREADS (16)
+
+// Maximum number of jobs waiting in the deque of a job thread. Must be a
+// power of 2.
+#define JOB_DEQUE_SIZE (1024)
+
+// Number of times a thread waiting for jobs checks for other work before it
+// goes to sleep.
+#define JOB_WAIT_SPINS (64)
+
+// size of the scratch arena of every job thread
+#define JOB_THREAD_SCRATCH_SIZE (1 << 22)
+
+// Number of locks for the shared packets of chunks. Chunks hash to one of
+// the locks.
+#define CHUNK_PACKET_LOCK_COUNT_LOG2 (6)
+#define CHUNK_PACKET_LOCK_COUNT (1 << CHUNK_PACKET_LOCK_COUNT_LOG2)
+
+// maximum number of phases a tick consists of
+#define MAX_TICK_PHASES (32)
+
+// Maximum number of chunk loads that can be in progress at once. Must be a
+// power of 2.
+#define MAX_CHUNK_LOADS_IN_FLIGHT (256)
+
+// size of the scratch arena of every chunk loader thread
+#define CHUNK_LOADER_SCRATCH_SIZE (1 << 22)
+
+// Chunk loader threads ask the kernel to read the data of this many queued
+// chunk loads ahead of time.
+#define CHUNK_PREFETCH_DISTANCE (16)
 
-#define MAX_CHUNK_LOADS_PER_TICK (2)
+// Changed chunks are saved this many ticks after their first unsaved change,
+// so a burst of changes ends up in a single save.
+#define CHUNK_SAVE_DELAY_TICKS (20 * 5)
+
+// Maximum number of chunk saves that can be in progress at once. Must be a
+// power of 2.
+#define MAX_CHUNK_SAVES_IN_FLIGHT (64)
+
+// size of the scratch arena of the chunk saver thread
+#define CHUNK_SAVER_SCRATCH_SIZE (1 << 23)
+
+// number of region files the chunk saver thread keeps open at once
+#define REGION_WRITER_CACHE_SIZE (4)
 
 // must be power of 2
 #define MAX_ENTITIES (1024)
 
 #define MAX_PLAYERS (100)
 
-// whether all play packets should be compressed or not
+// Maximum amount of data that can wait to be sent to a player, for example
+// because the client can't keep up. Players are disconnected if more data
+// piles up. Must be a power of 2.
+#define MAX_PLAYER_SEND_BUF_SIZE (1 << 23)
+
+// whether play packets should be compressed or not
 #define PACKET_COMPRESSION_ENABLED (1)
 
+// Packets smaller than this many bytes are sent uncompressed. Compressing
+// small packets costs more CPU time than it saves bandwidth.
+#define PACKET_COMPRESSION_THRESHOLD (256)
+
+// zlib compression level between 1 and 9 (libdeflate also accepts up to 12)
+#define PACKET_COMPRESSION_LEVEL (6)
+
+// compression level for data that is compressed and decompressed a lot, but
+// never leaves the server
+#define FAST_COMPRESSION_LEVEL (1)
+
+// compression level of chunks saved to region files
+#define CHUNK_COMPRESSION_LEVEL (6)
+
+// Whether to compress and decompress data with libdeflate instead of zlib.
+// libdeflate is faster, because it only does single-pass compression.
+// Requires linking with -ldeflate.
+#define LIBDEFLATE_ENABLED (0)
+
+// maximum uncompressed size of packets sent by clients
+#define MAX_UNCOMPRESSED_PACKET_SIZE (1 << 21)
+
+// Whether region files should be memory mapped, so chunk data can be
+// inflated straight from the page cache instead of being copied first.
+// Region files are read with pread otherwise, or if mapping fails.
+#define REGION_FILE_MMAP_ENABLED (1)
+
+// whether player sockets should be read and written in batches through
+// io_uring if the kernel supports it, instead of through plain socket calls
+#define IO_URING_ENABLED (1)
+
 #define MAX_WORLD_Y (255)
 
 // in network id order
@@ -176,20 +276,41 @@ typedef struct {
 } chunk_pos;
 
 #define CHUNK_LOADED (1u << 0)
-
+// set while the chunk is being loaded by a chunk loader thread
+#define CHUNK_LOAD_REQUESTED (1u << 1)
+// set while the chunk is kept loaded even though no one is interested in it
+#define CHUNK_RETAINED (1u << 2)
+// set while a snapshot of the chunk is being saved by the chunk saver thread
+#define CHUNK_SAVE_IN_FLIGHT (1u << 3)
+
+// Sections with few different block states store indices into a palette of
+// block states, packed into longs the same way as in the network protocol:
+// indices don't span multiple longs and the first index of a long is stored
+// in its least significant bits. Other sections store their block states
+// directly as 16-bit values. Sections start out with 4 bits per block and
+// move to larger sizes when their palette runs full.
 typedef struct {
-    int index_in_bucket;
-    mc_ushort block_states[4096];
+    mc_ushort index_in_bucket;
+    unsigned char size_class;
+    // 4, 5, 6 or 8 if the section has a palette, 16 if block states are
+    // stored directly
+    unsigned char bits_per_block;
+    mc_ushort palette_size;
+    // NULL if block states are stored directly
+    mc_ushort * palette;
+    // palette indices or block states for all 4096 blocks
+    mc_ulong * data;
 } chunk_section;
 
+#define CHUNK_SECTION_SIZE_CLASSES (5)
+
 #define CHUNK_SECTIONS_PER_BUCKET (64)
 
 typedef struct chunk_section_bucket chunk_section_bucket;
 
+// All sections in a bucket have the same size class. The sections follow the
+// bucket header in memory.
 struct chunk_section_bucket {
-    chunk_section chunk_sections[CHUNK_SECTIONS_PER_BUCKET];
-    // @TODO(traks) we use 2 * CHUNK_SECTIONS_PER_BUCKET 4096-byte pages for the
-    // block states in the chunk sections. How much of the next page do we use?
     chunk_section_bucket * next;
     chunk_section_bucket * prev;
     int used_sections;
@@ -262,11 +383,29 @@ typedef struct {
     mc_int data;
 } level_event;
 
+typedef struct chunk chunk;
+
+// Sky and block light levels of the 16 sections of a chunk, from 0 to 15.
+// Every section stores 4 bits per block in the same order as block states,
+// with the lower 4 bits of a byte used for the first block. A section is NULL
+// if all its blocks have the same light level, which is stored separately.
 typedef struct {
+    unsigned char * sky[16];
+    unsigned char * block[16];
+    mc_ubyte uniform_sky[16];
+    mc_ubyte uniform_block[16];
+} chunk_light;
+
+struct chunk {
+    chunk_pos pos;
     chunk_section * sections[16];
+    // Sections consisting of a single block state aren't allocated. If a
+    // section is NULL, all its blocks have the block state stored here.
+    mc_ushort uniform_section_states[16];
     mc_ushort non_air_count[16];
     // need shorts to store 257 different heights
     mc_ushort motion_blocking_height_map[256];
+    chunk_light light;
 
     // increment if you want to keep a chunk available in the map, decrement
     // if you no longer care for the chunk.
@@ -274,6 +413,19 @@ typedef struct {
     mc_uint available_interest;
     unsigned flags;
 
+    // Retained chunks are in a list ordered by the time they were retained.
+    // Newer chunks come first.
+    chunk * retained_newer;
+    chunk * retained_older;
+    mc_long retained_tick;
+    // memory used by the chunk when it was retained
+    mc_long retained_memory;
+
+    // A bit is set for every section that changed since the chunk was last
+    // saved. The tick is that of the first of those changes.
+    mc_ushort dirty_sections;
+    mc_long dirty_tick;
+
     // @TODO(traks) more changed blocks, better compression. Can become very
     // large due to redstone updates, carpet towers breaking, etc. This should
     // probably grow dynamically. An alternative would be to store a bit array
@@ -282,6 +434,20 @@ typedef struct {
     compact_chunk_block_pos changed_blocks[200];
     mc_ubyte changed_block_count;
 
+    // a bit is set for every section whose light changed this tick
+    mc_ushort changed_sky_light;
+    mc_ushort changed_block_light;
+
+    // Chunk data and light packets in their final compressed form, shared by
+    // all players the chunk is sent to. Allocated with malloc, NULL if the
+    // packets haven't been encoded since the chunk last changed.
+    unsigned char * packet_cache;
+    int packet_cache_size;
+    // The packet for this tick's light changes, shared in the same way.
+    // Allocated with malloc, freed at the end of the tick.
+    unsigned char * light_update_cache;
+    int light_update_cache_size;
+
     // @TODO(traks) allow more block entities. Possibly use an internally
     // chained hashmap for this. The question is, where do we allocate this
     // hashmap in? We may need some more general-purpose allocator. Could
@@ -297,20 +463,117 @@ typedef struct {
 
     level_event local_events[64];
     mc_ubyte local_event_count;
-} chunk;
+};
 
-#define CHUNKS_PER_BUCKET (32)
+// number of chunks allocated at once by the chunk pool
+#define CHUNKS_PER_POOL_BLOCK (64)
 
-#define CHUNK_MAP_SIZE (1024)
+#define INITIAL_CHUNK_MAP_SIZE (1024)
 
-typedef struct chunk_bucket chunk_bucket;
+// Chunks no one is interested in anymore are kept loaded for this many ticks,
+// in case someone becomes interested in them again. That happens all the
+// time when players move back and forth over chunk borders.
+#define CHUNK_RETENTION_TICKS (20 * 30)
 
-struct chunk_bucket {
-    chunk_bucket * next_bucket;
-    int size;
-    chunk_pos positions[CHUNKS_PER_BUCKET];
-    chunk chunks[CHUNKS_PER_BUCKET];
-};
+// Chunks kept loaded without interest use at most about this many bytes. The
+// chunks that have been unused the longest are unloaded first.
+#define CHUNK_RETENTION_MEMORY_BUDGET ((mc_long) 64 << 20)
+
+// Unloaded chunks are kept compressed in memory, so they can be loaded again
+// without going to storage. The compressed chunks use at most about this
+// many bytes. The chunks that were unloaded first are dropped first.
+#define COMPRESSED_CHUNK_CACHE_BUDGET ((mc_long) 64 << 20)
+
+#define COMPRESSED_CHUNK_CACHE_BUCKETS_LOG2 (14)
+
+typedef struct {
+    chunk_pos pos;
+    chunk * ch;
+} chunk_map_entry;
+
+// number of region files kept open at once
+#define REGION_FILE_CACHE_SIZE (16)
+
+// Region files are reopened after the chunk saver changed them. Changes are
+// tracked by this many counters, shared by all regions that hash to the same
+// counter. Must be a power of 2.
+#define REGION_FILE_VERSION_SLOTS (256)
+
+// Number of slots in the palette entry cache. At most half of them are used.
+// Worlds rarely contain more than a few hundred different block states.
+#define PALETTE_CACHE_SIZE (4096)
+
+// palette entries with more NBT data than this aren't cached
+#define PALETTE_CACHE_MAX_ENTRY_SIZE (116)
+
+typedef struct {
+    int region_x;
+    int region_z;
+    // -1 if the region file couldn't be opened or its header couldn't be read,
+    // in which case all chunks are absent
+    int fd;
+    mc_long file_size;
+    // the entire region file if it is memory mapped, NULL otherwise
+    unsigned char * map;
+    // whether this is a native region file instead of an Anvil one. Native
+    // region files are always memory mapped.
+    int native;
+    // 0 if the cache slot is unused
+    mc_long last_use;
+    // version of the region file when it was opened
+    mc_uint version;
+    // chunk location table from the header of an Anvil region file
+    mc_uint locations[1024];
+    // a bit is set if the region file may contain a fully generated chunk at
+    // that index
+    mc_ulong present_chunks[1024 / 64];
+} region_file;
+
+// Region files kept open by a single thread. The least recently used region
+// file is closed first.
+typedef struct {
+    region_file files[REGION_FILE_CACHE_SIZE];
+    mc_long use_counter;
+    // number of region files opened so far
+    mc_long open_count;
+    // if set, native region files are ignored
+    int anvil_only;
+} region_file_cache;
+
+// Blaze's own world format. Native region files in world/blaze store chunks
+// with block states in our own numbering, laid out the same way as chunk
+// sections in memory, so loading a chunk is mostly copying. The files are
+// created from Anvil region files by running the server with
+// --convert-world. They use the byte order of the machine that converted the
+// world, which the magic number detects.
+#define NATIVE_REGION_MAGIC (0x7a6c6272)
+#define NATIVE_REGION_VERSION (1)
+
+typedef struct {
+    mc_uint magic;
+    mc_uint version;
+    // native region files are only valid for the world version and block
+    // states they were converted with
+    mc_uint data_version;
+    mc_uint block_state_count;
+    // offset of every chunk record in the file, 0 if the chunk isn't stored
+    // because it doesn't exist or isn't fully generated
+    mc_uint chunk_offsets[1024];
+    mc_uint chunk_sizes[1024];
+} native_region_header;
+
+// Chunk records start at 8-byte aligned offsets with this header. After it
+// come all sections that aren't uniform in ascending order. Each of those
+// stores its palette padded to a multiple of 4 entries, followed by the data
+// longs of the section.
+typedef struct {
+    mc_ushort non_air_count[16];
+    mc_ushort uniform_section_states[16];
+    mc_ushort motion_blocking_height_map[256];
+    // 0 if the section is uniform
+    unsigned char bits_per_block[16];
+    mc_ushort palette_size[16];
+} native_chunk_header;
 
 enum block_type {
     BLOCK_AIR,
@@ -2869,6 +3132,14 @@ typedef struct {
     unsigned char success;
 } block_break_ack;
 
+// flags in entity_player.send_flags
+#define PLAYER_DID_INIT_PACKETS ((unsigned) (1 << 0))
+#define PLAYER_SENT_TELEPORT ((unsigned) (1 << 1))
+#define PLAYER_GOT_ALIVE_RESPONSE ((unsigned) (1 << 2))
+#define PLAYER_INITIALISED_TAB_LIST ((unsigned) (1 << 3))
+#define PLAYER_PACKET_COMPRESSION ((unsigned) (1 << 4))
+#define PLAYER_SEND_FAILED ((unsigned) (1 << 5))
+
 typedef struct {
     unsigned char username[16];
     int username_size;
@@ -2894,9 +3165,19 @@ typedef struct {
     unsigned char * rec_buf;
     int rec_buf_size;
     int rec_cursor;
+    // result of the receive done through io_uring this tick, if any
+    int ring_rec_result;
+
+    // Flags that are set while the player is sent packets. They are kept out
+    // of the entity flags, because players are sent their packets in
+    // parallel and read each other's entity flags while doing so.
+    unsigned send_flags;
 
+    // Data that the socket didn't accept yet, from send_start up to
+    // send_cursor. Allocated when needed and grows as needed.
     unsigned char * send_buf;
     int send_buf_size;
+    int send_start;
     int send_cursor;
 
     // The radius of the client's view distance, excluding the centre chunk,
@@ -2919,6 +3200,19 @@ typedef struct {
     mc_int main_hand;
 
     mc_long last_keep_alive_sent_tick;
+    mc_long last_keep_alive_sent_nanos;
+    int keep_alive_sent_backlog;
+    // lowest keep alive round trip time seen, 0 if unknown
+    mc_long min_rtt_nanos;
+
+    // Used to determine how fast chunks can be sent to the player. The
+    // backlog is the amount of data in the socket and the send buffer at the
+    // last send. New send bytes is the amount of data added since then.
+    int send_backlog;
+    int new_send_bytes;
+    // estimate of how many bytes the connection delivers per tick
+    int send_drain_rate;
+    int chunks_sent_last_tick;
 
     entity_id eid;
 
@@ -2954,18 +3248,15 @@ typedef struct {
 
 #define LIVING_EFFECT_AMBIENCE ((unsigned) (1 << 12))
 
-#define PLAYER_DID_INIT_PACKETS ((unsigned) (1 << 16))
-#define PLAYER_SENT_TELEPORT ((unsigned) (1 << 17))
-#define PLAYER_GOT_ALIVE_RESPONSE ((unsigned) (1 << 18))
 #define PLAYER_SHIFTING ((unsigned) (1 << 19))
 #define PLAYER_SPRINTING ((unsigned) (1 << 20))
-#define PLAYER_INITIALISED_TAB_LIST ((unsigned) (1 << 21))
-#define PLAYER_PACKET_COMPRESSION ((unsigned) (1 << 22))
 #define PLAYER_SPIN_ATTACKING ((unsigned) (1 << 23))
 #define PLAYER_FLYING ((unsigned) (1 << 24))
 #define PLAYER_CAN_FLY ((unsigned) (1 << 25))
 #define PLAYER_INSTABUILD ((unsigned) (1 << 26))
 #define PLAYER_CAN_BUILD ((unsigned) (1 << 27))
+#define PLAYER_SOCKET_READABLE ((unsigned) (1 << 28))
+#define PLAYER_RING_RECEIVED ((unsigned) (1 << 29))
 
 #define PLAYER_ABILITIES_CHANGED ((mc_ulong) (1ULL << 32))
 #define PLAYER_GAMEMODE_CHANGED ((mc_ulong) (1ULL << 33))
@@ -3224,9 +3515,6 @@ typedef struct {
     global_msg global_msgs[16];
     int global_msg_count;
 
-    void * short_lived_scratch;
-    mc_int short_lived_scratch_size;
-
     entity_id tab_list_added[64];
     int tab_list_added_count;
     entity_id tab_list_removed[64];
@@ -3255,6 +3543,11 @@ typedef struct {
     block_model block_models[128];
     support_model support_models[128];
     mc_ubyte collision_model_by_state[18000];
+    // light levels emitted by block states
+    mc_ubyte emitted_light_by_state[18000];
+    // how much light block states absorb: 0 if light passes through freely,
+    // 15 if no light passes through at all
+    mc_ubyte light_opacity_by_state[18000];
 
     dimension_type dimension_types[32];
     int dimension_type_count;
@@ -3344,6 +3637,12 @@ net_read_ulong(buffer_cursor * cursor);
 void
 net_write_ulong(buffer_cursor * cursor, mc_ulong val);
 
+void
+net_read_ulongs(buffer_cursor * cursor, mc_ulong * vals, int count);
+
+void
+net_write_ulongs(buffer_cursor * cursor, mc_ulong * vals, int count);
+
 mc_uint
 net_read_uint(buffer_cursor * cursor);
 
@@ -3395,6 +3694,21 @@ nbt_tape_entry *
 nbt_get_compound(net_string matcher, nbt_tape_entry * tape,
         buffer_cursor * cursor);
 
+mc_ubyte
+nbt_read_compound_entry(buffer_cursor * cursor, net_string * key);
+
+net_string
+nbt_read_string_value(buffer_cursor * cursor);
+
+void
+nbt_skip_value(mc_ubyte tag, buffer_cursor * cursor);
+
+void
+nbt_write_key(buffer_cursor * cursor, mc_ubyte tag, net_string key);
+
+void
+nbt_write_string(buffer_cursor * cursor, net_string val);
+
 nbt_tape_entry *
 load_nbt(buffer_cursor * cursor, memory_arena * arena, int max_level);
 
@@ -3408,6 +3722,134 @@ begin_timed_block(char * name);
 void
 end_timed_block();
 
+void
+add_profiler_counter(char * name, mc_long value);
+
+long long
+program_nano_time(void);
+
+// a logged in connection handed over by the handshake thread
+typedef struct {
+    int sock;
+    unsigned char username[16];
+    int username_size;
+} pending_join;
+
+void
+start_handshake_thread(int server_sock);
+
+int
+pop_pending_join(pending_join * join);
+
+void
+update_server_status(void);
+
+// A job for one of a batch of jobs handed out at once. Memory allocated from
+// the scratch arena stays around until the end of the tick. A job that hands
+// out jobs itself may run other jobs on the same arena while it waits, so it
+// shouldn't use a copy of the arena across that.
+typedef void (* job_function)(void * data, int index,
+        memory_arena * scratch_arena);
+
+typedef struct {
+    char * name;
+    void (* run)(memory_arena * scratch_arena);
+    // bit i is set if the phase has to wait for phase i to finish
+    mc_uint dependencies;
+} tick_phase;
+
+void
+init_job_system(void);
+
+void
+start_job_threads(void);
+
+int
+get_job_thread_count(void);
+
+int
+get_job_thread_index(void);
+
+memory_arena *
+get_scratch_arena(void);
+
+void
+reset_scratch_arenas(void);
+
+void
+run_jobs(job_function run, void * data, int count);
+
+void
+run_tick_phases(tick_phase * phases, int phase_count);
+
+void
+start_chunk_loader_threads(void);
+
+int
+request_chunk_loads(chunk_pos * positions, int count);
+
+void
+link_loaded_chunks(void);
+
+void
+start_chunk_saver_thread(void);
+
+int
+request_chunk_save(chunk * ch);
+
+int
+wait_for_chunk_saves(void);
+
+int
+finish_chunk_saves(void);
+
+// Tags identify sockets in readiness notifications. The top 32 bits contain
+// the kind of socket, the bottom 32 bits an index or entity ID.
+#define SOCKET_TAG_LISTENER ((mc_ulong) 0 << 32)
+#define SOCKET_TAG_INITIAL_CONNECTION ((mc_ulong) 1 << 32)
+#define SOCKET_TAG_PLAYER ((mc_ulong) 2 << 32)
+#define SOCKET_TAG_PLAYER_RECV ((mc_ulong) 3 << 32)
+#define SOCKET_TAG_PLAYER_SEND ((mc_ulong) 4 << 32)
+
+#define SOCKET_TAG_KIND_MASK ((mc_ulong) 0xffffffff << 32)
+
+int
+create_socket_watcher(void);
+
+int
+watch_socket(int watcher, int sock, mc_ulong tag);
+
+int
+retag_watched_socket(int watcher, int sock, mc_ulong tag);
+
+int
+unwatch_socket(int watcher, int sock);
+
+int
+wait_for_socket_events(int watcher, mc_ulong * tags, int max_tags,
+        int timeout_millis);
+
+int
+get_socket_send_queue_size(int sock);
+
+int
+create_io_ring(unsigned entries);
+
+int
+io_ring_available(void);
+
+int
+queue_socket_recv(int sock, void * buf, int size, mc_ulong tag);
+
+int
+queue_socket_send(int sock, void * buf, int size, mc_ulong tag);
+
+int
+submit_socket_ops(int wait_for_completions);
+
+int
+reap_socket_op(mc_ulong * tag, int * result);
+
 int
 find_property_value_index(block_property_spec * prop_spec, net_string val);
 
@@ -3437,16 +3879,79 @@ chunk_get_block_state(chunk * ch, int x, int y, int z);
 
 void
 try_read_chunk_from_storage(chunk_pos pos, chunk * ch,
+        memory_arena * scratch_arena, region_file_cache * region_cache);
+
+void
+prefetch_chunk_from_storage(chunk_pos pos, memory_arena * scratch_arena,
+        region_file_cache * region_cache);
+
+int
+get_native_chunk_size(chunk * ch);
+
+void
+write_native_chunk(chunk * ch, unsigned char * record);
+
+void
+convert_world(void);
+
+void
+bump_region_file_version(int region_x, int region_z);
+
+int
+decode_native_chunk(unsigned char * record, mc_long size, chunk * ch);
+
+int
+store_compressed_chunk(chunk * ch);
+
+int
+restore_compressed_chunk(chunk_pos pos, chunk * ch,
         memory_arena * scratch_arena);
 
+void
+get_compressed_chunk_cache_usage(int * chunk_count, mc_long * memory);
+
+void
+take_palette_cache_stats(mc_ulong * hits, mc_ulong * misses);
+
 chunk_section *
-alloc_chunk_section(void);
+alloc_chunk_section(int bits_per_block);
+
+mc_ushort
+get_section_block_state(chunk_section * section, int index);
+
+chunk_section *
+set_section_block_state(chunk_section * section, int index,
+        mc_ushort block_state);
+
+void
+unpack_chunk_section(chunk_section * section, mc_ushort * block_states);
 
 void
 free_chunk_section(chunk_section * section);
 
 void
-clean_up_unused_chunks(void);
+clean_up_unused_chunks(memory_arena * scratch_arena);
+
+void
+flush_chunk_saves(void);
+
+void
+light_chunk(chunk * ch, memory_arena * scratch_arena);
+
+void
+free_chunk_light(chunk_light * light);
+
+int
+get_chunk_light_memory(chunk_light * light);
+
+void
+link_chunk_light(chunk * ch);
+
+void
+request_light_update(chunk * ch, int x, int y, int z);
+
+void
+update_light(void);
 
 entity_base *
 resolve_entity(entity_id eid);
@@ -3468,9 +3973,45 @@ set_player_gamemode(entity_base * player, int new_gamemode);
 void
 tick_player(entity_base * entity, memory_arena * tick_arena);
 
+void
+prepare_broadcast_packets(memory_arena * arena);
+
+void
+update_player_chunk_interest(entity_base * player);
+
 void
 send_packets_to_player(entity_base * entity, memory_arena * tick_arena);
 
+void
+queue_player_sends(void);
+
+void
+complete_player_send(entity_base * entity, int result);
+
+enum compression_format {
+    COMPRESSION_FORMAT_ZLIB,
+    COMPRESSION_FORMAT_GZIP,
+};
+
+int
+compress_bound(int size);
+
+int
+compress_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size);
+
+int
+compress_data_fast(unsigned char * in, int in_size,
+        unsigned char * out, int out_size);
+
+int
+compress_chunk_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size);
+
+int
+decompress_data(unsigned char * in, int in_size,
+        unsigned char * out, int out_size, int format);
+
 void
 register_resource_loc(net_string resource_loc, mc_short id,
         resource_loc_table * table);
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "shared.h"
+
+// Converts the Anvil region files in world/region to native region files in
+// world/blaze. Chunks are read through the regular chunk loading code, so
+// the native region files contain exactly what the server would have loaded
+// from the Anvil region files.
+
+// a chunk record is at most this large: the header plus 16 sections that
+// store their block states directly
+#define MAX_NATIVE_CHUNK_SIZE (sizeof (native_chunk_header) \
+        + 16 * 4096 * sizeof (mc_ushort))
+
+static int
+write_fully(int fd, unsigned char * data, mc_long size, mc_long offset) {
+    mc_long written = 0;
+    while (written < size) {
+        ssize_t res = pwrite(fd, data + written, size - written,
+                offset + written);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        written += res;
+    }
+    return 1;
+}
+
+static int
+convert_region(int region_x, int region_z, memory_arena * scratch_arena,
+        region_file_cache * region_cache, chunk * ch,
+        unsigned char * record) {
+    // Returns the number of chunks converted, or -1 on failure
+    unsigned char temp_name[64];
+    unsigned char file_name[64];
+    sprintf((void *) temp_name, "world/blaze/r.%d.%d.blz.tmp",
+            region_x, region_z);
+    sprintf((void *) file_name, "world/blaze/r.%d.%d.blz",
+            region_x, region_z);
+
+    int fd = open((void *) temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        logs_errno("Failed to create native region file: %s");
+        return -1;
+    }
+
+    native_region_header * header = calloc(1, sizeof *header);
+    if (header == NULL) {
+        logs_errno("Failed to allocate native region header: %s");
+        close(fd);
+        return -1;
+    }
+    *header = (native_region_header) {
+        .magic = NATIVE_REGION_MAGIC,
+        .version = NATIVE_REGION_VERSION,
+        .data_version = SERVER_WORLD_VERSION,
+        .block_state_count = serv->actual_block_state_count
+    };
+
+    mc_long file_offset = sizeof *header;
+    int converted = 0;
+    int failed = 0;
+
+    for (int index = 0; index < 1024; index++) {
+        chunk_pos pos = {
+            .x = region_x * 32 + (index & 0x1f),
+            .z = region_z * 32 + (index >> 5)
+        };
+
+        *ch = (chunk) {0};
+        scratch_arena->index = 0;
+        try_read_chunk_from_storage(pos, ch, scratch_arena, region_cache);
+
+        if (ch->flags & CHUNK_LOADED) {
+            int size = get_native_chunk_size(ch);
+            write_native_chunk(ch, record);
+            if (!write_fully(fd, record, size, file_offset)) {
+                logs_errno("Failed to write native region file: %s");
+                failed = 1;
+            }
+
+            header->chunk_offsets[index] = file_offset;
+            header->chunk_sizes[index] = size;
+            // sizes are multiples of 8, so records stay aligned
+            file_offset += size;
+            converted++;
+        }
+
+        for (int section_y = 0; section_y < 16; section_y++) {
+            if (ch->sections[section_y] != NULL) {
+                free_chunk_section(ch->sections[section_y]);
+            }
+        }
+
+        if (failed) {
+            break;
+        }
+    }
+
+    if (!failed) {
+        if (!write_fully(fd, (unsigned char *) header, sizeof *header, 0)) {
+            logs_errno("Failed to write native region file: %s");
+            failed = 1;
+        }
+    }
+    free(header);
+
+    if (close(fd) == -1 && !failed) {
+        logs_errno("Failed to close native region file: %s");
+        failed = 1;
+    }
+    if (failed) {
+        unlink((void *) temp_name);
+        return -1;
+    }
+
+    // replace the old file only once the new one is complete
+    if (rename((void *) temp_name, (void *) file_name) == -1) {
+        logs_errno("Failed to rename native region file: %s");
+        unlink((void *) temp_name);
+        return -1;
+    }
+    return converted;
+}
+
+void
+convert_world(void) {
+    if (mkdir("world/blaze", 0755) == -1 && errno != EEXIST) {
+        logs_errno("Failed to create world/blaze: %s");
+        exit(1);
+    }
+
+    DIR * dir = opendir("world/region");
+    if (dir == NULL) {
+        logs_errno("Failed to open world/region: %s");
+        exit(1);
+    }
+
+    memory_arena scratch_arena = {
+        .ptr = malloc(CHUNK_LOADER_SCRATCH_SIZE),
+        .size = CHUNK_LOADER_SCRATCH_SIZE
+    };
+    region_file_cache * region_cache = calloc(1, sizeof *region_cache);
+    chunk * ch = calloc(1, sizeof *ch);
+    unsigned char * record = malloc(MAX_NATIVE_CHUNK_SIZE);
+    if (scratch_arena.ptr == NULL || region_cache == NULL || ch == NULL
+            || record == NULL) {
+        logs_errno("Failed to allocate memory for converter: %s");
+        exit(1);
+    }
+    region_cache->anvil_only = 1;
+
+    int region_count = 0;
+    long long chunk_count = 0;
+    long long start_time = program_nano_time();
+
+    for (;;) {
+        errno = 0;
+        struct dirent * entry = readdir(dir);
+        if (entry == NULL) {
+            if (errno != 0) {
+                logs_errno("Failed to read world/region: %s");
+                exit(1);
+            }
+            break;
+        }
+
+        int region_x;
+        int region_z;
+        int name_end = 0;
+        if (sscanf(entry->d_name, "r.%d.%d.mca%n", &region_x, &region_z,
+                &name_end) != 2 || entry->d_name[name_end] != '\0'
+                || name_end == 0) {
+            continue;
+        }
+
+        int converted = convert_region(region_x, region_z, &scratch_arena,
+                region_cache, ch, record);
+        if (converted == -1) {
+            logs("Failed to convert %s", entry->d_name);
+            exit(1);
+        }
+
+        logs("Converted %s: %d chunks", entry->d_name, converted);
+        region_count++;
+        chunk_count += converted;
+    }
+
+    closedir(dir);
+
+    long long end_time = program_nano_time();
+    logs("Converted %d region files with %lld chunks in %lld ms",
+            region_count, chunk_count, (end_time - start_time) / 1000000);
+}